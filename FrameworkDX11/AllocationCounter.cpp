@@ -0,0 +1,103 @@
+#include "AllocationCounter.h"
+
+#if defined(COUNT_HEAP_ALLOCATIONS)
+
+#include <cstdlib>
+#include <new>
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+namespace
+{
+	thread_local size_t*	t_counter = nullptr;
+
+	// malloc, retrying through the new handler as operator new has to; nullptr once there is none
+	void* Allocate(size_t size, size_t alignment)
+	{
+		if (t_counter)
+			(*t_counter)++;
+		if (size == 0)
+			size = 1;
+
+		for (;;)
+		{
+#if defined(_MSC_VER)
+			void* memory = alignment ? _aligned_malloc(size, alignment) : malloc(size);
+#else
+			void* memory = alignment ? aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : malloc(size);
+#endif
+			if (memory)
+				return memory;
+			const std::new_handler handler = std::get_new_handler();
+			if (handler == nullptr)
+				return nullptr;
+			handler();
+		}
+	}
+
+	void* AllocateOrThrow(size_t size, size_t alignment)
+	{
+		if (void* memory = Allocate(size, alignment))
+			return memory;
+		throw std::bad_alloc();
+	}
+
+	void* AllocateOrNull(size_t size, size_t alignment) noexcept
+	{
+		try
+		{
+			return Allocate(size, alignment);
+		}
+		catch (...)
+		{
+			return nullptr;
+		}
+	}
+
+	void Free(void* memory, size_t alignment) noexcept
+	{
+#if defined(_MSC_VER)
+		if (alignment)
+		{
+			_aligned_free(memory);
+			return;
+		}
+#else
+		(void)alignment;
+#endif
+		free(memory);
+	}
+}
+
+size_t* AllocationCounter::Watch(size_t* counter)
+{
+	size_t* const previous = t_counter;
+	t_counter = counter;
+	return previous;
+}
+
+void* operator new(size_t size) { return AllocateOrThrow(size, 0); }
+void* operator new[](size_t size) { return AllocateOrThrow(size, 0); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return AllocateOrNull(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return AllocateOrNull(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment) { return AllocateOrThrow(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return AllocateOrThrow(size, (size_t)alignment); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return AllocateOrNull(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return AllocateOrNull(size, (size_t)alignment); }
+
+void operator delete(void* memory) noexcept { Free(memory, 0); }
+void operator delete[](void* memory) noexcept { Free(memory, 0); }
+void operator delete(void* memory, size_t) noexcept { Free(memory, 0); }
+void operator delete[](void* memory, size_t) noexcept { Free(memory, 0); }
+void operator delete(void* memory, const std::nothrow_t&) noexcept { Free(memory, 0); }
+void operator delete[](void* memory, const std::nothrow_t&) noexcept { Free(memory, 0); }
+void operator delete(void* memory, std::align_val_t alignment) noexcept { Free(memory, (size_t)alignment); }
+void operator delete[](void* memory, std::align_val_t alignment) noexcept { Free(memory, (size_t)alignment); }
+void operator delete(void* memory, size_t, std::align_val_t alignment) noexcept { Free(memory, (size_t)alignment); }
+void operator delete[](void* memory, size_t, std::align_val_t alignment) noexcept { Free(memory, (size_t)alignment); }
+void operator delete(void* memory, std::align_val_t alignment, const std::nothrow_t&) noexcept { Free(memory, (size_t)alignment); }
+void operator delete[](void* memory, std::align_val_t alignment, const std::nothrow_t&) noexcept { Free(memory, (size_t)alignment); }
+
+#endif
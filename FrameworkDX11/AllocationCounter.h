@@ -0,0 +1,47 @@
+// Counts the heap allocations a piece of code makes, for checks that it runs without allocating.
+//
+// With COUNT_HEAP_ALLOCATIONS defined - only the Benchmark configuration defines it, an optimized
+// build like Profile - the global operator new and delete are replaced by ones that go straight to
+// malloc and free and count the allocations made on a thread while it is inside Count(). Everything
+// that allocates through new (containers, shared_ptr, std::function) is counted. The other
+// configurations keep the CRT allocator untouched, and there Count() gives -1.
+
+#pragma once
+
+#include <cstddef>
+
+class AllocationCounter
+{
+public:
+	static constexpr bool IsEnabled()
+	{
+#if defined(COUNT_HEAP_ALLOCATIONS)
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Runs fn and returns the heap allocations it made on this thread, or -1 if they are not counted.
+	// Calls may nest; an outer count includes the inner ones.
+	template <typename F>
+	static long long Count(F&& fn)
+	{
+#if defined(COUNT_HEAP_ALLOCATIONS)
+		size_t count = 0;
+		size_t* const previous = Watch(&count);
+		fn();
+		Watch(previous);
+		if (previous)
+			*previous += count;
+		return (long long)count;
+#else
+		fn();
+		return -1;
+#endif
+	}
+
+private:
+	// Makes counter the one this thread's allocations go to, nullptr for none, and returns the last one
+	static size_t*	Watch(size_t* counter);
+};
@@ -2,6 +2,7 @@
 #include <algorithm>
 
 using namespace std;
+using namespace DirectX;
 
 // Helper to read a vector of data from a glTF accessor
 template<typename T>
@@ -35,9 +36,15 @@ bool Animation::LoadFromGltf(const tinygltf::Model& model, const std::map<int, i
         const tinygltf::AnimationSampler& gltfSampler = anim.samplers[i];
         AnimationSampler& sampler = m_samplers[i];
 
-        if (gltfSampler.interpolation == "LINEAR") {
+        if (gltfSampler.interpolation == "STEP") {
+            sampler.interpolation = AnimationSampler::STEP;
+        }
+        else if (gltfSampler.interpolation == "CUBICSPLINE") {
+            sampler.interpolation = AnimationSampler::CUBICSPLINE;
+        }
+        else {
             sampler.interpolation = AnimationSampler::LINEAR;
-        } // Add cases for STEP and CUBICSPLINE if needed
+        }
 
         // Read timestamps
         ReadDataFromAccessor(model, gltfSampler.input, sampler.timestamps);
@@ -52,6 +59,17 @@ bool Animation::LoadFromGltf(const tinygltf::Model& model, const std::map<int, i
         {
             ReadDataFromAccessor(model, gltfSampler.output, sampler.vec4_values);
         }
+        else if (outputAccessor.type == TINYGLTF_TYPE_SCALAR &&
+                 outputAccessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT)
+        {
+            // Morph target weights, all targets of a key one after another
+            ReadDataFromAccessor(model, gltfSampler.output, sampler.scalar_values);
+            const size_t keys = sampler.timestamps.size() * (sampler.interpolation == AnimationSampler::CUBICSPLINE ? 3 : 1);
+            sampler.scalarsPerKey = keys > 0 ? sampler.scalar_values.size() / keys : 0;
+        }
+
+        if (sampler.interpolation == AnimationSampler::CUBICSPLINE)
+            sampler.BuildSegments();
     }
 
     // Load Channels
@@ -60,10 +78,22 @@ bool Animation::LoadFromGltf(const tinygltf::Model& model, const std::map<int, i
         const tinygltf::AnimationChannel& gltfChannel = anim.channels[i];
         AnimationChannel channel;
 
+        if (gltfChannel.target_path == "weights")
+        {
+            channel.path = AnimationChannel::WEIGHTS;
+            channel.jointIndex = -1;
+            channel.nodeIndex = gltfChannel.target_node;
+            channel.samplerIndex = gltfChannel.sampler;
+            if (channel.samplerIndex >= 0 && channel.samplerIndex < (int)m_samplers.size() &&
+                m_samplers[channel.samplerIndex].scalarsPerKey > 0)
+                m_weightChannels.push_back(channel);
+            continue;
+        }
+
         // Find which joint this channel targets using the map we built earlier
         auto it = nodeToJointMap.find(gltfChannel.target_node);
         if (it == nodeToJointMap.end()) {
-            continue; // This channel animates a node that isn't a joint, so we skip it.
+            continue; // Not a joint: plain nodes are played by a NodeAnimator, with its own map
         }
         channel.jointIndex = it->second;
         channel.samplerIndex = gltfChannel.sampler;
@@ -77,12 +107,191 @@ bool Animation::LoadFromGltf(const tinygltf::Model& model, const std::map<int, i
         else if (gltfChannel.target_path == "scale") {
             channel.path = AnimationChannel::SCALE;
         }
+        else {
+            continue;
+        }
         m_channels.push_back(channel);
     }
 
     return true;
 }
 
+size_t AnimationSampler::GetKeyCount() const
+{
+    const size_t values = scalarsPerKey > 0 ? scalar_values.size() / scalarsPerKey :
+                          vec4_values.empty() ? vec3_values.size() : vec4_values.size();
+    return std::min(timestamps.size(), interpolation == CUBICSPLINE ? values / 3 : values);
+}
+
+XMVECTOR XM_CALLCONV AnimationSampler::GetKeyValue(size_t key) const
+{
+    // Cubic spline keys are stored as (in tangent, value, out tangent)
+    const size_t index = interpolation == CUBICSPLINE ? key * 3 + 1 : key;
+    return vec4_values.empty() ? XMLoadFloat3(&vec3_values[index]) : XMLoadFloat4(&vec4_values[index]);
+}
+
+XMVECTOR XM_CALLCONV AnimationSampler::EvaluateSegment(size_t key, float s) const
+{
+    const XMFLOAT4* c = &segments[key * 4];
+    XMVECTOR value = XMLoadFloat4(&c[0]);
+    value = XMVectorMultiplyAdd(value, XMVectorReplicate(s), XMLoadFloat4(&c[1]));
+    value = XMVectorMultiplyAdd(value, XMVectorReplicate(s), XMLoadFloat4(&c[2]));
+    return XMVectorMultiplyAdd(value, XMVectorReplicate(s), XMLoadFloat4(&c[3]));
+}
+
+void AnimationSampler::BuildSegments()
+{
+    segments.clear();
+    const size_t count = GetKeyCount();
+    scalar_segments.clear();
+    if (interpolation != CUBICSPLINE || count < 2)
+        return;
+
+    if (scalarsPerKey > 0)
+    {
+        // The same expansion as below, one morph target at a time
+        const size_t n = scalarsPerKey;
+        scalar_segments.resize((count - 1) * 4 * n);
+        for (size_t k = 0; k + 1 < count; k++)
+        {
+            const float span = timestamps[k + 1] - timestamps[k];
+            float* c = &scalar_segments[k * 4 * n];
+            for (size_t i = 0; i < n; i++)
+            {
+                const float p0 = scalar_values[(k * 3 + 1) * n + i];
+                const float m0 = scalar_values[(k * 3 + 2) * n + i] * span;
+                const float p1 = scalar_values[((k + 1) * 3 + 1) * n + i];
+                const float m1 = scalar_values[((k + 1) * 3) * n + i] * span;
+                const float p = p0 - p1;
+                c[i] = 2.0f * p + m0 + m1;
+                c[n + i] = -3.0f * p - 2.0f * m0 - m1;
+                c[2 * n + i] = m0;
+                c[3 * n + i] = p0;
+            }
+        }
+        return;
+    }
+
+    auto load = [this](size_t index)
+    {
+        return vec4_values.empty() ? XMLoadFloat3(&vec3_values[index]) : XMLoadFloat4(&vec4_values[index]);
+    };
+
+    segments.resize((count - 1) * 4);
+    for (size_t k = 0; k + 1 < count; k++)
+    {
+        // Hermite basis with the tangents scaled to the segment's length, expanded into powers of s
+        const XMVECTOR span = XMVectorReplicate(timestamps[k + 1] - timestamps[k]);
+        const XMVECTOR p0 = load(k * 3 + 1);
+        const XMVECTOR m0 = XMVectorMultiply(load(k * 3 + 2), span);
+        const XMVECTOR p1 = load((k + 1) * 3 + 1);
+        const XMVECTOR m1 = XMVectorMultiply(load((k + 1) * 3), span);
+        const XMVECTOR p = XMVectorSubtract(p0, p1);
+
+        XMFLOAT4* c = &segments[k * 4];
+        XMStoreFloat4(&c[0], XMVectorAdd(XMVectorAdd(XMVectorScale(p, 2.0f), m0), m1));
+        XMStoreFloat4(&c[1], XMVectorSubtract(XMVectorSubtract(XMVectorScale(p, -3.0f), XMVectorScale(m0, 2.0f)), m1));
+        XMStoreFloat4(&c[2], m0);
+        XMStoreFloat4(&c[3], p0);
+    }
+}
+
+void EvaluateCubicSegments(const CubicSegmentSample* samples, size_t count, XMFLOAT4* results)
+{
+    // Four independent Horner chains per iteration, so each multiply-add does not wait on the one before
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const CubicSegmentSample* b = &samples[i];
+        const XMVECTOR s0 = XMVectorReplicate(b[0].s);
+        const XMVECTOR s1 = XMVectorReplicate(b[1].s);
+        const XMVECTOR s2 = XMVectorReplicate(b[2].s);
+        const XMVECTOR s3 = XMVectorReplicate(b[3].s);
+
+        XMVECTOR v0 = XMLoadFloat4(&b[0].coefficients[0]);
+        XMVECTOR v1 = XMLoadFloat4(&b[1].coefficients[0]);
+        XMVECTOR v2 = XMLoadFloat4(&b[2].coefficients[0]);
+        XMVECTOR v3 = XMLoadFloat4(&b[3].coefficients[0]);
+        for (int c = 1; c < 4; c++)
+        {
+            v0 = XMVectorMultiplyAdd(v0, s0, XMLoadFloat4(&b[0].coefficients[c]));
+            v1 = XMVectorMultiplyAdd(v1, s1, XMLoadFloat4(&b[1].coefficients[c]));
+            v2 = XMVectorMultiplyAdd(v2, s2, XMLoadFloat4(&b[2].coefficients[c]));
+            v3 = XMVectorMultiplyAdd(v3, s3, XMLoadFloat4(&b[3].coefficients[c]));
+        }
+        XMStoreFloat4(&results[i + 0], v0);
+        XMStoreFloat4(&results[i + 1], v1);
+        XMStoreFloat4(&results[i + 2], v2);
+        XMStoreFloat4(&results[i + 3], v3);
+    }
+    for (; i < count; i++)
+    {
+        const XMVECTOR s = XMVectorReplicate(samples[i].s);
+        XMVECTOR v = XMLoadFloat4(&samples[i].coefficients[0]);
+        for (int c = 1; c < 4; c++)
+            v = XMVectorMultiplyAdd(v, s, XMLoadFloat4(&samples[i].coefficients[c]));
+        XMStoreFloat4(&results[i], v);
+    }
+}
+
+size_t AnimationSampler::FindKeyframe(float time, size_t& cursor) const
+{
+    // A frame rarely crosses more than one or two keys; past this many a search is cheaper anyway
+    constexpr size_t kMaxForwardSteps = 4;
+
+    const size_t count = timestamps.size();
+    if (count < 2 || time <= timestamps[0])
+        return cursor = 0;
+    if (time >= timestamps[count - 1])
+        return cursor = count - 1;
+
+    size_t key = cursor;
+    if (key < count - 1 && timestamps[key] <= time)
+    {
+        for (size_t step = 0; step < kMaxForwardSteps; step++)
+        {
+            if (timestamps[key + 1] > time)
+                return cursor = key;
+            key++;
+        }
+    }
+
+    // time is strictly inside the range here, so there is always a key after the one found
+    key = std::upper_bound(timestamps.begin(), timestamps.end(), time) - timestamps.begin() - 1;
+    return cursor = key;
+}
+
+size_t AnimationSampler::FindSegment(float time, size_t& cursor, float& s) const
+{
+    const size_t count = GetKeyCount();
+    const size_t key = std::min(FindKeyframe(time, cursor), count - 1);
+    s = 0.0f;
+    if (key + 1 < count)
+    {
+        const float span = timestamps[key + 1] - timestamps[key];
+        s = span > 0.0f ? std::min(std::max((time - timestamps[key]) / span, 0.0f), 1.0f) : 0.0f;
+    }
+    return key;
+}
+
+XMVECTOR XM_CALLCONV AnimationSampler::Interpolate(size_t key, float s, bool rotation) const
+{
+    if (key + 1 >= GetKeyCount() || interpolation == STEP)
+        return GetKeyValue(key);
+    if (interpolation == CUBICSPLINE && segments.size() >= (key + 1) * 4)
+        return rotation ? XMQuaternionNormalize(EvaluateSegment(key, s)) : EvaluateSegment(key, s);
+    if (rotation)
+        return XMQuaternionSlerp(GetKeyValue(key), GetKeyValue(key + 1), s);
+    return XMVectorLerp(GetKeyValue(key), GetKeyValue(key + 1), s);
+}
+
+XMVECTOR XM_CALLCONV AnimationSampler::Sample(float time, size_t& cursor, bool rotation) const
+{
+    float s;
+    const size_t key = FindSegment(time, cursor, s);
+    return Interpolate(key, s, rotation);
+}
+
 float Animation::GetStartTime() const {
     // For simplicity, assuming start time is 0. A more robust implementation
     // would find the minimum timestamp across all samplers.
@@ -97,4 +306,57 @@ float Animation::GetEndTime() const {
         }
     }
     return endTime;
-}
\ No newline at end of file
+}
+
+bool Animation::SampleWeights(int nodeIndex, float time, float* weights, size_t count, std::vector<size_t>& cursors) const
+{
+    if (cursors.size() != m_samplers.size())
+        cursors.assign(m_samplers.size(), 0);
+
+    for (const AnimationChannel& channel : m_weightChannels)
+    {
+        if (channel.nodeIndex != nodeIndex)
+            continue;
+
+        const AnimationSampler& sampler = m_samplers[channel.samplerIndex];
+        const size_t keys = sampler.GetKeyCount();
+        const size_t n = std::min(count, sampler.scalarsPerKey);
+        if (keys == 0)
+            return false;
+
+        float s;
+        const size_t k0 = sampler.FindSegment(time, cursors[channel.samplerIndex], s);
+        const size_t k1 = std::min(k0 + 1, keys - 1);
+        const float* v = sampler.scalar_values.data();
+        const size_t stride = sampler.scalarsPerKey;
+
+        switch (sampler.interpolation)
+        {
+        case AnimationSampler::STEP:
+            for (size_t i = 0; i < n; i++)
+                weights[i] = v[k0 * stride + i];
+            break;
+        case AnimationSampler::CUBICSPLINE:
+        {
+            // Keys are (in tangents, values, out tangents), each scalarsPerKey long; within the clip the
+            // precomputed polynomial, past its last key the last value
+            if (k0 == k1 || sampler.scalar_segments.size() < (k0 + 1) * 4 * stride)
+            {
+                for (size_t i = 0; i < n; i++)
+                    weights[i] = v[(k0 * 3 + 1) * stride + i];
+                break;
+            }
+            const float* c = &sampler.scalar_segments[k0 * 4 * stride];
+            for (size_t i = 0; i < n; i++)
+                weights[i] = ((c[i] * s + c[stride + i]) * s + c[2 * stride + i]) * s + c[3 * stride + i];
+            break;
+        }
+        default:
+            for (size_t i = 0; i < n; i++)
+                weights[i] = v[k0 * stride + i] + (v[k1 * stride + i] - v[k0 * stride + i]) * s;
+            break;
+        }
+        return true;
+    }
+    return false;
+}
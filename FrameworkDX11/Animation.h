@@ -15,15 +15,57 @@ struct AnimationSampler
        // Have separate vectors for each possible data type
     std::vector<DirectX::XMFLOAT3> vec3_values;
     std::vector<DirectX::XMFLOAT4> vec4_values;
+    // Morph target weights: scalarsPerKey values (one per target) per key, or per tangent / value for
+    // cubic splines
+    std::vector<float> scalar_values;
+    size_t scalarsPerKey = 0;
+
+    // CUBICSPLINE only: the Hermite curve between keys k and k + 1 as a polynomial in s = 0..1 across the
+    // segment, ((a * s + b) * s + c) * s + d, with a, b, c and d at segments[k * 4]. Built at load.
+    std::vector<DirectX::XMFLOAT4> segments;
+    // CUBICSPLINE weights only: the same polynomial per morph target, stored per segment as the
+    // scalarsPerKey a's, then the b's, c's and d's, from scalar_segments[k * 4 * scalarsPerKey]
+    std::vector<float> scalar_segments;
+
+    size_t GetKeyCount() const;
+    // The value at a key, whatever the interpolation (cubic spline keys also store tangents)
+    DirectX::XMVECTOR XM_CALLCONV GetKeyValue(size_t key) const;
+    DirectX::XMVECTOR XM_CALLCONV EvaluateSegment(size_t key, float s) const;
+    void BuildSegments();
+
+    // Returns the last keyframe at or before time (0 before the first one). cursor is the caller's
+    // result from the previous call: if time has moved forward by at most a few keys it is stepped on
+    // from there, anything else (a seek, a loop, playing backwards) falls back to a binary search.
+    // The cursor is only a hint and is checked on every call, so a stale one is never wrong, just slower.
+    size_t FindKeyframe(float time, size_t& cursor) const;
+    // The keyframe found as above, clamped to the last key, and how far time is from it towards the
+    // next one in s (0..1; 0 from the last key on). Needs at least one key.
+    size_t FindSegment(float time, size_t& cursor, float& s) const;
+    // The value s of the way from key to the next one: held for STEP and at the last key, along the curve
+    // for CUBICSPLINE, slerped for rotations and lerped for anything else. Rotations come out normalized.
+    DirectX::XMVECTOR XM_CALLCONV Interpolate(size_t key, float s, bool rotation) const;
+    // Both of the above, the way every TRS channel is sampled
+    DirectX::XMVECTOR XM_CALLCONV Sample(float time, size_t& cursor, bool rotation) const;
+};
+
+// A cubic segment to evaluate, see AnimationSampler::segments
+struct CubicSegmentSample
+{
+    const DirectX::XMFLOAT4* coefficients;
+    float s;
 };
 
+// Evaluates a batch of cubic segments, four at a time so that their multiply-add chains overlap
+void EvaluateCubicSegments(const CubicSegmentSample* samples, size_t count, DirectX::XMFLOAT4* results);
+
 // Connects an animation sampler to a specific joint.
 struct AnimationChannel
 {
-    enum PathType { TRANSLATION, ROTATION, SCALE };
+    enum PathType { TRANSLATION, ROTATION, SCALE, WEIGHTS };
     PathType path = TRANSLATION;
     int jointIndex;       // The index of the joint in our skeleton to animate.
     int samplerIndex;     // The index of the sampler to use for keyframe data.
+    int nodeIndex = -1;   // WEIGHTS only: the glTF node whose mesh's morph weights are animated
 };
 
 // The main container for a single animation clip.
@@ -35,6 +77,7 @@ public:
     Animation(const Animation& other)
         : m_samplers(other.m_samplers), // This will call std::vector's copy constructor
         m_channels(other.m_channels), // This will call std::vector's copy constructor
+        m_weightChannels(other.m_weightChannels),
         m_name(other.m_name)          // This will call std::string's copy constructor
     {
     }
@@ -45,8 +88,16 @@ public:
     float GetStartTime() const;
     float GetEndTime() const;
 
+    // Writes the morph target weights of a glTF node at a time. Returns false (leaving weights as
+    // they are) if the clip does not animate them; weights past the sampler's count are left alone.
+    // cursors holds the caller's keyframe cursor per sampler (see AnimationSampler::FindKeyframe) and
+    // is sized to the samplers on first use.
+    bool SampleWeights(int nodeIndex, float time, float* weights, size_t count, std::vector<size_t>& cursors) const;
+    bool HasWeightChannels() const { return !m_weightChannels.empty(); }
+
     // These are public for easy access from the animation update logic.
     std::vector<AnimationSampler> m_samplers;
     std::vector<AnimationChannel> m_channels;
+    std::vector<AnimationChannel> m_weightChannels;   // WEIGHTS channels, kept apart as they target nodes, not joints
     std::string m_name;
 };
\ No newline at end of file
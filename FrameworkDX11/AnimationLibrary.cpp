@@ -0,0 +1,59 @@
+#include "AnimationLibrary.h"
+
+size_t AnimationClipSet::GetMemorySize(bool compressedClips) const
+{
+    size_t size = 0;
+    if (compressedClips)
+    {
+        for (const CompressedAnimation& animation : compressed)
+            size += animation.GetMemorySize();
+    }
+    else
+    {
+        for (const Animation& animation : animations)
+            size += CompressedAnimation::GetMemorySize(animation);
+    }
+    return size;
+}
+
+AnimationLibrary& AnimationLibrary::Get()
+{
+    static AnimationLibrary instance;
+    return instance;
+}
+
+std::shared_ptr<const AnimationClipSet> AnimationLibrary::GetOrBuild(const std::wstring& key, const std::function<AnimationClipSet()>& build)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_clipSets.find(key);
+    if (it != m_clipSets.end())
+        return it->second;
+
+    // Built under the lock, so two loads of the same character never both build it
+    std::shared_ptr<const AnimationClipSet> clips = std::make_shared<AnimationClipSet>(build());
+    m_clipSets[key] = clips;
+    return clips;
+}
+
+size_t AnimationLibrary::GetCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_clipSets.size();
+}
+
+size_t AnimationLibrary::GetMemorySize() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    size_t size = 0;
+    for (const auto& entry : m_clipSets)
+        size += entry.second->GetMemorySize(!entry.second->compressed.empty());
+    return size;
+}
+
+void AnimationLibrary::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_clipSets.clear();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Animation.h"
+#include "BakedAnimation.h"
+#include "CompressedAnimation.h"
+
+// The clips of one skin. Read only once built, so any number of skeletons (and threads) can play from it.
+struct AnimationClipSet
+{
+    std::vector<Animation>              animations;
+    std::vector<CompressedAnimation>    compressed;     // empty, or one per animation
+    std::vector<BakedAnimation>         baked;          // empty, or one per animation
+
+    size_t GetMemorySize(bool compressedClips) const;
+};
+
+// Process wide store of clip sets, so that every instance of a character shares one copy of its clips
+// instead of loading its own. Clip sets are keyed by the caller, e.g. by file name and skin.
+class AnimationLibrary
+{
+public:
+    static AnimationLibrary& Get();
+
+    // Returns the clip set for key, calling build to make it the first time
+    std::shared_ptr<const AnimationClipSet> GetOrBuild(const std::wstring& key, const std::function<AnimationClipSet()>& build);
+
+    // Tolerance the clips are compressed to when built (see Skeleton::CompressAnimations), 0 to keep
+    // them uncompressed. Only affects clip sets built afterwards.
+    void SetCompressionTolerance(float tolerance) { m_compressionTolerance = tolerance; }
+    float GetCompressionTolerance() const { return m_compressionTolerance; }
+
+    size_t GetCount() const;
+    size_t GetMemorySize() const;
+    void Clear();
+
+private:
+    AnimationLibrary() = default;
+
+    mutable std::mutex                                              m_mutex;
+    std::map<std::wstring, std::shared_ptr<const AnimationClipSet>> m_clipSets;
+    float                                                           m_compressionTolerance = 0.001f;
+};
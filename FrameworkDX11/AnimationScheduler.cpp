@@ -0,0 +1,176 @@
+#include "AnimationScheduler.h"
+#include "AnimationLibrary.h"
+#include "JobSystem.h"
+#include "Skeleton.h"
+#include "gltf_utils.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace DirectX;
+
+void AnimationScheduler::Add(Skeleton* skeleton, FXMMATRIX world)
+{
+    if (skeleton == nullptr || !skeleton->IsLoaded())
+        return;
+
+    const float scale = std::max(std::max(XMVectorGetX(XMVector3Length(world.r[0])), XMVectorGetX(XMVector3Length(world.r[1]))),
+                                 XMVectorGetX(XMVector3Length(world.r[2])));
+
+    Entry entry;
+    entry.skeleton = skeleton;
+    XMStoreFloat3(&entry.position, world.r[3]);
+    entry.radius = std::max(skeleton->GetRadius() * scale, 0.001f);
+    m_entries.push_back(entry);
+}
+
+unsigned int AnimationScheduler::SelectInterval(const Entry& entry, FXMMATRIX view, float projectionScale) const
+{
+    if (!m_settings.lod)
+        return 1;
+
+    const float depth = XMVectorGetZ(XMVector3TransformCoord(XMLoadFloat3(&entry.position), view));
+    if (depth < -entry.radius)
+        return m_settings.maxInterval;      // behind the camera
+    if (depth <= entry.radius)
+        return 1;
+
+    // Height on screen as a fraction of the viewport, against thresholds halving with each step
+    const float size = entry.radius * projectionScale / depth;
+    unsigned int interval = 1;
+    float threshold = 0.25f * m_lodBias;
+    while (interval < m_settings.maxInterval && size < threshold)
+    {
+        interval *= 2;
+        threshold *= 0.5f;
+    }
+    return interval;
+}
+
+void AnimationScheduler::Update(float deltaTime, FXMMATRIX view, CXMMATRIX projection)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    m_stats = Stats();
+    m_stats.instances = (unsigned int)m_entries.size();
+
+    const float projectionScale = XMVectorGetY(projection.r[1]);
+    std::vector<unsigned int> intervals(m_entries.size());
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        intervals[i] = SelectInterval(m_entries[i], view, projectionScale);
+        const unsigned int bucket = intervals[i] >= 8 ? 3 : intervals[i] >= 4 ? 2 : intervals[i] >= 2 ? 1 : 0;
+        m_stats.perInterval[bucket]++;
+    }
+
+    // Skeletons share nothing they write, so they can be updated in any order on any thread
+    std::vector<uint8_t> evaluated(m_entries.size(), 0);
+    auto updateRange = [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+            evaluated[i] = m_entries[i].skeleton->Update(deltaTime, intervals[i]) ? 1 : 0;
+    };
+    if (m_settings.parallel)
+        JobSystem::Get().ParallelFor(m_entries.size(), 8, updateRange);
+    else
+        updateRange(0, m_entries.size());
+
+    for (uint8_t e : evaluated)
+        m_stats.evaluated += e;
+
+    m_stats.updateMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    // Over budget: drop far characters to lower rates sooner. Well under: let them back up.
+    if (m_settings.adaptive && m_settings.lod)
+    {
+        if (m_stats.updateMs > m_settings.budgetMs)
+            m_lodBias = std::min(m_lodBias * 1.25f, 16.0f);
+        else if (m_stats.updateMs < m_settings.budgetMs * 0.5f)
+            m_lodBias = std::max(m_lodBias * 0.95f, 0.25f);
+    }
+    m_stats.lodBias = m_lodBias;
+
+    m_entries.clear();
+}
+
+void AnimationScheduler::RunBenchmark()
+{
+    constexpr int kInstances = 1000;
+    constexpr int kColumns = 40;
+    constexpr float kSpacing = 1.5f;
+    constexpr int kFrames = 120;
+    constexpr float kDeltaTime = 1.0f / 60.0f;
+
+    tinygltf::Model model;
+    Skeleton prototype;
+    if (!GltfUtils::LoadModel(model, L"Resources\\RiggedFigure.gltf") ||
+        !prototype.LoadFromGltf(model, 0, L"Resources\\RiggedFigure.gltf#0") || prototype.GetAnimationCount() == 0)
+    {
+        Log::Error(L"Crowd benchmark: cannot load an animated skin from Resources\\RiggedFigure.gltf");
+        return;
+    }
+
+    // Copies share the prototype's clips; each plays from its own time
+    std::vector<Skeleton> crowd(kInstances, prototype);
+    std::vector<XMFLOAT4X4> worlds(kInstances);
+    const float duration = std::max(prototype.CurrentAnimation() ? prototype.CurrentAnimation()->GetEndTime() : 0.0f, 0.001f);
+    for (int i = 0; i < kInstances; i++)
+    {
+        crowd[i].PlayAnimation(0);
+        crowd[i].SetAnimationTime(fmodf(i * 0.37f, duration));
+        XMStoreFloat4x4(&worlds[i], XMMatrixTranslation((i % kColumns - kColumns / 2) * kSpacing, 0.0f, (i / kColumns) * kSpacing));
+    }
+
+    // Looking down the field from just in front of it
+    const XMMATRIX view = XMMatrixLookAtLH(XMVectorSet(0.0f, 2.0f, -4.0f, 1.0f), XMVectorSet(0.0f, 0.0f, 10.0f, 1.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+    const XMMATRIX projection = XMMatrixPerspectiveFovLH(XM_PIDIV4, 16.0f / 9.0f, 0.1f, 200.0f);
+
+    struct Run
+    {
+        const wchar_t*  name;
+        bool            parallel;
+        bool            lod;
+        bool            adaptive;
+    };
+    const Run runs[] =
+    {
+        { L"serial, every frame", false, false, false },
+        { L"parallel, every frame", true, false, false },
+        { L"parallel, LOD", true, true, false },
+        { L"parallel, LOD within 1 ms", true, true, true },
+    };
+
+    for (const Run& run : runs)
+    {
+        AnimationScheduler scheduler;
+        scheduler.GetSettings().parallel = run.parallel;
+        scheduler.GetSettings().lod = run.lod;
+        scheduler.GetSettings().adaptive = run.adaptive;
+        scheduler.GetSettings().budgetMs = 1.0f;
+
+        double totalMs = 0.0;
+        double worstMs = 0.0;
+        double evaluated = 0.0;
+        for (int frame = 0; frame < kFrames; frame++)
+        {
+            for (int i = 0; i < kInstances; i++)
+                scheduler.Add(&crowd[i], XMLoadFloat4x4(&worlds[i]));
+            scheduler.Update(kDeltaTime, view, projection);
+
+            totalMs += scheduler.GetStats().updateMs;
+            worstMs = std::max(worstMs, scheduler.GetStats().updateMs);
+            evaluated += scheduler.GetStats().evaluated;
+        }
+
+        const Stats& stats = scheduler.GetStats();
+        Log::Info(L"Crowd benchmark, %d x RiggedFigure, %s: %.3f ms/frame (worst %.3f), %.0f poses/frame, "
+                  L"rates 1/2/4/8: %u/%u/%u/%u, LOD bias %.2f",
+                  kInstances, run.name, totalMs / kFrames, worstMs, evaluated / kFrames,
+                  stats.perInterval[0], stats.perInterval[1], stats.perInterval[2], stats.perInterval[3], stats.lodBias);
+    }
+
+    Log::Info(L"Crowd benchmark: clips %zu bytes shared by all %d instances (%zu bytes if each had its own copy)",
+              prototype.GetAnimationMemorySize(prototype.HasCompressedAnimations()), kInstances,
+              prototype.GetAnimationMemorySize(false) * kInstances);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <DirectXMath.h>
+
+class Skeleton;
+
+// Updates every animated skeleton of a frame in one go, before rendering, spread over the JobSystem.
+//
+// Each skeleton gets an update interval from its size on screen: close characters are evaluated every
+// frame, far ones every 2nd, 4th or 8th frame with blended transforms in between (see Skeleton::Update).
+// The size thresholds are scaled by a bias that adapts to keep the update within a time budget.
+class AnimationScheduler
+{
+public:
+    struct Settings
+    {
+        float           budgetMs = 2.0f;
+        bool            adaptive = true;        // adjust the LOD bias to stay within the budget
+        bool            parallel = true;
+        bool            lod = true;
+        unsigned int    maxInterval = 8;
+    };
+
+    struct Stats
+    {
+        unsigned int    instances = 0;
+        unsigned int    evaluated = 0;          // skeletons that evaluated a new pose this frame
+        unsigned int    perInterval[4] = {};    // instances updating every 1, 2, 4 and 8 frames
+        double          updateMs = 0.0;
+        float           lodBias = 1.0f;
+    };
+
+    // Queues a skeleton for this frame's update. world places its mesh in the scene.
+    void Add(Skeleton* skeleton, DirectX::FXMMATRIX world);
+
+    // Updates and then forgets everything added since the last call
+    void Update(float deltaTime, DirectX::FXMMATRIX view, DirectX::CXMMATRIX projection);
+
+    Settings&       GetSettings() { return m_settings; }
+    const Stats&    GetStats() const { return m_stats; }
+
+    // Times 1000 instances of RiggedFigure.gltf spread over a field, at full rate and with LOD, and logs
+    // the results
+    static void RunBenchmark();
+
+private:
+    struct Entry
+    {
+        Skeleton*           skeleton;
+        DirectX::XMFLOAT3   position;
+        float               radius;
+    };
+
+    unsigned int SelectInterval(const Entry& entry, DirectX::FXMMATRIX view, float projectionScale) const;
+
+    Settings            m_settings;
+    Stats               m_stats;
+    float               m_lodBias = 1.0f;
+    std::vector<Entry>  m_entries;
+};
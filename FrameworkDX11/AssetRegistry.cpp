@@ -0,0 +1,435 @@
+#include "AssetRegistry.h"
+
+#include "JobSystem.h"
+#include "log.hpp"
+
+#include <algorithm>
+#include <cwctype>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+
+using Microsoft::WRL::ComPtr;
+
+void AssetRegistry::Init(ID3D11Device* device, TextureStreamer* streamer)
+{
+	Release();
+	m_device = device;
+	m_streamer = streamer;
+}
+
+void AssetRegistry::Release()
+{
+	// Destroyed outside the lock, in case a pending load's result is the last reference
+	std::unordered_map<uint64_t, Entry> entries;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		entries.swap(m_entries);
+		m_keys.clear();
+	}
+	entries.clear();
+	m_device.Reset();
+	m_streamer = nullptr;
+}
+
+std::wstring AssetRegistry::GetCanonicalPath(const std::wstring& file)
+{
+	std::error_code error;
+	std::filesystem::path path = std::filesystem::weakly_canonical(file, error);
+	if (error)
+		path = file;
+
+	// Paths differing only in case are the same file
+	std::wstring canonical = path.make_preferred().wstring();
+	std::transform(canonical.begin(), canonical.end(), canonical.begin(), [](wchar_t c) { return (wchar_t)std::towlower(c); });
+	return canonical;
+}
+
+std::shared_ptr<const void> AssetRegistry::AcquireErased(uint64_t key, const std::function<std::shared_ptr<const void>()>& load,
+														 const std::function<bool(const void*)>& matches)
+{
+	std::promise<std::shared_ptr<const void>> promise;
+	std::shared_future<std::shared_ptr<const void>> pending;
+	bool collided = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Entry& entry = m_entries[key];
+		if (std::shared_ptr<const void> asset = entry.asset.lock())
+		{
+			if (!matches || matches(asset.get()))
+			{
+				m_hits++;
+				return asset;
+			}
+			collided = true;
+		}
+		else if (entry.loading.valid())
+		{
+			pending = entry.loading;
+			m_coalesced++;
+		}
+		else
+		{
+			entry.loading = promise.get_future().share();
+		}
+	}
+	if (pending.valid())
+	{
+		std::shared_ptr<const void> asset = pending.get();
+		if (!asset || !matches || matches(asset.get()))
+			return asset;
+		collided = true;
+	}
+
+	// Another asset has the key; this one is loaded on its own, and the key stays with the first
+	if (collided)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_collisions++;
+		}
+		Log::Warning(L"AssetRegistry: key %016llx is held by a different asset, loading another copy", (unsigned long long)key);
+		return load();
+	}
+
+	// A load that throws leaves no entry behind, and the requests waiting for it get the exception
+	std::shared_ptr<const void> asset;
+	try
+	{
+		asset = load();
+	}
+	catch (...)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_entries.erase(key);
+		}
+		promise.set_exception(std::current_exception());
+		throw;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (asset)
+		{
+			Entry& entry = m_entries[key];
+			entry.asset = asset;
+			entry.loading = {};
+			AddKey(key, asset.get());
+			m_loads++;
+		}
+		else
+		{
+			// Nothing to keep; a later request tries again
+			m_entries.erase(key);
+		}
+	}
+	promise.set_value(asset);
+	return asset;
+}
+
+std::shared_ptr<const void> AssetRegistry::ShareContent(uint64_t key, const std::shared_ptr<const void>& asset,
+												   const std::function<bool(const void*)>& same)
+{
+	std::shared_ptr<const void> existing;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Entry& entry = m_entries[key];
+		existing = entry.asset.lock();
+		if (!existing)
+		{
+			entry.asset = asset;
+			AddKey(key, asset.get());
+			return asset;
+		}
+	}
+
+	// The key only says the two may be the same; compared outside the lock, as that may read files
+	if (!same(existing.get()))
+		return asset;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_contentMatches++;
+	return existing;
+}
+
+void AssetRegistry::AddKey(uint64_t key, const void* asset)
+{
+	m_keys[asset].push_back(key);
+}
+
+void AssetRegistry::OnFreed(const void* asset)
+{
+	m_released++;
+
+	// Keys whose asset is gone would only be loaded again, so they go with it. A key may be loading
+	// again already, or hold a new asset by now, and then it stays.
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const auto keys = m_keys.find(asset);
+	if (keys == m_keys.end())
+		return;
+	for (const uint64_t key : keys->second)
+	{
+		const auto it = m_entries.find(key);
+		if (it != m_entries.end() && it->second.asset.expired() && !it->second.loading.valid())
+			m_entries.erase(it);
+	}
+	m_keys.erase(keys);
+}
+
+AssetRegistry::TextureRef AssetRegistry::AcquireTexture(const std::wstring& file)
+{
+	if (m_streamer == nullptr)
+		return nullptr;
+
+	const std::wstring path = GetCanonicalPath(file);
+	return Acquire<Texture>(Utils::HashBytes(path.data(), path.size() * sizeof(wchar_t)), [&]() -> TextureRef
+		{
+			TextureStreamer* streamer = m_streamer;
+			Texture texture;
+			texture.handle = streamer->Load(file);
+			if (texture.handle == TextureStreamer::kInvalidHandle)
+				return nullptr;
+
+			const uint64_t content = streamer->GetContentHash(texture.handle);
+			TextureRef loaded = MakeAsset<Texture>(std::move(texture), [streamer](Texture& freed) { streamer->Unload(freed.handle); });
+			if (content == 0)
+				return loaded;
+
+			// A copy of a file loaded under another path shares that texture, and this one is unloaded again.
+			// The content hash leaves out the levels not read yet, so the files are compared before sharing.
+			static const char kContentKey[] = "texture content";
+			const TextureStreamer::Handle handle = loaded->handle;
+			return std::static_pointer_cast<const Texture>(ShareContent(Utils::HashBytes(kContentKey, sizeof(kContentKey), content), loaded,
+				[streamer, handle](const void* other) { return streamer->HasSameContent(static_cast<const Texture*>(other)->handle, handle); }));
+		});
+}
+
+AssetRegistry::BufferKey AssetRegistry::GetBufferKey(const D3D11_BUFFER_DESC& desc, const void* data)
+{
+	BufferKey key;
+	key.key = Utils::HashBytes(data, desc.ByteWidth, Utils::HashBytes(&desc, sizeof(desc)));
+	key.check = Utils::HashBytesMurmur(data, desc.ByteWidth);
+	return key;
+}
+
+AssetRegistry::BufferRef AssetRegistry::AcquireBuffer(const D3D11_BUFFER_DESC& desc, const void* data)
+{
+	return AcquireBuffer(desc, data, GetBufferKey(desc, data));
+}
+
+AssetRegistry::BufferRef AssetRegistry::AcquireBuffer(const D3D11_BUFFER_DESC& desc, const void* data, const BufferKey& key)
+{
+	auto matches = [&desc, &key](const Buffer& buffer)
+	{
+		return buffer.check == key.check && memcmp(&buffer.desc, &desc, sizeof(desc)) == 0;
+	};
+	return Acquire<Buffer>(key.key, [&]() -> BufferRef
+		{
+			if (!m_device)
+				return nullptr;
+
+			D3D11_SUBRESOURCE_DATA initData = {};
+			initData.pSysMem = data;
+			Buffer buffer;
+			buffer.size = desc.ByteWidth;
+			buffer.desc = desc;
+			buffer.check = key.check;
+			const HRESULT hr = m_device->CreateBuffer(&desc, &initData, &buffer.buffer);
+			if (FAILED(hr))
+			{
+				Log::Error(L"AssetRegistry: cannot create a buffer of %u bytes (0x%08x)", desc.ByteWidth, (unsigned int)hr);
+				return nullptr;
+			}
+			return MakeAsset<Buffer>(std::move(buffer));
+		}, matches);
+}
+
+AssetRegistry::MeshRef AssetRegistry::AcquireMesh(const void* vertices, UINT vertexBytes, const void* indices, UINT indexBytes)
+{
+	D3D11_BUFFER_DESC vertexDesc = {};
+	vertexDesc.Usage = D3D11_USAGE_IMMUTABLE;
+	vertexDesc.ByteWidth = vertexBytes;
+	vertexDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	D3D11_BUFFER_DESC indexDesc = vertexDesc;
+	indexDesc.ByteWidth = indexBytes;
+	indexDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+
+	// The contents are hashed once, for the buffers; the mesh is keyed and confirmed by their hashes
+	const BufferKey vertexKey = GetBufferKey(vertexDesc, vertices);
+	const BufferKey indexKey = GetBufferKey(indexDesc, indices);
+	const uint64_t key = Utils::HashBytes(&indexKey.key, sizeof(indexKey.key), Utils::HashBytes(&vertexKey.key, sizeof(vertexKey.key)));
+	auto matches = [&](const Mesh& mesh)
+	{
+		return mesh.vertices->check == vertexKey.check && mesh.vertices->size == vertexBytes &&
+			   mesh.indices->check == indexKey.check && mesh.indices->size == indexBytes;
+	};
+	return Acquire<Mesh>(key, [&]() -> MeshRef
+		{
+			// Each buffer is shared on its own too, e.g. by primitives indexing the same vertices
+			Mesh mesh;
+			mesh.vertices = AcquireBuffer(vertexDesc, vertices, vertexKey);
+			mesh.indices = AcquireBuffer(indexDesc, indices, indexKey);
+			if (!mesh.vertices || !mesh.indices)
+				return nullptr;
+			return MakeAsset<Mesh>(std::move(mesh));
+		}, matches);
+}
+
+AssetRegistry::Stats AssetRegistry::GetStats() const
+{
+	Stats stats;
+	std::vector<std::shared_ptr<const void>> assets;	// let go of outside the lock, as that may free them
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (const auto& entry : m_entries)
+		{
+			if (std::shared_ptr<const void> asset = entry.second.asset.lock())
+				assets.push_back(std::move(asset));
+		}
+		stats.loads = m_loads;
+		stats.hits = m_hits;
+		stats.coalesced = m_coalesced;
+		stats.contentMatches = m_contentMatches;
+		stats.collisions = m_collisions;
+	}
+
+	// Keys sharing an asset (paths to one texture) count once
+	std::unordered_set<const void*> live;
+	for (const std::shared_ptr<const void>& asset : assets)
+		live.insert(asset.get());
+	stats.live = (UINT)live.size();
+	stats.released = m_released;
+	return stats;
+}
+
+bool AssetRegistry::RunSelfTest(ID3D11Device* device, ID3D11DeviceContext* context)
+{
+	bool passed = true;
+	auto check = [&passed](bool condition, const wchar_t* what)
+	{
+		if (!condition)
+		{
+			Log::Error(L"AssetRegistry self test: %s", what);
+			passed = false;
+		}
+	};
+
+	TextureStreamer streamer;
+	if (FAILED(streamer.Init(device, context)))
+	{
+		Log::Error(L"AssetRegistry self test: cannot start a texture streamer");
+		return false;
+	}
+	AssetRegistry registry;
+	registry.Init(device, &streamer);
+
+	// One texture per file, whichever way the path is written, and per content
+	const std::wstring file = L"Resources\\stone.dds";
+	const std::wstring copy = L"Resources\\stone_selftest_copy.dds";
+	std::error_code error;
+	std::filesystem::copy_file(file, copy, std::filesystem::copy_options::overwrite_existing, error);
+
+	TextureRef texture = registry.AcquireTexture(file);
+	TextureRef samePath = registry.AcquireTexture(L"resources\\..\\Resources\\STONE.dds");
+	TextureRef sameContent = registry.AcquireTexture(copy);
+	std::filesystem::remove(copy, error);
+	check(texture != nullptr, L"cannot load Resources\\stone.dds");
+	check(samePath == texture, L"two paths to a file should give one texture");
+	check(sameContent == texture, L"a copy of a file should share its texture");
+
+	// A copy differing in a texel of the top level, which is only streamed in later, is a texture of its own
+	const std::wstring edited = L"Resources\\stone_selftest_edited.dds";
+	std::filesystem::copy_file(file, edited, std::filesystem::copy_options::overwrite_existing, error);
+	const uintmax_t fileSize = std::filesystem::file_size(file, error);
+	{
+		std::fstream stream(std::filesystem::path(edited), std::ios::in | std::ios::out | std::ios::binary);
+		stream.seekg(fileSize / 2);
+		const char byte = (char)(stream.get() ^ 0xff);
+		stream.seekp(fileSize / 2);
+		stream.put(byte);
+	}
+	TextureRef otherContent = registry.AcquireTexture(edited);
+	std::filesystem::remove(edited, error);
+	check(otherContent != nullptr && otherContent != texture, L"files differing in their top level should not share a texture");
+	otherContent.reset();
+
+	const TextureStreamer::Handle handle = GetHandle(texture);
+	UINT released = registry.GetStats().released;
+	texture.reset();
+	samePath.reset();
+	check(streamer.IsLoaded(handle), L"a texture should stay loaded while referenced");
+	sameContent.reset();
+	check(!streamer.IsLoaded(handle) && registry.GetStats().released > released, L"a texture should be unloaded with its last reference");
+
+	// Concurrent requests for one buffer load it once
+	std::vector<uint32_t> data(1u << 20);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (uint32_t)(i * 2654435761u);
+	D3D11_BUFFER_DESC desc = {};
+	desc.Usage = D3D11_USAGE_IMMUTABLE;
+	desc.ByteWidth = (UINT)(data.size() * sizeof(uint32_t));
+	desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+
+	const Stats before = registry.GetStats();
+	std::vector<BufferRef> buffers(16);
+	JobSystem::Get().ParallelFor(buffers.size(), 1, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+				buffers[i] = registry.AcquireBuffer(desc, data.data());
+		});
+	const Stats after = registry.GetStats();
+	check(buffers[0] != nullptr && std::all_of(buffers.begin(), buffers.end(), [&](const BufferRef& b) { return b == buffers[0]; }),
+		  L"concurrent requests should share one buffer");
+	check(after.loads - before.loads == 1 && (after.hits - before.hits) + (after.coalesced - before.coalesced) == 15,
+		  L"concurrent requests should load the buffer once");
+
+	// Meshes share buffers with each other and with plain buffer requests
+	const std::vector<uint32_t> indices = { 0, 1, 2, 2, 1, 3 };
+	const std::vector<uint32_t> otherIndices = { 0, 2, 1 };
+	MeshRef mesh = registry.AcquireMesh(data.data(), desc.ByteWidth, indices.data(), (UINT)(indices.size() * sizeof(uint32_t)));
+	MeshRef sameMesh = registry.AcquireMesh(data.data(), desc.ByteWidth, indices.data(), (UINT)(indices.size() * sizeof(uint32_t)));
+	MeshRef otherMesh = registry.AcquireMesh(data.data(), desc.ByteWidth, otherIndices.data(), (UINT)(otherIndices.size() * sizeof(uint32_t)));
+	check(mesh && mesh == sameMesh, L"identical meshes should be one");
+	check(otherMesh && otherMesh != mesh && otherMesh->vertices == mesh->vertices && mesh->vertices == buffers[0],
+		  L"meshes with the same vertices should share the vertex buffer");
+
+	released = registry.GetStats().released;
+	buffers.clear();
+	mesh.reset();
+	sameMesh.reset();
+	otherMesh.reset();
+	const Stats freed = registry.GetStats();
+	check(freed.live == 0 && freed.released - released == 5, L"every asset should be freed with its last reference");
+
+	Log::Info(L"AssetRegistry: %u loads, %u hits, %u coalesced, %u content matches, %u released",
+			  freed.loads, freed.hits, freed.coalesced, freed.contentMatches, freed.released);
+
+	// A load that throws passes the exception on and leaves the key free for the next request
+	bool thrown = false;
+	try
+	{
+		registry.Acquire<int>(1, []() -> std::shared_ptr<const int> { throw std::runtime_error("load failed"); });
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	std::shared_ptr<const int> retried = registry.Acquire<int>(1, [&registry]() -> std::shared_ptr<const int> { return registry.MakeAsset<int>(7); });
+	check(thrown && retried && *retried == 7, L"a key whose load threw should load again on the next request");
+
+	// An asset under the key that is not the one asked for is left alone, and another one loaded
+	const UINT collisions = registry.GetStats().collisions;
+	std::shared_ptr<const int> collided = registry.Acquire<int>(1, [&registry]() -> std::shared_ptr<const int> { return registry.MakeAsset<int>(8); },
+																[](const int& value) { return value == 8; });
+	check(collided && *collided == 8 && collided != retried && registry.GetStats().collisions == collisions + 1 &&
+		  registry.Acquire<int>(1, []() -> std::shared_ptr<const int> { return nullptr; }) == retried, L"a key collision should load a separate asset and keep the first");
+	collided.reset();
+	retried.reset();
+
+	registry.Release();
+	streamer.Release();
+	if (passed)
+		Log::Info(L"AssetRegistry self test passed");
+	return passed;
+}
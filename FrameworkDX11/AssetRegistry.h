@@ -0,0 +1,182 @@
+// Shared, reference counted assets.
+//
+// Every asset is loaded once and handed out as a shared_ptr to a const asset; holders of the same
+// asset share it, and it is freed the moment the last of them lets go (the texture is unloaded from
+// the streamer, the device buffer released). The registry itself only keeps weak references, keyed
+// by a 64-bit hash:
+//
+//	- textures by canonical path, so "Resources\\a.dds" and "resources/../Resources/A.dds" are one
+//	  asset, and then by content (a hash of the file size, header and mip tail, confirmed by comparing
+//	  the files), so copies of a file are one too
+//	- device buffers and meshes by their contents, so geometry repeated across glTF files (or files
+//	  sharing a .bin) is uploaded once. A match is confirmed by the description and a second,
+//	  unrelated hash of the contents, so a collision of the key never hands out other geometry.
+//	- anything else through Acquire() with a key of the caller's choosing (e.g. decoded glTF images)
+//
+// Requests for an asset that is still loading wait for that load instead of starting another one.
+// Acquire() may be called from any thread; AcquireTexture() only from the render thread, as
+// TextureStreamer::Load() is not thread safe.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include "wrl.h"
+#include "TextureStreamer.h"
+#include "utils.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+class AssetRegistry
+{
+public:
+	struct Texture
+	{
+		TextureStreamer::Handle		handle = TextureStreamer::kInvalidHandle;
+	};
+
+	struct Buffer
+	{
+		Microsoft::WRL::ComPtr<ID3D11Buffer>	buffer;
+		UINT									size = 0;
+		D3D11_BUFFER_DESC						desc = {};
+		uint64_t								check = 0;	// second hash of the contents, confirming a key match
+	};
+
+	// Immutable vertex and index buffers of a primitive
+	struct Mesh
+	{
+		std::shared_ptr<const Buffer>	vertices;
+		std::shared_ptr<const Buffer>	indices;
+	};
+
+	// A texture made by the caller, e.g. from a decoded glTF image (see Acquire())
+	struct View
+	{
+		Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>	view;
+	};
+
+	using TextureRef = std::shared_ptr<const Texture>;
+	using BufferRef = std::shared_ptr<const Buffer>;
+	using MeshRef = std::shared_ptr<const Mesh>;
+	using ViewRef = std::shared_ptr<const View>;
+
+	struct Stats
+	{
+		UINT	live = 0;			// keys with an asset in use
+		UINT	loads = 0;
+		UINT	hits = 0;			// requests given an asset already loaded
+		UINT	coalesced = 0;		// requests that waited for another request's load
+		UINT	contentMatches = 0;	// textures found loaded under another path
+		UINT	collisions = 0;		// keys matched by a different asset, which was then loaded unshared
+		UINT	released = 0;		// assets freed after their last reference went
+	};
+
+	AssetRegistry() = default;
+	AssetRegistry(const AssetRegistry&) = delete;
+	AssetRegistry& operator = (const AssetRegistry&) = delete;
+
+	void	Init(ID3D11Device* device, TextureStreamer* streamer);
+	// Forgets every asset. References still held stay valid and free their asset when dropped, so
+	// the registry object itself must outlive them.
+	void	Release();
+
+	// nullptr if the file cannot be loaded (logged by the streamer)
+	TextureRef	AcquireTexture(const std::wstring& file);
+	static TextureStreamer::Handle	GetHandle(const TextureRef& texture) { return texture ? texture->handle : TextureStreamer::kInvalidHandle; }
+
+	// An immutable buffer created from data, nullptr if the device cannot create it
+	BufferRef	AcquireBuffer(const D3D11_BUFFER_DESC& desc, const void* data);
+	MeshRef		AcquireMesh(const void* vertices, UINT vertexBytes, const void* indices, UINT indexBytes);
+
+	// The asset stored under key, calling load() to create it if there is none. Assets that need work
+	// when freed are made by MakeAsset(). The key is hashed together with T, so different kinds of
+	// asset never collide. If given, matches() confirms an asset found under the key is the one asked
+	// for; when it is not, load() makes one that is not shared.
+	template <typename T>
+	std::shared_ptr<const T>	Acquire(uint64_t key, const std::function<std::shared_ptr<const T>()>& load,
+										const std::function<bool(const T&)>& matches = nullptr);
+
+	// A new asset counted in the stats when freed, calling onFree first. T is given explicitly.
+	template <typename T>
+	std::shared_ptr<T>	MakeAsset(T&& value, std::function<void(T&)> onFree = nullptr);
+
+	Stats	GetStats() const;
+
+	// Checks deduplication, concurrent requests and freeing against the real device
+	static bool	RunSelfTest(ID3D11Device* device, ID3D11DeviceContext* context);
+
+private:
+	struct Entry
+	{
+		std::weak_ptr<const void>						asset;
+		std::shared_future<std::shared_ptr<const void>>	loading;	// valid while a load is running
+	};
+
+	// Buffers are keyed by HashBytes() of their description and contents and confirmed by check
+	struct BufferKey
+	{
+		uint64_t	key = 0;
+		uint64_t	check = 0;
+	};
+
+	std::shared_ptr<const void>	AcquireErased(uint64_t key, const std::function<std::shared_ptr<const void>()>& load,
+											  const std::function<bool(const void*)>& matches);
+	static BufferKey	GetBufferKey(const D3D11_BUFFER_DESC& desc, const void* data);
+	BufferRef	AcquireBuffer(const D3D11_BUFFER_DESC& desc, const void* data, const BufferKey& key);
+	// The asset already under key if same() confirms it matches, or asset, stored there if the key is free
+	std::shared_ptr<const void>	ShareContent(uint64_t key, const std::shared_ptr<const void>& asset,
+											 const std::function<bool(const void*)>& same);
+	// Records that key holds asset, with m_mutex held
+	void	AddKey(uint64_t key, const void* asset);
+	// Drops the keys of an asset being freed
+	void	OnFreed(const void* asset);
+
+	static std::wstring	GetCanonicalPath(const std::wstring& file);
+
+	Microsoft::WRL::ComPtr<ID3D11Device>	m_device;
+	TextureStreamer*						m_streamer = nullptr;
+
+	mutable std::mutex							m_mutex;
+	std::unordered_map<uint64_t, Entry>			m_entries;
+	std::unordered_map<const void*, std::vector<uint64_t>>	m_keys;	// of each asset, so freeing one is O(1)
+	UINT										m_loads = 0;
+	UINT										m_hits = 0;
+	UINT										m_coalesced = 0;
+	UINT										m_contentMatches = 0;
+	UINT										m_collisions = 0;
+	std::atomic<UINT>							m_released{ 0 };
+};
+
+template <typename T>
+std::shared_ptr<const T> AssetRegistry::Acquire(uint64_t key, const std::function<std::shared_ptr<const T>()>& load,
+												const std::function<bool(const T&)>& matches)
+{
+	const uint64_t typedKey = Utils::HashBytes(typeid(T).name(), strlen(typeid(T).name()), key);
+	std::function<bool(const void*)> erasedMatches;
+	if (matches)
+		erasedMatches = [&matches](const void* asset) { return matches(*static_cast<const T*>(asset)); };
+	return std::static_pointer_cast<const T>(AcquireErased(typedKey, [&load]() -> std::shared_ptr<const void> { return load(); }, erasedMatches));
+}
+
+template <typename T>
+std::shared_ptr<T> AssetRegistry::MakeAsset(T&& value, std::function<void(T&)> onFree)
+{
+	return std::shared_ptr<T>(new T(std::move(value)), [this, onFree](T* asset)
+		{
+			if (onFree)
+				onFree(*asset);
+			// Before the delete, while no new asset can have its address
+			OnFreed(asset);
+			delete asset;
+		});
+}
@@ -0,0 +1,202 @@
+#include "BakedAnimation.h"
+#include "Skeleton.h"
+#include "gltf_utils.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+using namespace DirectX;
+
+bool BakedAnimation::Bake(const Skeleton& skeleton, const Animation& animation, float framesPerSecond)
+{
+    *this = BakedAnimation();
+    if (!skeleton.IsLoaded() || framesPerSecond <= 0.0f)
+        return false;
+
+    const float duration = animation.GetEndTime() - animation.GetStartTime();
+    const uint32_t intervals = std::max(1u, (uint32_t)lroundf(duration * framesPerSecond));
+
+    m_jointCount = skeleton.GetBoneCount();
+    m_frameCount = intervals + 1;
+    m_frameRate = duration > 0.0f ? intervals / duration : framesPerSecond;
+    m_startTime = animation.GetStartTime();
+    m_palettes.resize((size_t)m_frameCount * m_jointCount);
+
+    Skeleton pose = skeleton;
+    for (uint32_t frame = 0; frame < m_frameCount; frame++)
+    {
+        // The last frame is the clip's end, so looping blends back towards the first
+        const float time = m_startTime + std::min(frame / m_frameRate, duration);
+        pose.EvaluatePose(&animation, time);
+        pose.GetSkinningMatrices(&m_palettes[(size_t)frame * m_jointCount], m_jointCount);
+    }
+    return true;
+}
+
+uint32_t BakedAnimation::GetPosition(float time) const
+{
+    if (m_frameCount == 0)
+        return 0;
+
+    const float position = (time - m_startTime) * m_frameRate * kSubframes;
+    const uint32_t last = (m_frameCount - 1) * kSubframes;
+    return position <= 0.0f ? 0 : std::min((uint32_t)lroundf(position), last);
+}
+
+template <typename Store>
+void BakedAnimation::Blend(uint32_t position, unsigned int count, Store store) const
+{
+    if (m_frameCount == 0)
+        return;
+
+    const uint32_t frame = std::min(position / kSubframes, m_frameCount - 1);
+    const uint32_t next = std::min(frame + 1, m_frameCount - 1);
+    const float t = (float)(position % kSubframes) / kSubframes;
+    const XMFLOAT3X4* a = GetFrame(frame);
+    const XMFLOAT3X4* b = GetFrame(next);
+
+    // Rows are 16 bytes each, so every joint is three vector lerps
+    count = std::min(count, m_jointCount);
+    for (unsigned int j = 0; j < count; j++)
+    {
+        const XMVECTOR r0 = XMVectorLerp(XMLoadFloat4((const XMFLOAT4*)a[j].m[0]), XMLoadFloat4((const XMFLOAT4*)b[j].m[0]), t);
+        const XMVECTOR r1 = XMVectorLerp(XMLoadFloat4((const XMFLOAT4*)a[j].m[1]), XMLoadFloat4((const XMFLOAT4*)b[j].m[1]), t);
+        const XMVECTOR r2 = XMVectorLerp(XMLoadFloat4((const XMFLOAT4*)a[j].m[2]), XMLoadFloat4((const XMFLOAT4*)b[j].m[2]), t);
+        store(j, r0, r1, r2);
+    }
+}
+
+void BakedAnimation::Sample(uint32_t position, XMFLOAT3X4* palette, unsigned int count) const
+{
+    Blend(position, count, [palette](unsigned int j, FXMVECTOR r0, FXMVECTOR r1, FXMVECTOR r2)
+    {
+        XMStoreFloat4((XMFLOAT4*)palette[j].m[0], r0);
+        XMStoreFloat4((XMFLOAT4*)palette[j].m[1], r1);
+        XMStoreFloat4((XMFLOAT4*)palette[j].m[2], r2);
+    });
+}
+
+void BakedAnimation::Sample(uint32_t position, XMMATRIX* palette, unsigned int count) const
+{
+    const XMVECTOR lastRow = g_XMIdentityR3;
+    Blend(position, count, [palette, lastRow](unsigned int j, FXMVECTOR r0, FXMVECTOR r1, FXMVECTOR r2)
+    {
+        palette[j].r[0] = r0;
+        palette[j].r[1] = r1;
+        palette[j].r[2] = r2;
+        palette[j].r[3] = lastRow;
+    });
+}
+
+void BakedAnimation::RunBenchmark()
+{
+    constexpr int kInstances = 1000;
+    constexpr int kFrames = 20;
+    constexpr float kDeltaTime = 1.0f / 60.0f;
+    constexpr float kBakeRate = 30.0f;
+    const wchar_t* files[] = { L"Resources\\RiggedFigure.gltf", L"Resources\\Fox.gltf" };
+
+    for (const wchar_t* file : files)
+    {
+        tinygltf::Model model;
+        Skeleton live;
+        if (!GltfUtils::LoadModel(model, file) || !live.LoadFromGltf(model) || live.GetAnimationCount() == 0)
+        {
+            Log::Error(L"Baked animation benchmark: cannot load an animated skin from %s", file);
+            continue;
+        }
+        live.PlayAnimation(0);
+
+        Skeleton baked = live;
+        baked.BakeAnimations(kBakeRate);
+
+        const std::shared_ptr<const AnimationClipSet> clips = baked.GetClips();
+        for (size_t a = 0; a < clips->baked.size(); a++)
+        {
+            Log::Info(L"Baked animation benchmark, %s clip %zu: %u frames x %u joints at %.1f fps, %zu bytes (clip %zu bytes)",
+                      file, a, clips->baked[a].GetFrameCount(), clips->baked[a].GetJointCount(), clips->baked[a].GetFrameRate(),
+                      clips->baked[a].GetMemorySize(), CompressedAnimation::GetMemorySize(clips->animations[a]));
+        }
+
+        // Instances spread over the clip, as the crowd's are
+        const unsigned int bones = live.GetBoneCount();
+        std::vector<XMMATRIX> palettes((size_t)kInstances * bones);
+        auto spawn = [](const Skeleton& prototype)
+        {
+            std::vector<Skeleton> instances(kInstances, prototype);
+            for (int i = 0; i < kInstances; i++)
+                instances[i].SetAnimationTime(prototype.CurrentAnimation()->GetStartTime() + 0.37f * i);
+            return instances;
+        };
+
+        auto run = [&](std::vector<Skeleton>& instances, bool share, double& usPerInstance, size_t& palettesPerFrame)
+        {
+            std::vector<std::pair<Skeleton::PaletteKey, int>> keys(kInstances);
+            palettesPerFrame = 0;
+            const auto start = std::chrono::high_resolution_clock::now();
+            for (int frame = 0; frame < kFrames; frame++)
+            {
+                for (int i = 0; i < kInstances; i++)
+                    instances[i].Update(kDeltaTime);
+
+                if (!share)
+                {
+                    for (int i = 0; i < kInstances; i++)
+                        instances[i].GetSkinningMatrices(&palettes[(size_t)i * bones], bones);
+                    palettesPerFrame += kInstances;
+                    continue;
+                }
+
+                // One palette per distinct key, as the renderer does after sorting its draws
+                for (int i = 0; i < kInstances; i++)
+                    keys[i] = { instances[i].GetPaletteKey(), i };
+                std::sort(keys.begin(), keys.end());
+                for (int i = 0; i < kInstances; i++)
+                {
+                    if (i > 0 && keys[i].first == keys[i - 1].first)
+                        continue;
+                    instances[keys[i].second].GetSkinningMatrices(&palettes[(size_t)keys[i].second * bones], bones);
+                    palettesPerFrame++;
+                }
+            }
+            usPerInstance = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count() / ((double)kFrames * kInstances);
+            palettesPerFrame /= kFrames;
+        };
+
+        std::vector<Skeleton> liveInstances = spawn(live);
+        std::vector<Skeleton> bakedInstances = spawn(baked);
+        double liveUs = 0.0, bakedUs = 0.0, sharedUs = 0.0;
+        size_t livePalettes = 0, bakedPalettes = 0, sharedPalettes = 0;
+        run(liveInstances, false, liveUs, livePalettes);
+        run(bakedInstances, false, bakedUs, bakedPalettes);
+        run(bakedInstances, true, sharedUs, sharedPalettes);
+
+        // Error: baked against live at the same times, over two loops of the clip
+        std::vector<XMMATRIX> reference(bones), sampled(bones);
+        float maxError = 0.0f;
+        Skeleton liveProbe = live;
+        Skeleton bakedProbe = baked;
+        const float duration = live.CurrentAnimation()->GetEndTime() - live.CurrentAnimation()->GetStartTime();
+        for (float time = 0.0f; time < 2.0f * duration; time += 0.01f)
+        {
+            liveProbe.SetAnimationTime(live.CurrentAnimation()->GetStartTime());
+            bakedProbe.SetAnimationTime(live.CurrentAnimation()->GetStartTime());
+            liveProbe.Update(time);
+            bakedProbe.Update(time);
+            liveProbe.GetSkinningMatrices(reference.data(), bones);
+            bakedProbe.GetSkinningMatrices(sampled.data(), bones);
+            for (unsigned int b = 0; b < bones; b++)
+            {
+                for (int r = 0; r < 3; r++)
+                    maxError = std::max(maxError, XMVectorGetX(XMVector4Length((XMVectorSubtract(reference[b].r[r], sampled[b].r[r])))));
+            }
+        }
+
+        Log::Info(L"Baked animation benchmark, %s, %d instances: live %.3f us/instance, baked %.3f us/instance, "
+                  L"baked and shared %.3f us/instance (%zu palettes/frame instead of %zu), largest matrix row error %.5f",
+                  file, kInstances, liveUs, bakedUs, sharedUs, sharedPalettes, bakedPalettes, maxError);
+    }
+}
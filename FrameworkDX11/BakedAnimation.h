@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <DirectXMath.h>
+
+#include "Animation.h"
+
+class Skeleton;
+
+// A clip pre-sampled at a fixed rate into finished skinning palettes, for large crowds of one character.
+//
+// Playing it back costs no pose evaluation at all: a time picks two stored frames and the palette is
+// their per element blend. Times are quantized to kSubframes steps per frame first, so instances close
+// enough in time produce identical palettes and can share one (see Skeleton::GetPaletteKey).
+// Each joint is a 3x4 matrix, the transposed skinning matrix without its constant last column.
+class BakedAnimation
+{
+public:
+    static constexpr uint32_t kSubframes = 4;
+
+    // Samples animation on skeleton (which is left untouched) at about framesPerSecond; the rate is
+    // adjusted so the clip is a whole number of frames
+    bool Bake(const Skeleton& skeleton, const Animation& animation, float framesPerSecond);
+
+    // Quantized playback position of a time: frame * kSubframes + subframe, clamped to the clip
+    uint32_t GetPosition(float time) const;
+
+    // Writes the palette at a position in glTF joint order. Joints past count are dropped.
+    void Sample(uint32_t position, DirectX::XMFLOAT3X4* palette, unsigned int count) const;
+    // The same, expanded to transposed 4x4 matrices
+    void Sample(uint32_t position, DirectX::XMMATRIX* palette, unsigned int count) const;
+
+    const DirectX::XMFLOAT3X4* GetFrame(uint32_t frame) const { return &m_palettes[(size_t)frame * m_jointCount]; }
+    uint32_t GetFrameCount() const { return m_frameCount; }
+    unsigned int GetJointCount() const { return m_jointCount; }
+    float GetFrameRate() const { return m_frameRate; }
+    size_t GetMemorySize() const { return m_palettes.size() * sizeof(DirectX::XMFLOAT3X4); }
+
+    // Bakes the clips of RiggedFigure.gltf and Fox.gltf and logs their memory, the cost per instance of
+    // 1000 instances played live, baked and baked with shared palettes, and the largest error against
+    // live evaluation
+    static void RunBenchmark();
+
+private:
+    template <typename Store>
+    void Blend(uint32_t position, unsigned int count, Store store) const;
+
+    std::vector<DirectX::XMFLOAT3X4>    m_palettes;     // frame major, m_jointCount per frame
+    unsigned int                        m_jointCount = 0;
+    uint32_t                            m_frameCount = 0;
+    float                               m_frameRate = 0.0f;
+    float                               m_startTime = 0.0f;
+};
@@ -0,0 +1,401 @@
+#include "BlendTree.h"
+#include "AllocationCounter.h"
+#include "gltf_utils.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace DirectX;
+
+BlendTree::NodeId BlendTree::AddNode(const Node& node)
+{
+    // Inputs must already exist, which also keeps the tree free of cycles
+    for (const NodeId input : node.inputs)
+    {
+        if (input != -1 && !IsValid(input))
+            return -1;
+    }
+    m_nodes.push_back(node);
+    return (NodeId)m_nodes.size() - 1;
+}
+
+BlendTree::NodeId BlendTree::AddClip(unsigned int animation, float speed, float time)
+{
+    Node node;
+    node.type = NodeType::Clip;
+    node.animation = animation;
+    node.speed = speed;
+    node.time = time;
+    return AddNode(node);
+}
+
+BlendTree::NodeId BlendTree::AddBlend(NodeId a, NodeId b, float weight)
+{
+    if (!IsValid(a) || !IsValid(b))
+        return -1;
+
+    Node node;
+    node.type = NodeType::Blend;
+    node.inputs[0] = a;
+    node.inputs[1] = b;
+    node.weight = node.targetWeight = std::min(std::max(weight, 0.0f), 1.0f);
+    return AddNode(node);
+}
+
+BlendTree::NodeId BlendTree::AddLayer(NodeId base, NodeId layer, std::vector<float> mask, float weight)
+{
+    const NodeId id = AddBlend(base, layer, weight);
+    if (id >= 0)
+    {
+        m_nodes[id].mask = (int)m_masks.size();
+        m_masks.push_back(std::move(mask));
+    }
+    return id;
+}
+
+BlendTree::NodeId BlendTree::AddAdditive(NodeId base, NodeId additive, NodeId reference, float weight)
+{
+    if (!IsValid(base) || !IsValid(additive) || !IsValid(reference))
+        return -1;
+
+    Node node;
+    node.type = NodeType::Additive;
+    node.inputs[0] = base;
+    node.inputs[1] = additive;
+    node.inputs[2] = reference;
+    node.weight = node.targetWeight = std::max(weight, 0.0f);
+    return AddNode(node);
+}
+
+void BlendTree::Clear()
+{
+    m_nodes.clear();
+    m_masks.clear();
+    m_root = -1;
+}
+
+void BlendTree::SetWeight(NodeId node, float weight)
+{
+    if (!IsValid(node) || m_nodes[node].type == NodeType::Clip)
+        return;
+
+    Node& n = m_nodes[node];
+    n.weight = n.targetWeight = n.type == NodeType::Blend ? std::min(std::max(weight, 0.0f), 1.0f) : std::max(weight, 0.0f);
+    n.fadeRate = 0.0f;
+}
+
+float BlendTree::GetWeight(NodeId node) const
+{
+    return IsValid(node) ? m_nodes[node].weight : 0.0f;
+}
+
+void BlendTree::FadeTo(NodeId node, float target, float seconds)
+{
+    if (!IsValid(node) || m_nodes[node].type == NodeType::Clip)
+        return;
+
+    Node& n = m_nodes[node];
+    const float weight = n.weight;
+    SetWeight(node, target);
+    if (seconds > 0.0f && n.weight != weight)
+    {
+        n.fadeRate = fabsf(n.targetWeight - weight) / seconds;
+        n.weight = weight;
+    }
+}
+
+void BlendTree::SetSpeed(NodeId clip, float speed)
+{
+    if (IsValid(clip))
+        m_nodes[clip].speed = speed;
+}
+
+void BlendTree::SetTime(NodeId clip, float time)
+{
+    if (IsValid(clip))
+        m_nodes[clip].time = time;
+}
+
+void BlendTree::Advance(const Skeleton& skeleton, float deltaTime)
+{
+    const std::shared_ptr<const AnimationClipSet> clips = skeleton.GetClips();
+    for (Node& node : m_nodes)
+    {
+        if (node.type == NodeType::Clip)
+        {
+            if (!clips || node.animation >= clips->animations.size())
+                continue;
+
+            // Every clip keeps its own time, played or not, so faded in clips come in at the right phase
+            const Animation& animation = clips->animations[node.animation];
+            const float start = animation.GetStartTime();
+            const float duration = animation.GetEndTime() - start;
+            float time = duration > 0.0f ? fmodf(node.time + deltaTime * node.speed - start, duration) : 0.0f;
+            if (time < 0.0f)
+                time += duration;
+            node.time = start + time;
+        }
+        else if (node.fadeRate > 0.0f)
+        {
+            const float step = node.fadeRate * deltaTime;
+            if (fabsf(node.targetWeight - node.weight) <= step)
+            {
+                node.weight = node.targetWeight;
+                node.fadeRate = 0.0f;
+            }
+            else
+                node.weight += node.targetWeight > node.weight ? step : -step;
+        }
+    }
+}
+
+void BlendTree::Evaluate(Skeleton& skeleton)
+{
+    if (!IsValid(m_root) || !skeleton.IsLoaded())
+        return;
+
+    PosePool& pool = PosePool::ForThread();
+    PosePool::Lease pose(pool, skeleton.GetBoneCount());
+    EvaluateNode(m_root, skeleton, *pose, pool);
+    skeleton.SetLocalPose(*pose);
+}
+
+void BlendTree::EvaluateNode(NodeId id, Skeleton& skeleton, LocalPose& pose, PosePool& pool)
+{
+    Node& node = m_nodes[id];
+    switch (node.type)
+    {
+    case NodeType::Clip:
+        skeleton.SampleLocalPose(node.animation, node.time, node.cursor, pose);
+        break;
+
+    case NodeType::Blend:
+    {
+        // A mask made for another skeleton leaves the base alone
+        const float* mask = nullptr;
+        float weight = node.weight;
+        if (node.mask >= 0)
+        {
+            const std::vector<float>& jointWeights = m_masks[node.mask];
+            mask = jointWeights.data();
+            if (jointWeights.size() != pose.GetJointCount())
+                weight = 0.0f;
+        }
+
+        if (weight <= 0.0f)
+        {
+            EvaluateNode(node.inputs[0], skeleton, pose, pool);
+        }
+        else if (weight >= 1.0f && !mask)
+        {
+            EvaluateNode(node.inputs[1], skeleton, pose, pool);
+        }
+        else
+        {
+            EvaluateNode(node.inputs[0], skeleton, pose, pool);
+            PosePool::Lease other(pool, pose.GetJointCount());
+            EvaluateNode(node.inputs[1], skeleton, *other, pool);
+            Blend(pose, *other, weight, mask, pose);
+        }
+        break;
+    }
+
+    case NodeType::Additive:
+    {
+        EvaluateNode(node.inputs[0], skeleton, pose, pool);
+        if (node.weight <= 0.0f)
+            break;
+
+        PosePool::Lease additive(pool, pose.GetJointCount());
+        PosePool::Lease reference(pool, pose.GetJointCount());
+        EvaluateNode(node.inputs[1], skeleton, *additive, pool);
+        EvaluateNode(node.inputs[2], skeleton, *reference, pool);
+        AddDifference(pose, *additive, *reference, node.weight, pose);
+        break;
+    }
+    }
+}
+
+void BlendTree::Blend(const LocalPose& a, const LocalPose& b, float weight, const float* mask, LocalPose& out)
+{
+    const size_t count = out.GetJointCount();
+    const XMVECTOR zero = XMVectorZero();
+    for (size_t j = 0; j < count; j++)
+    {
+        const float w = mask ? weight * mask[j] : weight;
+        if (w <= 0.0f)
+        {
+            if (&out != &a)
+            {
+                out.translation[j] = a.translation[j];
+                out.rotation[j] = a.rotation[j];
+                out.scale[j] = a.scale[j];
+            }
+            continue;
+        }
+
+        const XMVECTOR t = XMVectorReplicate(w);
+
+        // q and -q are the same rotation; blend towards the one on a's side to take the shorter way
+        const XMVECTOR qa = XMLoadFloat4(&a.rotation[j]);
+        XMVECTOR qb = XMLoadFloat4(&b.rotation[j]);
+        qb = XMVectorSelect(qb, XMVectorNegate(qb), XMVectorLess(XMVector4Dot(qa, qb), zero));
+        XMStoreFloat4(&out.rotation[j], XMQuaternionNormalize(XMVectorLerpV(qa, qb, t)));
+
+        XMStoreFloat3(&out.translation[j], XMVectorLerpV(XMLoadFloat3(&a.translation[j]), XMLoadFloat3(&b.translation[j]), t));
+        XMStoreFloat3(&out.scale[j], XMVectorLerpV(XMLoadFloat3(&a.scale[j]), XMLoadFloat3(&b.scale[j]), t));
+    }
+}
+
+void BlendTree::AddDifference(const LocalPose& base, const LocalPose& additive, const LocalPose& reference,
+                              float weight, LocalPose& out)
+{
+    const size_t count = out.GetJointCount();
+    const XMVECTOR t = XMVectorReplicate(weight);
+    const XMVECTOR zero = XMVectorZero();
+    const XMVECTOR one = XMVectorSplatOne();
+    const XMVECTOR identity = XMQuaternionIdentity();
+    for (size_t j = 0; j < count; j++)
+    {
+        // The rotation taking the reference to the additive pose, reference^-1 * additive, scaled by
+        // weight and applied under the base rotation
+        XMVECTOR delta = XMQuaternionMultiply(XMLoadFloat4(&additive.rotation[j]), XMQuaternionConjugate(XMLoadFloat4(&reference.rotation[j])));
+        delta = XMVectorSelect(delta, XMVectorNegate(delta), XMVectorLess(XMVectorSplatW(delta), zero));
+        delta = XMQuaternionNormalize(XMVectorLerpV(identity, delta, t));
+        XMStoreFloat4(&out.rotation[j], XMQuaternionNormalize(XMQuaternionMultiply(delta, XMLoadFloat4(&base.rotation[j]))));
+
+        const XMVECTOR offset = XMVectorSubtract(XMLoadFloat3(&additive.translation[j]), XMLoadFloat3(&reference.translation[j]));
+        XMStoreFloat3(&out.translation[j], XMVectorMultiplyAdd(offset, t, XMLoadFloat3(&base.translation[j])));
+
+        // Scales compose by ratio; a zero reference scale has none
+        const XMVECTOR referenceScale = XMLoadFloat3(&reference.scale[j]);
+        XMVECTOR ratio = XMVectorDivide(XMLoadFloat3(&additive.scale[j]), XMVectorSelect(referenceScale, one, XMVectorEqual(referenceScale, zero)));
+        ratio = XMVectorSelect(ratio, one, XMVectorEqual(referenceScale, zero));
+        XMStoreFloat3(&out.scale[j], XMVectorMultiply(XMLoadFloat3(&base.scale[j]), XMVectorLerpV(one, ratio, t)));
+    }
+}
+
+void BlendTree::RunBenchmark()
+{
+    constexpr int kCharacters = 256;
+    constexpr int kWarmUpFrames = 4;
+    constexpr int kFrames = 600;
+    constexpr float kDeltaTime = 1.0f / 60.0f;
+    constexpr float kTolerance = 0.001f;
+    const wchar_t* file = L"Resources\\Fox.gltf";
+
+    tinygltf::Model model;
+    Skeleton source;
+    if (!GltfUtils::LoadModel(model, file) || !source.LoadFromGltf(model) || source.GetAnimationCount() < 3)
+    {
+        Log::Error(L"Blend tree benchmark: cannot load a skin with three animations from %s", file);
+        return;
+    }
+
+    std::vector<float> upperBody = source.MakeJointMask("b_Spine01_02");
+    if (upperBody.empty())
+    {
+        Log::Error(L"Blend tree benchmark: no b_Spine01_02 joint in %s", file);
+        return;
+    }
+
+    // Walk and run cross-fading on the legs, Survey layered over the upper body, and Survey again as an
+    // additive relative to its first frame. The cross-fade starts half way so that the warm up frames
+    // use every node.
+    BlendTree tree;
+    const NodeId locomotion = tree.AddBlend(tree.AddClip(2), tree.AddClip(0), 0.5f);
+    const NodeId upper = tree.AddLayer(locomotion, tree.AddClip(1), upperBody, 1.0f);
+    tree.SetRoot(tree.AddAdditive(upper, tree.AddClip(1, 1.3f), tree.AddClip(1, 0.0f), 0.5f));
+
+    for (const bool compressed : { false, true })
+    {
+        Skeleton prototype = source;
+        if (compressed)
+            prototype.CompressAnimations(kTolerance);
+
+        std::vector<Skeleton> crowd(kCharacters, prototype);
+        std::vector<BlendTree> trees(kCharacters, tree);
+        for (int i = 0; i < kCharacters; i++)
+            trees[i].Advance(crowd[i], i * 0.37f);
+
+        auto frame = [&](int f)
+        {
+            for (int i = 0; i < kCharacters; i++)
+            {
+                if ((f + i) % 120 == 0)
+                    trees[i].FadeTo(locomotion, trees[i].GetWeight(locomotion) < 0.5f ? 1.0f : 0.0f, 0.3f);
+                trees[i].Advance(crowd[i], kDeltaTime);
+                trees[i].Evaluate(crowd[i]);
+            }
+        };
+
+        for (int f = 0; f < kWarmUpFrames; f++)
+            frame(f);
+
+        const PosePool& pool = PosePool::ForThread();
+        const size_t growCount = pool.GetGrowCount();
+        const auto start = std::chrono::high_resolution_clock::now();
+        const long long allocations = AllocationCounter::Count([&]()
+        {
+            for (int f = kWarmUpFrames; f < kWarmUpFrames + kFrames; f++)
+                frame(f);
+        });
+        const double blendSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        const size_t grown = pool.GetGrowCount() - growCount;
+
+        // The same crowd playing single clips the usual way
+        for (int i = 0; i < kCharacters; i++)
+            crowd[i].PlayAnimation(2);
+        const auto singleStart = std::chrono::high_resolution_clock::now();
+        for (int f = 0; f < kFrames; f++)
+        {
+            for (Skeleton& skeleton : crowd)
+                skeleton.Update(kDeltaTime);
+        }
+        const double singleSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - singleStart).count();
+
+        const double perCharacter = 1e6 / ((double)kCharacters * kFrames);
+        Log::Info(L"Blend tree benchmark, %s clips: %d characters of %u joints, %.2f us per character and frame (single clip %.2f us), "
+                  L"%zu pooled poses (%zu bytes)",
+                  compressed ? L"compressed" : L"source", kCharacters, prototype.GetBoneCount(), blendSeconds * perCharacter,
+                  singleSeconds * perCharacter, pool.GetPoseCount(), pool.GetMemorySize());
+        if (allocations < 0)
+            Log::Info(L"Blend tree benchmark: heap allocations are only counted in the Benchmark configuration; the pose pool grew %zu times", grown);
+        else if (allocations == 0 && grown == 0)
+            Log::Info(L"Blend tree benchmark: no allocations in %d frames", kFrames);
+        else
+            Log::Error(L"Blend tree benchmark: %lld heap allocations and %zu pose pool growths in %d steady state frames", allocations, grown, kFrames);
+    }
+
+    // An additive over its own reference pose has to give the additive clip back
+    Skeleton blended = source;
+    Skeleton single = source;
+    BlendTree additive;
+    const NodeId reference = additive.AddClip(2, 0.0f, 0.3f);
+    additive.SetRoot(additive.AddAdditive(reference, additive.AddClip(1, 0.0f, 0.7f), reference, 1.0f));
+    BlendTree plain;
+    plain.SetRoot(plain.AddClip(1, 0.0f, 0.7f));
+    additive.Evaluate(blended);
+    plain.Evaluate(single);
+
+    std::vector<XMFLOAT3X4> a(source.GetBoneCount());
+    std::vector<XMFLOAT3X4> b(source.GetBoneCount());
+    blended.GetSkinningMatrices(a.data(), (unsigned int)a.size());
+    single.GetSkinningMatrices(b.data(), (unsigned int)b.size());
+    float maxError = 0.0f;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        for (int r = 0; r < 3; r++)
+        {
+            for (int c = 0; c < 4; c++)
+                maxError = std::max(maxError, fabsf(a[i].m[r][c] - b[i].m[r][c]));
+        }
+    }
+    const float allowed = std::max(source.GetRadius(), 1.0f) * 1e-4f;
+    if (maxError <= allowed)
+        Log::Info(L"Blend tree benchmark: additive over its reference matches the clip (largest difference %g)", maxError);
+    else
+        Log::Error(L"Blend tree benchmark: additive over its reference is off the clip by %g", maxError);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <DirectXMath.h>
+
+#include "PosePool.h"
+#include "Skeleton.h"
+
+// Blends several of a skeleton's clips into one pose: cross-fades, per joint layers (an upper body clip
+// over the legs' locomotion) and additive clips.
+//
+// The tree is a flat list of nodes, leaves being clips with their own time, speed and keyframe cursors.
+// Evaluate() walks it from the root, sampling clips into local poses drawn from the calling thread's
+// PosePool and blending them joint by joint: rotations with a normalized lerp (taking the shorter way
+// round), translations and scales with a lerp. Blends whose weight leaves one side out do not evaluate
+// that side. Once the pool and cursors are warm nothing allocates, so trees can be evaluated for many
+// characters from several threads, one tree and skeleton per character.
+class BlendTree
+{
+public:
+    using NodeId = int;
+
+    // A clip of the skeleton played from time at speed, looping
+    NodeId AddClip(unsigned int animation, float speed = 1.0f, float time = 0.0f);
+    // (1 - weight) * a + weight * b
+    NodeId AddBlend(NodeId a, NodeId b, float weight = 0.0f);
+    // layer over base by weight times the mask's weight for each joint (see Skeleton::MakeJointMask())
+    NodeId AddLayer(NodeId base, NodeId layer, std::vector<float> mask, float weight = 1.0f);
+    // base plus weight times the difference of additive from reference, reference being for example
+    // the additive clip's first frame (a clip node at speed 0)
+    NodeId AddAdditive(NodeId base, NodeId additive, NodeId reference, float weight = 1.0f);
+
+    void SetRoot(NodeId node) { m_root = node; }
+    NodeId GetRoot() const { return m_root; }
+    size_t GetNodeCount() const { return m_nodes.size(); }
+    void Clear();
+
+    // Blend weights; FadeTo() moves the weight to target over seconds of Advance()
+    void SetWeight(NodeId node, float weight);
+    float GetWeight(NodeId node) const;
+    void FadeTo(NodeId node, float target, float seconds);
+    void SetSpeed(NodeId clip, float speed);
+    void SetTime(NodeId clip, float time);
+
+    // Moves the clips' times and the fades on, wrapping the times into the skeleton's clips
+    void Advance(const Skeleton& skeleton, float deltaTime);
+    // Evaluates the root into the skeleton's current pose
+    void Evaluate(Skeleton& skeleton);
+
+    // Plays blend trees for a crowd of Fox.gltf, checks that steady state evaluation allocates nothing
+    // and that an additive over its own reference gives the additive clip back, and logs the cost per
+    // character against plain single clip playback
+    static void RunBenchmark();
+
+private:
+    enum class NodeType { Clip, Blend, Additive };
+
+    struct Node
+    {
+        NodeType                type = NodeType::Clip;
+        NodeId                  inputs[3] = { -1, -1, -1 };
+
+        // Clip
+        unsigned int            animation = 0;
+        float                   time = 0.0f;
+        float                   speed = 1.0f;
+        Skeleton::ClipCursor    cursor;
+
+        // Blend and additive
+        float                   weight = 0.0f;
+        float                   targetWeight = 0.0f;
+        float                   fadeRate = 0.0f;    // weight per second, 0 when not fading
+        int                     mask = -1;          // into m_masks
+    };
+
+    NodeId AddNode(const Node& node);
+    bool IsValid(NodeId node) const { return node >= 0 && node < (NodeId)m_nodes.size(); }
+    void EvaluateNode(NodeId id, Skeleton& skeleton, LocalPose& pose, PosePool& pool);
+
+    // out may be a
+    static void Blend(const LocalPose& a, const LocalPose& b, float weight, const float* mask, LocalPose& out);
+    static void AddDifference(const LocalPose& base, const LocalPose& additive, const LocalPose& reference,
+                              float weight, LocalPose& out);
+
+    std::vector<Node>               m_nodes;
+    std::vector<std::vector<float>> m_masks;
+    NodeId                          m_root = -1;
+};
@@ -0,0 +1,409 @@
+#include "ClusteredLighting.h"
+#include "RenderStateTracker.h"
+#include "JobSystem.h"
+
+#include "log.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <random>
+
+using Microsoft::WRL::ComPtr;
+
+HRESULT ClusteredLighting::Init(ID3D11Device* device, UINT width, UINT height)
+{
+	Release();
+	m_device = device;
+	Resize(width, height);
+
+	m_groups.resize(kGridZ * kGroupsPerSlice);
+	m_clusterCounts.resize(kClusterCount);
+	m_clusterScratch.resize((size_t)kClusterCount * kMaxLightsPerCluster);
+	m_ranges.resize(kClusterCount);
+
+	if (!device)
+		return S_OK;
+
+	HRESULT hr = m_cbParams.Create(device);
+	if (FAILED(hr))
+		return hr;
+
+	// Start with room for a few lights so there is always something valid to bind
+	hr = EnsureBuffer(m_lightBuffer, m_lightSRV, m_lightCapacity, 64, sizeof(GpuLight));
+	if (SUCCEEDED(hr))
+		hr = EnsureBuffer(m_rangeBuffer, m_rangeSRV, m_rangeCapacity, kClusterCount, sizeof(XMUINT2));
+	if (SUCCEEDED(hr))
+		hr = EnsureBuffer(m_indexBuffer, m_indexSRV, m_indexCapacity, 1024, sizeof(uint32_t));
+	return hr;
+}
+
+void ClusteredLighting::Release()
+{
+	m_lightSRV.Reset();
+	m_lightBuffer.Reset();
+	m_rangeSRV.Reset();
+	m_rangeBuffer.Reset();
+	m_indexSRV.Reset();
+	m_indexBuffer.Reset();
+	m_lightCapacity = m_rangeCapacity = m_indexCapacity = 0;
+	m_cbParams = ConstantBuffer<CbClusterParams>();
+	m_device.Reset();
+	m_p11 = m_p22 = m_near = m_far = 0;
+}
+
+void ClusteredLighting::Resize(UINT width, UINT height)
+{
+	m_width = std::max(width, 1u);
+	m_height = std::max(height, 1u);
+}
+
+float ClusteredLighting::ComputeLightRadius(const Light& light, float cutoff)
+{
+	const float intensity = std::max(light.Color.x, std::max(light.Color.y, light.Color.z));
+	const float c = light.ConstantAttenuation;
+	const float l = light.LinearAttenuation;
+	const float q = light.QuadraticAttenuation;
+
+	// Solve intensity / (c + l*d + q*d^2) = cutoff for d
+	const float target = intensity / cutoff - c;
+	if (target <= 0.0f)
+		return 0.0f;
+	if (q > 0.0f)
+		return (-l + sqrtf(l * l + 4.0f * q * target)) / (2.0f * q);
+	if (l > 0.0f)
+		return target / l;
+	return FLT_MAX;	// no falloff, touches everything
+}
+
+int ClusteredLighting::SliceFromDepth(float viewZ) const
+{
+	if (viewZ <= m_near)
+		return 0;
+	const int slice = (int)floorf(logf(viewZ) * m_sliceScale + m_sliceBias);
+	return std::min(std::max(slice, 0), (int)kGridZ - 1);
+}
+
+void ClusteredLighting::BuildClusterBounds(float p11, float p22, float nearZ, float farZ)
+{
+	m_p11 = p11;
+	m_p22 = p22;
+	m_near = nearZ;
+	m_far = farZ;
+
+	// slice = log(z) * scale + bias, so that slice 0 starts at near and slice kGridZ ends at far
+	const float logRatio = logf(farZ / nearZ);
+	m_sliceScale = kGridZ / logRatio;
+	m_sliceBias = -(float)kGridZ * logf(nearZ) / logRatio;
+
+	for (UINT z = 0; z < kGridZ; z++)
+	{
+		const float zNear = nearZ * powf(farZ / nearZ, (float)z / kGridZ);
+		const float zFar = nearZ * powf(farZ / nearZ, (float)(z + 1) / kGridZ);
+
+		for (UINT t = 0; t < kClustersPerSlice; t++)
+		{
+			const UINT x = t % kGridX;
+			const UINT y = t / kGridX;
+
+			// Tile corners in NDC (y points down the screen), then projected out to both slice depths
+			const float ndcX[2] = { -1.0f + 2.0f * x / kGridX, -1.0f + 2.0f * (x + 1) / kGridX };
+			const float ndcY[2] = { 1.0f - 2.0f * (y + 1) / kGridY, 1.0f - 2.0f * y / kGridY };
+
+			float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+			for (float depth : { zNear, zFar })
+			{
+				for (int i = 0; i < 2; i++)
+				{
+					const float vx = ndcX[i] * depth / p11;
+					const float vy = ndcY[i] * depth / p22;
+					minX = std::min(minX, vx);
+					maxX = std::max(maxX, vx);
+					minY = std::min(minY, vy);
+					maxY = std::max(maxY, vy);
+				}
+			}
+
+			ClusterGroup& group = m_groups[z * kGroupsPerSlice + t / 4];
+			const UINT lane = t % 4;
+			group.minX[lane] = minX;
+			group.minY[lane] = minY;
+			group.minZ[lane] = zNear;
+			group.maxX[lane] = maxX;
+			group.maxY[lane] = maxY;
+			group.maxZ[lane] = zFar;
+		}
+	}
+}
+
+void ClusteredLighting::Assign(const std::vector<Light>& lights, FXMMATRIX view, CXMMATRIX projection)
+{
+	const auto start = std::chrono::high_resolution_clock::now();
+
+	if (m_groups.empty())
+		return;	// Init() not called
+
+	// Near / far / focal lengths straight from the (left handed) perspective matrix
+	XMFLOAT4X4 proj;
+	XMStoreFloat4x4(&proj, projection);
+	const float nearZ = -proj._43 / proj._33;
+	const float farZ = proj._33 * nearZ / (proj._33 - 1.0f);
+	if (proj._11 != m_p11 || proj._22 != m_p22 || nearZ != m_near || farZ != m_far)
+		BuildClusterBounds(proj._11, proj._22, nearZ, farZ);
+
+	// Lights into view space, dropping disabled ones and anything entirely in front of near / behind far
+	m_viewLights.clear();
+	m_gpuLights.clear();
+	for (const Light& light : lights)
+	{
+		if (!light.Enabled)
+			continue;
+		if (m_gpuLights.size() > UINT16_MAX)
+			break;	// cluster lists store 16 bit indices
+
+		const float radius = ComputeLightRadius(light);
+		if (radius <= 0.0f)
+			continue;
+
+		XMFLOAT3 center;
+		XMStoreFloat3(&center, XMVector3TransformCoord(XMLoadFloat4(&light.Position), view));
+		if (center.z + radius < nearZ || center.z - radius > farZ)
+			continue;
+
+		ViewLight viewLight;
+		viewLight.centerRadius = XMFLOAT4(center.x, center.y, center.z, radius);
+		viewLight.index = (uint32_t)m_gpuLights.size();
+		viewLight.firstSlice = (uint16_t)SliceFromDepth(center.z - radius);
+		viewLight.lastSlice = (uint16_t)SliceFromDepth(std::min(center.z + radius, farZ));
+		m_viewLights.push_back(viewLight);
+
+		GpuLight gpuLight;
+		gpuLight.PositionRadius = XMFLOAT4(light.Position.x, light.Position.y, light.Position.z, radius);
+		gpuLight.Color = light.Color;
+		gpuLight.Attenuation = XMFLOAT4(light.ConstantAttenuation, light.LinearAttenuation, light.QuadraticAttenuation, 0.0f);
+		m_gpuLights.push_back(gpuLight);
+	}
+
+	// Slices are independent, so each job owns a set of whole slices and nothing is shared
+	std::fill(m_clusterCounts.begin(), m_clusterCounts.end(), 0u);
+	if (m_multithreaded)
+		JobSystem::Get().ParallelFor(kGridZ, 1, [this](size_t begin, size_t end) { AssignSlices(begin, end); });
+	else
+		AssignSlices(0, kGridZ);
+
+	// Compact the fixed size per-cluster lists into one index list
+	m_indices.clear();
+	m_stats.maxPerCluster = 0;
+	m_stats.overflows = 0;
+	for (UINT cluster = 0; cluster < kClusterCount; cluster++)
+	{
+		const uint32_t count = m_clusterCounts[cluster];
+		const uint32_t stored = std::min(count, kMaxLightsPerCluster);
+		m_ranges[cluster] = XMUINT2((uint32_t)m_indices.size(), stored);
+
+		const uint16_t* list = &m_clusterScratch[(size_t)cluster * kMaxLightsPerCluster];
+		m_indices.insert(m_indices.end(), list, list + stored);
+
+		m_stats.maxPerCluster = std::max(m_stats.maxPerCluster, count);
+		m_stats.overflows += count - stored;
+	}
+
+	m_stats.lightCount = (UINT)lights.size();
+	m_stats.visibleLights = (UINT)m_gpuLights.size();
+	m_stats.indexCount = (UINT)m_indices.size();
+	m_stats.assignMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void ClusteredLighting::AssignSlices(size_t firstSlice, size_t endSlice)
+{
+	const XMVECTOR zero = XMVectorZero();
+
+	for (size_t slice = firstSlice; slice < endSlice; slice++)
+	{
+		const ClusterGroup* groups = &m_groups[slice * kGroupsPerSlice];
+		uint32_t* counts = &m_clusterCounts[slice * kClustersPerSlice];
+		uint16_t* lists = &m_clusterScratch[slice * kClustersPerSlice * kMaxLightsPerCluster];
+
+		for (const ViewLight& light : m_viewLights)
+		{
+			if (slice < light.firstSlice || slice > light.lastSlice)
+				continue;
+
+			const XMVECTOR cx = XMVectorReplicate(light.centerRadius.x);
+			const XMVECTOR cy = XMVectorReplicate(light.centerRadius.y);
+			const XMVECTOR cz = XMVectorReplicate(light.centerRadius.z);
+			const XMVECTOR r2 = XMVectorReplicate(light.centerRadius.w * light.centerRadius.w);
+
+			// Sphere vs AABB for four clusters at once: squared distance from the centre to each box
+			for (UINT g = 0; g < kGroupsPerSlice; g++)
+			{
+				const ClusterGroup& group = groups[g];
+				const XMVECTOR dx = XMVectorAdd(XMVectorMax(zero, XMVectorSubtract(XMLoadFloat4A((const XMFLOAT4A*)group.minX), cx)),
+												XMVectorMax(zero, XMVectorSubtract(cx, XMLoadFloat4A((const XMFLOAT4A*)group.maxX))));
+				const XMVECTOR dy = XMVectorAdd(XMVectorMax(zero, XMVectorSubtract(XMLoadFloat4A((const XMFLOAT4A*)group.minY), cy)),
+												XMVectorMax(zero, XMVectorSubtract(cy, XMLoadFloat4A((const XMFLOAT4A*)group.maxY))));
+				const XMVECTOR dz = XMVectorAdd(XMVectorMax(zero, XMVectorSubtract(XMLoadFloat4A((const XMFLOAT4A*)group.minZ), cz)),
+												XMVectorMax(zero, XMVectorSubtract(cz, XMLoadFloat4A((const XMFLOAT4A*)group.maxZ))));
+				const XMVECTOR d2 = XMVectorMultiplyAdd(dz, dz, XMVectorMultiplyAdd(dy, dy, XMVectorMultiply(dx, dx)));
+
+				XMUINT4 hit;
+				XMStoreUInt4(&hit, XMVectorLessOrEqual(d2, r2));
+				const uint32_t lanes[4] = { hit.x, hit.y, hit.z, hit.w };
+				for (UINT lane = 0; lane < 4; lane++)
+				{
+					if (!lanes[lane])
+						continue;
+					const UINT t = g * 4 + lane;
+					const uint32_t n = counts[t]++;
+					if (n < kMaxLightsPerCluster)
+						lists[t * kMaxLightsPerCluster + n] = (uint16_t)light.index;
+				}
+			}
+		}
+	}
+}
+
+HRESULT ClusteredLighting::EnsureBuffer(ComPtr<ID3D11Buffer>& buffer, ComPtr<ID3D11ShaderResourceView>& srv,
+										UINT& capacity, UINT required, UINT stride)
+{
+	if (buffer && required <= capacity)
+		return S_OK;
+
+	UINT newCapacity = std::max(capacity, 64u);
+	while (newCapacity < required)
+		newCapacity *= 2;
+
+	D3D11_BUFFER_DESC bd = {};
+	bd.Usage = D3D11_USAGE_DYNAMIC;
+	bd.ByteWidth = newCapacity * stride;
+	bd.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	bd.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+	bd.StructureByteStride = stride;
+
+	ComPtr<ID3D11Buffer> newBuffer;
+	HRESULT hr = m_device->CreateBuffer(&bd, nullptr, &newBuffer);
+	if (FAILED(hr))
+		return hr;
+
+	D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+	srvDesc.Format = DXGI_FORMAT_UNKNOWN;
+	srvDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+	srvDesc.Buffer.FirstElement = 0;
+	srvDesc.Buffer.NumElements = newCapacity;
+
+	ComPtr<ID3D11ShaderResourceView> newSRV;
+	hr = m_device->CreateShaderResourceView(newBuffer.Get(), &srvDesc, &newSRV);
+	if (FAILED(hr))
+		return hr;
+
+	buffer = newBuffer;
+	srv = newSRV;
+	capacity = newCapacity;
+	return S_OK;
+}
+
+HRESULT ClusteredLighting::Upload(ID3D11DeviceContext* context, ConstantBufferStats* stats)
+{
+	if (!m_device)
+		return E_FAIL;
+
+	HRESULT hr = EnsureBuffer(m_lightBuffer, m_lightSRV, m_lightCapacity, (UINT)m_gpuLights.size(), sizeof(GpuLight));
+	if (SUCCEEDED(hr))
+		hr = EnsureBuffer(m_indexBuffer, m_indexSRV, m_indexCapacity, (UINT)m_indices.size(), sizeof(uint32_t));
+	if (FAILED(hr))
+		return hr;
+
+	auto write = [context](ID3D11Buffer* buffer, const void* data, size_t size) -> HRESULT
+	{
+		D3D11_MAPPED_SUBRESOURCE mapped = {};
+		HRESULT hr = context->Map(buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
+		if (FAILED(hr))
+			return hr;
+		if (size > 0)
+			memcpy(mapped.pData, data, size);
+		context->Unmap(buffer, 0);
+		return S_OK;
+	};
+
+	const size_t lightBytes = m_gpuLights.size() * sizeof(GpuLight);
+	const size_t rangeBytes = m_ranges.size() * sizeof(XMUINT2);
+	const size_t indexBytes = m_indices.size() * sizeof(uint32_t);
+	if (FAILED(hr = write(m_lightBuffer.Get(), m_gpuLights.data(), lightBytes)) ||
+		FAILED(hr = write(m_rangeBuffer.Get(), m_ranges.data(), rangeBytes)) ||
+		FAILED(hr = write(m_indexBuffer.Get(), m_indices.data(), indexBytes)))
+		return hr;
+
+	CbClusterParams params;
+	params.GridSize = XMUINT4(kGridX, kGridY, kGridZ, (UINT)m_gpuLights.size());
+	params.ZParams = XMFLOAT4(m_sliceScale, m_sliceBias, m_near, m_far);
+	params.TileSize = XMFLOAT4((float)m_width / kGridX, (float)m_height / kGridY, 0.0f, 0.0f);
+	m_cbParams.Update(context, params, stats);
+
+	if (stats)
+		stats->bytesUploaded += lightBytes + rangeBytes + indexBytes;
+	return S_OK;
+}
+
+void ClusteredLighting::Bind(RenderStateTracker& tracker)
+{
+	ID3D11ShaderResourceView* views[] = { m_lightSRV.Get(), m_rangeSRV.Get(), m_indexSRV.Get() };
+	tracker.SetShaderResources(RenderStateTracker::ePixelStage, kLightsSlot, ARRAYSIZE(views), views);
+	tracker.SetConstantBuffer(RenderStateTracker::ePixelStage, kParamsSlot, m_cbParams.Get());
+}
+
+void ClusteredLighting::RunBenchmark()
+{
+	constexpr int kIterations = 50;
+	const UINT lightCounts[] = { 16, 64, 256, 1024, 4096 };
+
+	// Fixed camera looking down +z over a 60 x 20 x 60 box of lights with a ~4 unit reach
+	const XMMATRIX view = XMMatrixLookAtLH(XMVectorSet(0, 5, -30, 1), XMVectorSet(0, 0, 0, 1), XMVectorSet(0, 1, 0, 0));
+	const XMMATRIX projection = XMMatrixPerspectiveFovLH(XMConvertToRadians(60.0f), 16.0f / 9.0f, 0.01f, 100.0f);
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> position(-30.0f, 30.0f);
+	std::uniform_real_distribution<float> height(0.0f, 20.0f);
+
+	// The scratch lists are a few MB, keep them off the stack
+	std::unique_ptr<ClusteredLighting> clusters = std::make_unique<ClusteredLighting>();
+	clusters->Init(nullptr, 1280, 720);
+
+	Log::Info(L"ClusteredLighting benchmark: %ux%ux%u clusters, %u worker threads",
+			  kGridX, kGridY, kGridZ, JobSystem::Get().GetWorkerCount());
+
+	for (UINT lightCount : lightCounts)
+	{
+		std::vector<Light> lights(lightCount);
+		for (Light& light : lights)
+		{
+			light.Enabled = 1;
+			light.LightType = PointLight;
+			light.Position = XMFLOAT4(position(rng), height(rng), position(rng), 1.0f);
+			light.ConstantAttenuation = 1.0f;
+			light.LinearAttenuation = 0.0f;
+			light.QuadraticAttenuation = 16.0f;	// radius ~4 at the 1/256 cutoff
+		}
+
+		double ms[2] = {};
+		for (int mt = 0; mt < 2; mt++)
+		{
+			clusters->SetMultithreaded(mt != 0);
+			clusters->Assign(lights, view, projection);	// warm up
+			for (int i = 0; i < kIterations; i++)
+			{
+				clusters->Assign(lights, view, projection);
+				ms[mt] += clusters->GetStats().assignMs;
+			}
+			ms[mt] /= kIterations;
+		}
+
+		const Stats& stats = clusters->GetStats();
+		Log::Info(L"  %5u lights: %7.3f ms single, %7.3f ms multi (x%.2f) - %u visible, %u indices, max %u per cluster",
+				  lightCount, ms[0], ms[1], ms[1] > 0.0 ? ms[0] / ms[1] : 0.0,
+				  stats.visibleLights, stats.indexCount, stats.maxPerCluster);
+	}
+}
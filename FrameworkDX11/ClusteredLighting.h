@@ -0,0 +1,138 @@
+// Clustered forward lighting.
+//
+// The view frustum is split into a kGridX * kGridY * kGridZ grid of clusters ("froxels"), with the
+// depth slices spaced exponentially. Every frame each light's bounding sphere (derived from its
+// attenuation) is tested against the cluster bounds on the CPU - four clusters at a time with
+// DirectXMath, one depth slice per job - and the per-cluster light lists are packed into three
+// structured buffers:
+//
+//  t5 - lights            : position / radius, colour and attenuation of every visible light
+//  t6 - cluster ranges    : (offset, count) into the index list, one per cluster
+//  t7 - light index list  : the lights touching each cluster, back to back
+//
+// The pixel shader finds its cluster from SV_Position and view depth and only shades those lights.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include "wrl.h"
+#include "structures.h"
+#include "ConstantBuffers.h"
+#include <cstdint>
+#include <vector>
+
+class RenderStateTracker;
+
+class ClusteredLighting
+{
+public:
+	static constexpr UINT kGridX = 16;
+	static constexpr UINT kGridY = 9;
+	static constexpr UINT kGridZ = 24;
+	static constexpr UINT kClustersPerSlice = kGridX * kGridY;
+	static constexpr UINT kClusterCount = kClustersPerSlice * kGridZ;
+	static constexpr UINT kMaxLightsPerCluster = 256;	// anything above is dropped (and counted)
+
+	static constexpr UINT kLightsSlot = 5;
+	static constexpr UINT kClusterRangesSlot = 6;
+	static constexpr UINT kLightIndicesSlot = 7;
+	static constexpr UINT kParamsSlot = 6;
+
+	// A light stops contributing once its attenuated intensity drops below this
+	static constexpr float kLightCutoff = 1.0f / 256.0f;
+
+	// Layout of one entry in the t5 buffer
+	struct GpuLight
+	{
+		XMFLOAT4	PositionRadius;	// world space position, bounding radius in w
+		XMFLOAT4	Color;
+		XMFLOAT4	Attenuation;	// constant, linear, quadratic, unused
+	};
+
+	struct Stats
+	{
+		double	assignMs = 0.0;
+		UINT	lightCount = 0;
+		UINT	visibleLights = 0;
+		UINT	indexCount = 0;
+		UINT	maxPerCluster = 0;
+		UINT	overflows = 0;
+	};
+
+	HRESULT Init(ID3D11Device* device, UINT width, UINT height);
+	void	Release();
+	void	Resize(UINT width, UINT height);
+
+	// CPU side - needs no device, so the benchmark can run it on its own
+	void	Assign(const std::vector<Light>& lights, FXMMATRIX view, CXMMATRIX projection);
+
+	// Uploads the result of the last Assign() and binds the buffers to the pixel shader
+	HRESULT Upload(ID3D11DeviceContext* context, ConstantBufferStats* stats = nullptr);
+	void	Bind(RenderStateTracker& tracker);
+
+	void	SetMultithreaded(bool enable) { m_multithreaded = enable; }
+	bool	IsMultithreaded() const { return m_multithreaded; }
+
+	const Stats&	GetStats() const { return m_stats; }
+
+	// Distance at which the light's attenuated intensity falls to 'cutoff'
+	static float	ComputeLightRadius(const Light& light, float cutoff = kLightCutoff);
+
+	// Times Assign() for a range of light counts, single and multithreaded, and logs the results
+	static void		RunBenchmark();
+
+private:
+	// Bounds of four neighbouring clusters of one slice, view space, structure of arrays
+	struct alignas(16) ClusterGroup
+	{
+		float	minX[4], minY[4], minZ[4];
+		float	maxX[4], maxY[4], maxZ[4];
+	};
+	static constexpr UINT kGroupsPerSlice = kClustersPerSlice / 4;
+	static_assert(kClustersPerSlice % 4 == 0, "Clusters per slice must be a multiple of the SIMD width");
+
+	// A visible light in view space with the depth slices it overlaps
+	struct ViewLight
+	{
+		XMFLOAT4	centerRadius;
+		uint32_t	index;		// into m_gpuLights
+		uint16_t	firstSlice;
+		uint16_t	lastSlice;
+	};
+
+	void	BuildClusterBounds(float p11, float p22, float nearZ, float farZ);
+	void	AssignSlices(size_t firstSlice, size_t endSlice);
+	int		SliceFromDepth(float viewZ) const;
+
+	HRESULT	EnsureBuffer(Microsoft::WRL::ComPtr<ID3D11Buffer>& buffer, Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>& srv,
+						 UINT& capacity, UINT required, UINT stride);
+
+	// Grid
+	std::vector<ClusterGroup>	m_groups;	// kGridZ * kGroupsPerSlice
+	float	m_p11 = 0, m_p22 = 0, m_near = 0, m_far = 0;
+	float	m_sliceScale = 0, m_sliceBias = 0;
+	UINT	m_width = 1, m_height = 1;
+
+	// Per frame
+	std::vector<ViewLight>	m_viewLights;
+	std::vector<GpuLight>	m_gpuLights;
+	std::vector<uint32_t>	m_clusterCounts;
+	std::vector<uint16_t>	m_clusterScratch;	// kMaxLightsPerCluster entries per cluster
+	std::vector<XMUINT2>	m_ranges;
+	std::vector<uint32_t>	m_indices;
+	bool					m_multithreaded = true;
+	Stats					m_stats;
+
+	// GPU
+	Microsoft::WRL::ComPtr<ID3D11Device>				m_device;
+	Microsoft::WRL::ComPtr<ID3D11Buffer>				m_lightBuffer;
+	Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>	m_lightSRV;
+	Microsoft::WRL::ComPtr<ID3D11Buffer>				m_rangeBuffer;
+	Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>	m_rangeSRV;
+	Microsoft::WRL::ComPtr<ID3D11Buffer>				m_indexBuffer;
+	Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>	m_indexSRV;
+	UINT	m_lightCapacity = 0;
+	UINT	m_rangeCapacity = 0;
+	UINT	m_indexCapacity = 0;
+	ConstantBuffer<CbClusterParams>						m_cbParams;
+};
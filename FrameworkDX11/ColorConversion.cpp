@@ -0,0 +1,642 @@
+#include "ColorConversion.h"
+
+#include "JobSystem.h"
+#include "log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <emmintrin.h>
+#include <vector>
+
+namespace
+{
+	// Values or texels a job converts at least
+	static constexpr size_t kParallelChunk = 16384;
+
+	// Least squares fits of the sRGB curves above their linear segments: to linear in the sRGB value,
+	// to sRGB in the fourth root of the linear value, which takes the steep start out of the curve
+	static const float kToLinear[6] = { 0.0010332019f, 0.0296148644f, 0.542297997f, 0.602765072f, -0.231937524f, 0.0562419151f };
+	static const float kToSrgb[6] = { -0.0618717589f, 0.167316883f, 1.23575775f, -0.543185261f, 0.261146862f, -0.0591676128f };
+
+	float SrgbToLinearExact(float value)
+	{
+		return value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+	}
+
+	float LinearToSrgbExact(float value)
+	{
+		return value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+	}
+
+	// The scalar kernels are written as the SSE instructions behave: MAXPS and MINPS return their second
+	// operand when the first is NaN, so NaN clamps to 0
+	float Max0(float value)
+	{
+		return value > 0.0f ? value : 0.0f;
+	}
+
+	float Clamp01(float value)
+	{
+		value = Max0(value);
+		return value < 1.0f ? value : 1.0f;
+	}
+
+	float Horner(const float c[6], float x)
+	{
+		return ((((c[5] * x + c[4]) * x + c[3]) * x + c[2]) * x + c[1]) * x + c[0];
+	}
+
+	float SrgbToLinearFit(float value)
+	{
+		const float x = Clamp01(value);
+		return x <= 0.04045f ? x / 12.92f : Horner(kToLinear, x);
+	}
+
+	float LinearToSrgbFit(float value)
+	{
+		const float x = Clamp01(value);
+		return x <= 0.0031308f ? x * 12.92f : Horner(kToSrgb, std::sqrt(std::sqrt(x)));
+	}
+
+	__m128 Clamp01SSE(__m128 value)
+	{
+		return _mm_min_ps(_mm_max_ps(value, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+	}
+
+	__m128 Select(__m128 mask, __m128 a, __m128 b)
+	{
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	}
+
+	__m128 HornerSSE(const float c[6], __m128 x)
+	{
+		__m128 result = _mm_set1_ps(c[5]);
+		for (int i = 4; i >= 0; i--)
+			result = _mm_add_ps(_mm_mul_ps(result, x), _mm_set1_ps(c[i]));
+		return result;
+	}
+
+	__m128 SrgbToLinearSSE(__m128 value)
+	{
+		const __m128 x = Clamp01SSE(value);
+		const __m128 linear = _mm_div_ps(x, _mm_set1_ps(12.92f));
+		return Select(_mm_cmple_ps(x, _mm_set1_ps(0.04045f)), linear, HornerSSE(kToLinear, x));
+	}
+
+	__m128 LinearToSrgbSSE(__m128 value)
+	{
+		const __m128 x = Clamp01SSE(value);
+		const __m128 linear = _mm_mul_ps(x, _mm_set1_ps(12.92f));
+		return Select(_mm_cmple_ps(x, _mm_set1_ps(0.0031308f)), linear, HornerSSE(kToSrgb, _mm_sqrt_ps(_mm_sqrt_ps(x))));
+	}
+
+	// All ones in the lanes of the colour channels
+	__m128 GetColourMask(UINT colourChannels)
+	{
+		const __m128i lanes = _mm_set_epi32(3, 2, 1, 0);
+		return _mm_castsi128_ps(_mm_cmplt_epi32(lanes, _mm_set1_epi32((int)std::min(colourChannels, 4u))));
+	}
+
+	template <typename Convert, typename ConvertSSE>
+	void ConvertColour(const float* src, size_t texels, UINT colourChannels, float* dst, ColorConversion::Kernel kernel,
+					   Convert convert, ConvertSSE convertSSE)
+	{
+		if (kernel == ColorConversion::eSSE)
+		{
+			const __m128 mask = GetColourMask(colourChannels);
+			for (size_t i = 0; i < texels * 4; i += 4)
+			{
+				const __m128 texel = _mm_loadu_ps(src + i);
+				_mm_storeu_ps(dst + i, Select(mask, convertSSE(texel), texel));
+			}
+			return;
+		}
+
+		for (size_t i = 0; i < texels * 4; i++)
+			dst[i] = (i & 3) < colourChannels ? convert(src[i]) : src[i];
+	}
+
+	uint8_t PremultiplyScalar(uint8_t value, uint8_t alpha)
+	{
+		// Rounds value * alpha / 255 to nearest without dividing
+		const UINT t = (UINT)value * alpha + 128;
+		return (uint8_t)((t + (t >> 8)) >> 8);
+	}
+
+	uint8_t UnpremultiplyScalar(uint8_t value, uint8_t alpha)
+	{
+		if (alpha == 0)
+			return 0;
+		const float unpremultiplied = (float)value * 255.0f / (float)alpha + 0.5f;
+		return (uint8_t)(unpremultiplied < 255.0f ? unpremultiplied : 255.0f);
+	}
+}
+
+void ColorConversion::UnormToFloat(const uint8_t* src, size_t count, float* dst, Kernel kernel)
+{
+	const float scale = 1.0f / 255.0f;
+	size_t i = 0;
+	if (kernel == eSSE)
+	{
+		const __m128 scaleSSE = _mm_set1_ps(scale);
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= count; i += 16)
+		{
+			const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+			const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+			const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+			_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero)), scaleSSE));
+			_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero)), scaleSSE));
+			_mm_storeu_ps(dst + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero)), scaleSSE));
+			_mm_storeu_ps(dst + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero)), scaleSSE));
+		}
+	}
+	for (; i < count; i++)
+		dst[i] = (float)src[i] * scale;
+}
+
+void ColorConversion::UnormToFloat(const uint16_t* src, size_t count, float* dst, Kernel kernel)
+{
+	const float scale = 1.0f / 65535.0f;
+	size_t i = 0;
+	if (kernel == eSSE)
+	{
+		const __m128 scaleSSE = _mm_set1_ps(scale);
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 8 <= count; i += 8)
+		{
+			const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+			_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(values, zero)), scaleSSE));
+			_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(values, zero)), scaleSSE));
+		}
+	}
+	for (; i < count; i++)
+		dst[i] = (float)src[i] * scale;
+}
+
+void ColorConversion::FloatToUnorm(const float* src, size_t count, uint8_t* dst, Kernel kernel)
+{
+	size_t i = 0;
+	if (kernel == eSSE)
+	{
+		const __m128 scale = _mm_set1_ps(255.0f);
+		const __m128 half = _mm_set1_ps(0.5f);
+		__m128i values[4];
+		for (; i + 16 <= count; i += 16)
+		{
+			for (int j = 0; j < 4; j++)
+				values[j] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(Clamp01SSE(_mm_loadu_ps(src + i + j * 4)), scale), half));
+			const __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(values[0], values[1]), _mm_packs_epi32(values[2], values[3]));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), bytes);
+		}
+	}
+	for (; i < count; i++)
+		dst[i] = (uint8_t)(int)(Clamp01(src[i]) * 255.0f + 0.5f);
+}
+
+void ColorConversion::FloatToUnorm(const float* src, size_t count, uint16_t* dst, Kernel kernel)
+{
+	size_t i = 0;
+	if (kernel == eSSE)
+	{
+		const __m128 scale = _mm_set1_ps(65535.0f);
+		const __m128 half = _mm_set1_ps(0.5f);
+		// SSE2 only packs to signed 16 bits, so the values are packed less 32768 and shifted back
+		const __m128i bias = _mm_set1_epi32(32768);
+		const __m128i sign = _mm_set1_epi16((short)0x8000);
+		for (; i + 8 <= count; i += 8)
+		{
+			const __m128i low = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(Clamp01SSE(_mm_loadu_ps(src + i)), scale), half));
+			const __m128i high = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(Clamp01SSE(_mm_loadu_ps(src + i + 4)), scale), half));
+			const __m128i packed = _mm_packs_epi32(_mm_sub_epi32(low, bias), _mm_sub_epi32(high, bias));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(packed, sign));
+		}
+	}
+	for (; i < count; i++)
+		dst[i] = (uint16_t)(int)(Clamp01(src[i]) * 65535.0f + 0.5f);
+}
+
+const float* ColorConversion::GetSrgbTable(UINT bits)
+{
+	auto build = [](UINT maximum)
+	{
+		std::vector<float> table(maximum + 1);
+		for (UINT i = 0; i <= maximum; i++)
+			table[i] = SrgbToLinearExact((float)i / maximum);
+		return table;
+	};
+	static const std::vector<float> table8 = build(255);
+	static const std::vector<float> table16 = build(65535);
+	return bits == 8 ? table8.data() : table16.data();
+}
+
+void ColorConversion::SrgbToLinear(const uint8_t* src, size_t texels, UINT colourChannels, float* dst)
+{
+	const float* table = GetSrgbTable(8);
+	for (size_t i = 0; i < texels * 4; i++)
+		dst[i] = (i & 3) < colourChannels ? table[src[i]] : (float)src[i] * (1.0f / 255.0f);
+}
+
+void ColorConversion::SrgbToLinear(const uint16_t* src, size_t texels, UINT colourChannels, float* dst)
+{
+	const float* table = GetSrgbTable(16);
+	for (size_t i = 0; i < texels * 4; i++)
+		dst[i] = (i & 3) < colourChannels ? table[src[i]] : (float)src[i] * (1.0f / 65535.0f);
+}
+
+void ColorConversion::SrgbToLinear(const float* src, size_t texels, UINT colourChannels, float* dst, Kernel kernel)
+{
+	ConvertColour(src, texels, colourChannels, dst, kernel, SrgbToLinearFit, SrgbToLinearSSE);
+}
+
+void ColorConversion::LinearToSrgb(const float* src, size_t texels, UINT colourChannels, float* dst, Kernel kernel)
+{
+	ConvertColour(src, texels, colourChannels, dst, kernel, LinearToSrgbFit, LinearToSrgbSSE);
+}
+
+void ColorConversion::Premultiply(const uint8_t* src, size_t texels, uint8_t* dst, Kernel kernel)
+{
+	size_t i = 0;
+	if (kernel == eSSE)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		// Alpha is multiplied by 255, which keeps it
+		const __m128i colourMask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+		const __m128i opaque = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+		const __m128i round = _mm_set1_epi16(128);
+		auto premultiply = [&](__m128i values)
+		{
+			__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(values, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			alpha = _mm_or_si128(_mm_and_si128(alpha, colourMask), opaque);
+			const __m128i t = _mm_add_epi16(_mm_mullo_epi16(values, alpha), round);
+			return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+		};
+		for (; i + 4 <= texels; i += 4)
+		{
+			const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+			const __m128i low = premultiply(_mm_unpacklo_epi8(bytes, zero));
+			const __m128i high = premultiply(_mm_unpackhi_epi8(bytes, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_packus_epi16(low, high));
+		}
+	}
+	for (; i < texels; i++)
+	{
+		const uint8_t alpha = src[i * 4 + 3];
+		for (int c = 0; c < 3; c++)
+			dst[i * 4 + c] = PremultiplyScalar(src[i * 4 + c], alpha);
+		dst[i * 4 + 3] = alpha;
+	}
+}
+
+void ColorConversion::Unpremultiply(const uint8_t* src, size_t texels, uint8_t* dst, Kernel kernel)
+{
+	size_t i = 0;
+	if (kernel == eSSE)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 alphaMask = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+		const __m128 scale = _mm_set1_ps(255.0f);
+		const __m128 half = _mm_set1_ps(0.5f);
+		auto unpremultiply = [&](__m128i texel)
+		{
+			const __m128 values = _mm_cvtepi32_ps(texel);
+			const __m128 alpha = _mm_shuffle_ps(values, values, _MM_SHUFFLE(3, 3, 3, 3));
+			__m128 colour = _mm_add_ps(_mm_div_ps(_mm_mul_ps(values, scale), alpha), half);
+			colour = _mm_andnot_ps(_mm_cmpeq_ps(alpha, _mm_setzero_ps()), _mm_min_ps(colour, scale));
+			return _mm_cvttps_epi32(Select(alphaMask, values, colour));
+		};
+		for (; i + 4 <= texels; i += 4)
+		{
+			const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+			const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+			const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+			const __m128i texels01 = _mm_packs_epi32(unpremultiply(_mm_unpacklo_epi16(low, zero)), unpremultiply(_mm_unpackhi_epi16(low, zero)));
+			const __m128i texels23 = _mm_packs_epi32(unpremultiply(_mm_unpacklo_epi16(high, zero)), unpremultiply(_mm_unpackhi_epi16(high, zero)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_packus_epi16(texels01, texels23));
+		}
+	}
+	for (; i < texels; i++)
+	{
+		const uint8_t alpha = src[i * 4 + 3];
+		for (int c = 0; c < 3; c++)
+			dst[i * 4 + c] = UnpremultiplyScalar(src[i * 4 + c], alpha);
+		dst[i * 4 + 3] = alpha;
+	}
+}
+
+void ColorConversion::Swizzle(const uint8_t* src, size_t texels, const Channel order[4], uint8_t* dst, Kernel kernel)
+{
+	size_t i = 0;
+	if (kernel == eSSE)
+	{
+		// Each texel is a 32 bit lane: a channel is shifted down from its source byte and up into its own
+		const __m128i byteMask = _mm_set1_epi32(0xff);
+		__m128i constant = _mm_setzero_si128();
+		__m128i shifts[4];
+		for (int c = 0; c < 4; c++)
+		{
+			shifts[c] = _mm_cvtsi32_si128(order[c] <= eAlpha ? (int)order[c] * 8 : 0);
+			if (order[c] == eOne)
+				constant = _mm_or_si128(constant, _mm_set1_epi32(0xff << (c * 8)));
+		}
+		const __m128i destinations[4] = { _mm_cvtsi32_si128(0), _mm_cvtsi32_si128(8), _mm_cvtsi32_si128(16), _mm_cvtsi32_si128(24) };
+		for (; i + 4 <= texels; i += 4)
+		{
+			const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+			__m128i result = constant;
+			for (int c = 0; c < 4; c++)
+			{
+				if (order[c] <= eAlpha)
+					result = _mm_or_si128(result, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(values, shifts[c]), byteMask), destinations[c]));
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), result);
+		}
+	}
+	for (; i < texels; i++)
+	{
+		uint8_t texel[4];
+		for (int c = 0; c < 4; c++)
+			texel[c] = order[c] <= eAlpha ? src[i * 4 + order[c]] : order[c] == eOne ? 255 : 0;
+		memcpy(dst + i * 4, texel, 4);
+	}
+}
+
+void ColorConversion::ReconstructNormalZ(uint8_t* rgba, size_t texels, Kernel kernel)
+{
+	size_t i = 0;
+	if (kernel == eSSE)
+	{
+		const __m128i byteMask = _mm_set1_epi32(0xff);
+		const __m128i blueMask = _mm_set1_epi32(0xff0000);
+		const __m128 unpack = _mm_set1_ps(127.5f);
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 half = _mm_set1_ps(0.5f);
+		const __m128 scale = _mm_set1_ps(255.0f);
+		for (; i + 4 <= texels; i += 4)
+		{
+			const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + i * 4));
+			const __m128 x = _mm_sub_ps(_mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(values, byteMask)), unpack), one);
+			const __m128 y = _mm_sub_ps(_mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(values, 8), byteMask)), unpack), one);
+			const __m128 zz = _mm_max_ps(_mm_sub_ps(_mm_sub_ps(one, _mm_mul_ps(x, x)), _mm_mul_ps(y, y)), _mm_setzero_ps());
+			const __m128 z = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_sqrt_ps(zz), half), half), scale), half);
+			const __m128i blue = _mm_slli_epi32(_mm_cvttps_epi32(z), 16);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4), _mm_or_si128(_mm_andnot_si128(blueMask, values), blue));
+		}
+	}
+	for (; i < texels; i++)
+	{
+		uint8_t* texel = rgba + i * 4;
+		const float x = texel[0] / 127.5f - 1.0f;
+		const float y = texel[1] / 127.5f - 1.0f;
+		texel[2] = (uint8_t)((std::sqrt(Max0(1.0f - x * x - y * y)) * 0.5f + 0.5f) * 255.0f + 0.5f);
+	}
+}
+
+void ColorConversion::Parallel(size_t count, const std::function<void(size_t, size_t)>& fn)
+{
+	JobSystem::Get().ParallelFor(count, kParallelChunk, fn);
+}
+
+bool ColorConversion::RunSelfTest()
+{
+	bool passed = true;
+	auto check = [&passed](bool condition, const wchar_t* what)
+	{
+		if (!condition)
+		{
+			Log::Error(L"ColorConversion self test: %s", what);
+			passed = false;
+		}
+	};
+
+	// Odd lengths leave a tail for the scalar loop after the SSE one
+	constexpr size_t kTexels = 1027;
+	constexpr size_t kCount = kTexels * 4;
+	uint32_t seed = 12345;
+	auto next = [&seed]()
+	{
+		seed = seed * 1664525u + 1013904223u;
+		return seed;
+	};
+	std::vector<uint8_t> bytes(kCount);
+	std::vector<uint16_t> words(kCount);
+	std::vector<float> floats(kCount);
+	for (size_t i = 0; i < kCount; i++)
+	{
+		bytes[i] = (uint8_t)(next() >> 24);
+		words[i] = (uint16_t)(next() >> 16);
+		floats[i] = ((next() >> 8) / 16777216.0f) * 1.5f - 0.25f;
+	}
+	// Exact limits, special values and values around the ends of the linear segments
+	const float specials[] = { 0.0f, -0.0f, 1.0f, 0.5f, -1.0f, 2.0f, NAN, INFINITY, -INFINITY, 0.04045f, 0.0031308f,
+							   std::nextafter(0.04045f, 1.0f), std::nextafter(0.0031308f, 1.0f), 1e-30f, 0.999999f };
+	for (size_t i = 0; i < sizeof(specials) / sizeof(specials[0]); i++)
+		floats[i * 7] = specials[i];
+	bytes[0] = 0;
+	bytes[1] = 255;
+
+	// Every kernel against the scalar one
+	{
+		std::vector<float> scalar(kCount), sse(kCount);
+		UnormToFloat(bytes.data(), kCount, scalar.data(), eScalar);
+		UnormToFloat(bytes.data(), kCount, sse.data(), eSSE);
+		check(scalar == sse, L"8 bit to float kernels differ");
+		check(scalar[0] == 0.0f && scalar[1] == 1.0f, L"8 bit to float should map 0 and 255 to 0 and 1");
+		UnormToFloat(words.data(), kCount, scalar.data(), eScalar);
+		UnormToFloat(words.data(), kCount, sse.data(), eSSE);
+		check(scalar == sse, L"16 bit to float kernels differ");
+
+		std::vector<uint8_t> scalar8(kCount), sse8(kCount);
+		FloatToUnorm(floats.data(), kCount, scalar8.data(), eScalar);
+		FloatToUnorm(floats.data(), kCount, sse8.data(), eSSE);
+		check(scalar8 == sse8, L"float to 8 bit kernels differ");
+		std::vector<uint16_t> scalar16(kCount), sse16(kCount);
+		FloatToUnorm(floats.data(), kCount, scalar16.data(), eScalar);
+		FloatToUnorm(floats.data(), kCount, sse16.data(), eSSE);
+		check(scalar16 == sse16, L"float to 16 bit kernels differ");
+		check(scalar16[6 * 7] == 0 && scalar16[7 * 7] == 65535 && scalar16[4 * 7] == 0 && scalar16[5 * 7] == 65535,
+			  L"NaN should clamp to 0, infinity and values above 1 to 65535");
+
+		for (UINT colourChannels : { 4u, 3u, 1u })
+		{
+			SrgbToLinear(floats.data(), kTexels, colourChannels, scalar.data(), eScalar);
+			SrgbToLinear(floats.data(), kTexels, colourChannels, sse.data(), eSSE);
+			check(memcmp(scalar.data(), sse.data(), kCount * sizeof(float)) == 0, L"sRGB to linear kernels differ");
+			LinearToSrgb(floats.data(), kTexels, colourChannels, scalar.data(), eScalar);
+			LinearToSrgb(floats.data(), kTexels, colourChannels, sse.data(), eSSE);
+			check(memcmp(scalar.data(), sse.data(), kCount * sizeof(float)) == 0, L"linear to sRGB kernels differ");
+		}
+		check(memcmp(&scalar[3], &floats[3], sizeof(float)) == 0, L"alpha should be passed through as it is");
+
+		Premultiply(bytes.data(), kTexels, scalar8.data(), eScalar);
+		Premultiply(bytes.data(), kTexels, sse8.data(), eSSE);
+		check(scalar8 == sse8, L"premultiply kernels differ");
+		Unpremultiply(bytes.data(), kTexels, scalar8.data(), eScalar);
+		Unpremultiply(bytes.data(), kTexels, sse8.data(), eSSE);
+		check(scalar8 == sse8, L"unpremultiply kernels differ");
+
+		const Channel orders[][4] = { { eBlue, eGreen, eRed, eAlpha }, { eRed, eRed, eRed, eOne }, { eAlpha, eZero, eGreen, eBlue } };
+		for (const Channel* order : orders)
+		{
+			Swizzle(bytes.data(), kTexels, order, scalar8.data(), eScalar);
+			Swizzle(bytes.data(), kTexels, order, sse8.data(), eSSE);
+			check(scalar8 == sse8, L"swizzle kernels differ");
+		}
+
+		scalar8 = bytes;
+		sse8 = bytes;
+		ReconstructNormalZ(scalar8.data(), kTexels, eScalar);
+		ReconstructNormalZ(sse8.data(), kTexels, eSSE);
+		check(scalar8 == sse8, L"normal Z kernels differ");
+	}
+
+	// The fits against the exact curves, and 8 bit values through linear and back
+	{
+		float toLinear = 0.0f, toSrgb = 0.0f;
+		for (int i = 0; i <= 100000; i++)
+		{
+			const float value = i / 100000.0f;
+			toLinear = std::max(toLinear, std::fabs(SrgbToLinearFit(value) - SrgbToLinearExact(value)));
+			toSrgb = std::max(toSrgb, std::fabs(LinearToSrgbFit(value) - LinearToSrgbExact(value)));
+		}
+		check(toLinear < 3e-5f, L"the sRGB to linear fit is too far from the curve");
+		check(toSrgb < 3e-5f, L"the linear to sRGB fit is too far from the curve");
+
+		std::vector<uint8_t> values(256 * 4), roundTrip(256 * 4);
+		for (int i = 0; i < 256 * 4; i++)
+			values[i] = (uint8_t)(i / 4);
+		std::vector<float> linear(256 * 4);
+		SrgbToLinear(values.data(), 256, 3, linear.data());
+		LinearToSrgb(linear.data(), 256, 3, linear.data(), eSSE);
+		FloatToUnorm(linear.data(), linear.size(), roundTrip.data(), eSSE);
+		check(roundTrip == values, L"8 bit sRGB values should round trip through linear");
+		Log::Info(L"ColorConversion: sRGB fits within %.2g (to linear) and %.2g (to sRGB) of the curves", toLinear, toSrgb);
+	}
+
+	// Premultiplying rounds to nearest, for every colour and alpha; unpremultiplying undoes it closely
+	{
+		std::vector<uint8_t> texels(256 * 256 * 4), premultiplied(texels.size()), restored(texels.size());
+		for (UINT i = 0; i < 256 * 256; i++)
+		{
+			texels[i * 4] = texels[i * 4 + 1] = texels[i * 4 + 2] = (uint8_t)(i & 255);
+			texels[i * 4 + 3] = (uint8_t)(i >> 8);
+		}
+		Premultiply(texels.data(), 256 * 256, premultiplied.data(), eSSE);
+		Unpremultiply(premultiplied.data(), 256 * 256, restored.data(), eSSE);
+		bool rounded = true, undone = true;
+		for (UINT i = 0; i < 256 * 256; i++)
+		{
+			const UINT colour = i & 255, alpha = i >> 8;
+			rounded = rounded && premultiplied[i * 4] == (colour * alpha + 127) / 255 && premultiplied[i * 4 + 3] == alpha;
+			// Premultiplying loses precision as alpha falls, so only opaque enough texels come back close
+			if (alpha >= 128)
+				undone = undone && std::abs((int)restored[i * 4] - (int)colour) <= 1;
+			if (alpha == 255 || alpha == 0)
+				undone = undone && restored[i * 4] == (alpha ? colour : 0);
+		}
+		check(rounded, L"premultiplied colour should be colour * alpha / 255 rounded to nearest");
+		check(undone, L"unpremultiplying should restore colour");
+	}
+
+	// Swizzles and normals by value
+	{
+		const uint8_t texel[8] = { 10, 20, 30, 40, 128, 128, 7, 9 };
+		uint8_t out[8] = {};
+		const Channel bgra[4] = { eBlue, eGreen, eRed, eAlpha };
+		Swizzle(texel, 2, bgra, out, eSSE);
+		check(out[0] == 30 && out[1] == 20 && out[2] == 10 && out[3] == 40, L"BGRA to RGBA should swap red and blue");
+		const Channel constants[4] = { eAlpha, eZero, eOne, eRed };
+		Swizzle(texel, 2, constants, out, eSSE);
+		check(out[0] == 40 && out[1] == 0 && out[2] == 255 && out[3] == 10, L"constant channels should be 0 and 255");
+
+		uint8_t normal[4] = { 128, 128, 0, 77 };
+		ReconstructNormalZ(normal, 1, eSSE);
+		check(normal[2] == 255 && normal[3] == 77, L"a flat normal should point along Z, keeping alpha");
+	}
+
+	// Parallel runs give the serial result
+	{
+		std::vector<float> serial(kCount), parallel(kCount);
+		LinearToSrgb(floats.data(), kTexels, 3, serial.data(), eSSE);
+		Parallel(kTexels, [&](size_t begin, size_t end)
+			{
+				LinearToSrgb(floats.data() + begin * 4, end - begin, 3, parallel.data() + begin * 4, eSSE);
+			});
+		check(memcmp(serial.data(), parallel.data(), kCount * sizeof(float)) == 0, L"the parallel conversion differs");
+	}
+
+	if (passed)
+		Log::Info(L"ColorConversion self test passed");
+	return passed;
+}
+
+void ColorConversion::RunBenchmark()
+{
+	constexpr size_t kTexels = 2048 * 2048;
+	constexpr int kIterations = 5;
+	std::vector<uint8_t> bytes(kTexels * 4), bytesOut(kTexels * 4);
+	std::vector<uint16_t> words(kTexels * 4);
+	std::vector<float> floats(kTexels * 4), floatsOut(kTexels * 4);
+	uint32_t seed = 12345;
+	for (size_t i = 0; i < kTexels * 4; i++)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		bytes[i] = (uint8_t)(seed >> 24);
+		words[i] = (uint16_t)(seed >> 16);
+		floats[i] = (seed >> 8) / 16777216.0f;
+	}
+
+	// Conversions of [begin, end) texels
+	struct Test
+	{
+		const wchar_t*										name;
+		std::function<void(size_t, size_t, Kernel)>	convert;
+	};
+	const Test tests[] = {
+		{ L"8 bit to float", [&](size_t b, size_t e, Kernel k) { UnormToFloat(bytes.data() + b * 4, (e - b) * 4, floatsOut.data() + b * 4, k); } },
+		{ L"16 bit to float", [&](size_t b, size_t e, Kernel k) { UnormToFloat(words.data() + b * 4, (e - b) * 4, floatsOut.data() + b * 4, k); } },
+		{ L"float to 8 bit", [&](size_t b, size_t e, Kernel k) { FloatToUnorm(floats.data() + b * 4, (e - b) * 4, bytesOut.data() + b * 4, k); } },
+		{ L"sRGB8 to linear", [&](size_t b, size_t e, Kernel) { SrgbToLinear(bytes.data() + b * 4, e - b, 3, floatsOut.data() + b * 4); } },
+		{ L"sRGB to linear", [&](size_t b, size_t e, Kernel k) { SrgbToLinear(floats.data() + b * 4, e - b, 3, floatsOut.data() + b * 4, k); } },
+		{ L"linear to sRGB", [&](size_t b, size_t e, Kernel k) { LinearToSrgb(floats.data() + b * 4, e - b, 3, floatsOut.data() + b * 4, k); } },
+		{ L"premultiply", [&](size_t b, size_t e, Kernel k) { Premultiply(bytes.data() + b * 4, e - b, bytesOut.data() + b * 4, k); } },
+		{ L"unpremultiply", [&](size_t b, size_t e, Kernel k) { Unpremultiply(bytes.data() + b * 4, e - b, bytesOut.data() + b * 4, k); } },
+		{ L"swizzle BGRA", [&](size_t b, size_t e, Kernel k)
+			{
+				const Channel bgra[4] = { eBlue, eGreen, eRed, eAlpha };
+				Swizzle(bytes.data() + b * 4, e - b, bgra, bytesOut.data() + b * 4, k);
+			} },
+		{ L"normal Z", [&](size_t b, size_t e, Kernel k) { ReconstructNormalZ(bytesOut.data() + b * 4, e - b, k); } },
+	};
+
+	// The pow() the fits replace, as SceneUtils::SrgbValueToLinear used to call it for every value
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < kTexels * 4; i++)
+		floatsOut[i] = SrgbToLinearExact(floats[i]);
+	const double powMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	Log::Info(L"ColorConversion benchmark: %ux%u texels, %u worker threads, Mtexels/s", 2048, 2048, JobSystem::Get().GetWorkerCount());
+	Log::Info(L"  %-16s scalar %7.1f", L"pow to linear", kTexels / (powMs * 1000.0));
+	for (const Test& test : tests)
+	{
+		double ms[3] = {};
+		for (int run = 0; run < 3; run++)
+		{
+			const Kernel kernel = run == 0 ? eScalar : eSSE;
+			start = std::chrono::steady_clock::now();
+			for (int i = 0; i < kIterations; i++)
+			{
+				if (run == 2)
+					Parallel(kTexels, [&](size_t begin, size_t end) { test.convert(begin, end, kernel); });
+				else
+					test.convert(0, kTexels, kernel);
+			}
+			ms[run] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / kIterations;
+		}
+		Log::Info(L"  %-16s scalar %7.1f, SSE %7.1f, SSE parallel %7.1f", test.name, kTexels / (ms[0] * 1000.0),
+				  kTexels / (ms[1] * 1000.0), kTexels / (ms[2] * 1000.0));
+	}
+}
@@ -0,0 +1,76 @@
+// Batch colour conversions over rows or whole images of texels.
+//
+// Every conversion takes a run of values or RGBA texels and has a scalar kernel, the reference, and
+// an SSE2 one that does the same float and integer operations in the same order, so the two give
+// identical results - NaNs and out of range values included. Runs are independent, so a whole image
+// can be split over the JobSystem with Parallel() and converted a chunk at a time.
+//
+//	- 8 and 16 bit UNORM to float and back, clamped and rounded to nearest
+//	- sRGB to linear through tables for 8 and 16 bit values, and both ways for float through
+//	  polynomial fits of the curves (within 3e-5 of the exact curves, so 8 bit values round trip)
+//	- premultiplied alpha both ways, rounded to nearest
+//	- channel swizzles of RGBA8, with constant 0 and 255 channels
+//	- Z of tangent space normals rebuilt from X and Y in RGBA8
+
+#pragma once
+
+#include <d3d11_1.h>
+#include <cstdint>
+#include <functional>
+
+class ColorConversion
+{
+public:
+	enum Kernel
+	{
+		eScalar,
+		eSSE,
+	};
+
+	// Where a swizzled channel comes from
+	enum Channel
+	{
+		eRed,
+		eGreen,
+		eBlue,
+		eAlpha,
+		eZero,
+		eOne,
+	};
+
+	// Values (any channels) to float in [0, 1] and back. Floats are clamped to [0, 1], NaN to 0.
+	static void	UnormToFloat(const uint8_t* src, size_t count, float* dst, Kernel kernel);
+	static void	UnormToFloat(const uint16_t* src, size_t count, float* dst, Kernel kernel);
+	static void	FloatToUnorm(const float* src, size_t count, uint8_t* dst, Kernel kernel);
+	static void	FloatToUnorm(const float* src, size_t count, uint16_t* dst, Kernel kernel);
+
+	// Linear values of every 8 or 16 bit sRGB value
+	static const float*	GetSrgbTable(UINT bits);
+
+	// The sRGB conversions work on texels of 4 channels, of which the first colourChannels (1 for grey,
+	// 3 for RGB) are converted and the rest (alpha) are linear already. From integers they go through
+	// the tables; the float ones clamp colour to [0, 1] and may convert in place.
+	static void	SrgbToLinear(const uint8_t* src, size_t texels, UINT colourChannels, float* dst);
+	static void	SrgbToLinear(const uint16_t* src, size_t texels, UINT colourChannels, float* dst);
+	static void	SrgbToLinear(const float* src, size_t texels, UINT colourChannels, float* dst, Kernel kernel);
+	static void	LinearToSrgb(const float* src, size_t texels, UINT colourChannels, float* dst, Kernel kernel);
+
+	// RGBA8 colour times alpha and back; alpha is kept, and colour with no alpha left is 0
+	static void	Premultiply(const uint8_t* src, size_t texels, uint8_t* dst, Kernel kernel);
+	static void	Unpremultiply(const uint8_t* src, size_t texels, uint8_t* dst, Kernel kernel);
+
+	// RGBA8 channel c of dst from order[c] of src; src and dst may be the same
+	static void	Swizzle(const uint8_t* src, size_t texels, const Channel order[4], uint8_t* dst, Kernel kernel);
+
+	// B of RGBA8 normals from R and G, as Z = sqrt(1 - X^2 - Y^2)
+	static void	ReconstructNormalZ(uint8_t* rgba, size_t texels, Kernel kernel);
+
+	// Splits count values or texels over the JobSystem, in chunks big enough to be worth a job
+	static void	Parallel(size_t count, const std::function<void(size_t, size_t)>& fn);
+
+	// Checks the SSE kernels match the scalar ones exactly, odd lengths and special values included,
+	// the accuracy of the sRGB fits and the rounding of premultiplied alpha
+	static bool	RunSelfTest();
+	// Throughput of every conversion with each kernel, serially and in parallel
+	static void	RunBenchmark();
+};
@@ -0,0 +1,396 @@
+#include "CompressedAnimation.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace DirectX;
+
+namespace
+{
+    constexpr float kMaxTick = 65535.0f;
+    constexpr float kSmallestThreeRange = 0.70710678f;     // the three smaller components are within +-1/sqrt(2)
+    constexpr float kSmallestThreeSteps = 32767.0f;        // 15 bits each
+    constexpr int kCubicSubdivisions = 8;                   // linear keys per cubic spline segment
+
+    uint16_t QuantizeUnit(float value, float steps)
+    {
+        return (uint16_t)std::min(std::max(value * steps + 0.5f, 0.0f), steps);
+    }
+
+    // Largest component index in the top 2 of 48 bits, then the other three at 15 bits each
+    void PackQuaternion(const XMFLOAT4& quaternion, uint16_t out[3])
+    {
+        XMFLOAT4 q;
+        XMStoreFloat4(&q, XMQuaternionNormalize(XMLoadFloat4(&quaternion)));
+        const float c[4] = { q.x, q.y, q.z, q.w };
+
+        int largest = 0;
+        for (int i = 1; i < 4; i++)
+        {
+            if (fabsf(c[i]) > fabsf(c[largest]))
+                largest = i;
+        }
+
+        // q and -q are the same rotation, so the dropped component can always be made positive
+        const float sign = c[largest] < 0.0f ? -1.0f : 1.0f;
+        uint64_t bits = (uint64_t)largest;
+        for (int i = 0; i < 4; i++)
+        {
+            if (i == largest)
+                continue;
+            const float unit = (c[i] * sign / kSmallestThreeRange) * 0.5f + 0.5f;
+            bits = (bits << 15) | QuantizeUnit(unit, kSmallestThreeSteps);
+        }
+
+        out[0] = (uint16_t)(bits >> 32);
+        out[1] = (uint16_t)(bits >> 16);
+        out[2] = (uint16_t)bits;
+    }
+
+    XMFLOAT4 UnpackQuaternion(const uint16_t in[3])
+    {
+        const uint64_t bits = ((uint64_t)in[0] << 32) | ((uint64_t)in[1] << 16) | in[2];
+        const int largest = (int)(bits >> 45) & 3;
+
+        float c[4];
+        float sumSquares = 0.0f;
+        for (int i = 0, j = 0; i < 4; i++)
+        {
+            if (i == largest)
+                continue;
+            const float unit = ((bits >> (30 - 15 * j)) & 0x7FFF) / kSmallestThreeSteps;
+            c[i] = (unit * 2.0f - 1.0f) * kSmallestThreeRange;
+            sumSquares += c[i] * c[i];
+            j++;
+        }
+        c[largest] = sqrtf(std::max(1.0f - sumSquares, 0.0f));
+        return XMFLOAT4(c[0], c[1], c[2], c[3]);
+    }
+
+    float RotationError(FXMVECTOR a, FXMVECTOR b)
+    {
+        const float d = fabsf(XMVectorGetX(XMVector4Dot(XMQuaternionNormalize(a), XMQuaternionNormalize(b))));
+        return 2.0f * acosf(std::min(d, 1.0f));
+    }
+}
+
+bool CompressedAnimation::Compress(const Animation& source, const std::vector<Tolerance>& jointTolerances,
+                                   const Tolerance& defaultTolerance, float blockLength)
+{
+    *this = CompressedAnimation();
+
+    m_duration = std::max(source.GetEndTime(), 0.0f);
+    m_ticksPerSecond = m_duration > 0.0f ? kMaxTick / m_duration : 0.0f;
+    // A clip of no length is a single pose, held by a single block
+    m_blockTicks = m_duration > 0.0f ? (uint32_t)std::min(std::max(blockLength * m_ticksPerSecond, 1.0f), kMaxTick + 1.0f)
+                                     : (uint32_t)kMaxTick + 1;
+
+    // The kept keys of each channel, still separate
+    std::vector<std::vector<PackedKey>> channelKeys;
+
+    for (const AnimationChannel& sourceChannel : source.m_channels)
+    {
+        if (sourceChannel.samplerIndex < 0 || sourceChannel.samplerIndex >= (int)source.m_samplers.size())
+            continue;
+        const AnimationSampler& sampler = source.m_samplers[sourceChannel.samplerIndex];
+        const bool rotation = sourceChannel.path == AnimationChannel::ROTATION;
+
+        const size_t sourceCount = sampler.GetKeyCount();
+        if (sourceCount == 0 || rotation == sampler.vec4_values.empty() || m_channels.size() >= 0xFFFF)
+            continue;
+
+        // Cubic splines are sampled along their curves and stored as linear keys, which key removal thins
+        // out again where the curve is flat enough
+        std::vector<float> times;
+        std::vector<XMFLOAT4> values;
+        const bool cubic = sampler.interpolation == AnimationSampler::CUBICSPLINE && sampler.segments.size() == (sourceCount - 1) * 4;
+        for (size_t k = 0; k < sourceCount; k++)
+        {
+            const int subdivisions = cubic && k + 1 < sourceCount ? kCubicSubdivisions : 1;
+            for (int i = 0; i < subdivisions; i++)
+            {
+                const float s = (float)i / subdivisions;
+                XMVECTOR value = i == 0 ? sampler.GetKeyValue(k) : sampler.EvaluateSegment(k, s);
+                if (rotation && i > 0)
+                    value = XMQuaternionNormalize(value);
+                XMFLOAT4 v;
+                XMStoreFloat4(&v, value);
+                if (!rotation)
+                    v.w = 0.0f;
+                times.push_back(i == 0 ? sampler.timestamps[k] : sampler.timestamps[k] + s * (sampler.timestamps[k + 1] - sampler.timestamps[k]));
+                values.push_back(v);
+            }
+        }
+        const size_t count = times.size();
+
+        Channel channel;
+        channel.joint = (int16_t)sourceChannel.jointIndex;
+        channel.path = (uint8_t)sourceChannel.path;
+        channel.step = sampler.interpolation == AnimationSampler::STEP ? 1 : 0;
+        channel.rangeMin = XMFLOAT3(0.0f, 0.0f, 0.0f);
+        channel.rangeExtent = XMFLOAT3(0.0f, 0.0f, 0.0f);
+        if (!rotation)
+        {
+            XMVECTOR low = XMLoadFloat4(&values[0]);
+            XMVECTOR high = low;
+            for (const XMFLOAT4& v : values)
+            {
+                low = XMVectorMin(low, XMLoadFloat4(&v));
+                high = XMVectorMax(high, XMLoadFloat4(&v));
+            }
+            XMStoreFloat3(&channel.rangeMin, low);
+            XMStoreFloat3(&channel.rangeExtent, XMVectorSubtract(high, low));
+        }
+        const uint16_t channelIndex = (uint16_t)m_channels.size();
+        m_channels.push_back(channel);
+
+        // Quantize everything first, so that key removal judges the values playback will actually see
+        std::vector<PackedKey> packed(count);
+        std::vector<XMFLOAT4> decoded(count);
+        for (size_t k = 0; k < count; k++)
+        {
+            PackedKey& key = packed[k];
+            key.channel = channelIndex;
+            // Rounded down, so that sampling exactly at a key's time never lands before the key
+            key.tick = (uint16_t)std::min(std::min(std::max(times[k], 0.0f), m_duration) * m_ticksPerSecond, kMaxTick);
+            if (rotation)
+            {
+                PackQuaternion(values[k], key.value);
+            }
+            else
+            {
+                const float* v = &values[k].x;
+                const float* low = &channel.rangeMin.x;
+                const float* extent = &channel.rangeExtent.x;
+                for (int c = 0; c < 3; c++)
+                    key.value[c] = extent[c] > 0.0f ? QuantizeUnit((v[c] - low[c]) / extent[c], 65535.0f) : 0;
+            }
+            decoded[k] = Decode(key);
+        }
+
+        const Tolerance& tolerance = sourceChannel.jointIndex >= 0 && sourceChannel.jointIndex < (int)jointTolerances.size()
+                                   ? jointTolerances[sourceChannel.jointIndex] : defaultTolerance;
+        auto withinTolerance = [&](FXMVECTOR value, size_t k)
+        {
+            const XMVECTOR reference = XMLoadFloat4(&values[k]);
+            switch (channel.path)
+            {
+            case AnimationChannel::ROTATION:
+                return RotationError(value, reference) <= tolerance.rotation;
+            case AnimationChannel::TRANSLATION:
+                return XMVectorGetX(XMVector3Length(XMVectorSubtract(value, reference))) <= tolerance.translation;
+            default:
+                return XMVector3LessOrEqual(XMVectorAbs(XMVectorSubtract(value, reference)), XMVectorReplicate(tolerance.scale));
+            }
+        };
+
+        // Can keys a and b stand in for everything between them?
+        auto spanFits = [&](size_t a, size_t b)
+        {
+            const float time0 = times[a];
+            const float span = times[b] - time0;
+            for (size_t k = a + 1; k < b; k++)
+            {
+                XMVECTOR value = XMLoadFloat4(&decoded[a]);
+                if (!channel.step && span > 0.0f)
+                {
+                    const float t = (times[k] - time0) / span;
+                    value = rotation ? XMQuaternionSlerp(value, XMLoadFloat4(&decoded[b]), t)
+                                     : XMVectorLerp(value, XMLoadFloat4(&decoded[b]), t);
+                }
+                if (!withinTolerance(value, k))
+                    return false;
+            }
+            return true;
+        };
+
+        // Greedy: from each kept key, reach as far as the tolerance allows
+        std::vector<PackedKey> kept;
+        kept.push_back(packed[0]);
+        bool constant = true;
+        for (size_t k = 1; k < count && constant; k++)
+            constant = withinTolerance(XMLoadFloat4(&decoded[0]), k);
+        if (!constant)
+        {
+            size_t a = 0;
+            while (a + 1 < count)
+            {
+                size_t b = a + 1;
+                while (b + 1 < count && spanFits(a, b + 1))
+                    b++;
+                kept.push_back(packed[b]);
+                a = b;
+            }
+        }
+
+        m_sourceKeyCount += count;
+        channelKeys.push_back(std::move(kept));
+    }
+
+    if (m_channels.empty())
+        return false;
+
+    // Interleave into blocks
+    struct StreamKey
+    {
+        uint16_t    previousTick;
+        uint16_t    channel;
+        uint32_t    index;
+    };
+    const uint32_t blockCount = (uint32_t)kMaxTick / m_blockTicks + 1;
+    std::vector<StreamKey> stream;
+    for (uint32_t b = 0; b < blockCount; b++)
+    {
+        const uint32_t blockStart = b * m_blockTicks;
+        const uint32_t blockEnd = blockStart + m_blockTicks;
+
+        Block block;
+        block.first = (uint32_t)m_keys.size();
+
+        // The keys either side of the block's start
+        for (const std::vector<PackedKey>& keys : channelKeys)
+        {
+            size_t k0 = 0, k1 = 0;
+            while (k1 < keys.size() && keys[k1].tick <= blockStart)
+                k1++;
+            if (k1 > 0)
+                k0 = k1 - 1;
+            if (k1 == keys.size())
+                k1 = k0;
+            m_keys.push_back(keys[k0]);
+            m_keys.push_back(keys[k1]);
+        }
+
+        // Then every key that becomes the upcoming one during the block, in the order it happens
+        stream.clear();
+        for (uint16_t c = 0; c < (uint16_t)channelKeys.size(); c++)
+        {
+            const std::vector<PackedKey>& keys = channelKeys[c];
+            for (uint32_t k = 1; k < (uint32_t)keys.size(); k++)
+            {
+                if (keys[k - 1].tick > blockStart && keys[k - 1].tick < blockEnd)
+                    stream.push_back({ keys[k - 1].tick, c, k });
+            }
+        }
+        std::sort(stream.begin(), stream.end(), [](const StreamKey& a, const StreamKey& b)
+        {
+            if (a.previousTick != b.previousTick)
+                return a.previousTick < b.previousTick;
+            if (a.channel != b.channel)
+                return a.channel < b.channel;
+            return a.index < b.index;
+        });
+        for (const StreamKey& key : stream)
+            m_keys.push_back(channelKeys[key.channel][key.index]);
+
+        block.end = (uint32_t)m_keys.size();
+        m_blocks.push_back(block);
+    }
+
+    return true;
+}
+
+XMFLOAT4 CompressedAnimation::Decode(const PackedKey& key) const
+{
+    const Channel& channel = m_channels[key.channel];
+    if (channel.path == AnimationChannel::ROTATION)
+        return UnpackQuaternion(key.value);
+
+    const float* low = &channel.rangeMin.x;
+    const float* extent = &channel.rangeExtent.x;
+    float v[3];
+    for (int c = 0; c < 3; c++)
+        v[c] = low[c] + extent[c] * (key.value[c] / 65535.0f);
+    return XMFLOAT4(v[0], v[1], v[2], 0.0f);
+}
+
+void CompressedAnimation::Seek(int block, Cursor& cursor) const
+{
+    cursor.animation = this;
+    cursor.block = block;
+    cursor.keys.resize(m_channels.size() * 2);
+
+    const uint32_t first = m_blocks[block].first;
+    for (size_t i = 0; i < cursor.keys.size(); i++)
+    {
+        const PackedKey& key = m_keys[first + i];
+        cursor.keys[i].tick = key.tick;
+        cursor.keys[i].value = Decode(key);
+    }
+    cursor.position = first + (uint32_t)cursor.keys.size();
+}
+
+void CompressedAnimation::Sample(float time, Cursor& cursor, XMFLOAT3* translations, XMFLOAT4* rotations,
+                                 XMFLOAT3* scales, int jointCount) const
+{
+    if (m_blocks.empty())
+        return;
+
+    const float tick = time >= m_duration ? kMaxTick : std::max(time, 0.0f) * m_ticksPerSecond;
+    const int block = std::min((int)(tick / m_blockTicks), (int)m_blocks.size() - 1);
+    if (cursor.animation != this || cursor.block != block || tick < cursor.tick ||
+        cursor.keys.size() != m_channels.size() * 2 || cursor.position > m_blocks[block].end)
+        Seek(block, cursor);
+    cursor.tick = tick;
+
+    // Stream forward; stop at the first key whose channel has not reached its upcoming key yet
+    const uint32_t end = m_blocks[block].end;
+    while (cursor.position < end)
+    {
+        const PackedKey& key = m_keys[cursor.position];
+        Cursor::Key* pair = &cursor.keys[key.channel * 2];
+        if (pair[1].tick > tick)
+            break;
+        pair[0] = pair[1];
+        pair[1].tick = key.tick;
+        pair[1].value = Decode(key);
+        cursor.position++;
+    }
+
+    for (size_t c = 0; c < m_channels.size(); c++)
+    {
+        const Channel& channel = m_channels[c];
+        if (channel.joint < 0 || channel.joint >= jointCount)
+            continue;
+
+        const Cursor::Key* pair = &cursor.keys[c * 2];
+        XMVECTOR value = XMLoadFloat4(&pair[0].value);
+        const float span = pair[1].tick - pair[0].tick;
+        if (tick >= pair[1].tick)
+        {
+            // Only past the channel's last key
+            value = XMLoadFloat4(&pair[1].value);
+        }
+        else if (!channel.step && span > 0.0f && tick > pair[0].tick)
+        {
+            const float t = std::min((tick - pair[0].tick) / span, 1.0f);
+            value = channel.path == AnimationChannel::ROTATION ? XMQuaternionSlerp(value, XMLoadFloat4(&pair[1].value), t)
+                                                               : XMVectorLerp(value, XMLoadFloat4(&pair[1].value), t);
+        }
+
+        switch (channel.path)
+        {
+        case AnimationChannel::ROTATION:    XMStoreFloat4(&rotations[channel.joint], value); break;
+        case AnimationChannel::TRANSLATION: XMStoreFloat3(&translations[channel.joint], value); break;
+        default:                            XMStoreFloat3(&scales[channel.joint], value); break;
+        }
+    }
+}
+
+size_t CompressedAnimation::GetMemorySize() const
+{
+    return sizeof(*this) + m_channels.size() * sizeof(Channel) + m_keys.size() * sizeof(PackedKey) + m_blocks.size() * sizeof(Block);
+}
+
+size_t CompressedAnimation::GetMemorySize(const Animation& source)
+{
+    size_t size = sizeof(Animation) + source.m_name.size() +
+                  (source.m_channels.size() + source.m_weightChannels.size()) * sizeof(AnimationChannel);
+    for (const AnimationSampler& sampler : source.m_samplers)
+    {
+        size += sizeof(AnimationSampler) + sampler.timestamps.size() * sizeof(float) +
+                sampler.vec3_values.size() * sizeof(XMFLOAT3) + sampler.vec4_values.size() * sizeof(XMFLOAT4) +
+                sampler.scalar_values.size() * sizeof(float);
+    }
+    return size;
+}
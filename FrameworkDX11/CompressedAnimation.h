@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <DirectXMath.h>
+
+#include "Animation.h"
+
+// A compact, read only copy of an Animation for long clips and crowds.
+//
+// Compression removes every key that interpolating its kept neighbours reproduces within the channel's
+// tolerance, then quantizes what is left: rotations to 48 bit "smallest three" quaternions, translations
+// and scales to 16 bits per component over the channel's value range, and times to 16 bits over the clip.
+// Every key is the same 10 bytes. Cubic splines are sampled along their curves into linear keys first.
+//
+// Keys are not stored per channel but interleaved in the order playback needs them: a key is needed once
+// the time passes the key before it, so the keys are sorted by their predecessor's time and a cursor
+// moving forward reads them strictly linearly. The clip is cut into blocks of fixed length, each starting
+// with the two keys every channel is between at the block's start, so a seek only has to go back to the
+// start of one block.
+class CompressedAnimation
+{
+public:
+    struct Tolerance
+    {
+        float translation = 0.001f;     // units
+        float rotation = 0.001f;        // radians
+        float scale = 0.001f;
+    };
+
+    // Playback state of one instance. Reading forward continues where the last call stopped; going
+    // backwards or into another block restarts from a block's start.
+    struct Cursor
+    {
+        struct Key
+        {
+            float               tick;
+            DirectX::XMFLOAT4   value;
+        };
+
+        const CompressedAnimation*  animation = nullptr;
+        int                         block = -1;
+        uint32_t                    position = 0;
+        float                       tick = 0.0f;
+        std::vector<Key>            keys;       // the two keys either side of the time, per channel
+    };
+
+    // jointTolerances is indexed by joint; joints past its end use defaultTolerance
+    bool Compress(const Animation& source, const std::vector<Tolerance>& jointTolerances,
+                  const Tolerance& defaultTolerance, float blockLength = 4.0f);
+
+    // Writes the animated channels at time into the per joint arrays, the others are left untouched
+    void Sample(float time, Cursor& cursor, DirectX::XMFLOAT3* translations, DirectX::XMFLOAT4* rotations,
+                DirectX::XMFLOAT3* scales, int jointCount) const;
+
+    float GetDuration() const { return m_duration; }
+    size_t GetKeyCount() const { return m_keys.size(); }
+    size_t GetBlockCount() const { return m_blocks.size(); }
+    size_t GetSourceKeyCount() const { return m_sourceKeyCount; }
+    size_t GetMemorySize() const;
+    static size_t GetMemorySize(const Animation& source);
+
+private:
+#pragma pack(push, 2)
+    struct PackedKey
+    {
+        uint16_t    channel;
+        uint16_t    tick;
+        uint16_t    value[3];
+    };
+#pragma pack(pop)
+
+    struct Channel
+    {
+        int16_t                 joint;
+        uint8_t                 path;           // AnimationChannel::PathType
+        uint8_t                 step;           // hold the earlier key instead of interpolating
+        DirectX::XMFLOAT3       rangeMin;       // translations and scales only
+        DirectX::XMFLOAT3       rangeExtent;
+    };
+
+    struct Block
+    {
+        uint32_t    first;      // 2 keys per channel for the block's start, then the stream
+        uint32_t    end;
+    };
+
+    DirectX::XMFLOAT4 Decode(const PackedKey& key) const;
+    void Seek(int block, Cursor& cursor) const;
+
+    std::vector<Channel>        m_channels;
+    std::vector<PackedKey>      m_keys;
+    std::vector<Block>          m_blocks;
+    float                       m_duration = 0.0f;
+    float                       m_ticksPerSecond = 0.0f;
+    uint32_t                    m_blockTicks = 1;
+    size_t                      m_sourceKeyCount = 0;
+};
@@ -0,0 +1,123 @@
+#include "ConstantBuffers.h"
+#include "RenderStateTracker.h"
+
+#include <algorithm>
+#include <cstdint>
+
+HRESULT ConstantBufferRing::Create(ID3D11Device* device, ID3D11DeviceContext1* context1, UINT sizeInBytes)
+{
+	Release();
+
+	// Sub-allocation needs the 11.1 runtime (for the offset binds) and driver support for
+	// NO_OVERWRITE maps on dynamic constant buffers
+	D3D11_FEATURE_DATA_D3D11_OPTIONS options = {};
+	if (context1 != nullptr &&
+		SUCCEEDED(device->CheckFeatureSupport(D3D11_FEATURE_D3D11_OPTIONS, &options, sizeof(options))))
+	{
+		m_subAllocate = options.ConstantBufferOffsetting && options.MapNoOverwriteOnDynamicConstantBuffer;
+	}
+
+	m_size = m_subAllocate ? sizeInBytes : D3D11_REQ_CONSTANT_BUFFER_ELEMENT_COUNT * 16;
+	m_size = (m_size + kAlignment - 1) / kAlignment * kAlignment;
+	m_offset = m_size; // forces a DISCARD on the first push
+	m_context1 = context1;
+
+	D3D11_BUFFER_DESC bd = {};
+	bd.Usage = D3D11_USAGE_DYNAMIC;
+	bd.ByteWidth = m_size;
+	bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	return device->CreateBuffer(&bd, nullptr, &m_buffer);
+}
+
+void ConstantBufferRing::Release()
+{
+	m_buffer.Reset();
+	m_context1.Reset();
+	m_size = 0;
+	m_offset = 0;
+	m_subAllocate = false;
+}
+
+bool ConstantBufferRing::Push(ID3D11DeviceContext* context, UINT slot, const void* data, UINT size, ConstantBufferStats* stats, RenderStateTracker* tracker)
+{
+	if (!m_buffer || size == 0)
+		return false;
+
+	if (!m_subAllocate)
+		return PushFallback(context, slot, data, size, stats, tracker);
+
+	const UINT allocSize = (size + kAlignment - 1) / kAlignment * kAlignment;
+	if (allocSize > m_size)
+		return false;
+
+	// Wrap around - DISCARD hands us a fresh buffer so the GPU can keep reading the previous contents
+	D3D11_MAP mapType = D3D11_MAP_WRITE_NO_OVERWRITE;
+	if (m_offset + allocSize > m_size)
+	{
+		mapType = D3D11_MAP_WRITE_DISCARD;
+		m_offset = 0;
+		if (stats)
+			stats->ringWraps++;
+	}
+
+	D3D11_MAPPED_SUBRESOURCE mapped = {};
+	if (FAILED(context->Map(m_buffer.Get(), 0, mapType, 0, &mapped)))
+		return false;
+	memcpy(static_cast<uint8_t*>(mapped.pData) + m_offset, data, size);
+	context->Unmap(m_buffer.Get(), 0);
+
+	// Offsets and sizes are in 16-byte shader constants
+	const UINT firstConstant = m_offset / 16;
+	const UINT numConstants = allocSize / 16;
+	ID3D11Buffer* buffer = m_buffer.Get();
+	if (tracker)
+	{
+		tracker->SetConstantBuffer(RenderStateTracker::eBothStages, slot, buffer, firstConstant, numConstants);
+	}
+	else
+	{
+		m_context1->VSSetConstantBuffers1(slot, 1, &buffer, &firstConstant, &numConstants);
+		m_context1->PSSetConstantBuffers1(slot, 1, &buffer, &firstConstant, &numConstants);
+	}
+
+	m_offset += allocSize;
+
+	if (stats)
+	{
+		stats->bytesUploaded += size;
+		stats->uploads++;
+	}
+	return true;
+}
+
+bool ConstantBufferRing::PushFallback(ID3D11DeviceContext* context, UINT slot, const void* data, UINT size, ConstantBufferStats* stats, RenderStateTracker* tracker)
+{
+	if (size > m_size)
+		return false;
+
+	D3D11_MAPPED_SUBRESOURCE mapped = {};
+	if (FAILED(context->Map(m_buffer.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+		return false;
+	memcpy(mapped.pData, data, size);
+	context->Unmap(m_buffer.Get(), 0);
+
+	// Same buffer every time, so with a tracker this only binds once - DISCARD renames the contents underneath
+	ID3D11Buffer* buffer = m_buffer.Get();
+	if (tracker)
+	{
+		tracker->SetConstantBuffer(RenderStateTracker::eBothStages, slot, buffer);
+	}
+	else
+	{
+		context->VSSetConstantBuffers(slot, 1, &buffer);
+		context->PSSetConstantBuffers(slot, 1, &buffer);
+	}
+
+	if (stats)
+	{
+		stats->bytesUploaded += size;
+		stats->uploads++;
+	}
+	return true;
+}
@@ -0,0 +1,115 @@
+// Constant buffer helpers, split by how often the data changes.
+//
+//  - ConstantBuffer<T>   : per-frame / per-view / per-material blocks. Keeps a CPU shadow copy
+//                          and skips the upload entirely when the contents have not changed.
+//  - ConstantBufferRing  : per-draw blocks. One large dynamic buffer which is sub-allocated with
+//                          D3D11_MAP_WRITE_NO_OVERWRITE and bound with *SetConstantBuffers1 offsets.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include "wrl.h"
+#include <cstring>
+
+class RenderStateTracker;
+
+// Byte counters for the debug UI. 'legacyBytes' is what the old single-buffer path
+// (ConstantBufferSwitch per draw + the whole light buffer per frame) would have uploaded.
+struct ConstantBufferStats
+{
+	UINT64	bytesUploaded = 0;
+	UINT64	bytesSkipped = 0;
+	UINT64	legacyBytes = 0;
+	UINT	uploads = 0;
+	UINT	skips = 0;
+	UINT	ringWraps = 0;
+
+	void Reset() { *this = ConstantBufferStats(); }
+};
+
+// Sizes of the buffers the pre-split renderer uploaded, used for the before/after report.
+constexpr UINT kLegacyPerDrawBytes = 240;	// ConstantBufferSwitch, once per primitive
+constexpr UINT kLegacyPerFrameBytes = 240 + 832 + 16;	// ConstantBufferSwitch + LightPropertiesConstantBuffer + ConstantBufferlight
+constexpr UINT kLegacyPaletteBytes = 100 * 64 + 16;	// the fixed 100 joint CbSkinning, once per skinned node
+
+template <typename T>
+class ConstantBuffer
+{
+	static_assert(sizeof(T) % 16 == 0, "Constant buffer size must be a multiple of 16 bytes");
+
+public:
+	HRESULT Create(ID3D11Device* device)
+	{
+		D3D11_BUFFER_DESC bd = {};
+		bd.Usage = D3D11_USAGE_DEFAULT;
+		bd.ByteWidth = sizeof(T);
+		bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+		bd.CPUAccessFlags = 0;
+		m_valid = false;
+		return device->CreateBuffer(&bd, nullptr, &m_buffer);
+	}
+
+	// Uploads the data only if it differs from what is already on the GPU. Returns true if an upload happened.
+	bool Update(ID3D11DeviceContext* context, const T& data, ConstantBufferStats* stats = nullptr)
+	{
+		if (m_valid && memcmp(&m_shadow, &data, sizeof(T)) == 0)
+		{
+			if (stats)
+			{
+				stats->bytesSkipped += sizeof(T);
+				stats->skips++;
+			}
+			return false;
+		}
+
+		context->UpdateSubresource(m_buffer.Get(), 0, nullptr, &data, 0, 0);
+		memcpy(&m_shadow, &data, sizeof(T));
+		m_valid = true;
+
+		if (stats)
+		{
+			stats->bytesUploaded += sizeof(T);
+			stats->uploads++;
+		}
+		return true;
+	}
+
+	// Forces the next Update() to upload (e.g. after a device reset)
+	void Invalidate() { m_valid = false; }
+
+	ID3D11Buffer*			Get() const { return m_buffer.Get(); }
+	ID3D11Buffer* const*	GetAddressOf() const { return m_buffer.GetAddressOf(); }
+
+private:
+	Microsoft::WRL::ComPtr<ID3D11Buffer>	m_buffer;
+	T										m_shadow = {};
+	bool									m_valid = false;
+};
+
+class ConstantBufferRing
+{
+public:
+	// Constant buffer offsets are specified in 16-byte constants and must be a multiple of 16 constants (256 bytes)
+	static constexpr UINT kAlignment = 256;
+
+	HRESULT Create(ID3D11Device* device, ID3D11DeviceContext1* context1, UINT sizeInBytes = 256 * 1024);
+	void	Release();
+
+	// Copies the data into the ring and binds it to the given slot of the vertex and pixel shader stages.
+	// When a tracker is given the bind goes through it, otherwise straight to the context.
+	bool	Push(ID3D11DeviceContext* context, UINT slot, const void* data, UINT size, ConstantBufferStats* stats = nullptr, RenderStateTracker* tracker = nullptr);
+
+	// True when the NO_OVERWRITE + offset path is available, false when falling back to one DISCARD per draw
+	bool	IsSubAllocating() const { return m_subAllocate; }
+
+	UINT	GetSize() const { return m_size; }
+
+private:
+	bool	PushFallback(ID3D11DeviceContext* context, UINT slot, const void* data, UINT size, ConstantBufferStats* stats, RenderStateTracker* tracker);
+
+	Microsoft::WRL::ComPtr<ID3D11Buffer>			m_buffer;
+	Microsoft::WRL::ComPtr<ID3D11DeviceContext1>	m_context1;
+	UINT	m_size = 0;
+	UINT	m_offset = 0;
+	bool	m_subAllocate = false;
+};
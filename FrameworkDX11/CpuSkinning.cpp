@@ -0,0 +1,417 @@
+#include "CpuSkinning.h"
+#include "JobSystem.h"
+#include "Skeleton.h"
+#include "gltf_utils.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <intrin.h>
+#include <immintrin.h>
+
+using namespace DirectX;
+
+namespace
+{
+    CpuSkinning::Bounds EmptyBounds()
+    {
+        return { XMFLOAT3(FLT_MAX, FLT_MAX, FLT_MAX), XMFLOAT3(-FLT_MAX, -FLT_MAX, -FLT_MAX) };
+    }
+
+    float WeightSum(const SceneVertex& v)
+    {
+        return v.Weights.x + v.Weights.y + v.Weights.z + v.Weights.w;
+    }
+
+    // Reference: plain floats, one vertex at a time, skipping zero weights
+    CpuSkinning::Bounds SkinScalar(const SceneVertex* vertices, size_t count, const XMFLOAT3X4* palette,
+                                   unsigned int jointCount, CpuSkinning::Vertex* out)
+    {
+        CpuSkinning::Bounds bounds = EmptyBounds();
+        for (size_t v = 0; v < count; v++)
+        {
+            const SceneVertex& in = vertices[v];
+            CpuSkinning::Vertex& o = out[v];
+
+            if (jointCount == 0 || WeightSum(in) <= 0.0f)
+            {
+                o.position = in.Pos;
+                o.normal = in.Normal;
+                o.tangent = in.Tangent;
+            }
+            else
+            {
+                const uint32_t joints[4] = { in.Joints.x, in.Joints.y, in.Joints.z, in.Joints.w };
+                const float weights[4] = { in.Weights.x, in.Weights.y, in.Weights.z, in.Weights.w };
+                float m[3][4] = {};
+                for (int i = 0; i < 4; i++)
+                {
+                    if (weights[i] == 0.0f)
+                        continue;
+                    const XMFLOAT3X4& joint = palette[std::min(joints[i], jointCount - 1)];
+                    for (int r = 0; r < 3; r++)
+                        for (int c = 0; c < 4; c++)
+                            m[r][c] += joint.m[r][c] * weights[i];
+                }
+
+                auto transform = [&m](const XMFLOAT3& p, float w, float* result)
+                {
+                    for (int r = 0; r < 3; r++)
+                        result[r] = m[r][0] * p.x + m[r][1] * p.y + m[r][2] * p.z + m[r][3] * w;
+                };
+                auto normalize = [](float* n)
+                {
+                    const float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                    if (length > 0.0f)
+                    {
+                        n[0] /= length;
+                        n[1] /= length;
+                        n[2] /= length;
+                    }
+                };
+
+                float p[3], n[3], t[3];
+                transform(in.Pos, 1.0f, p);
+                transform(in.Normal, 0.0f, n);
+                transform(XMFLOAT3(in.Tangent.x, in.Tangent.y, in.Tangent.z), 0.0f, t);
+                normalize(n);
+                normalize(t);
+                o.position = XMFLOAT3(p[0], p[1], p[2]);
+                o.normal = XMFLOAT3(n[0], n[1], n[2]);
+                o.tangent = XMFLOAT4(t[0], t[1], t[2], in.Tangent.w);
+            }
+
+            bounds.min = XMFLOAT3(std::min(bounds.min.x, o.position.x), std::min(bounds.min.y, o.position.y), std::min(bounds.min.z, o.position.z));
+            bounds.max = XMFLOAT3(std::max(bounds.max.x, o.position.x), std::max(bounds.max.y, o.position.y), std::max(bounds.max.z, o.position.z));
+        }
+        return bounds;
+    }
+
+    // One vertex with DirectXMath. Vertices without weights blend the identity instead, so there is no
+    // branch on them.
+    inline XMVECTOR XM_CALLCONV SkinVertexSSE(const SceneVertex& in, const XMFLOAT3X4* palette, unsigned int jointCount,
+                                               CpuSkinning::Vertex& o)
+    {
+        const float identity = WeightSum(in) > 0.0f ? 0.0f : 1.0f;
+        XMVECTOR r0 = XMVectorMultiply(g_XMIdentityR0, XMVectorReplicate(identity));
+        XMVECTOR r1 = XMVectorMultiply(g_XMIdentityR1, XMVectorReplicate(identity));
+        XMVECTOR r2 = XMVectorMultiply(g_XMIdentityR2, XMVectorReplicate(identity));
+
+        const uint32_t joints[4] = { in.Joints.x, in.Joints.y, in.Joints.z, in.Joints.w };
+        const float weights[4] = { in.Weights.x, in.Weights.y, in.Weights.z, in.Weights.w };
+        for (int i = 0; i < 4; i++)
+        {
+            const XMFLOAT3X4& joint = palette[std::min(joints[i], jointCount - 1)];
+            const XMVECTOR w = XMVectorReplicate(weights[i]);
+            r0 = XMVectorMultiplyAdd(XMLoadFloat4((const XMFLOAT4*)joint.m[0]), w, r0);
+            r1 = XMVectorMultiplyAdd(XMLoadFloat4((const XMFLOAT4*)joint.m[1]), w, r1);
+            r2 = XMVectorMultiplyAdd(XMLoadFloat4((const XMFLOAT4*)joint.m[2]), w, r2);
+        }
+
+        // The rows hold the transposed matrix; transposing back gives one for row vectors
+        const XMMATRIX m = XMMatrixTranspose(XMMATRIX(r0, r1, r2, g_XMZero));
+        const XMVECTOR position = XMVector3Transform(XMLoadFloat3(&in.Pos), m);
+        XMStoreFloat3(&o.position, position);
+        XMStoreFloat3(&o.normal, XMVector3Normalize(XMVector3TransformNormal(XMLoadFloat3(&in.Normal), m)));
+        const XMVECTOR tangent = XMVector3Normalize(XMVector3TransformNormal(XMLoadFloat4(&in.Tangent), m));
+        XMStoreFloat4(&o.tangent, XMVectorSetW(tangent, in.Tangent.w));
+        return position;
+    }
+
+    CpuSkinning::Bounds SkinSSE(const SceneVertex* vertices, size_t count, const XMFLOAT3X4* palette,
+                                unsigned int jointCount, CpuSkinning::Vertex* out)
+    {
+        if (jointCount == 0)
+            return SkinScalar(vertices, count, palette, jointCount, out);
+
+        XMVECTOR lower = XMVectorReplicate(FLT_MAX);
+        XMVECTOR upper = XMVectorReplicate(-FLT_MAX);
+        for (size_t v = 0; v < count; v++)
+        {
+            const XMVECTOR position = SkinVertexSSE(vertices[v], palette, jointCount, out[v]);
+            lower = XMVectorMin(lower, position);
+            upper = XMVectorMax(upper, position);
+        }
+
+        CpuSkinning::Bounds bounds;
+        XMStoreFloat3(&bounds.min, lower);
+        XMStoreFloat3(&bounds.max, upper);
+        return bounds;
+    }
+
+    // Two vertices per iteration, vertex a in the low 128 bit lane and b in the high one, so each lane
+    // runs the same steps as the SSE kernel
+    inline __m256 Pair(float a, float b)
+    {
+        return _mm256_set_m128(_mm_set1_ps(b), _mm_set1_ps(a));
+    }
+
+    inline __m256 Normalize3(__m256 v)
+    {
+        const __m256 length = _mm256_sqrt_ps(_mm256_dp_ps(v, v, 0x7F));
+        return _mm256_div_ps(v, _mm256_max_ps(length, _mm256_set1_ps(FLT_MIN)));
+    }
+
+    CpuSkinning::Bounds SkinAVX2(const SceneVertex* vertices, size_t count, const XMFLOAT3X4* palette,
+                                 unsigned int jointCount, CpuSkinning::Vertex* out)
+    {
+        if (jointCount == 0)
+            return SkinScalar(vertices, count, palette, jointCount, out);
+
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 identity0 = _mm256_setr_ps(1, 0, 0, 0, 1, 0, 0, 0);
+        const __m256 identity1 = _mm256_setr_ps(0, 1, 0, 0, 0, 1, 0, 0);
+        const __m256 identity2 = _mm256_setr_ps(0, 0, 1, 0, 0, 0, 1, 0);
+        __m256 lower = _mm256_set1_ps(FLT_MAX);
+        __m256 upper = _mm256_set1_ps(-FLT_MAX);
+
+        size_t v = 0;
+        for (; v + 2 <= count; v += 2)
+        {
+            const SceneVertex& a = vertices[v];
+            const SceneVertex& b = vertices[v + 1];
+
+            const __m256 identity = Pair(WeightSum(a) > 0.0f ? 0.0f : 1.0f, WeightSum(b) > 0.0f ? 0.0f : 1.0f);
+            __m256 r0 = _mm256_mul_ps(identity0, identity);
+            __m256 r1 = _mm256_mul_ps(identity1, identity);
+            __m256 r2 = _mm256_mul_ps(identity2, identity);
+
+            const uint32_t jointsA[4] = { a.Joints.x, a.Joints.y, a.Joints.z, a.Joints.w };
+            const uint32_t jointsB[4] = { b.Joints.x, b.Joints.y, b.Joints.z, b.Joints.w };
+            const float weightsA[4] = { a.Weights.x, a.Weights.y, a.Weights.z, a.Weights.w };
+            const float weightsB[4] = { b.Weights.x, b.Weights.y, b.Weights.z, b.Weights.w };
+            for (int i = 0; i < 4; i++)
+            {
+                const XMFLOAT3X4& ja = palette[std::min(jointsA[i], jointCount - 1)];
+                const XMFLOAT3X4& jb = palette[std::min(jointsB[i], jointCount - 1)];
+                const __m256 w = Pair(weightsA[i], weightsB[i]);
+                r0 = _mm256_fmadd_ps(_mm256_loadu2_m128(jb.m[0], ja.m[0]), w, r0);
+                r1 = _mm256_fmadd_ps(_mm256_loadu2_m128(jb.m[1], ja.m[1]), w, r1);
+                r2 = _mm256_fmadd_ps(_mm256_loadu2_m128(jb.m[2], ja.m[2]), w, r2);
+            }
+
+            // Transpose each lane's rows into columns c0..c3
+            const __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+            const __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+            const __m256 t2 = _mm256_unpacklo_ps(r2, zero);
+            const __m256 t3 = _mm256_unpackhi_ps(r2, zero);
+            const __m256 c0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+            const __m256 c1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+            const __m256 c2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+            const __m256 c3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+
+            auto transform = [&](const XMFLOAT3& pa, const XMFLOAT3& pb, __m256 translation)
+            {
+                __m256 result = _mm256_fmadd_ps(c2, Pair(pa.z, pb.z), translation);
+                result = _mm256_fmadd_ps(c1, Pair(pa.y, pb.y), result);
+                return _mm256_fmadd_ps(c0, Pair(pa.x, pb.x), result);
+            };
+            const __m256 position = transform(a.Pos, b.Pos, c3);
+            const __m256 normal = Normalize3(transform(a.Normal, b.Normal, zero));
+            const __m256 tangent = Normalize3(transform(XMFLOAT3(a.Tangent.x, a.Tangent.y, a.Tangent.z),
+                                                        XMFLOAT3(b.Tangent.x, b.Tangent.y, b.Tangent.z), zero));
+            lower = _mm256_min_ps(lower, position);
+            upper = _mm256_max_ps(upper, position);
+
+            XMStoreFloat3(&out[v].position, _mm256_castps256_ps128(position));
+            XMStoreFloat3(&out[v + 1].position, _mm256_extractf128_ps(position, 1));
+            XMStoreFloat3(&out[v].normal, _mm256_castps256_ps128(normal));
+            XMStoreFloat3(&out[v + 1].normal, _mm256_extractf128_ps(normal, 1));
+            XMStoreFloat4(&out[v].tangent, XMVectorSetW(_mm256_castps256_ps128(tangent), a.Tangent.w));
+            XMStoreFloat4(&out[v + 1].tangent, XMVectorSetW(_mm256_extractf128_ps(tangent, 1), b.Tangent.w));
+        }
+
+        XMVECTOR lowerXM = XMVectorMin(_mm256_castps256_ps128(lower), _mm256_extractf128_ps(lower, 1));
+        XMVECTOR upperXM = XMVectorMax(_mm256_castps256_ps128(upper), _mm256_extractf128_ps(upper, 1));
+        if (v < count)
+        {
+            const XMVECTOR position = SkinVertexSSE(vertices[v], palette, jointCount, out[v]);
+            lowerXM = XMVectorMin(lowerXM, position);
+            upperXM = XMVectorMax(upperXM, position);
+        }
+
+        CpuSkinning::Bounds bounds;
+        XMStoreFloat3(&bounds.min, lowerXM);
+        XMStoreFloat3(&bounds.max, upperXM);
+        return bounds;
+    }
+
+    void Merge(CpuSkinning::Bounds& bounds, const CpuSkinning::Bounds& other)
+    {
+        bounds.min = XMFLOAT3(std::min(bounds.min.x, other.min.x), std::min(bounds.min.y, other.min.y), std::min(bounds.min.z, other.min.z));
+        bounds.max = XMFLOAT3(std::max(bounds.max.x, other.max.x), std::max(bounds.max.y, other.max.y), std::max(bounds.max.z, other.max.z));
+    }
+}
+
+bool CpuSkinning::HasAVX2()
+{
+    static const bool supported = []()
+    {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+
+        __cpuid(info, 1);
+        const bool fma = (info[2] & (1 << 12)) != 0;
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+        // The OS has to save the YMM registers as well
+        if (!fma || !osxsave || !avx || (_xgetbv(0) & 6) != 6)
+            return false;
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    }();
+    return supported;
+}
+
+CpuSkinning::Bounds CpuSkinning::Skin(const SceneVertex* vertices, size_t count, const XMFLOAT3X4* palette,
+                                      unsigned int jointCount, Vertex* out, Kernel kernel)
+{
+    if (kernel == eBest)
+        kernel = HasAVX2() ? eAVX2 : eSSE;
+    if (kernel == eAVX2 && !HasAVX2())
+        kernel = eSSE;
+
+    switch (kernel)
+    {
+    case eScalar:   return SkinScalar(vertices, count, palette, jointCount, out);
+    case eAVX2:     return SkinAVX2(vertices, count, palette, jointCount, out);
+    default:        return SkinSSE(vertices, count, palette, jointCount, out);
+    }
+}
+
+CpuSkinning::Bounds CpuSkinning::SkinParallel(const SceneVertex* vertices, size_t count, const XMFLOAT3X4* palette,
+                                              unsigned int jointCount, Vertex* out, Kernel kernel)
+{
+    // Chunks are large enough that merging their bounds under a lock costs nothing
+    Bounds bounds = EmptyBounds();
+    std::mutex mutex;
+    JobSystem::Get().ParallelFor(count, 2048, [&](size_t begin, size_t end)
+    {
+        const Bounds chunk = Skin(vertices + begin, end - begin, palette, jointCount, out + begin, kernel);
+        std::lock_guard<std::mutex> lock(mutex);
+        Merge(bounds, chunk);
+    });
+    return bounds;
+}
+
+CpuSkinning::Bounds CpuSkinning::SkinPrimitive(const ScenePrimitive& primitive, const Skeleton& skeleton, std::vector<Vertex>& out)
+{
+    std::vector<XMFLOAT3X4> palette(skeleton.GetBoneCount());
+    skeleton.GetSkinningMatrices(palette.data(), (unsigned int)palette.size());
+
+    // Morph targets apply before skinning, as on the GPU
+    const std::vector<SceneVertex>& vertices = primitive.HasMorphTargets() ? primitive.mMorphedVertices : primitive.mVertices;
+    out.resize(vertices.size());
+    return SkinParallel(vertices.data(), vertices.size(), palette.data(), (unsigned int)palette.size(), out.data());
+}
+
+void CpuSkinning::RunBenchmark()
+{
+    constexpr size_t kTargetVertices = 4 * 1000 * 1000;
+    const wchar_t* file = L"Resources\\Fox.gltf";
+
+    tinygltf::Model model;
+    Skeleton skeleton;
+    if (!GltfUtils::LoadModel(model, file) || !skeleton.LoadFromGltf(model) || skeleton.GetAnimationCount() == 0)
+    {
+        Log::Error(L"CPU skinning benchmark: cannot load an animated skin from %s", file);
+        return;
+    }
+    skeleton.PlayAnimation(0);
+    skeleton.Update(0.5f);
+
+    // Every skinned primitive of the file, back to back
+    std::vector<SceneVertex> vertices;
+    for (const tinygltf::Mesh& mesh : model.meshes)
+    {
+        for (int p = 0; p < (int)mesh.primitives.size(); p++)
+        {
+            if (mesh.primitives[p].attributes.count("JOINTS_0") == 0)
+                continue;
+            ScenePrimitive primitive;
+            if (primitive.LoadGeometryFromGLTF(model, mesh, p, L""))
+                vertices.insert(vertices.end(), primitive.mVertices.begin(), primitive.mVertices.end());
+        }
+    }
+    if (vertices.empty())
+    {
+        Log::Error(L"CPU skinning benchmark: no skinned primitives in %s", file);
+        return;
+    }
+
+    std::vector<XMFLOAT3X4> palette(skeleton.GetBoneCount());
+    skeleton.GetSkinningMatrices(palette.data(), (unsigned int)palette.size());
+    const unsigned int jointCount = (unsigned int)palette.size();
+
+    // Repeat the mesh until the batch is big enough to time, and to be worth splitting over threads
+    const size_t copies = std::max<size_t>(1, kTargetVertices / vertices.size() / 16);
+    std::vector<SceneVertex> batch;
+    batch.reserve(vertices.size() * copies);
+    for (size_t c = 0; c < copies; c++)
+        batch.insert(batch.end(), vertices.begin(), vertices.end());
+    const size_t repeats = std::max<size_t>(1, kTargetVertices / batch.size());
+
+    std::vector<Vertex> reference(batch.size());
+    const Bounds referenceBounds = Skin(batch.data(), batch.size(), palette.data(), jointCount, reference.data(), eScalar);
+
+    struct Run
+    {
+        const wchar_t*  name;
+        Kernel          kernel;
+        bool            parallel;
+    };
+    const Run runs[] =
+    {
+        { L"scalar", eScalar, false },
+        { L"SSE", eSSE, false },
+        { L"AVX2", eAVX2, false },
+        { L"scalar, parallel", eScalar, true },
+        { L"SSE, parallel", eSSE, true },
+        { L"AVX2, parallel", eAVX2, true },
+    };
+
+    std::vector<Vertex> skinned(batch.size());
+    for (const Run& run : runs)
+    {
+        if (run.kernel == eAVX2 && !HasAVX2())
+        {
+            Log::Info(L"CPU skinning benchmark, %s: skipped, no AVX2 / FMA on this CPU", run.name);
+            continue;
+        }
+
+        Bounds bounds;
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (size_t r = 0; r < repeats; r++)
+        {
+            bounds = run.parallel ? SkinParallel(batch.data(), batch.size(), palette.data(), jointCount, skinned.data(), run.kernel)
+                                  : Skin(batch.data(), batch.size(), palette.data(), jointCount, skinned.data(), run.kernel);
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+        float maxError = 0.0f;
+        for (size_t v = 0; v < batch.size(); v++)
+        {
+            const XMVECTOR a = XMLoadFloat3(&skinned[v].position);
+            const XMVECTOR b = XMLoadFloat3(&reference[v].position);
+            const XMVECTOR na = XMLoadFloat3(&skinned[v].normal);
+            const XMVECTOR nb = XMLoadFloat3(&reference[v].normal);
+            maxError = std::max(maxError, XMVectorGetX(XMVector3Length(XMVectorSubtract(a, b))));
+            maxError = std::max(maxError, XMVectorGetX(XMVector3Length(XMVectorSubtract(na, nb))));
+        }
+
+        Log::Info(L"CPU skinning benchmark, %s, %zu vertices x %zu: %.1f M vertices/s, largest difference to scalar %.6f, "
+                  L"bounds (%.2f %.2f %.2f) - (%.2f %.2f %.2f)",
+                  run.name, batch.size(), repeats, batch.size() * repeats / seconds / 1e6, maxError,
+                  bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y, bounds.max.z);
+    }
+
+    Log::Info(L"CPU skinning benchmark: %zu vertices per Fox, reference bounds (%.2f %.2f %.2f) - (%.2f %.2f %.2f)",
+              vertices.size(), referenceBounds.min.x, referenceBounds.min.y, referenceBounds.min.z,
+              referenceBounds.max.x, referenceBounds.max.y, referenceBounds.max.z);
+}
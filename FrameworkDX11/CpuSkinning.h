@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <DirectXMath.h>
+
+#include "scenegraph.h"
+
+class Skeleton;
+
+// Linear blend skinning on the CPU, for picking, collision, bounds and rendering without a GPU.
+//
+// Does the same as the skinned vertex shader: each vertex's 3x4 joint matrices (from
+// Skeleton::GetSkinningMatrices) are blended by its weights and applied to the position, normal and
+// tangent; vertices without weights are passed through. The skinned bounding box comes out of the
+// same pass.
+//
+// Three kernels give the same results up to rounding: a scalar reference, a DirectXMath (SSE) one
+// doing one vertex at a time, and an AVX2 / FMA one doing two vertices at a time, one per 128 bit
+// lane. eBest picks AVX2 where the CPU has it.
+class CpuSkinning
+{
+public:
+    enum Kernel
+    {
+        eScalar,
+        eSSE,
+        eAVX2,
+        eBest,
+    };
+
+    struct Vertex
+    {
+        DirectX::XMFLOAT3   position;
+        DirectX::XMFLOAT3   normal;
+        DirectX::XMFLOAT4   tangent;
+    };
+
+    struct Bounds
+    {
+        DirectX::XMFLOAT3   min;
+        DirectX::XMFLOAT3   max;
+    };
+
+    // Skins count vertices into out. Returns the bounds of the skinned positions (inverted, min > max,
+    // when count is 0).
+    static Bounds Skin(const SceneVertex* vertices, size_t count, const DirectX::XMFLOAT3X4* palette,
+                       unsigned int jointCount, Vertex* out, Kernel kernel = eBest);
+
+    // The same, split into vertex chunks over the JobSystem
+    static Bounds SkinParallel(const SceneVertex* vertices, size_t count, const DirectX::XMFLOAT3X4* palette,
+                               unsigned int jointCount, Vertex* out, Kernel kernel = eBest);
+
+    // Skins a primitive in the skeleton's current pose (mesh space, as the GPU path)
+    static Bounds SkinPrimitive(const ScenePrimitive& primitive, const Skeleton& skeleton, std::vector<Vertex>& out);
+
+    static bool HasAVX2();
+
+    // Skins Fox.gltf with every kernel, serially and in parallel, and logs vertices per second and the
+    // largest difference to the scalar reference
+    static void RunBenchmark();
+};
@@ -127,6 +127,8 @@ typedef public std::unique_ptr<void, handle_closer> ScopedHandle;
 
 inline HANDLE safe_handle( HANDLE h ) { return (h == INVALID_HANDLE_VALUE) ? 0 : h; }
 
+struct view_unmapper { void operator()(const uint8_t* p) { if (p) UnmapViewOfFile(p); } };
+
 template<UINT TNameLength>
 inline void SetDebugObjectName(_In_ ID3D11DeviceChild* resource, _In_ const char (&name)[TNameLength])
 {
@@ -140,11 +142,13 @@ inline void SetDebugObjectName(_In_ ID3D11DeviceChild* resource, _In_ const char
 
 };
 
+//--------------------------------------------------------------------------------------
+// Maps the file and validates its headers in place; bitData points into the mapping
 //--------------------------------------------------------------------------------------
 static HRESULT LoadTextureDataFromFile( _In_z_ const wchar_t* fileName,
-                                        std::unique_ptr<uint8_t[]>& ddsData,
-                                        DDS_HEADER** header,
-                                        uint8_t** bitData,
+                                        DirectX::DDS_MAPPED_FILE& ddsData,
+                                        const DDS_HEADER** header,
+                                        const uint8_t** bitData,
                                         size_t* bitSize
                                       )
 {
@@ -153,86 +157,33 @@ static HRESULT LoadTextureDataFromFile( _In_z_ const wchar_t* fileName,
         return E_POINTER;
     }
 
-    // open the file
-#if (_WIN32_WINNT >= _WIN32_WINNT_WIN8)
-    ScopedHandle hFile( safe_handle( CreateFile2( fileName,
-                                                  GENERIC_READ,
-                                                  FILE_SHARE_READ,
-                                                  OPEN_EXISTING,
-                                                  nullptr ) ) );
-#else
-    ScopedHandle hFile( safe_handle( CreateFileW( fileName,
-                                                  GENERIC_READ,
-                                                  FILE_SHARE_READ,
-                                                  nullptr,
-                                                  OPEN_EXISTING,
-                                                  FILE_ATTRIBUTE_NORMAL,
-                                                  nullptr ) ) );
-#endif
-
-    if ( !hFile )
-    {
-        return HRESULT_FROM_WIN32( GetLastError() );
-    }
-
-    // Get the file size
-    LARGE_INTEGER FileSize = { 0 };
-
-#if (_WIN32_WINNT >= _WIN32_WINNT_VISTA)
-    FILE_STANDARD_INFO fileInfo;
-    if ( !GetFileInformationByHandleEx( hFile.get(), FileStandardInfo, &fileInfo, sizeof(fileInfo) ) )
+    HRESULT hr = DirectX::MapDDSFile( fileName, &ddsData );
+    if (FAILED(hr))
     {
-        return HRESULT_FROM_WIN32( GetLastError() );
+        return hr;
     }
-    FileSize = fileInfo.EndOfFile;
-#else
-    GetFileSizeEx( hFile.get(), &FileSize );
-#endif
 
-    // File is too big for 32-bit allocation, so reject read
-    if (FileSize.HighPart > 0)
+    // File is too big for 32-bit sizes, so reject it
+    if (ddsData.size > UINT32_MAX)
     {
         return E_FAIL;
     }
 
     // Need at least enough data to fill the header and magic number to be a valid DDS
-    if (FileSize.LowPart < ( sizeof(DDS_HEADER) + sizeof(uint32_t) ) )
-    {
-        return E_FAIL;
-    }
-
-    // create enough space for the file data
-    ddsData.reset( new (std::nothrow) uint8_t[ FileSize.LowPart ] );
-    if (!ddsData)
-    {
-        return E_OUTOFMEMORY;
-    }
-
-    // read the data in
-    DWORD BytesRead = 0;
-    if (!ReadFile( hFile.get(),
-                   ddsData.get(),
-                   FileSize.LowPart,
-                   &BytesRead,
-                   nullptr
-                 ))
-    {
-        return HRESULT_FROM_WIN32( GetLastError() );
-    }
-
-    if (BytesRead < FileSize.LowPart)
+    if (ddsData.size < ( sizeof(DDS_HEADER) + sizeof(uint32_t) ) )
     {
         return E_FAIL;
     }
 
     // DDS files always start with the same magic number ("DDS ")
-    uint32_t dwMagicNumber = *( const uint32_t* )( ddsData.get() );
+    const uint8_t* data = ddsData.data.get();
+    uint32_t dwMagicNumber = *( const uint32_t* )( data );
     if (dwMagicNumber != DDS_MAGIC)
     {
         return E_FAIL;
     }
 
-    auto hdr = reinterpret_cast<DDS_HEADER*>( ddsData.get() + sizeof( uint32_t ) );
+    auto hdr = reinterpret_cast<const DDS_HEADER*>( data + sizeof( uint32_t ) );
 
     // Verify header to validate DDS file
     if (hdr->size != sizeof(DDS_HEADER) ||
@@ -247,7 +198,7 @@ static HRESULT LoadTextureDataFromFile( _In_z_ const wchar_t* fileName,
         (MAKEFOURCC( 'D', 'X', '1', '0' ) == hdr->ddspf.fourCC))
     {
         // Must be long enough for both headers and magic value
-        if (FileSize.LowPart < ( sizeof(DDS_HEADER) + sizeof(uint32_t) + sizeof(DDS_HEADER_DXT10) ) )
+        if (ddsData.size < ( sizeof(DDS_HEADER) + sizeof(uint32_t) + sizeof(DDS_HEADER_DXT10) ) )
         {
             return E_FAIL;
         }
@@ -259,8 +210,8 @@ static HRESULT LoadTextureDataFromFile( _In_z_ const wchar_t* fileName,
     *header = hdr;
     ptrdiff_t offset = sizeof( uint32_t ) + sizeof( DDS_HEADER )
                        + (bDXT10Header ? sizeof( DDS_HEADER_DXT10 ) : 0);
-    *bitData = ddsData.get() + offset;
-    *bitSize = FileSize.LowPart - offset;
+    *bitData = data + offset;
+    *bitSize = ddsData.size - offset;
 
     return S_OK;
 }
@@ -1751,11 +1702,12 @@ HRESULT DirectX::CreateDDSTextureFromFileEx( ID3D11Device* d3dDevice,
         return E_INVALIDARG;
     }
 
-    DDS_HEADER* header = nullptr;
-    uint8_t* bitData = nullptr;
+    const DDS_HEADER* header = nullptr;
+    const uint8_t* bitData = nullptr;
     size_t bitSize = 0;
 
-    std::unique_ptr<uint8_t[]> ddsData;
+    // Subresources are uploaded straight from the mapping, which stays until the texture is created
+    DDS_MAPPED_FILE ddsData;
     HRESULT hr = LoadTextureDataFromFile( fileName,
                                           ddsData,
                                           &header,
@@ -1824,3 +1776,258 @@ HRESULT DirectX::CreateDDSTextureFromFileEx( ID3D11Device* d3dDevice,
 
     return hr;
 }
+
+
+//--------------------------------------------------------------------------------------
+_Use_decl_annotations_
+HRESULT DirectX::GetDDSTextureLayout( const uint8_t* headerData,
+                                      size_t headerDataSize,
+                                      size_t fileSize,
+                                      DDS_TEXTURE_LAYOUT* layout )
+{
+    if ( !headerData || !layout )
+    {
+        return E_INVALIDARG;
+    }
+
+    if ( headerDataSize < ( sizeof(uint32_t) + sizeof(DDS_HEADER) ) ||
+         *reinterpret_cast<const uint32_t*>( headerData ) != DDS_MAGIC )
+    {
+        return E_FAIL;
+    }
+
+    auto header = reinterpret_cast<const DDS_HEADER*>( headerData + sizeof(uint32_t) );
+    if ( header->size != sizeof(DDS_HEADER) ||
+         header->ddspf.size != sizeof(DDS_PIXELFORMAT) )
+    {
+        return E_FAIL;
+    }
+
+    size_t dataOffset = sizeof(uint32_t) + sizeof(DDS_HEADER);
+    DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN;
+    size_t arraySize = 1;
+    bool isCubeMap = false;
+
+    if ((header->ddspf.flags & DDS_FOURCC) &&
+        (MAKEFOURCC( 'D', 'X', '1', '0' ) == header->ddspf.fourCC))
+    {
+        if ( headerDataSize < dataOffset + sizeof(DDS_HEADER_DXT10) )
+        {
+            return E_FAIL;
+        }
+
+        auto d3d10ext = reinterpret_cast<const DDS_HEADER_DXT10*>( headerData + dataOffset );
+        dataOffset += sizeof(DDS_HEADER_DXT10);
+
+        if ( d3d10ext->resourceDimension != D3D11_RESOURCE_DIMENSION_TEXTURE2D )
+        {
+            return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+        }
+
+        arraySize = d3d10ext->arraySize;
+        if ( arraySize == 0 )
+        {
+            return HRESULT_FROM_WIN32( ERROR_INVALID_DATA );
+        }
+
+        if ( d3d10ext->miscFlag & D3D11_RESOURCE_MISC_TEXTURECUBE )
+        {
+            arraySize *= 6;
+            isCubeMap = true;
+        }
+        format = d3d10ext->dxgiFormat;
+    }
+    else
+    {
+        if ( header->flags & DDS_HEADER_FLAGS_VOLUME )
+        {
+            return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+        }
+
+        if ( header->caps2 & DDS_CUBEMAP )
+        {
+            if ((header->caps2 & DDS_CUBEMAP_ALLFACES ) != DDS_CUBEMAP_ALLFACES)
+            {
+                return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+            }
+
+            arraySize = 6;
+            isCubeMap = true;
+        }
+        format = GetDXGIFormat( header->ddspf );
+    }
+
+    // Planar and palettized formats are left to CreateDDSTextureFromFile
+    switch ( format )
+    {
+    case DXGI_FORMAT_UNKNOWN:
+    case DXGI_FORMAT_AI44:
+    case DXGI_FORMAT_IA44:
+    case DXGI_FORMAT_P8:
+    case DXGI_FORMAT_A8P8:
+    case DXGI_FORMAT_NV12:
+    case DXGI_FORMAT_P010:
+    case DXGI_FORMAT_P016:
+    case DXGI_FORMAT_420_OPAQUE:
+    case DXGI_FORMAT_NV11:
+        return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+
+    default:
+        if ( BitsPerPixel( format ) == 0 )
+        {
+            return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+        }
+    }
+
+    const size_t mipCount = header->mipMapCount ? header->mipMapCount : 1;
+    if ( mipCount > D3D11_REQ_MIP_LEVELS ||
+         arraySize > D3D11_REQ_TEXTURE2D_ARRAY_AXIS_DIMENSION ||
+         header->width == 0 || header->height == 0 ||
+         header->width > D3D11_REQ_TEXTURE2D_U_OR_V_DIMENSION ||
+         header->height > D3D11_REQ_TEXTURE2D_U_OR_V_DIMENSION )
+    {
+        return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+    }
+
+    layout->format = format;
+    layout->width = header->width;
+    layout->height = header->height;
+    layout->mipCount = static_cast<UINT>( mipCount );
+    layout->arraySize = static_cast<UINT>( arraySize );
+    layout->isCubeMap = isCubeMap;
+    layout->dataOffset = dataOffset;
+
+    size_t sliceSize = 0;
+    size_t w = header->width;
+    size_t h = header->height;
+    for ( size_t i = 0; i < mipCount; i++ )
+    {
+        size_t numBytes = 0;
+        GetSurfaceInfo( w, h, format, &numBytes, nullptr, nullptr );
+        sliceSize += numBytes;
+        w = std::max<size_t>( w >> 1, 1 );
+        h = std::max<size_t>( h >> 1, 1 );
+    }
+    layout->sliceSize = sliceSize;
+
+    if ( dataOffset + sliceSize * arraySize > fileSize )
+    {
+        return HRESULT_FROM_WIN32( ERROR_HANDLE_EOF );
+    }
+
+    return S_OK;
+}
+
+
+//--------------------------------------------------------------------------------------
+_Use_decl_annotations_
+DDS_SUBRESOURCE_LAYOUT DirectX::GetDDSSubresourceLayout( const DDS_TEXTURE_LAYOUT& layout,
+                                                         UINT mip,
+                                                         UINT slice )
+{
+    DDS_SUBRESOURCE_LAYOUT subresource = {};
+    subresource.offset = layout.dataOffset + layout.sliceSize * slice;
+
+    size_t w = layout.width;
+    size_t h = layout.height;
+    for ( UINT i = 0; i <= mip && i < layout.mipCount; i++ )
+    {
+        size_t numBytes = 0;
+        size_t rowBytes = 0;
+        GetSurfaceInfo( w, h, layout.format, &numBytes, &rowBytes, nullptr );
+        if ( i == mip )
+        {
+            subresource.size = numBytes;
+            subresource.width = static_cast<UINT>( w );
+            subresource.height = static_cast<UINT>( h );
+            subresource.rowPitch = static_cast<UINT>( rowBytes );
+            break;
+        }
+
+        subresource.offset += numBytes;
+        w = std::max<size_t>( w >> 1, 1 );
+        h = std::max<size_t>( h >> 1, 1 );
+    }
+
+    return subresource;
+}
+
+
+//--------------------------------------------------------------------------------------
+_Use_decl_annotations_
+HRESULT DirectX::MapDDSFile( const wchar_t* fileName,
+                             DDS_MAPPED_FILE* file )
+{
+    if ( !fileName || !file )
+    {
+        return E_INVALIDARG;
+    }
+
+    file->data.reset();
+    file->size = 0;
+
+    // open the file
+#if (_WIN32_WINNT >= _WIN32_WINNT_WIN8)
+    ScopedHandle hFile( safe_handle( CreateFile2( fileName,
+                                                  GENERIC_READ,
+                                                  FILE_SHARE_READ,
+                                                  OPEN_EXISTING,
+                                                  nullptr ) ) );
+#else
+    ScopedHandle hFile( safe_handle( CreateFileW( fileName,
+                                                  GENERIC_READ,
+                                                  FILE_SHARE_READ,
+                                                  nullptr,
+                                                  OPEN_EXISTING,
+                                                  FILE_ATTRIBUTE_NORMAL,
+                                                  nullptr ) ) );
+#endif
+
+    if ( !hFile )
+    {
+        return HRESULT_FROM_WIN32( GetLastError() );
+    }
+
+    // Get the file size
+    LARGE_INTEGER FileSize = { 0 };
+
+#if (_WIN32_WINNT >= _WIN32_WINNT_VISTA)
+    FILE_STANDARD_INFO fileInfo;
+    if ( !GetFileInformationByHandleEx( hFile.get(), FileStandardInfo, &fileInfo, sizeof(fileInfo) ) )
+    {
+        return HRESULT_FROM_WIN32( GetLastError() );
+    }
+    FileSize = fileInfo.EndOfFile;
+#else
+    GetFileSizeEx( hFile.get(), &FileSize );
+#endif
+
+    // Empty files cannot be mapped, and 32-bit builds cannot map files larger than their address space
+    if ( FileSize.QuadPart <= 0 || static_cast<uint64_t>( FileSize.QuadPart ) > SIZE_MAX )
+    {
+        return E_FAIL;
+    }
+
+    ScopedHandle hMapping( CreateFileMappingW( hFile.get(),
+                                               nullptr,
+                                               PAGE_READONLY,
+                                               0,
+                                               0,
+                                               nullptr ) );
+    if ( !hMapping )
+    {
+        return HRESULT_FROM_WIN32( GetLastError() );
+    }
+
+    auto view = static_cast<const uint8_t*>( MapViewOfFile( hMapping.get(), FILE_MAP_READ, 0, 0, 0 ) );
+    if ( !view )
+    {
+        return HRESULT_FROM_WIN32( GetLastError() );
+    }
+
+    // The view keeps the file open, so both handles can be closed now
+    file->data.reset( view, view_unmapper() );
+    file->size = static_cast<size_t>( FileSize.QuadPart );
+
+    return S_OK;
+}
@@ -35,6 +35,8 @@
 #include <stdint.h>
 #pragma warning(pop)
 
+#include <memory>
+
 #if defined(_MSC_VER) && (_MSC_VER<1610) && !defined(_In_reads_)
 #define _In_reads_(exp)
 #define _Out_writes_(exp)
@@ -153,4 +155,58 @@ namespace DirectX
                                         _Outptr_opt_ ID3D11ShaderResourceView** textureView,
                                         _Out_opt_ DDS_ALPHA_MODE* alphaMode = nullptr
                                     );
+
+    // Layout queries for loaders that read a DDS file piecewise instead of in one go (TextureStreamer)
+
+    // Magic number and both headers - enough of the start of a file for GetDDSTextureLayout
+    const size_t DDS_MAX_HEADER_SIZE = 148;
+
+    struct DDS_TEXTURE_LAYOUT
+    {
+        DXGI_FORMAT format;
+        UINT        width;
+        UINT        height;
+        UINT        mipCount;
+        UINT        arraySize;      // 6 per cube
+        bool        isCubeMap;
+        size_t      dataOffset;     // where the pixel data starts in the file
+        size_t      sliceSize;      // bytes of one array slice, all its mips
+    };
+
+    struct DDS_SUBRESOURCE_LAYOUT
+    {
+        size_t      offset;         // from the start of the file
+        size_t      size;
+        UINT        width;
+        UINT        height;
+        UINT        rowPitch;
+    };
+
+    // 2D textures and cube maps only, anything else is ERROR_NOT_SUPPORTED. headerData is the start
+    // of the file (DDS_MAX_HEADER_SIZE bytes, or the whole file if it is shorter); fileSize is checked
+    // against the size the layout needs.
+    HRESULT GetDDSTextureLayout( _In_reads_bytes_(headerDataSize) const uint8_t* headerData,
+                                 _In_ size_t headerDataSize,
+                                 _In_ size_t fileSize,
+                                 _Out_ DDS_TEXTURE_LAYOUT* layout
+                               );
+
+    // Where mip of array slice lives in the file
+    DDS_SUBRESOURCE_LAYOUT GetDDSSubresourceLayout( _In_ const DDS_TEXTURE_LAYOUT& layout,
+                                                    _In_ UINT mip,
+                                                    _In_ UINT slice
+                                                  );
+
+    // A file mapped read-only into the address space. Pages are read in on first touch and are
+    // backed by the file itself, so nothing is copied or committed; the view is unmapped when the
+    // last copy of data goes.
+    struct DDS_MAPPED_FILE
+    {
+        std::shared_ptr<const uint8_t>  data;
+        size_t                          size = 0;
+    };
+
+    HRESULT MapDDSFile( _In_z_ const wchar_t* fileName,
+                        _Out_ DDS_MAPPED_FILE* file
+                      );
 }
\ No newline at end of file
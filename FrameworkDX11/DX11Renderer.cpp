@@ -1,5 +1,10 @@
 #include "DX11Renderer.h"
 #include "Scene.h"
+#include "CpuSkinning.h"
+#include "BlendTree.h"
+#include "TextureFormats.h"
+#include "ColorConversion.h"
+#include "utils.hpp"
 
 #include "imgui/imgui.h"
 #include "imgui/imgui_impl_win32.h"
@@ -7,15 +12,25 @@
 #include "d3dcompiler.h"
 #include <iostream>
 
-// TRUE - PBR Rendering / FALSE - Animation Rendering
-constexpr bool PBR_MODE = TRUE;
-
 #pragma region Class lifetime
 
 HRESULT DX11Renderer::init(HWND hwnd)
 {
     initDevice(hwnd);
 
+    m_stateTracker.Init(m_pImmediateContext.Get(), m_pImmediateContext1.Get());
+    m_stateObjectCache.Init(m_pd3dDevice.Get());
+
+    if (FAILED(m_cbRing.Create(m_pd3dDevice.Get(), m_pImmediateContext1.Get())))
+        return E_FAIL;
+    if (FAILED(m_paletteRing.Create(m_pd3dDevice.Get())))
+        return E_FAIL;
+    if (FAILED(m_textureStreamer.Init(m_pd3dDevice.Get(), m_pImmediateContext.Get())))
+        return E_FAIL;
+    m_assets.Init(m_pd3dDevice.Get(), &m_textureStreamer);
+    if (FAILED(m_materials.Init(m_pd3dDevice.Get(), &m_assets, &m_textureCooker, &m_texturePacking)))
+        return E_FAIL;
+
     m_pScene = new Scene;
     m_pScene->init(hwnd, m_pd3dDevice, m_pImmediateContext, this);
 
@@ -27,15 +42,7 @@ HRESULT DX11Renderer::init(HWND hwnd)
     XMStoreFloat4x4(&m_matProjection, XMMatrixPerspectiveFovLH(fovAngleY, width / (FLOAT)height, 0.01f, 100.0f));
 
     initIMGUI(hwnd);
-    HRESULT hr;
-    // Compile the vertex shader
-    ID3DBlob* pVSBlob = nullptr;
-    if constexpr (PBR_MODE) 
-        hr = DX11Renderer::compileShaderFromFile(L"shader_me.hlsl", "VS", "vs_4_0", &pVSBlob);
-    else
-        hr = DX11Renderer::compileShaderFromFile(L"skinned_shader.hlsl", "VS", "vs_4_0", &pVSBlob);
-    
-
+    HRESULT hr = initShaders();
     if (FAILED(hr))
     {
         MessageBox(nullptr,
@@ -43,13 +50,28 @@ HRESULT DX11Renderer::init(HWND hwnd)
         return hr;
     }
 
-    // Create the vertex shader
-    hr = m_pd3dDevice->CreateVertexShader(pVSBlob->GetBufferPointer(), pVSBlob->GetBufferSize(), nullptr, &m_pVertexShader);
-    if (FAILED(hr))
-    {
-        pVSBlob->Release();
-        return hr;
-    }
+    return hr;
+}
+
+HRESULT DX11Renderer::initShaders()
+{
+    // Every variant the renderer can switch between at runtime. Only the pixel shader of the skinned
+    // programs takes MAX_LIGHTS, so both share one vertex shader.
+    const ShaderCache::Handle pbrVS = m_shaderCache.Add({ L"shader_me.hlsl", "VS", "vs_5_0", {} });
+    const ShaderCache::Handle pbrPS = m_shaderCache.Add({ L"shader_me.hlsl", "PS_PBR", "ps_5_0", {} });
+    const ShaderCache::Handle skinnedVS = m_shaderCache.Add({ L"skinned_shader.hlsl", "VS", "vs_5_0", {} });
+    const ShaderCache::Handle skinnedPS1 = m_shaderCache.Add({ L"skinned_shader.hlsl", "PS", "ps_4_0", { { "MAX_LIGHTS", "1" } } });
+    const ShaderCache::Handle skinnedPS4 = m_shaderCache.Add({ L"skinned_shader.hlsl", "PS", "ps_4_0", { { "MAX_LIGHTS", "4" } } });
+    const ShaderCache::Handle solidPS = m_shaderCache.Add({ L"shader_me.hlsl", "PSSolid", "ps_5_0", {} });
+
+    m_shaderPrograms.clear();
+    m_shaderPrograms.push_back({ "PBR (clustered lights)", pbrVS, pbrPS });
+    m_shaderPrograms.push_back({ "Skinned, 1 light", skinnedVS, skinnedPS1 });
+    m_shaderPrograms.push_back({ "Skinned, 4 lights", skinnedVS, skinnedPS4 });
+
+    // Loads whatever is cached on disk and compiles the rest in parallel. A failed variant is only
+    // unavailable, the others can still be used.
+    m_shaderCache.Build();
 
     // Define the input layout
     D3D11_INPUT_ELEMENT_DESC layout[] =
@@ -64,57 +86,48 @@ HRESULT DX11Renderer::init(HWND hwnd)
 
     UINT numElements = ARRAYSIZE(layout);
 
-    // Create the input layout
-    hr = m_pd3dDevice->CreateInputLayout(layout, numElements, pVSBlob->GetBufferPointer(),
-        pVSBlob->GetBufferSize(), &m_pVertexLayout);
-    pVSBlob->Release();
-    if (FAILED(hr))
-        return hr;
-
-    // Set the input layout
-    m_pImmediateContext->IASetInputLayout(m_pVertexLayout.Get());
-
-    // Compile the pixel shader
-    ID3DBlob* pPSBlob = nullptr;
-
-    if constexpr (PBR_MODE)
-        hr = DX11Renderer::compileShaderFromFile(L"shader_me.hlsl", "PS_PBR", "ps_4_0", &pPSBlob);
-    else
-        hr = DX11Renderer::compileShaderFromFile(L"skinned_shader.hlsl", "PS", "ps_4_0", &pPSBlob);
-
-
-    if (FAILED(hr))
+    for (ShaderProgram& program : m_shaderPrograms)
     {
-        MessageBox(nullptr,
-            L"The FX file cannot be compiled.  Please run this executable from the directory that contains the FX file.", L"Error", MB_OK);
-        return hr;
+        const std::vector<uint8_t>* vsBytecode = m_shaderCache.GetBytecode(program.vs);
+        const std::vector<uint8_t>* psBytecode = m_shaderCache.GetBytecode(program.ps);
+        if (!vsBytecode || !psBytecode)
+            continue;
+
+        // The input layout is validated against the vertex shader it was created with, so one per program
+        if (FAILED(m_pd3dDevice->CreateVertexShader(vsBytecode->data(), vsBytecode->size(), nullptr, &program.vertexShader)) ||
+            FAILED(m_pd3dDevice->CreateInputLayout(layout, numElements, vsBytecode->data(), vsBytecode->size(), &program.vertexLayout)) ||
+            FAILED(m_pd3dDevice->CreatePixelShader(psBytecode->data(), psBytecode->size(), nullptr, &program.pixelShader)))
+        {
+            program.vertexShader.Reset();
+            program.vertexLayout.Reset();
+            program.pixelShader.Reset();
+        }
     }
 
-    // Create the pixel shader
-    hr = m_pd3dDevice->CreatePixelShader(pPSBlob->GetBufferPointer(), pPSBlob->GetBufferSize(), nullptr, &m_pPixelShader);
-    pPSBlob->Release();
+    const std::vector<uint8_t>* solidBytecode = m_shaderCache.GetBytecode(solidPS);
+    if (!solidBytecode)
+        return E_FAIL;
+    HRESULT hr = m_pd3dDevice->CreatePixelShader(solidBytecode->data(), solidBytecode->size(), nullptr, &m_pPixelSolidShader);
     if (FAILED(hr))
         return hr;
 
-    // Compile the pixel shader
-    pPSBlob = nullptr;
+    return selectShaderProgram(0) ? S_OK : E_FAIL;
+}
 
-    hr = DX11Renderer::compileShaderFromFile(L"shader_me.hlsl", "PSSolid", "ps_4_0", &pPSBlob);
-    
-    if (FAILED(hr))
-    {
-        MessageBox(nullptr,
-            L"The FX file cannot be compiled.  Please run this executable from the directory that contains the FX file.", L"Error", MB_OK);
-        return hr;
-    }
+bool DX11Renderer::selectShaderProgram(int index)
+{
+    if (index < 0 || index >= (int)m_shaderPrograms.size() || !m_shaderPrograms[index].pixelShader)
+        return false;
 
-    // Create the pixel shader
-    hr = m_pd3dDevice->CreatePixelShader(pPSBlob->GetBufferPointer(), pPSBlob->GetBufferSize(), nullptr, &m_pPixelSolidShader);
-    pPSBlob->Release();
-    if (FAILED(hr))
-        return hr;
+    const ShaderProgram& program = m_shaderPrograms[index];
+    m_pVertexShader = program.vertexShader;
+    m_pPixelShader = program.pixelShader;
+    m_pVertexLayout = program.vertexLayout;
+    m_activeShaderProgram = index;
 
-    return hr;
+    // Set the input layout
+    m_stateTracker.IASetInputLayout(m_pVertexLayout.Get());
+    return true;
 }
 
 HRESULT DX11Renderer::initDevice(HWND hwnd)
@@ -323,15 +336,25 @@ HRESULT DX11Renderer::initDevice(HWND hwnd)
 
 void DX11Renderer::cleanUp()
 {
+    // The scene goes first, so the assets it holds are freed while their owners still exist
+    m_pScene->cleanUp();
+    delete m_pScene;
+    m_pScene = nullptr;
+
+    m_cbRing.Release();
+    m_paletteRing.Release();
+    m_materials.Release();
+    m_textureStreamer.Release();
+    m_assets.Release();
+    m_stateObjectCache.Clear();
+    m_shaderPrograms.clear();
+
     cleanupDevice();
+    m_stateTracker.Invalidate();
 
     ImGui_ImplDX11_Shutdown();
     ImGui_ImplWin32_Shutdown();
     ImGui::DestroyContext();
-
-
-    m_pScene->cleanUp();
-    delete m_pScene;
 }
 
 void DX11Renderer::cleanupDevice()
@@ -364,39 +387,6 @@ void DX11Renderer::cleanupDevice()
 //
 // With VS 11, we could load up prebuilt .cso files instead...
 //--------------------------------------------------------------------------------------
-HRESULT DX11Renderer::compileShaderFromFile(const WCHAR* szFileName, LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3DBlob** ppBlobOut)
-{
-    HRESULT hr = S_OK;
-
-    DWORD dwShaderFlags = D3DCOMPILE_ENABLE_STRICTNESS;
-#ifdef _DEBUG
-    // Set the D3DCOMPILE_DEBUG flag to embed debug information in the shaders.
-    // Setting this flag improves the shader debugging experience, but still allows 
-    // the shaders to be optimized and to run exactly the way they will run in 
-    // the release configuration of this program.
-    dwShaderFlags |= D3DCOMPILE_DEBUG;
-
-    // Disable optimizations to improve shader debugging
-    dwShaderFlags |= D3DCOMPILE_SKIP_OPTIMIZATION;
-#endif
-
-    ID3DBlob* pErrorBlob = nullptr;
-    hr = D3DCompileFromFile(szFileName, nullptr, nullptr, szEntryPoint, szShaderModel,
-        dwShaderFlags, 0, ppBlobOut, &pErrorBlob);
-    if (FAILED(hr))
-    {
-        if (pErrorBlob)
-        {
-            OutputDebugStringA(reinterpret_cast<const char*>(pErrorBlob->GetBufferPointer()));
-            pErrorBlob->Release();
-        }
-        return hr;
-    }
-    if (pErrorBlob) pErrorBlob->Release();
-
-    return S_OK;
-}
-
 void DX11Renderer::initIMGUI(HWND hwnd)
 {
     // Setup Dear ImGui context
@@ -553,6 +543,70 @@ void DX11Renderer::startIMGUIDraw(const unsigned int FPS)
 	ImGui::Text("Use WASD to move, RMB to look");
 	ImGui::Text("Press M to change texture");
 	ImGui::Text("Texture Index: %d", m_pScene->textureIndex);
+	ImGui::Text("CB upload: %llu bytes/frame (%llu skipped, legacy path %llu)",
+		m_cbStatsLastFrame.bytesUploaded, m_cbStatsLastFrame.bytesSkipped, m_cbStatsLastFrame.legacyBytes);
+	ImGui::Text("CB ring: %s, %u wraps", m_cbRing.IsSubAllocating() ? "no-overwrite" : "discard fallback", m_cbStatsLastFrame.ringWraps);
+	ImGui::Text("Palette ring: %s, %u matrices", m_paletteRing.IsAppending() ? "no-overwrite" : "discard per batch", m_paletteRing.GetCapacity());
+	ImGui::Text("State binds: %u issued, %u filtered", m_stateCountersLastFrame.issued, m_stateCountersLastFrame.filtered);
+	ImGui::Text("State objects: %zu (%u cache hits)", m_stateObjectCache.GetObjectCount(), m_stateObjectCache.GetHits());
+	ImGui::Text("Materials: %zu, %u binds (%u texture sets) for %u draws", m_materials.GetCount(),
+		m_materialBindsLastFrame, m_textureBindsLastFrame, m_materialBindsLastFrame + m_materialSkipsLastFrame);
+	const TextureStreamer::Stats textureStats = m_textureStreamer.GetStats();
+	ImGui::Text("Textures: %u/%u at full quality, %.1f MB resident, %.1f MB read, %u levels streamed",
+		textureStats.fullyResident, textureStats.textures, textureStats.residentBytes / (1024.0 * 1024.0),
+		textureStats.bytesRead / (1024.0 * 1024.0), textureStats.levelsStreamed);
+	ImGui::Text("Texture streaming: %.1f ms loading, first frame at %.1f ms, full quality at %.1f ms",
+		textureStats.loadMs, textureStats.firstFrameMs, textureStats.fullQualityMs);
+	ImGui::Text("Texture residency: %.1f MB streamed, %u levels evicted, %u textures held back by the budget",
+		textureStats.bytesStreamed / (1024.0 * 1024.0), textureStats.levelsEvicted, textureStats.deferred);
+	const AssetRegistry::Stats assetStats = m_assets.GetStats();
+	ImGui::Text("Assets: %u live, %u loads, %u hits (%u waited on a load, %u by content), %u released, %u key collisions",
+		assetStats.live, assetStats.loads, assetStats.hits, assetStats.coalesced, assetStats.contentMatches, assetStats.released,
+		assetStats.collisions);
+	const TextureCooker::Stats& cookerStats = m_textureCooker.GetStats();
+	ImGui::Text("Cooked textures: %u encoded, %u from the cache in %.1f ms, %.1f MB -> %.1f MB",
+		cookerStats.cooked, cookerStats.cacheHits, cookerStats.cookMs,
+		cookerStats.sourceBytes / (1024.0 * 1024.0), cookerStats.cookedBytes / (1024.0 * 1024.0));
+	int textureBudgetMB = (int)(m_textureStreamer.GetSettings().budgetBytes >> 20);
+	if (ImGui::SliderInt("Texture budget (MB, 0 = none)", &textureBudgetMB, 0, 256))
+		m_textureStreamer.GetSettings().budgetBytes = (uint64_t)textureBudgetMB << 20;
+	if (ImGui::CollapsingHeader("Texture residency"))
+	{
+		for (TextureStreamer::Handle texture = 0; texture < (TextureStreamer::Handle)m_textureStreamer.GetCount(); texture++)
+		{
+			if (!m_textureStreamer.IsLoaded(texture))
+				continue;
+			const UINT requiredMip = m_textureStreamer.GetRequiredMip(texture);
+			char required[16] = "-";
+			if (requiredMip != ~0u)
+				sprintf_s(required, "%u", requiredMip);
+			ImGui::Text("%s: mip %u of %u resident (needs %s), %.1f KB", Utils::WstringToString(m_textureStreamer.GetFile(texture)).c_str(),
+				m_textureStreamer.GetResidentMip(texture), m_textureStreamer.GetMipCount(texture), required,
+				m_textureStreamer.GetResidentBytes(texture) / 1024.0);
+		}
+	}
+	ImGui::Text("Shaders: %zu variants, %u from disk cache, %u compiled (%.1f ms)", m_shaderCache.GetCount(),
+		m_shaderCache.GetStats().diskHits, m_shaderCache.GetStats().compiled, m_shaderCache.GetStats().buildMs);
+	if (ImGui::BeginCombo("Shader", m_shaderPrograms[m_activeShaderProgram].name))
+	{
+		for (int i = 0; i < (int)m_shaderPrograms.size(); i++)
+		{
+			const bool available = m_shaderPrograms[i].pixelShader != nullptr;
+			if (ImGui::Selectable(m_shaderPrograms[i].name, i == m_activeShaderProgram, available ? 0 : ImGuiSelectableFlags_Disabled))
+				selectShaderProgram(i);
+		}
+		ImGui::EndCombo();
+	}
+
+	const ClusteredLighting::Stats& clusterStats = m_pScene->m_clusteredLighting.GetStats();
+	ImGui::Text("Clusters: %u/%u lights visible, %u indices, max %u per cluster (%u dropped), %.3f ms",
+		clusterStats.visibleLights, clusterStats.lightCount, clusterStats.indexCount,
+		clusterStats.maxPerCluster, clusterStats.overflows, clusterStats.assignMs);
+	bool clusterThreads = m_pScene->m_clusteredLighting.IsMultithreaded();
+	if (ImGui::Checkbox("Multithreaded light assignment", &clusterThreads))
+	{
+		m_pScene->m_clusteredLighting.SetMultithreaded(clusterThreads);
+	}
 	
     if (m_pScene->getCamera()) {
         XMFLOAT3 camPos = m_pScene->getCamera()->getPosition();
@@ -654,38 +708,159 @@ void DX11Renderer::startIMGUIDraw(const unsigned int FPS)
     }
     ImGui::End();
 
+    ImGui::Begin("Animation");
+    int crowdSize = m_pScene->getCrowdSize();
+    if (ImGui::SliderInt("Crowd size", &crowdSize, 0, 2000))
+    {
+        m_pScene->setCrowdSize(crowdSize);
+    }
+    bool crowdBaked = m_pScene->isCrowdBaked();
+    if (ImGui::Checkbox("Baked palettes", &crowdBaked))
+    {
+        m_pScene->setCrowdBaked(crowdBaked);
+    }
+    AnimationScheduler::Settings& animationSettings = m_pScene->m_animationScheduler.GetSettings();
+    ImGui::Checkbox("Parallel update", &animationSettings.parallel);
+    ImGui::Checkbox("Update rate LOD", &animationSettings.lod);
+    ImGui::Checkbox("Adapt LOD to budget", &animationSettings.adaptive);
+    ImGui::SliderFloat("Budget (ms)", &animationSettings.budgetMs, 0.25f, 8.0f, "%.2f");
+    const AnimationScheduler::Stats& animationStats = m_pScene->m_animationScheduler.GetStats();
+    ImGui::Text("%u skeletons, %u posed this frame, %.3f ms", animationStats.instances, animationStats.evaluated, animationStats.updateMs);
+    ImGui::Text("Every 1/2/4/8 frames: %u/%u/%u/%u, LOD bias %.2f", animationStats.perInterval[0], animationStats.perInterval[1],
+                animationStats.perInterval[2], animationStats.perInterval[3], animationStats.lodBias);
+    ImGui::End();
+
     ImGui::Begin("Window B");
     if (ImGui::Button("add light")) 
     {
-        if (m_pScene->lightCount + 1 < MAX_LIGHTS) {
-            m_pScene->m_lightProperties.Lights[m_pScene->lightCount].Enabled = true;
-            m_pScene->lightCount++;
+        // New lights start as a copy of the last one
+        Light light;
+        if (!m_pScene->m_lights.empty()) {
+            light = m_pScene->m_lights.back();
         }
+        light.Enabled = true;
+        m_pScene->addLight(light);
     }
     ImGui::SameLine();
     if (ImGui::Button("minus light"))
     {
-        if (m_pScene->lightCount > 0) {
-            m_pScene->m_lightProperties.Lights[m_pScene->lightCount].Enabled = false;
-            m_pScene->lightCount--;
-        }
+        m_pScene->removeLight();
     }
-    for (int x = 0; x < MAX_LIGHTS; x++)
+    ImGui::SameLine();
+    if (ImGui::Button("add 100 random lights"))
+    {
+        m_pScene->addRandomLights(100);
+    }
+    ImGui::Text("%zu lights", m_pScene->m_lights.size());
+    // Editing thousands of lights one by one isn't useful, only list the first few
+    const int listedLights = std::min((int)m_pScene->m_lights.size(), 32);
+    for (int x = 0; x < listedLights; x++)
     {
-        if (!m_pScene->m_lightProperties.Lights[x].Enabled) continue;
         std::string objName = "Light " + std::to_string(x);
         if (ImGui::CollapsingHeader(objName.c_str()))
         {
-            XMFLOAT4 objPos = m_pScene->m_lightProperties.Lights[x].Position;
+            XMFLOAT4 objPos = m_pScene->m_lights[x].Position;
 
 
             if (ImGui::DragFloat3(("LPosition##" + std::to_string(x)).c_str(), &objPos.x, 0.1f)) {
-                m_pScene->m_lightProperties.Lights[x].Position = objPos;
+                m_pScene->m_lights[x].Position = objPos;
             }
         }
     }
     ImGui::End();
 
+    ImGui::Begin("Benchmarks");
+    if (ImGui::Button("Clustered light assignment"))
+    {
+        ClusteredLighting::RunBenchmark();
+    }
+    if (ImGui::Button("Skeleton pose evaluation"))
+    {
+        Skeleton::RunBenchmark();
+    }
+    if (ImGui::Button("Keyframe sampling"))
+    {
+        Skeleton::RunSamplingBenchmark();
+    }
+    if (ImGui::Button("Animation compression"))
+    {
+        Skeleton::RunCompressionBenchmark();
+    }
+    if (ImGui::Button("Crowd animation"))
+    {
+        AnimationScheduler::RunBenchmark();
+    }
+    if (ImGui::Button("Baked animation palettes"))
+    {
+        BakedAnimation::RunBenchmark();
+    }
+    if (ImGui::Button("CPU skinning"))
+    {
+        CpuSkinning::RunBenchmark();
+    }
+    if (ImGui::Button("Morph targets"))
+    {
+        MorphTargets::RunBenchmark();
+    }
+    if (ImGui::Button("Node animation"))
+    {
+        NodeAnimator::RunBenchmark();
+    }
+    if (ImGui::Button("Blend tree"))
+    {
+        BlendTree::RunBenchmark();
+    }
+    if (ImGui::Button("Shader cache self test"))
+    {
+        ShaderCache::RunSelfTest();
+    }
+    if (ImGui::Button("Asset registry self test"))
+    {
+        AssetRegistry::RunSelfTest(m_pd3dDevice.Get(), m_pImmediateContext.Get());
+    }
+    if (ImGui::Button("DDS loading"))
+    {
+        TextureStreamer::RunLoadBenchmark(m_pd3dDevice.Get());
+    }
+    if (ImGui::Button("Texture cooker self test"))
+    {
+        TextureCooker::RunSelfTest();
+    }
+    if (ImGui::Button("Texture cooking"))
+    {
+        TextureCooker::RunBenchmark();
+    }
+    if (ImGui::Button("Mip generator self test"))
+    {
+        MipGenerator::RunSelfTest();
+    }
+    if (ImGui::Button("Mip generation"))
+    {
+        MipGenerator::RunBenchmark();
+    }
+    if (ImGui::Button("Texture formats self test"))
+    {
+        TextureFormats::RunSelfTest();
+    }
+    if (ImGui::Button("Color conversion self test"))
+    {
+        ColorConversion::RunSelfTest();
+    }
+    if (ImGui::Button("Color conversion"))
+    {
+        ColorConversion::RunBenchmark();
+    }
+    if (ImGui::Button("Texture packer self test"))
+    {
+        TexturePacker::RunSelfTest();
+    }
+    if (ImGui::Button("Texture packing"))
+    {
+        TexturePacker::RunBenchmark();
+    }
+    ImGui::Text("Results are written to the log");
+    ImGui::End();
+
     ImGui::Spacing();
 
     // example usage
@@ -721,6 +896,18 @@ void DX11Renderer::update(const float deltaTime)
         frameCounter = 0;
     }
 
+    m_cbStatsLastFrame = m_cbStats;
+    m_cbStats.Reset();
+    m_stateCountersLastFrame = m_stateTracker.GetCounters();
+    m_stateTracker.ResetCounters();
+    m_materialBindsLastFrame = m_materials.GetBindCount();
+    m_materialSkipsLastFrame = m_materials.GetSkippedBindCount();
+    m_textureBindsLastFrame = m_materials.GetTextureBindCount();
+    m_materials.ResetCounters();
+
+    // Levels read since last frame go in before anything samples the textures
+    m_textureStreamer.Update();
+
     startIMGUIDraw(FPS);
 
     // Clear the back buffer
@@ -732,8 +919,8 @@ void DX11Renderer::update(const float deltaTime)
     m_pImmediateContext->ClearDepthStencilView(m_pDepthStencilView.Get(), D3D11_CLEAR_DEPTH, 1.0f, 0);
 
 
-    m_pImmediateContext->VSSetShader(m_pVertexShader.Get(), nullptr, 0);
-    m_pImmediateContext->PSSetShader(m_pPixelShader.Get(), nullptr, 0);
+    m_stateTracker.VSSetShader(m_pVertexShader.Get());
+    m_stateTracker.PSSetShader(m_pPixelShader.Get());
 
 
     m_pScene->update(deltaTime);
@@ -743,4 +930,5 @@ void DX11Renderer::update(const float deltaTime)
 
     // Present our back buffer to our front buffer
     m_pSwapChain->Present(0, 0);
+    m_textureStreamer.MarkFirstFrame();     // only the first call counts
 }
\ No newline at end of file
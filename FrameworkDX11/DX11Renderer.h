@@ -20,6 +20,14 @@
 #include "Camera.h"
 #include "wrl.h"
 #include "structures.h"
+#include "ConstantBuffers.h"
+#include "PaletteRing.h"
+#include "RenderStateTracker.h"
+#include "Material.h"
+#include "ShaderCache.h"
+#include "TextureStreamer.h"
+#include "AssetRegistry.h"
+#include "TextureCooker.h"
 #include <vector>
 #include <d3d11_1.h>
 #include "imgui/imgui_impl_dx11.h"
@@ -31,6 +39,17 @@ struct ImGuiParameterState
 	int selected_radio;
 };
 
+// A vertex + pixel shader pair from the shader cache, selectable at runtime
+struct ShaderProgram
+{
+	const char*			name;
+	ShaderCache::Handle	vs;
+	ShaderCache::Handle	ps;
+	Microsoft::WRL::ComPtr <ID3D11VertexShader>	vertexShader;
+	Microsoft::WRL::ComPtr <ID3D11PixelShader>	pixelShader;
+	Microsoft::WRL::ComPtr <ID3D11InputLayout>	vertexLayout;
+};
+
 class DX11Renderer
 {
 public:
@@ -42,13 +61,14 @@ public:
 
 	void	update(const float deltaTime);
 
-	// a helper method - todo: move to a unique class to reduce dependency on Renderer
-	static HRESULT compileShaderFromFile(const WCHAR* szFileName, LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3DBlob** ppBlobOut);
+	// Switches the scene to one of m_shaderPrograms, false if it failed to compile
+	bool	selectShaderProgram(int index);
 
 	void input(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
 
 private: // methods
 	HRESULT initDevice(HWND hwnd);
+	HRESULT initShaders();
 	void    cleanupDevice();
 	void	initIMGUI(HWND hwnd);
 	void	startIMGUIDraw(const unsigned int FPS);
@@ -75,9 +95,41 @@ public: // properties
 	Microsoft::WRL::ComPtr <ID3D11PixelShader>		m_pPixelSolidShader;
 	Microsoft::WRL::ComPtr <ID3D11InputLayout>		m_pVertexLayout;
 
+	// Shader variants are built through the cache; the members above point at the active program
+	ShaderCache					m_shaderCache;
+	std::vector<ShaderProgram>	m_shaderPrograms;
+	int							m_activeShaderProgram = 0;
+
 	XMFLOAT4X4				m_matProjection;
-	//ConstantBuffer			m_ConstantBufferData;
-	ConstantBufferSwitch	m_ConstantBufferDataSwitch;
+
+	// Per-draw constants are sub-allocated from this ring; the stats feed the debug UI
+	ConstantBufferRing		m_cbRing;
+	PaletteRing				m_paletteRing;		// skinning palettes, appended per skinned scene
+	ConstantBufferStats		m_cbStats;
+	ConstantBufferStats		m_cbStatsLastFrame;
+
+	// All scene binds go through the tracker so redundant ones are dropped; states are shared through the cache
+	RenderStateTracker		m_stateTracker;
+	RenderStateCounters		m_stateCountersLastFrame;
+	StateObjectCache		m_stateObjectCache;
+
+	// DDS textures come in mip tail first; the larger levels are swapped in as they are read
+	TextureStreamer			m_textureStreamer;
+
+	// Textures, glTF images and geometry loaded once and shared by reference
+	AssetRegistry			m_assets;
+
+	// glTF images are block compressed by role on first use and the results cached on disk
+	TextureCooker			m_textureCooker;
+
+	// glTF material maps are packed into texture arrays and atlases per model
+	TexturePacker::Settings	m_texturePacking;
+
+	// Materials are shared by all scene graphs and referenced by handle
+	MaterialLibrary			m_materials;
+	UINT					m_materialBindsLastFrame = 0;
+	UINT					m_materialSkipsLastFrame = 0;
+	UINT					m_textureBindsLastFrame = 0;
 
 
 	Scene* m_pScene;
@@ -0,0 +1,115 @@
+#include "JobSystem.h"
+
+#include <algorithm>
+
+JobSystem::JobSystem(unsigned int workerCount)
+{
+	if (workerCount == 0)
+	{
+		const unsigned int hardwareThreads = std::thread::hardware_concurrency();
+		workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+	}
+
+	m_workers.reserve(workerCount);
+	for (unsigned int i = 0; i < workerCount; i++)
+		m_workers.emplace_back(&JobSystem::WorkerLoop, this);
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+
+	for (auto& worker : m_workers)
+		worker.join();
+}
+
+JobSystem& JobSystem::Get()
+{
+	static JobSystem instance;
+	return instance;
+}
+
+void JobSystem::Enqueue(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queue.push_back(std::move(task));
+	}
+	m_wake.notify_one();
+}
+
+void JobSystem::WorkerLoop()
+{
+	for (;;)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+			if (m_stop && m_queue.empty())
+				return;
+			task = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+		task();
+	}
+}
+
+void JobSystem::ParallelFor(size_t count, size_t minChunk, const std::function<void(size_t, size_t)>& fn)
+{
+	if (count == 0)
+		return;
+
+	// A few chunks per thread keeps the load balanced when items take uneven time
+	const size_t threads = m_workers.size() + 1;
+	const size_t chunkSize = std::max<size_t>(std::max<size_t>(minChunk, 1), (count + threads * 4 - 1) / (threads * 4));
+	const size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+	if (chunkCount == 1)
+	{
+		fn(0, count);
+		return;
+	}
+
+	struct Shared
+	{
+		std::atomic<size_t>		next{ 0 };
+		std::atomic<size_t>		done{ 0 };
+		std::mutex				mutex;
+		std::condition_variable	finished;
+	};
+	auto shared = std::make_shared<Shared>();
+
+	// Grabs chunks until there are none left; run by the helpers and the calling thread alike
+	auto work = [shared, &fn, count, chunkSize, chunkCount]()
+	{
+		for (;;)
+		{
+			const size_t chunk = shared->next.fetch_add(1);
+			if (chunk >= chunkCount)
+				return;
+
+			const size_t begin = chunk * chunkSize;
+			fn(begin, std::min(begin + chunkSize, count));
+
+			if (shared->done.fetch_add(1) + 1 == chunkCount)
+			{
+				std::lock_guard<std::mutex> lock(shared->mutex);
+				shared->finished.notify_all();
+			}
+		}
+	};
+
+	// Helpers that start after everything is claimed return immediately without touching fn
+	const size_t helpers = std::min(chunkCount - 1, m_workers.size());
+	for (size_t i = 0; i < helpers; i++)
+		Enqueue(work);
+
+	work();
+
+	std::unique_lock<std::mutex> lock(shared->mutex);
+	shared->finished.wait(lock, [&]() { return shared->done.load() == chunkCount; });
+}
@@ -0,0 +1,57 @@
+// A small fixed-size thread pool.
+//
+// Submit() queues a single task and returns a future for its result. ParallelFor() splits an index
+// range into chunks, hands them to the workers and also works on them from the calling thread, so
+// it is safe to call from inside another job (it never waits on work nobody will pick up).
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class JobSystem
+{
+public:
+	// 0 = one worker per hardware thread, minus the calling thread
+	explicit JobSystem(unsigned int workerCount = 0);
+	~JobSystem();
+
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator = (const JobSystem&) = delete;
+
+	// Process wide pool shared by the renderer, animation and asset code
+	static JobSystem& Get();
+
+	unsigned int GetWorkerCount() const { return (unsigned int)m_workers.size(); }
+
+	template <typename F>
+	auto Submit(F&& task) -> std::future<decltype(task())>
+	{
+		using Result = decltype(task());
+		auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+		std::future<Result> future = packaged->get_future();
+		Enqueue([packaged]() { (*packaged)(); });
+		return future;
+	}
+
+	// Calls fn(begin, end) for consecutive sub-ranges of [0, count) and returns once all of them are done.
+	// minChunk bounds how finely the range is split; chunks never cross item boundaries.
+	void ParallelFor(size_t count, size_t minChunk, const std::function<void(size_t, size_t)>& fn);
+
+private:
+	void Enqueue(std::function<void()> task);
+	void WorkerLoop();
+
+	std::vector<std::thread>			m_workers;
+	std::deque<std::function<void()>>	m_queue;
+	std::mutex							m_mutex;
+	std::condition_variable				m_wake;
+	bool								m_stop = false;
+};
@@ -0,0 +1,434 @@
+#include "Material.h"
+#include "RenderStateTracker.h"
+#include "DDSTextureLoader.h"
+#include "MipGenerator.h"
+#include "TextureFormats.h"
+
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+using Microsoft::WRL::ComPtr;
+
+HRESULT MaterialLibrary::Init(ID3D11Device* device, AssetRegistry* assets, TextureCooker* cooker, const TexturePacker::Settings* packing)
+{
+	Release();
+	m_device = device;
+	m_assets = assets;
+	m_cooker = cooker;
+	m_packing = packing;
+
+	HRESULT hr = m_defaultConstants.Create(device);
+	if (FAILED(hr))
+		return hr;
+
+	Material material;
+	material.name = "default";
+	material.constants = m_defaultConstants.Get();
+	m_materials.push_back(std::move(material));
+	return S_OK;
+}
+
+void MaterialLibrary::Release()
+{
+	m_materials.clear();
+	m_defaultConstants = ConstantBuffer<CbPerMaterial>();
+	m_device.Reset();
+	m_assets = nullptr;
+	m_cooker = nullptr;
+	m_packing = nullptr;
+	m_bound = kInvalidHandle;
+	m_boundTextureSet = kInvalidHandle;
+	m_textureSetCount = 1;
+}
+
+void MaterialLibrary::SetDefaultTextures(ID3D11ShaderResourceView* const textures[kTextureSlots])
+{
+	if (m_materials.empty())
+		return;
+
+	for (UINT i = 0; i < kTextureSlots; i++)
+		m_materials[kDefaultMaterial].textures[i] = textures[i];
+	if (m_bound == kDefaultMaterial)
+		InvalidateBinding();
+}
+
+void MaterialLibrary::SetStreamedTextures(MaterialHandle handle, const TextureStreamer::Handle textures[kTextureSlots])
+{
+	if (handle >= m_materials.size())
+		return;
+
+	Material& material = m_materials[handle];
+	material.streamed = true;
+	for (UINT i = 0; i < kTextureSlots; i++)
+		material.streamedTextures[i] = textures[i];
+}
+
+const TextureStreamer::Handle* MaterialLibrary::GetStreamedTextures(MaterialHandle handle) const
+{
+	if (handle >= m_materials.size() || !m_materials[handle].streamed)
+		return nullptr;
+	return m_materials[handle].streamedTextures;
+}
+
+void MaterialLibrary::UpdateDefault(ID3D11DeviceContext* context, const CbPerMaterial& data, ConstantBufferStats* stats)
+{
+	m_defaultConstants.Update(context, data, stats);
+}
+
+MaterialHandle MaterialLibrary::Create(const std::string& name, const CbPerMaterial& data, ID3D11ShaderResourceView* const textures[kTextureSlots])
+{
+	if (!m_device)
+		return kDefaultMaterial;
+
+	D3D11_BUFFER_DESC bd = {};
+	bd.Usage = D3D11_USAGE_IMMUTABLE;
+	bd.ByteWidth = sizeof(CbPerMaterial);
+	bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	D3D11_SUBRESOURCE_DATA initData = {};
+	initData.pSysMem = &data;
+
+	Material material;
+	material.name = name;
+	if (FAILED(m_device->CreateBuffer(&bd, &initData, &material.constants)))
+	{
+		Log::Error(L"MaterialLibrary: Failed to create constant buffer for material \"%s\"", Utils::StringToWstring(name).c_str());
+		return kDefaultMaterial;
+	}
+	for (UINT i = 0; i < kTextureSlots; i++)
+		material.textures[i] = textures ? textures[i] : nullptr;
+
+	// The set of the first material with the same views, or a new one
+	material.textureSet = m_textureSetCount;
+	for (size_t other = kDefaultMaterial + 1; other < m_materials.size(); other++)
+	{
+		if (std::equal(std::begin(material.textures), std::end(material.textures), std::begin(m_materials[other].textures)))
+		{
+			material.textureSet = m_materials[other].textureSet;
+			break;
+		}
+	}
+	if (material.textureSet == m_textureSetCount)
+		m_textureSetCount++;
+
+	m_materials.push_back(std::move(material));
+	return static_cast<MaterialHandle>(m_materials.size() - 1);
+}
+
+std::vector<MaterialHandle> MaterialLibrary::LoadFromGltf(const tinygltf::Model& model)
+{
+	// The image behind a glTF texture index, or null
+	auto getImage = [&model](int textureIdx) -> const tinygltf::Image*
+	{
+		if (textureIdx < 0 || textureIdx >= (int)model.textures.size())
+			return nullptr;
+		const int imageIdx = model.textures[textureIdx].source;
+		return imageIdx >= 0 && imageIdx < (int)model.images.size() ? &model.images[imageIdx] : nullptr;
+	};
+
+	// The shader scales the maps by the factors when texturing is on - missing metal and roughness maps
+	// of textured materials become a 1x1 white map, leaving the factor
+	tinygltf::Image white;
+	white.width = white.height = 1;
+	white.component = 1;
+	white.bits = 8;
+	white.image = { 255 };
+
+	// glTF packs roughness in G and metalness in B of one texture; the shader wants them in separate
+	// single channel maps, so they are split here once instead of per pixel. Maps are (image, channel).
+	using Map = std::pair<const tinygltf::Image*, int>;
+	std::vector<std::array<Map, kTextureSlots>> materialMaps(model.materials.size());
+	std::vector<Map> maps;
+	for (size_t m = 0; m < model.materials.size(); m++)
+	{
+		const auto& pbr = model.materials[m].pbrMetallicRoughness;
+		const tinygltf::Image* albedoImage = getImage(pbr.baseColorTexture.index);
+		if (albedoImage == nullptr)
+			continue;
+		const tinygltf::Image* metalRoughImage = getImage(pbr.metallicRoughnessTexture.index);
+		materialMaps[m] = { Map(albedoImage, -1), Map(metalRoughImage ? metalRoughImage : &white, metalRoughImage ? 2 : -1),
+							Map(metalRoughImage ? metalRoughImage : &white, metalRoughImage ? 1 : -1) };
+		for (const Map& map : materialMaps[m])
+		{
+			if (std::find(maps.begin(), maps.end(), map) == maps.end())
+				maps.push_back(map);
+		}
+	}
+
+	// Packed, every map of the model goes into arrays shared by all its materials
+	std::vector<ComPtr<ID3D11ShaderResourceView>> packedViews;
+	std::vector<TexturePacker::Placement> placements;
+	if (m_packing && !maps.empty())
+		PackImages(maps, packedViews, placements);
+
+	std::vector<MaterialHandle> handles;
+	handles.reserve(model.materials.size());
+	for (size_t m = 0; m < model.materials.size(); m++)
+	{
+		const tinygltf::Material& gltfMaterial = model.materials[m];
+		const auto& pbr = gltfMaterial.pbrMetallicRoughness;
+
+		CbPerMaterial data = {};
+		data.albedo = XMFLOAT4((float)pbr.baseColorFactor[0], (float)pbr.baseColorFactor[1],
+							   (float)pbr.baseColorFactor[2], (float)pbr.baseColorFactor[3]);
+		data.metal = (float)pbr.metallicFactor;
+		data.rough = (float)pbr.roughnessFactor;
+
+		AssetRegistry::ViewRef images[kTextureSlots];
+		ID3D11ShaderResourceView* textures[kTextureSlots] = {};
+		float slices[kTextureSlots] = {};
+		bool packed = false;
+		if (materialMaps[m][0].first)
+		{
+			if (m_packing)
+			{
+				packed = true;
+				for (UINT i = 0; i < kTextureSlots; i++)
+				{
+					const size_t map = std::find(maps.begin(), maps.end(), materialMaps[m][i]) - maps.begin();
+					textures[i] = packedViews[map].Get();
+					packed = packed && textures[i];
+					data.textureRects[i] = placements[map].rect;
+					slices[i] = (float)placements[map].slice;
+				}
+			}
+			else
+			{
+				for (UINT i = 0; i < kTextureSlots; i++)
+				{
+					images[i] = GetImageTexture(*materialMaps[m][i].first, materialMaps[m][i].second);
+					if (!images[i] && i > 0)
+						images[i] = GetImageTexture(white);
+					textures[i] = images[i] ? images[i]->view.Get() : nullptr;
+				}
+			}
+		}
+
+		const bool textured = packed || (!m_packing && textures[0]);
+		if (textured)
+		{
+			data.textureSelect = 1.0f;
+			data.textureSlices = XMFLOAT4(slices[0], slices[1], slices[2], packed ? 1.0f : 0.0f);
+
+			// Grey albedo stays one or two channels wide, so the shader spreads R over RGB
+			data.albedoGrey = materialMaps[m][0].first->component <= 2 ? 1.0f : 0.0f;
+		}
+		else
+		{
+			std::fill(std::begin(textures), std::end(textures), nullptr);
+		}
+
+		const MaterialHandle handle = Create(gltfMaterial.name, data, textures);
+		if (handle != kDefaultMaterial)
+		{
+			m_materials[handle].packed = packed;
+			std::copy(std::begin(images), std::end(images), m_materials[handle].images);
+		}
+		Log::Debug(L"MaterialLibrary: Material \"%s\" -> handle %u%s",
+				   Utils::StringToWstring(gltfMaterial.name).c_str(), handle, textured ? (packed ? L" (textured, packed)" : L" (textured)") : L"");
+		handles.push_back(handle);
+	}
+
+	return handles;
+}
+
+void MaterialLibrary::Bind(RenderStateTracker& tracker, MaterialHandle handle)
+{
+	if (handle >= m_materials.size())
+		handle = kDefaultMaterial;
+
+	if (handle == m_bound)
+	{
+		m_skippedBinds++;
+		return;
+	}
+
+	const Material& material = m_materials[handle];
+	tracker.SetConstantBuffer(RenderStateTracker::ePixelStage, kConstantBufferSlot, material.constants.Get());
+
+	// Materials of one texture set only differ in their constants
+	if (material.textureSet != m_boundTextureSet)
+	{
+		ID3D11ShaderResourceView* textures[kTextureSlots];
+		for (UINT i = 0; i < kTextureSlots; i++)
+			textures[i] = material.textures[i].Get();
+		tracker.SetShaderResources(RenderStateTracker::ePixelStage, material.packed ? kPackedTextureSlot : 0, kTextureSlots, textures);
+		m_boundTextureSet = material.textureSet;
+		m_textureBinds++;
+	}
+
+	m_bound = handle;
+	m_binds++;
+}
+
+AssetRegistry::ViewRef MaterialLibrary::GetImageTexture(const tinygltf::Image& image, int channel)
+{
+	auto create = [&]() -> AssetRegistry::ViewRef
+	{
+		AssetRegistry::View view;
+		view.view = CreateTextureFromImage(image, channel);
+		if (!view.view)
+			return nullptr;
+		return m_assets ? m_assets->MakeAsset<AssetRegistry::View>(std::move(view)) : std::make_shared<AssetRegistry::View>(std::move(view));
+	};
+	if (m_assets == nullptr)
+		return create();
+
+	// Keyed by the decoded pixels, so an image used by several models (or materials) is created once
+	const int format[] = { image.width, image.height, image.component, image.bits, channel };
+	const uint64_t key = Utils::HashBytes(image.image.data(), image.image.size(), Utils::HashBytes(format, sizeof(format)));
+	return m_assets->Acquire<AssetRegistry::View>(key, create);
+}
+
+bool MaterialLibrary::BuildTextureData(const tinygltf::Image& image, int channel, TextureData& data)
+{
+	// tinygltf decodes images to 8 or 16 bit per channel
+	if (image.image.empty() || (image.bits != 8 && image.bits != 16) || image.component < 1 || image.component > 4)
+		return false;
+
+	const UINT width = (UINT)image.width;
+	const UINT height = (UINT)image.height;
+	const UINT srcComponents = (UINT)image.component;
+	const UINT bits = (UINT)image.bits;
+
+	// Either one channel picked out, or the image as it is
+	const bool singleChannel = (channel >= 0) || (srcComponents == 1);
+	const UINT srcChannel = (channel >= 0) ? std::min((UINT)channel, srcComponents - 1) : 0;
+
+	if (m_cooker && bits == 8)
+	{
+		TextureCooker::Image source;
+		source.pixels = image.image.data();
+		source.width = width;
+		source.height = height;
+		source.components = srcComponents;
+
+		DirectX::DDS_TEXTURE_LAYOUT layout = {};
+		if (m_cooker->Cook(source, singleChannel ? TextureCooker::eSingle : TextureCooker::eColor, data.dds, (int)srcChannel) &&
+			SUCCEEDED(DirectX::GetDDSTextureLayout(data.dds.data(), data.dds.size(), data.dds.size(), &layout)))
+		{
+			data.texture.format = layout.format;
+			for (UINT level = 0; level < layout.mipCount; level++)
+			{
+				const DirectX::DDS_SUBRESOURCE_LAYOUT subresource = DirectX::GetDDSSubresourceLayout(layout, level, 0);
+				data.texture.levels.push_back({ data.dds.data() + subresource.offset, subresource.width, subresource.height, subresource.rowPitch });
+			}
+			return true;
+		}
+		// Sizes that are not a multiple of 4 go up uncompressed
+		data.dds.clear();
+	}
+
+	// Uncompressed in the nearest native format (see TextureFormats), 16 bit images included; UNORM
+	// rather than SRGB, as the shader takes albedo as stored
+	const TextureFormats::Layout layout = TextureFormats::GetNativeLayout(channel >= 0 ? 1 : srcComponents, bits, false);
+	TextureFormats::Repack(image.image.data(), (size_t)width * height, srcComponents, channel, layout, data.pixels);
+
+	// The full mip chain, colour taken to be sRGB encoded as glTF's is
+	MipGenerator::Generate(data.pixels.data(), width, height, layout.components, bits,
+						   singleChannel ? MipGenerator::eLinear : MipGenerator::eSrgb, MipGenerator::Settings(), data.mips);
+
+	data.texture.format = layout.format;
+	data.texture.levels.push_back({ data.pixels.data(), width, height, width * layout.GetBytesPerTexel() });
+	for (const MipGenerator::Level& mip : data.mips)
+		data.texture.levels.push_back({ mip.pixels.data(), mip.width, mip.height, mip.width * layout.GetBytesPerTexel() });
+	return true;
+}
+
+ComPtr<ID3D11ShaderResourceView> MaterialLibrary::CreateTextureFromImage(const tinygltf::Image& image, int channel)
+{
+	TextureData data;
+	if (!m_device || !BuildTextureData(image, channel, data))
+		return nullptr;
+
+	const TexturePacker::Texture& texture = data.texture;
+	std::vector<D3D11_SUBRESOURCE_DATA> initData(texture.levels.size());
+	for (size_t level = 0; level < texture.levels.size(); level++)
+	{
+		initData[level].pSysMem = texture.levels[level].data;
+		initData[level].SysMemPitch = texture.levels[level].rowPitch;
+	}
+
+	D3D11_TEXTURE2D_DESC desc = {};
+	desc.Width = texture.levels[0].width;
+	desc.Height = texture.levels[0].height;
+	desc.MipLevels = (UINT)texture.levels.size();
+	desc.ArraySize = 1;
+	desc.Format = texture.format;
+	desc.SampleDesc.Count = 1;
+	desc.Usage = D3D11_USAGE_IMMUTABLE;
+	desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+	ComPtr<ID3D11Texture2D> resource;
+	ComPtr<ID3D11ShaderResourceView> srv;
+	if (FAILED(m_device->CreateTexture2D(&desc, initData.data(), &resource)) ||
+		FAILED(m_device->CreateShaderResourceView(resource.Get(), nullptr, &srv)))
+	{
+		Log::Error(L"MaterialLibrary: Failed to create texture for image \"%s\"", Utils::StringToWstring(image.name).c_str());
+		return nullptr;
+	}
+	return srv;
+}
+
+void MaterialLibrary::PackImages(const std::vector<std::pair<const tinygltf::Image*, int>>& images,
+								 std::vector<ComPtr<ID3D11ShaderResourceView>>& views, std::vector<TexturePacker::Placement>& placements)
+{
+	views.assign(images.size(), nullptr);
+	placements.assign(images.size(), TexturePacker::Placement());
+	if (!m_device || !m_packing)
+		return;
+
+	// Images that cannot be read have no levels, which leaves them out
+	std::vector<TextureData> data(images.size());
+	std::vector<TexturePacker::Texture> textures(images.size());
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		if (BuildTextureData(*images[i].first, images[i].second, data[i]))
+			textures[i] = data[i].texture;
+	}
+
+	std::vector<TexturePacker::Array> arrays;
+	TexturePacker::Pack(textures, *m_packing, arrays, placements);
+
+	std::vector<ComPtr<ID3D11ShaderResourceView>> arrayViews(arrays.size());
+	UINT atlases = 0;
+	for (size_t a = 0; a < arrays.size(); a++)
+	{
+		const TexturePacker::Array& array = arrays[a];
+		D3D11_TEXTURE2D_DESC desc = {};
+		desc.Width = array.width;
+		desc.Height = array.height;
+		desc.MipLevels = array.levels;
+		desc.ArraySize = array.slices;
+		desc.Format = array.format;
+		desc.SampleDesc.Count = 1;
+		desc.Usage = D3D11_USAGE_IMMUTABLE;
+		desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+		// An array view even of a single slice, which the shader samples as an array
+		D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc = {};
+		viewDesc.Format = array.format;
+		viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2DARRAY;
+		viewDesc.Texture2DArray.MipLevels = array.levels;
+		viewDesc.Texture2DArray.ArraySize = array.slices;
+
+		ComPtr<ID3D11Texture2D> resource;
+		if (FAILED(m_device->CreateTexture2D(&desc, array.subresources.data(), &resource)) ||
+			FAILED(m_device->CreateShaderResourceView(resource.Get(), &viewDesc, &arrayViews[a])))
+		{
+			Log::Error(L"MaterialLibrary: Failed to create a %ux%u texture array of %u slices", array.width, array.height, array.slices);
+			continue;
+		}
+		atlases += array.atlas ? 1 : 0;
+	}
+
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		if (placements[i].array < arrayViews.size())
+			views[i] = arrayViews[placements[i].array];
+	}
+	Log::Info(L"MaterialLibrary: packed %zu maps into %zu texture arrays (%u of atlases)", images.size(), arrays.size(), atlases);
+}
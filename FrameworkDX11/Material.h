@@ -0,0 +1,125 @@
+// Material library - one constant buffer + texture set per material, built once at load time.
+//
+// glTF materials become immutable constant buffers, so drawing with them never uploads anything.
+// Handle 0 is the editable default material driven by the ImGui sliders; it is the only one that
+// is ever re-uploaded (and only when a slider moves). Draws reference materials by handle and
+// Bind() is a no-op when the handle is already bound.
+//
+// With packing, the maps of a glTF model's materials are packed into Texture2DArrays shared by all of
+// them (see TexturePacker), bound to t9-t11 instead of t0-t2, and a material's constants give each
+// map's slice and UV rect. Materials with the same views share a texture set; draws sorted by it
+// switch only the constant buffer from one material to the next.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include "wrl.h"
+#include "structures.h"
+#include "ConstantBuffers.h"
+#include "AssetRegistry.h"
+#include "TextureCooker.h"
+#include "MipGenerator.h"
+#include "TexturePacker.h"
+#include "tiny_gltf.h" // just the interfaces (no implementation)
+#include <string>
+#include <vector>
+
+class RenderStateTracker;
+
+using MaterialHandle = uint32_t;
+constexpr MaterialHandle kDefaultMaterial = 0;
+
+class MaterialLibrary
+{
+public:
+	// t0 albedo, t1 metallic, t2 roughness - the IBL maps in t3/t4 are bound per frame by the scene
+	static constexpr UINT kTextureSlots = 3;
+	static constexpr UINT kConstantBufferSlot = 4;
+	// Packed maps, in the same order
+	static constexpr UINT kPackedTextureSlot = 9;
+
+	// glTF images are shared through assets when given (by content, across models), block compressed
+	// by cooker when given, and packed into arrays per model with packing when given (which takes the
+	// place of sharing through assets)
+	HRESULT Init(ID3D11Device* device, AssetRegistry* assets = nullptr, TextureCooker* cooker = nullptr,
+				 const TexturePacker::Settings* packing = nullptr);
+	void	Release();
+
+	// Default (editable) material
+	void	SetDefaultTextures(ID3D11ShaderResourceView* const textures[kTextureSlots]);
+	void	UpdateDefault(ID3D11DeviceContext* context, const CbPerMaterial& data, ConstantBufferStats* stats = nullptr);
+
+	// The streamed textures behind a material's views, which draws with it ask to be resident.
+	// GetStreamedTextures() gives kTextureSlots handles (kInvalidHandle where not streamed), or nullptr.
+	void	SetStreamedTextures(MaterialHandle handle, const TextureStreamer::Handle textures[kTextureSlots]);
+	const TextureStreamer::Handle*	GetStreamedTextures(MaterialHandle handle) const;
+
+	// Immutable materials
+	MaterialHandle	Create(const std::string& name, const CbPerMaterial& data, ID3D11ShaderResourceView* const textures[kTextureSlots]);
+
+	// Builds one material per entry of model.materials; the result is indexed by glTF material index
+	std::vector<MaterialHandle>	LoadFromGltf(const tinygltf::Model& model);
+
+	// Binds the constant buffer and textures unless the material is already bound
+	void	Bind(RenderStateTracker& tracker, MaterialHandle handle);
+	// Call when something else may have touched the material slots (e.g. start of frame)
+	void	InvalidateBinding() { m_bound = kInvalidHandle; m_boundTextureSet = kInvalidHandle; }
+
+	// Materials with the same texture views have the same set; the default material's is 0
+	UINT	GetTextureSet(MaterialHandle handle) const { return handle < m_materials.size() ? m_materials[handle].textureSet : 0; }
+
+	size_t	GetCount() const { return m_materials.size(); }
+	UINT	GetBindCount() const { return m_binds; }
+	UINT	GetSkippedBindCount() const { return m_skippedBinds; }
+	UINT	GetTextureBindCount() const { return m_textureBinds; }
+	void	ResetCounters() { m_binds = 0; m_skippedBinds = 0; m_textureBinds = 0; }
+
+private:
+	static constexpr MaterialHandle kInvalidHandle = ~0u;
+
+	struct Material
+	{
+		std::string											name;
+		Microsoft::WRL::ComPtr<ID3D11Buffer>				constants;
+		Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>	textures[kTextureSlots];
+		bool												packed = false;
+		UINT												textureSet = 0;
+		bool												streamed = false;
+		TextureStreamer::Handle								streamedTextures[kTextureSlots] = {};
+		AssetRegistry::ViewRef								images[kTextureSlots];	// keep shared glTF images alive
+	};
+
+	// A texture's levels on the CPU, before it is created on its own or packed with others
+	struct TextureData
+	{
+		std::vector<uint8_t>				dds;		// cooked
+		std::vector<uint8_t>				pixels;		// or uncompressed, the top level
+		std::vector<MipGenerator::Level>	mips;		// and the ones below
+		TexturePacker::Texture				texture;	// points into the above
+	};
+
+	// A glTF image's levels (keeping one channel only when channel is not -1): block compressed by the
+	// cooker where it can, in its native format with a generated mip chain otherwise
+	bool	BuildTextureData(const tinygltf::Image& image, int channel, TextureData& data);
+	// Creates a texture with a full mip chain from a decoded glTF image (see BuildTextureData)
+	Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> CreateTextureFromImage(const tinygltf::Image& image, int channel = -1);
+	// Same, shared through the asset registry when there is one
+	AssetRegistry::ViewRef GetImageTexture(const tinygltf::Image& image, int channel = -1);
+	// Packs images (each with a channel) into arrays; the array view and placement of each follow
+	// images, with a null view for an image that could not be read
+	void	PackImages(const std::vector<std::pair<const tinygltf::Image*, int>>& images,
+					   std::vector<Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>>& views, std::vector<TexturePacker::Placement>& placements);
+
+	Microsoft::WRL::ComPtr<ID3D11Device>	m_device;
+	AssetRegistry*							m_assets = nullptr;
+	TextureCooker*							m_cooker = nullptr;
+	const TexturePacker::Settings*			m_packing = nullptr;
+	std::vector<Material>					m_materials;
+	ConstantBuffer<CbPerMaterial>			m_defaultConstants;
+	MaterialHandle							m_bound = kInvalidHandle;
+	UINT									m_boundTextureSet = kInvalidHandle;
+	UINT									m_textureSetCount = 1;
+	UINT									m_binds = 0;
+	UINT									m_skippedBinds = 0;
+	UINT									m_textureBinds = 0;
+};
@@ -0,0 +1,492 @@
+#include "MipGenerator.h"
+
+#include "ColorConversion.h"
+#include "JobSystem.h"
+#include "log.hpp"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <xmmintrin.h>
+
+namespace
+{
+	static constexpr float kPi = 3.14159265358979f;
+
+	// Reach of each filter either side of a level texel's centre, in level texels
+	float GetSupport(MipGenerator::Filter filter)
+	{
+		return filter == MipGenerator::eBox ? 0.5f : 3.0f;
+	}
+
+	float Sinc(float x)
+	{
+		if (std::fabs(x) < 1e-6f)
+			return 1.0f;
+		x *= kPi;
+		return std::sin(x) / x;
+	}
+
+	float BesselI0(float x)
+	{
+		float sum = 1.0f;
+		float term = 1.0f;
+		for (int k = 1; k < 32 && term > sum * 1e-8f; k++)
+		{
+			const float half = x / (2.0f * k);
+			term *= half * half;
+			sum += term;
+		}
+		return sum;
+	}
+
+	float EvaluateFilter(MipGenerator::Filter filter, float x)
+	{
+		x = std::fabs(x);
+		if (x >= 3.0f)
+			return 0.0f;
+		if (filter == MipGenerator::eKaiser)
+		{
+			const float alpha = 4.0f;
+			const float t = x / 3.0f;
+			return Sinc(x) * BesselI0(alpha * std::sqrt(1.0f - t * t)) / BesselI0(alpha);
+		}
+		return Sinc(x) * Sinc(x / 3.0f);
+	}
+
+	// The source texels each level texel along one axis is filtered from, and their weights
+	struct Taps
+	{
+		UINT				count = 0;	// per level texel, some with no weight
+		std::vector<int>	sources;	// clamped to the edge
+		std::vector<float>	weights;
+	};
+
+	void BuildTaps(MipGenerator::Filter filter, UINT srcSize, UINT dstSize, Taps& taps)
+	{
+		const float scale = (float)srcSize / dstSize;
+		const float radius = GetSupport(filter) * scale;
+		taps.count = (UINT)std::ceil(radius * 2.0f) + 1;
+		taps.sources.resize((size_t)dstSize * taps.count);
+		taps.weights.resize((size_t)dstSize * taps.count);
+		for (UINT i = 0; i < dstSize; i++)
+		{
+			const float centre = (i + 0.5f) * scale;
+			const int first = (int)std::floor(centre - radius);
+			float total = 0.0f;
+			for (UINT t = 0; t < taps.count; t++)
+			{
+				const int j = first + (int)t;
+				float weight;
+				if (filter == MipGenerator::eBox)
+					weight = std::max(0.0f, std::min(j + 1.0f, centre + scale * 0.5f) - std::max((float)j, centre - scale * 0.5f));
+				else
+					weight = EvaluateFilter(filter, (j + 0.5f - centre) / scale);
+				taps.sources[i * taps.count + t] = std::min(std::max(j, 0), (int)srcSize - 1);
+				taps.weights[i * taps.count + t] = weight;
+				total += weight;
+			}
+			for (UINT t = 0; t < taps.count; t++)
+				taps.weights[i * taps.count + t] /= total;
+		}
+	}
+
+	// One row of the row pass: src is a source row, dst a row of the half-width image
+	void FilterRowScalar(const float* src, const Taps& taps, UINT dstWidth, float* dst)
+	{
+		for (UINT x = 0; x < dstWidth; x++)
+		{
+			float sum[4] = {};
+			for (UINT t = 0; t < taps.count; t++)
+			{
+				const float weight = taps.weights[x * taps.count + t];
+				const float* texel = src + (size_t)taps.sources[x * taps.count + t] * 4;
+				for (UINT c = 0; c < 4; c++)
+					sum[c] = sum[c] + weight * texel[c];
+			}
+			memcpy(dst + (size_t)x * 4, sum, sizeof(sum));
+		}
+	}
+
+	void FilterRowSSE(const float* src, const Taps& taps, UINT dstWidth, float* dst)
+	{
+		for (UINT x = 0; x < dstWidth; x++)
+		{
+			__m128 sum = _mm_setzero_ps();
+			for (UINT t = 0; t < taps.count; t++)
+			{
+				const __m128 weight = _mm_set1_ps(taps.weights[x * taps.count + t]);
+				sum = _mm_add_ps(sum, _mm_mul_ps(weight, _mm_loadu_ps(src + (size_t)taps.sources[x * taps.count + t] * 4)));
+			}
+			_mm_storeu_ps(dst + (size_t)x * 4, sum);
+		}
+	}
+
+	// Row y of the column pass, a weighted sum of whole rows of the half-width image so the reads
+	// stay sequential (each texel still adds its taps in order, as the row pass does)
+	void FilterColumnScalar(const float* image, const Taps& taps, UINT y, UINT width, float* dst)
+	{
+		memset(dst, 0, (size_t)width * 4 * sizeof(float));
+		for (UINT t = 0; t < taps.count; t++)
+		{
+			const float weight = taps.weights[y * taps.count + t];
+			const float* row = image + (size_t)taps.sources[y * taps.count + t] * width * 4;
+			for (size_t i = 0; i < (size_t)width * 4; i++)
+				dst[i] = dst[i] + weight * row[i];
+		}
+	}
+
+	void FilterColumnSSE(const float* image, const Taps& taps, UINT y, UINT width, float* dst)
+	{
+		memset(dst, 0, (size_t)width * 4 * sizeof(float));
+		for (UINT t = 0; t < taps.count; t++)
+		{
+			const __m128 weight = _mm_set1_ps(taps.weights[y * taps.count + t]);
+			const float* row = image + (size_t)taps.sources[y * taps.count + t] * width * 4;
+			for (size_t i = 0; i < (size_t)width * 4; i += 4)
+				_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(weight, _mm_loadu_ps(row + i))));
+		}
+	}
+
+	void ForRows(bool parallel, UINT rows, UINT width, const std::function<void(size_t, size_t)>& fn)
+	{
+		if (parallel)
+			JobSystem::Get().ParallelFor(rows, std::max(1u, 4096 / std::max(width, 1u)), fn);
+		else
+			fn(0, rows);
+	}
+}
+
+UINT MipGenerator::GetLevelCount(UINT width, UINT height)
+{
+	UINT levels = 1;
+	while ((std::max(width, height) >> levels) > 0)
+		levels++;
+	return levels;
+}
+
+void MipGenerator::Generate(const void* pixels, UINT width, UINT height, UINT components, UINT bits, Content content,
+							const Settings& settings, std::vector<Level>& levels)
+{
+	levels.clear();
+	const UINT count = GetLevelCount(width, height);
+	if (count < 2 || components < 1 || components > 4 || (bits != 8 && bits != 16))
+		return;
+
+	// Every level in float, linear, the top level first
+	std::vector<std::vector<float>> images(count);
+	std::vector<UINT> widths(count), heights(count);
+	widths[0] = width;
+	heights[0] = height;
+	for (UINT level = 1; level < count; level++)
+	{
+		widths[level] = std::max(widths[level - 1] / 2, 1u);
+		heights[level] = std::max(heights[level - 1] / 2, 1u);
+	}
+
+	// How each channel is stored, and so filtered
+	if (content == eNormal && components < 3)
+		content = eLinear;
+	Content channels[4];
+	for (UINT c = 0; c < 4; c++)
+		channels[c] = (content == eSrgb && (c == 3 || (components == 2 && c == 1))) ? eLinear : content;
+
+	const float* srgbTable = ColorConversion::GetSrgbTable(bits);
+	const float scale = 1.0f / (bits == 8 ? 255.0f : 65535.0f);
+	const uint8_t* src8 = static_cast<const uint8_t*>(pixels);
+	const uint16_t* src16 = static_cast<const uint16_t*>(pixels);
+	images[0].resize((size_t)width * height * 4);
+	ForRows(settings.parallel, height, width, [&](size_t begin, size_t end)
+		{
+			for (size_t i = begin * width; i < end * width; i++)
+			{
+				float* texel = &images[0][i * 4];
+				texel[0] = texel[1] = texel[2] = 0.0f;
+				texel[3] = 1.0f;
+				for (UINT c = 0; c < components; c++)
+				{
+					const UINT value = bits == 8 ? src8[i * components + c] : src16[i * components + c];
+					texel[c] = channels[c] == eSrgb ? srgbTable[value] : channels[c] == eNormal ? value * scale * 2.0f - 1.0f : value * scale;
+				}
+			}
+		});
+
+	Taps rowTaps, columnTaps;
+	std::vector<float> halfWidth;
+	for (UINT level = 1; level < count; level++)
+	{
+		const UINT srcWidth = widths[level - 1];
+		const UINT srcHeight = heights[level - 1];
+		const UINT dstWidth = widths[level];
+		const UINT dstHeight = heights[level];
+		BuildTaps(settings.filter, srcWidth, dstWidth, rowTaps);
+		BuildTaps(settings.filter, srcHeight, dstHeight, columnTaps);
+
+		const std::vector<float>& src = images[level - 1];
+		halfWidth.resize((size_t)dstWidth * srcHeight * 4);
+		ForRows(settings.parallel, srcHeight, dstWidth, [&](size_t begin, size_t end)
+			{
+				for (size_t y = begin; y < end; y++)
+				{
+					const float* row = src.data() + y * srcWidth * 4;
+					float* out = halfWidth.data() + y * dstWidth * 4;
+					if (settings.kernel == eSSE)
+						FilterRowSSE(row, rowTaps, dstWidth, out);
+					else
+						FilterRowScalar(row, rowTaps, dstWidth, out);
+				}
+			});
+
+		std::vector<float>& dst = images[level];
+		dst.resize((size_t)dstWidth * dstHeight * 4);
+		ForRows(settings.parallel, dstHeight, dstWidth, [&](size_t begin, size_t end)
+			{
+				for (size_t y = begin; y < end; y++)
+				{
+					float* out = dst.data() + y * dstWidth * 4;
+					if (settings.kernel == eSSE)
+						FilterColumnSSE(halfWidth.data(), columnTaps, (UINT)y, dstWidth, out);
+					else
+						FilterColumnScalar(halfWidth.data(), columnTaps, (UINT)y, dstWidth, out);
+
+					// Averaged normals are shorter than 1, which would darken the lighting
+					if (content != eNormal)
+						continue;
+					for (UINT x = 0; x < dstWidth; x++)
+					{
+						float* n = out + x * 4;
+						const float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+						if (length > 1e-6f)
+						{
+							n[0] /= length;
+							n[1] /= length;
+							n[2] /= length;
+						}
+					}
+				}
+			});
+	}
+
+	// Back to integers over the rows of every level together, as the small levels alone are not worth a job
+	levels.resize(count - 1);
+	std::vector<UINT> firstRows(count, 0);
+	for (UINT level = 1; level < count; level++)
+	{
+		levels[level - 1].width = widths[level];
+		levels[level - 1].height = heights[level];
+		levels[level - 1].pixels.resize((size_t)widths[level] * heights[level] * components * (bits / 8));
+		if (level + 1 < count)
+			firstRows[level + 1] = firstRows[level] + heights[level];
+	}
+	const UINT rows = firstRows[count - 1] + heights[count - 1];
+	const ColorConversion::Kernel kernel = settings.kernel == eSSE ? ColorConversion::eSSE : ColorConversion::eScalar;
+	auto convert = [&](size_t begin, size_t end)
+	{
+		std::vector<float> encoded;
+		for (size_t row = begin; row < end; row++)
+		{
+			const UINT level = (UINT)(std::upper_bound(firstRows.begin() + 1, firstRows.end(), (UINT)row) - firstRows.begin()) - 1;
+			const size_t first = ((size_t)row - firstRows[level]) * widths[level];
+			const float* src = images[level].data() + first * 4;
+			const size_t width = widths[level];
+
+			// Encoded in RGBA, then packed down to the source's channels
+			encoded.resize(width * 4);
+			if (content == eSrgb)
+				ColorConversion::LinearToSrgb(src, width, components >= 3 ? 3 : 1, encoded.data(), kernel);
+			else if (content == eNormal)
+				std::transform(src, src + width * 4, encoded.begin(), [](float value) { return value * 0.5f + 0.5f; });
+			else
+				std::copy(src, src + width * 4, encoded.begin());
+			if (components < 4)
+			{
+				for (size_t x = 0; x < width; x++)
+				{
+					for (UINT c = 0; c < components; c++)
+						encoded[x * components + c] = encoded[x * 4 + c];
+				}
+			}
+
+			uint8_t* dst = levels[level - 1].pixels.data() + first * components * (bits / 8);
+			if (bits == 8)
+				ColorConversion::FloatToUnorm(encoded.data(), width * components, dst, kernel);
+			else
+				ColorConversion::FloatToUnorm(encoded.data(), width * components, reinterpret_cast<uint16_t*>(dst), kernel);
+		}
+	};
+	if (settings.parallel)
+		JobSystem::Get().ParallelFor(rows, 16, convert);
+	else
+		convert(0, rows);
+}
+
+bool MipGenerator::RunSelfTest()
+{
+	bool passed = true;
+	auto check = [&passed](bool condition, const wchar_t* what)
+	{
+		if (!condition)
+		{
+			Log::Error(L"MipGenerator self test: %s", what);
+			passed = false;
+		}
+	};
+
+	const Filter filters[] = { eBox, eKaiser, eLanczos };
+	const Content contents[] = { eLinear, eSrgb, eNormal };
+
+	// Noise at an odd size: every kernel and path gives the same levels, of the right sizes
+	const UINT width = 100;
+	const UINT height = 60;
+	std::vector<uint8_t> noise((size_t)width * height * 4);
+	uint32_t seed = 12345;
+	for (uint8_t& value : noise)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		value = (uint8_t)(seed >> 24);
+	}
+	for (Filter filter : filters)
+	{
+		for (Content content : contents)
+		{
+			std::vector<Level> reference, sse, parallel;
+			Settings settings;
+			settings.filter = filter;
+			settings.kernel = eScalar;
+			settings.parallel = false;
+			Generate(noise.data(), width, height, 4, 8, content, settings, reference);
+			settings.kernel = eSSE;
+			Generate(noise.data(), width, height, 4, 8, content, settings, sse);
+			settings.parallel = true;
+			Generate(noise.data(), width, height, 4, 8, content, settings, parallel);
+
+			bool same = reference.size() == sse.size() && sse.size() == parallel.size();
+			for (size_t i = 0; same && i < reference.size(); i++)
+				same = reference[i].pixels == sse[i].pixels && sse[i].pixels == parallel[i].pixels;
+			check(same, L"the scalar, SSE and parallel paths should give the same levels");
+			check(reference.size() == 6 && reference[0].width == 50 && reference[0].height == 30 &&
+				  reference[2].width == 12 && reference[2].height == 7 && reference[5].width == 1 && reference[5].height == 1,
+				  L"wrong level sizes for 100x60");
+		}
+	}
+
+	// A flat image stays flat through every filter, negative lobes and all
+	std::vector<uint8_t> flat((size_t)width * height * 4);
+	for (size_t i = 0; i < flat.size(); i += 4)
+	{
+		flat[i] = 200;
+		flat[i + 1] = 90;
+		flat[i + 2] = 30;
+		flat[i + 3] = 128;
+	}
+	for (Filter filter : filters)
+	{
+		for (Content content : { eLinear, eSrgb })
+		{
+			std::vector<Level> levels;
+			Settings settings;
+			settings.filter = filter;
+			Generate(flat.data(), width, height, 4, 8, content, settings, levels);
+			bool unchanged = true;
+			for (const Level& level : levels)
+			{
+				for (size_t i = 0; i < level.pixels.size(); i++)
+					unchanged = unchanged && level.pixels[i] == flat[i & 3];
+			}
+			check(unchanged, L"a flat image should give flat levels");
+		}
+	}
+
+	// A black and white checkerboard averages to half the light: 188 in sRGB, not 128
+	std::vector<uint8_t> checker(64 * 64 * 4);
+	for (UINT y = 0; y < 64; y++)
+	{
+		for (UINT x = 0; x < 64; x++)
+		{
+			const uint8_t value = ((x ^ y) & 1) ? 255 : 0;
+			memset(&checker[(y * 64 + x) * 4], value, 3);
+			checker[(y * 64 + x) * 4 + 3] = 255;
+		}
+	}
+	Settings box;
+	box.filter = eBox;
+	std::vector<Level> srgb, linear;
+	Generate(checker.data(), 64, 64, 4, 8, eSrgb, box, srgb);
+	Generate(checker.data(), 64, 64, 4, 8, eLinear, box, linear);
+	check(srgb[0].pixels[0] == 188 && srgb.back().pixels[1] == 188, L"sRGB levels should be filtered in linear space");
+	check(linear[0].pixels[0] == 128, L"linear levels should be filtered as stored");
+
+	// Normals leaning either way average to straight up, at full length
+	std::vector<uint8_t> normals(64 * 64 * 4);
+	for (UINT y = 0; y < 64; y++)
+	{
+		for (UINT x = 0; x < 64; x++)
+		{
+			uint8_t* n = &normals[(y * 64 + x) * 4];
+			n[0] = (x & 1) ? 204 : 51;	// +-0.6
+			n[1] = 128;
+			n[2] = 230;					// 0.8
+			n[3] = 255;
+		}
+	}
+	std::vector<Level> normalLevels;
+	Generate(normals.data(), 64, 64, 4, 8, eNormal, box, normalLevels);
+	const uint8_t* n = normalLevels[0].pixels.data();
+	check(std::abs(n[0] - 128) <= 1 && std::abs(n[1] - 128) <= 1 && n[2] == 255, L"normals should be renormalised");
+
+	// 16 bit grey keeps its precision: a ramp within one 8 bit step stays a ramp
+	std::vector<uint16_t> ramp(64 * 64);
+	for (size_t i = 0; i < ramp.size(); i++)
+		ramp[i] = (uint16_t)(30000 + (i % 64) / 4);
+	std::vector<Level> rampLevels;
+	Generate(ramp.data(), 64, 64, 1, 16, eLinear, box, rampLevels);
+	uint16_t first = 0, last = 0;
+	if (rampLevels.size() == 6 && rampLevels[1].pixels.size() == 16 * 16 * 2)
+	{
+		memcpy(&first, rampLevels[1].pixels.data(), sizeof(first));
+		memcpy(&last, rampLevels[1].pixels.data() + 15 * 2, sizeof(last));
+	}
+	check(first >= 30000 && first < 30002 && last > 30013 && last <= 30015, L"16 bit levels should keep their precision");
+
+	if (passed)
+		Log::Info(L"MipGenerator self test passed");
+	return passed;
+}
+
+void MipGenerator::RunBenchmark()
+{
+	constexpr int kIterations = 3;
+	int width = 0, height = 0, components = 0;
+	stbi_uc* pixels = stbi_load("Resources\\Texture.png", &width, &height, &components, 4);
+	if (!pixels)
+	{
+		Log::Error(L"MipGenerator benchmark: cannot load Resources\\Texture.png");
+		return;
+	}
+
+	Log::Info(L"MipGenerator benchmark: %dx%d, %u levels, %u worker threads", width, height,
+			  GetLevelCount(width, height), JobSystem::Get().GetWorkerCount());
+	const wchar_t* names[] = { L"box", L"Kaiser", L"Lanczos" };
+	for (int filter = eBox; filter <= eLanczos; filter++)
+	{
+		double ms[3] = {};
+		const Kernel kernels[] = { eScalar, eSSE, eSSE };
+		for (int run = 0; run < 3; run++)
+		{
+			Settings settings;
+			settings.filter = (Filter)filter;
+			settings.kernel = kernels[run];
+			settings.parallel = run == 2;
+			std::vector<Level> levels;
+			const auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < kIterations; i++)
+				Generate(pixels, width, height, 4, 8, eSrgb, settings, levels);
+			ms[run] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / kIterations;
+		}
+		Log::Info(L"  %-8s scalar %7.1f ms, SSE %7.1f ms, SSE parallel %7.1f ms", names[filter], ms[0], ms[1], ms[2]);
+	}
+	stbi_image_free(pixels);
+}
@@ -0,0 +1,75 @@
+// Mip chains for decoded images, generated on the CPU.
+//
+// Each level is filtered from the one above it, in float and in linear space, and stored with the
+// channels and precision of the source (1 to 4 channels of 8 or 16 bits):
+//
+//	- eSrgb: RGB decoded from sRGB before filtering and encoded again after (alpha is linear)
+//	- eNormal: XYZ in RGB mapped to [-1, 1] and renormalised after every level
+//	- eLinear: filtered as stored
+//
+// The filter is separable - a row pass into a half-width image, then a column pass - with weights
+// worked out once per level and axis, so odd sizes are handled like even ones. eBox averages the
+// texels a level texel covers; eKaiser (a Kaiser-windowed sinc) and eLanczos (Lanczos 3) reach
+// further, keeping the smaller levels sharper without aliasing. Both passes split their rows over the
+// JobSystem and the conversion back to integers (ColorConversion's kernels) runs over the rows of
+// every level at once. The scalar and SSE kernels do the same float operations in the same order, so
+// they give identical levels.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include <cstdint>
+#include <vector>
+
+class MipGenerator
+{
+public:
+	enum Filter
+	{
+		eBox,
+		eKaiser,
+		eLanczos,
+	};
+
+	enum Kernel
+	{
+		eScalar,
+		eSSE,
+	};
+
+	enum Content
+	{
+		eLinear,
+		eSrgb,
+		eNormal,
+	};
+
+	struct Settings
+	{
+		Filter	filter = eKaiser;
+		Kernel	kernel = eSSE;
+		bool	parallel = true;
+	};
+
+	struct Level
+	{
+		UINT					width = 0;
+		UINT					height = 0;
+		std::vector<uint8_t>	pixels;		// laid out as the source image
+	};
+
+	// Levels in a full chain for a width x height image, the top level included
+	static UINT	GetLevelCount(UINT width, UINT height);
+
+	// Every level below an image of components (1 to 4) 8 or 16 bit channels, rows tightly packed,
+	// down to 1x1: levels[0] is half its size. With eSrgb the last of 2 or 4 channels is alpha;
+	// eNormal needs XYZ, so fewer than 3 channels are filtered as eLinear.
+	static void	Generate(const void* pixels, UINT width, UINT height, UINT components, UINT bits, Content content,
+						 const Settings& settings, std::vector<Level>& levels);
+
+	// Checks the kernels and the serial and parallel paths agree, the filters keep flat images flat,
+	// sRGB and normal handling, odd sizes, and 16 bit and single channel images
+	static bool	RunSelfTest();
+	// Generates the chain of Texture.png with every filter and kernel, serially and in parallel
+	static void	RunBenchmark();
+};
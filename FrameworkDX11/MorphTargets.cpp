@@ -0,0 +1,478 @@
+#include "MorphTargets.h"
+#include "scenegraph.h"
+#include "gltf_utils.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
+using namespace DirectX;
+
+namespace
+{
+    // Weights smaller than this leave their target out
+    constexpr float kMinWeight = 1e-5f;
+
+    // Start of count elements of elementSize in a buffer view, or null if they do not fit in the buffer
+    const unsigned char* GetViewData(const tinygltf::Model& model, int viewIdx, size_t byteOffset,
+                                     size_t elementSize, size_t count, size_t& stride)
+    {
+        if (viewIdx < 0 || viewIdx >= (int)model.bufferViews.size())
+            return nullptr;
+        const tinygltf::BufferView& view = model.bufferViews[viewIdx];
+        if (view.buffer < 0 || view.buffer >= (int)model.buffers.size())
+            return nullptr;
+        const tinygltf::Buffer& buffer = model.buffers[view.buffer];
+
+        stride = view.byteStride ? view.byteStride : elementSize;
+        const size_t start = view.byteOffset + byteOffset;
+        if (count > 0 && start + (count - 1) * stride + elementSize > buffer.data.size())
+            return nullptr;
+        return buffer.data.data() + start;
+    }
+
+    // Reads a float VEC3 accessor of deltas as the list of its non zero elements, applying its sparse
+    // substitution if it has one. A sparse accessor without a buffer view (the usual case for morph
+    // targets) is read without ever expanding it.
+    bool ReadDeltas(const tinygltf::Model& model, int accessorIdx, size_t vertexCount,
+                    std::vector<uint32_t>& indices, std::vector<XMFLOAT3>& values)
+    {
+        indices.clear();
+        values.clear();
+        if (accessorIdx < 0 || accessorIdx >= (int)model.accessors.size())
+            return false;
+
+        const tinygltf::Accessor& accessor = model.accessors[accessorIdx];
+        if (accessor.componentType != TINYGLTF_COMPONENT_TYPE_FLOAT || accessor.type != TINYGLTF_TYPE_VEC3 ||
+            accessor.count != vertexCount)
+            return false;
+
+        auto isZero = [](const XMFLOAT3& d) { return d.x == 0.0f && d.y == 0.0f && d.z == 0.0f; };
+
+        if (accessor.bufferView >= 0)
+        {
+            size_t stride = 0;
+            const unsigned char* data = GetViewData(model, accessor.bufferView, accessor.byteOffset,
+                                                    sizeof(XMFLOAT3), accessor.count, stride);
+            if (data == nullptr)
+                return false;
+            for (size_t i = 0; i < accessor.count; i++)
+            {
+                XMFLOAT3 delta;
+                memcpy(&delta, data + i * stride, sizeof(delta));
+                if (!isZero(delta))
+                {
+                    indices.push_back((uint32_t)i);
+                    values.push_back(delta);
+                }
+            }
+        }
+        if (!accessor.sparse.isSparse)
+            return true;
+
+        const size_t count = (size_t)std::max(accessor.sparse.count, 0);
+        const int indexType = accessor.sparse.indices.componentType;
+        const size_t indexSize = indexType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE ? 1 :
+                                 indexType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT ? 2 : 4;
+        size_t indexStride = 0;
+        size_t valueStride = 0;
+        const unsigned char* sparseIndices = GetViewData(model, accessor.sparse.indices.bufferView,
+                                                         accessor.sparse.indices.byteOffset, indexSize, count, indexStride);
+        const unsigned char* sparseValues = GetViewData(model, accessor.sparse.values.bufferView,
+                                                        accessor.sparse.values.byteOffset, sizeof(XMFLOAT3), count, valueStride);
+        if (sparseIndices == nullptr || sparseValues == nullptr)
+            return false;
+
+        // The spec asks for increasing indices; sorting anyway costs little and makes the merge safe
+        std::vector<std::pair<uint32_t, XMFLOAT3>> substitutes(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            const unsigned char* index = sparseIndices + i * indexStride;
+            uint32_t vertex = 0;
+            switch (indexSize)
+            {
+            case 1:     vertex = *index; break;
+            case 2:     { uint16_t v; memcpy(&v, index, 2); vertex = v; } break;
+            default:    memcpy(&vertex, index, 4); break;
+            }
+            if (vertex >= vertexCount)
+                return false;
+            substitutes[i].first = vertex;
+            memcpy(&substitutes[i].second, sparseValues + i * valueStride, sizeof(XMFLOAT3));
+        }
+        std::stable_sort(substitutes.begin(), substitutes.end(),
+                         [](const std::pair<uint32_t, XMFLOAT3>& a, const std::pair<uint32_t, XMFLOAT3>& b) { return a.first < b.first; });
+
+        // Merge into the base elements, the substitutes winning
+        std::vector<uint32_t> mergedIndices;
+        std::vector<XMFLOAT3> mergedValues;
+        mergedIndices.reserve(indices.size() + count);
+        mergedValues.reserve(indices.size() + count);
+        size_t b = 0;
+        for (size_t s = 0; s <= substitutes.size(); s++)
+        {
+            const uint32_t limit = s < substitutes.size() ? substitutes[s].first : UINT32_MAX;
+            for (; b < indices.size() && indices[b] < limit; b++)
+            {
+                mergedIndices.push_back(indices[b]);
+                mergedValues.push_back(values[b]);
+            }
+            if (s == substitutes.size())
+                break;
+            if (b < indices.size() && indices[b] == limit)
+                b++;
+            if (!mergedIndices.empty() && mergedIndices.back() == limit)
+            {
+                mergedValues.back() = substitutes[s].second;
+            }
+            else if (!isZero(substitutes[s].second))
+            {
+                mergedIndices.push_back(limit);
+                mergedValues.push_back(substitutes[s].second);
+            }
+        }
+        indices.swap(mergedIndices);
+        values.swap(mergedValues);
+        return true;
+    }
+
+    // Spreads a sparse attribute over the union of a target's indices, zero where it has no element
+    void Scatter(const std::vector<uint32_t>& all, const std::vector<uint32_t>& indices,
+                 const std::vector<XMFLOAT3>& values, std::vector<XMFLOAT3>& out)
+    {
+        out.assign(all.size(), XMFLOAT3(0.0f, 0.0f, 0.0f));
+        size_t k = 0;
+        for (size_t i = 0; i < all.size() && k < indices.size(); i++)
+        {
+            if (all[i] == indices[k])
+                out[i] = values[k++];
+        }
+    }
+}
+
+bool MorphTargets::LoadFromGltf(const tinygltf::Model& model, const tinygltf::Primitive& primitive,
+                                size_t vertexCount, const std::wstring& logPrefix)
+{
+    m_targets.clear();
+    m_weights.clear();
+    m_touched.clear();
+
+    std::vector<uint32_t> positionIndices, normalIndices, tangentIndices, all;
+    std::vector<XMFLOAT3> positions, normals, tangents;
+    m_targets.reserve(primitive.targets.size());
+    for (size_t t = 0; t < primitive.targets.size(); t++)
+    {
+        const std::map<std::string, int>& attributes = primitive.targets[t];
+        auto read = [&](const char* name, std::vector<uint32_t>& indices, std::vector<XMFLOAT3>& values)
+        {
+            const auto it = attributes.find(name);
+            if (it == attributes.end())
+            {
+                indices.clear();
+                values.clear();
+                return true;
+            }
+            if (ReadDeltas(model, it->second, vertexCount, indices, values))
+                return true;
+            Log::Error(L"%sMorph target %d: unsupported or invalid %S accessor %d!",
+                       logPrefix.c_str(), (int)t, name, it->second);
+            return false;
+        };
+        if (!read("POSITION", positionIndices, positions) ||
+            !read("NORMAL", normalIndices, normals) ||
+            !read("TANGENT", tangentIndices, tangents))
+        {
+            m_targets.clear();
+            return false;
+        }
+
+        all.clear();
+        std::set_union(positionIndices.begin(), positionIndices.end(), normalIndices.begin(), normalIndices.end(),
+                       std::back_inserter(all));
+        std::vector<uint32_t> withTangents;
+        std::set_union(all.begin(), all.end(), tangentIndices.begin(), tangentIndices.end(),
+                       std::back_inserter(withTangents));
+
+        Target target;
+        target.indices = std::move(withTangents);
+        Scatter(target.indices, positionIndices, positions, target.positions);
+        if (!normalIndices.empty())
+            Scatter(target.indices, normalIndices, normals, target.normals);
+        if (!tangentIndices.empty())
+            Scatter(target.indices, tangentIndices, tangents, target.tangents);
+        m_targets.push_back(std::move(target));
+    }
+
+    Log::Debug(L"%sMorph targets: %d, %d moved vertices in total, %d bytes (%d dense)",
+               logPrefix.c_str(), (int)m_targets.size(), (int)GetDeltaCount(), (int)GetMemorySize(),
+               (int)(m_targets.size() * vertexCount * sizeof(XMFLOAT3)));
+    return true;
+}
+
+size_t MorphTargets::GetDeltaCount() const
+{
+    size_t count = 0;
+    for (const Target& target : m_targets)
+        count += target.indices.size();
+    return count;
+}
+
+size_t MorphTargets::GetMemorySize() const
+{
+    size_t size = 0;
+    for (const Target& target : m_targets)
+    {
+        size += sizeof(Target) + target.indices.size() * sizeof(uint32_t) +
+                (target.positions.size() + target.normals.size() + target.tangents.size()) * sizeof(XMFLOAT3);
+    }
+    return size;
+}
+
+void MorphTargets::Restore(const SceneVertex* base, SceneVertex* vertices) const
+{
+    for (const uint32_t v : m_touched)
+    {
+        vertices[v].Pos = base[v].Pos;
+        vertices[v].Normal = base[v].Normal;
+        vertices[v].Tangent = base[v].Tangent;
+    }
+}
+
+MorphTargets::Range MorphTargets::Apply(const SceneVertex* base, const float* weights, size_t weightCount, SceneVertex* vertices)
+{
+    const size_t targetCount = m_targets.size();
+    auto weightOf = [&](size_t t)
+    {
+        const float w = t < weightCount ? weights[t] : 0.0f;
+        return fabsf(w) < kMinWeight ? 0.0f : w;
+    };
+
+    bool changed = m_weights.size() != targetCount;
+    for (size_t t = 0; t < targetCount && !changed; t++)
+        changed = m_weights[t] != weightOf(t);
+    if (!changed)
+        return Range();
+    m_weights.resize(targetCount);
+
+    // Whatever the last weights moved has to be written again, if only to restore it
+    uint32_t first = m_touched.empty() ? UINT32_MAX : m_touched.front();
+    uint32_t end = m_touched.empty() ? 0 : m_touched.back() + 1;
+    Restore(base, vertices);
+    m_touched.clear();
+
+    bool normals = false;
+    bool tangents = false;
+    for (size_t t = 0; t < targetCount; t++)
+    {
+        m_weights[t] = weightOf(t);
+        if (m_weights[t] == 0.0f)
+            continue;
+
+        const Target& target = m_targets[t];
+        const XMVECTOR w = XMVectorReplicate(m_weights[t]);
+        const size_t count = target.indices.size();
+        for (size_t k = 0; k < count; k++)
+        {
+            SceneVertex& v = vertices[target.indices[k]];
+            XMStoreFloat3(&v.Pos, XMVectorMultiplyAdd(XMLoadFloat3(&target.positions[k]), w, XMLoadFloat3(&v.Pos)));
+        }
+        if (!target.normals.empty())
+        {
+            normals = true;
+            for (size_t k = 0; k < count; k++)
+            {
+                SceneVertex& v = vertices[target.indices[k]];
+                XMStoreFloat3(&v.Normal, XMVectorMultiplyAdd(XMLoadFloat3(&target.normals[k]), w, XMLoadFloat3(&v.Normal)));
+            }
+        }
+        if (!target.tangents.empty())
+        {
+            // xyz only, the handedness in w stays
+            tangents = true;
+            for (size_t k = 0; k < count; k++)
+            {
+                XMFLOAT3* tangent = reinterpret_cast<XMFLOAT3*>(&vertices[target.indices[k]].Tangent);
+                XMStoreFloat3(tangent, XMVectorMultiplyAdd(XMLoadFloat3(&target.tangents[k]), w, XMLoadFloat3(tangent)));
+            }
+        }
+
+        m_scratch.clear();
+        std::set_union(m_touched.begin(), m_touched.end(), target.indices.begin(), target.indices.end(),
+                       std::back_inserter(m_scratch));
+        m_touched.swap(m_scratch);
+    }
+
+    if (normals || tangents)
+    {
+        for (const uint32_t v : m_touched)
+        {
+            if (normals)
+                XMStoreFloat3(&vertices[v].Normal, XMVector3Normalize(XMLoadFloat3(&vertices[v].Normal)));
+            if (tangents)
+            {
+                XMFLOAT3* tangent = reinterpret_cast<XMFLOAT3*>(&vertices[v].Tangent);
+                XMStoreFloat3(tangent, XMVector3Normalize(XMLoadFloat3(tangent)));
+            }
+        }
+    }
+
+    if (!m_touched.empty())
+    {
+        first = std::min(first, m_touched.front());
+        end = std::max(end, m_touched.back() + 1);
+    }
+
+    Range range;
+    if (first < end)
+    {
+        range.first = first;
+        range.end = end;
+    }
+    return range;
+}
+
+void MorphTargets::RunBenchmark()
+{
+    constexpr int kFrames = 2000;
+    const wchar_t* file = L"Resources\\scene.gltf";
+
+    tinygltf::Model model;
+    if (!GltfUtils::LoadModel(model, file))
+    {
+        Log::Error(L"Morph target benchmark: cannot load %s", file);
+        return;
+    }
+
+    struct Morphed
+    {
+        ScenePrimitive                      primitive;
+        std::vector<SceneVertex>            sparse;
+        std::vector<SceneVertex>            dense;
+        std::vector<std::vector<XMFLOAT3>>  densePositions;     // per target, every vertex
+        std::vector<std::vector<XMFLOAT3>>  denseNormals;
+    };
+    std::vector<Morphed> morphed;
+    for (const tinygltf::Mesh& mesh : model.meshes)
+    {
+        for (int p = 0; p < (int)mesh.primitives.size(); p++)
+        {
+            if (mesh.primitives[p].targets.empty())
+                continue;
+            Morphed m;
+            if (!m.primitive.LoadGeometryFromGLTF(model, mesh, p, L"") || m.primitive.mMorphTargets.IsEmpty())
+                continue;
+            morphed.push_back(std::move(m));
+        }
+    }
+    if (morphed.empty())
+    {
+        Log::Error(L"Morph target benchmark: no morph targets in %s", file);
+        return;
+    }
+
+    // The dense layout this replaces: a full array of deltas per target and attribute
+    size_t vertices = 0, targets = 0, deltas = 0, sparseBytes = 0, denseBytes = 0;
+    for (Morphed& m : morphed)
+    {
+        const size_t count = m.primitive.mVertices.size();
+        for (const Target& target : m.primitive.mMorphTargets.GetTargets())
+        {
+            std::vector<XMFLOAT3> positions(count, XMFLOAT3(0.0f, 0.0f, 0.0f));
+            std::vector<XMFLOAT3> normals;
+            if (!target.normals.empty())
+                normals.assign(count, XMFLOAT3(0.0f, 0.0f, 0.0f));
+            for (size_t k = 0; k < target.indices.size(); k++)
+            {
+                positions[target.indices[k]] = target.positions[k];
+                if (!normals.empty())
+                    normals[target.indices[k]] = target.normals[k];
+            }
+            denseBytes += (positions.size() + normals.size()) * sizeof(XMFLOAT3);
+            m.densePositions.push_back(std::move(positions));
+            m.denseNormals.push_back(std::move(normals));
+        }
+        m.sparse = m.primitive.mVertices;
+        m.dense = m.primitive.mVertices;
+        vertices += count;
+        targets += m.primitive.mMorphTargets.GetTargetCount();
+        deltas += m.primitive.mMorphTargets.GetDeltaCount();
+        sparseBytes += m.primitive.mMorphTargets.GetMemorySize();
+    }
+
+    // Each target fades in and out on its own phase and is off half the time
+    std::vector<float> weights;
+    auto weightsAt = [&weights](int frame, size_t count)
+    {
+        weights.resize(count);
+        for (size_t t = 0; t < count; t++)
+            weights[t] = std::max(0.0f, sinf(frame * 0.05f + t * 2.1f));
+        return weights.data();
+    };
+
+    size_t uploaded = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int f = 0; f < kFrames; f++)
+    {
+        for (Morphed& m : morphed)
+        {
+            const size_t count = m.primitive.mMorphTargets.GetTargetCount();
+            const MorphTargets::Range range = m.primitive.mMorphTargets.Apply(m.primitive.mVertices.data(), weightsAt(f, count),
+                                                                              count, m.sparse.data());
+            uploaded += range.end - range.first;
+        }
+    }
+    const double sparseSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    start = std::chrono::high_resolution_clock::now();
+    for (int f = 0; f < kFrames; f++)
+    {
+        for (Morphed& m : morphed)
+        {
+            const size_t count = m.primitive.mVertices.size();
+            const float* w = weightsAt(f, m.densePositions.size());
+            for (size_t v = 0; v < count; v++)
+            {
+                XMVECTOR position = XMLoadFloat3(&m.primitive.mVertices[v].Pos);
+                XMVECTOR normal = XMLoadFloat3(&m.primitive.mVertices[v].Normal);
+                bool hasNormals = false;
+                for (size_t t = 0; t < m.densePositions.size(); t++)
+                {
+                    position = XMVectorMultiplyAdd(XMLoadFloat3(&m.densePositions[t][v]), XMVectorReplicate(w[t]), position);
+                    if (!m.denseNormals[t].empty())
+                    {
+                        normal = XMVectorMultiplyAdd(XMLoadFloat3(&m.denseNormals[t][v]), XMVectorReplicate(w[t]), normal);
+                        hasNormals = true;
+                    }
+                }
+                XMStoreFloat3(&m.dense[v].Pos, position);
+                XMStoreFloat3(&m.dense[v].Normal, hasNormals ? XMVector3Normalize(normal) : normal);
+            }
+        }
+    }
+    const double denseSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    float maxError = 0.0f;
+    for (const Morphed& m : morphed)
+    {
+        for (size_t v = 0; v < m.sparse.size(); v++)
+        {
+            const XMVECTOR a = XMLoadFloat3(&m.sparse[v].Pos);
+            const XMVECTOR b = XMLoadFloat3(&m.dense[v].Pos);
+            maxError = std::max(maxError, XMVectorGetX(XMVector3Length(XMVectorSubtract(a, b))));
+            const XMVECTOR na = XMLoadFloat3(&m.sparse[v].Normal);
+            const XMVECTOR nb = XMLoadFloat3(&m.dense[v].Normal);
+            maxError = std::max(maxError, XMVectorGetX(XMVector3Length(XMVectorSubtract(na, nb))));
+        }
+    }
+
+    Log::Info(L"Morph target benchmark: %zu primitives, %zu vertices, %zu targets moving %zu vertices; "
+              L"deltas %zu bytes sparse, %zu bytes dense",
+              morphed.size(), vertices, targets, deltas, sparseBytes, denseBytes);
+    Log::Info(L"Morph target benchmark, %d frames: sparse %.3f us/frame (%.1f vertices uploaded per frame), "
+              L"dense %.3f us/frame, largest difference %.6f",
+              kFrames, sparseSeconds * 1e6 / kFrames, (double)uploaded / kFrames, denseSeconds * 1e6 / kFrames, maxError);
+}
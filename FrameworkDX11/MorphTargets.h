@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <DirectXMath.h>
+#include "tiny_gltf.h"
+
+struct SceneVertex;
+
+// The morph targets of one primitive, stored sparse.
+//
+// A target usually moves a small part of the mesh (a face, a hand), so each keeps only the vertices it
+// actually moves: a sorted index list and the position, normal and tangent deltas parallel to it.
+// Sparse glTF accessors are read as they are; dense ones drop their zero deltas on load.
+//
+// Apply() updates a morphed copy of the vertices in place and only touches what moves: it restores the
+// vertices the previous weights had moved, then adds the deltas of the targets whose weight is not zero.
+// Memory and per frame cost scale with the moved vertices, not with vertices times targets.
+class MorphTargets
+{
+public:
+    struct Target
+    {
+        std::vector<uint32_t>           indices;    // sorted
+        std::vector<DirectX::XMFLOAT3>  positions;
+        std::vector<DirectX::XMFLOAT3>  normals;    // empty if the target has no normal deltas
+        std::vector<DirectX::XMFLOAT3>  tangents;   // empty if the target has no tangent deltas
+    };
+
+    // Vertices changed by Apply(), [first, end), for uploading
+    struct Range
+    {
+        uint32_t first = 0;
+        uint32_t end = 0;
+
+        bool IsEmpty() const { return first >= end; }
+    };
+
+    bool LoadFromGltf(const tinygltf::Model& model, const tinygltf::Primitive& primitive,
+                      size_t vertexCount, const std::wstring& logPrefix);
+
+    // Morphs vertices, which must have started as a copy of base and only ever been changed by this
+    // call. Weights past the target count are ignored, missing ones count as 0. Returns the vertices
+    // changed, empty if the weights are the same as last time.
+    Range Apply(const SceneVertex* base, const float* weights, size_t weightCount, SceneVertex* vertices);
+
+    bool IsEmpty() const { return m_targets.empty(); }
+    size_t GetTargetCount() const { return m_targets.size(); }
+    const std::vector<Target>& GetTargets() const { return m_targets; }
+    size_t GetDeltaCount() const;
+    size_t GetMemorySize() const;
+
+    // Loads the morphed primitives of scene.gltf and logs their memory sparse and dense, the cost of
+    // animating the weights sparse and dense, and the largest difference between the two
+    static void RunBenchmark();
+
+private:
+    void Restore(const SceneVertex* base, SceneVertex* vertices) const;
+
+    std::vector<Target>     m_targets;
+
+    // State of the last Apply()
+    std::vector<float>      m_weights;
+    std::vector<uint32_t>   m_touched;      // sorted vertices it moved
+    std::vector<uint32_t>   m_scratch;
+};
@@ -0,0 +1,242 @@
+#include "NodeAnimator.h"
+#include "scenegraph.h"
+#include "gltf_utils.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <set>
+
+using namespace DirectX;
+
+bool NodeAnimator::Load(const tinygltf::Model& model, const std::vector<SceneNode*>& nodes)
+{
+    Clear();
+
+    std::set<int> joints;
+    for (const tinygltf::Skin& skin : model.skins)
+        joints.insert(skin.joints.begin(), skin.joints.end());
+
+    // Every node some channel moves gets a slot, in order of first appearance
+    std::map<int, int> nodeToSlot;
+    for (const tinygltf::Animation& animation : model.animations)
+    {
+        for (const tinygltf::AnimationChannel& channel : animation.channels)
+        {
+            const int node = channel.target_node;
+            if (channel.target_path == "weights" || joints.count(node) != 0 ||
+                node < 0 || node >= (int)nodes.size() || nodes[node] == nullptr || nodeToSlot.count(node) != 0)
+                continue;
+            nodeToSlot[node] = (int)m_nodes.size();
+            m_nodes.push_back(nodes[node]);
+            m_restTranslation.push_back(XMFLOAT3(0.0f, 0.0f, 0.0f));
+            m_restRotation.push_back(XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f));
+            m_restScale.push_back(XMFLOAT3(1.0f, 1.0f, 1.0f));
+
+            // Channels replace single components, so the rest of the node's transform is needed
+            const tinygltf::Node& gltfNode = model.nodes[node];
+            if (gltfNode.matrix.size() == 16)
+            {
+                XMFLOAT4X4 m;
+                for (int i = 0; i < 16; i++)
+                    m.m[i / 4][i % 4] = (float)gltfNode.matrix[i];
+                XMVECTOR s, r, t;
+                if (XMMatrixDecompose(&s, &r, &t, XMLoadFloat4x4(&m)))
+                {
+                    XMStoreFloat3(&m_restScale.back(), s);
+                    XMStoreFloat4(&m_restRotation.back(), r);
+                    XMStoreFloat3(&m_restTranslation.back(), t);
+                }
+            }
+            else
+            {
+                if (gltfNode.translation.size() == 3)
+                    m_restTranslation.back() = XMFLOAT3((float)gltfNode.translation[0], (float)gltfNode.translation[1], (float)gltfNode.translation[2]);
+                if (gltfNode.rotation.size() == 4)
+                    m_restRotation.back() = XMFLOAT4((float)gltfNode.rotation[0], (float)gltfNode.rotation[1], (float)gltfNode.rotation[2], (float)gltfNode.rotation[3]);
+                if (gltfNode.scale.size() == 3)
+                    m_restScale.back() = XMFLOAT3((float)gltfNode.scale[0], (float)gltfNode.scale[1], (float)gltfNode.scale[2]);
+            }
+        }
+    }
+    if (m_nodes.empty())
+        return false;
+
+    m_translation = m_restTranslation;
+    m_rotation = m_restRotation;
+    m_scale = m_restScale;
+
+    // The slot map stands in for the joint map, so the node channels land in m_channels with their slot
+    // as the joint index. Every animation is kept, empty or not, to keep the file's numbering.
+    m_animations.resize(model.animations.size());
+    m_animatedNodes.resize(model.animations.size());
+    for (unsigned int a = 0; a < (unsigned int)model.animations.size(); a++)
+    {
+        Animation& animation = m_animations[a];
+        animation.LoadFromGltf(model, nodeToSlot, a);
+        animation.m_weightChannels.clear();
+
+        // Drop the joint and weight samplers, which are played elsewhere
+        std::vector<int> remap(animation.m_samplers.size(), -1);
+        std::vector<AnimationSampler> samplers;
+        for (AnimationChannel& channel : animation.m_channels)
+        {
+            if (channel.samplerIndex < 0 || channel.samplerIndex >= (int)remap.size())
+                continue;
+            if (remap[channel.samplerIndex] < 0)
+            {
+                remap[channel.samplerIndex] = (int)samplers.size();
+                samplers.push_back(std::move(animation.m_samplers[channel.samplerIndex]));
+            }
+            channel.samplerIndex = remap[channel.samplerIndex];
+        }
+        animation.m_samplers = std::move(samplers);
+
+        std::vector<int>& animated = m_animatedNodes[a];
+        for (const AnimationChannel& channel : animation.m_channels)
+            animated.push_back(channel.jointIndex);
+        std::sort(animated.begin(), animated.end());
+        animated.erase(std::unique(animated.begin(), animated.end()), animated.end());
+    }
+
+    PlayAnimation(0);
+    return true;
+}
+
+void NodeAnimator::Clear()
+{
+    *this = NodeAnimator();
+}
+
+size_t NodeAnimator::GetChannelCount() const
+{
+    size_t count = 0;
+    for (const Animation& animation : m_animations)
+        count += animation.m_channels.size();
+    return count;
+}
+
+void NodeAnimator::PlayAnimation(unsigned int animation)
+{
+    if (animation >= m_animations.size() || (int)animation == m_currentAnimation)
+        return;
+
+    // Nodes the previous clip moved and this one does not go back to rest
+    if (m_currentAnimation >= 0)
+    {
+        for (const int n : m_animatedNodes[m_currentAnimation])
+        {
+            const XMMATRIX local = XMMatrixAffineTransformation(XMLoadFloat3(&m_restScale[n]), XMVectorZero(),
+                                                                XMLoadFloat4(&m_restRotation[n]), XMLoadFloat3(&m_restTranslation[n]));
+            m_nodes[n]->SetMatrix(local);
+        }
+    }
+
+    m_currentAnimation = (int)animation;
+    m_samplerCursors.assign(m_animations[animation].m_samplers.size(), 0);
+}
+
+float NodeAnimator::GetDuration() const
+{
+    return m_currentAnimation >= 0 ? m_animations[m_currentAnimation].GetEndTime() - m_animations[m_currentAnimation].GetStartTime() : 0.0f;
+}
+
+void NodeAnimator::Evaluate(float time)
+{
+    if (m_currentAnimation < 0)
+        return;
+
+    const Animation& animation = m_animations[m_currentAnimation];
+    const std::vector<int>& animated = m_animatedNodes[m_currentAnimation];
+    if (animated.empty())
+        return;
+
+    const float start = animation.GetStartTime();
+    const float duration = animation.GetEndTime() - start;
+    time = duration > 0.0f ? start + fmodf(std::max(time - start, 0.0f), duration) : start;
+
+    // 1. Rest pose for the nodes the clip moves
+    for (const int n : animated)
+    {
+        m_translation[n] = m_restTranslation[n];
+        m_rotation[n] = m_restRotation[n];
+        m_scale[n] = m_restScale[n];
+    }
+
+    // 2. Every channel into its node's TRS
+    for (const AnimationChannel& channel : animation.m_channels)
+    {
+        const AnimationSampler& sampler = animation.m_samplers[channel.samplerIndex];
+        const size_t count = sampler.GetKeyCount();
+        const bool rotation = channel.path == AnimationChannel::ROTATION;
+        if (count == 0 || rotation == sampler.vec4_values.empty())
+            continue;
+
+        StoreChannelValue(channel, sampler.Sample(time, m_samplerCursors[channel.samplerIndex], rotation));
+    }
+
+    // 3. Local matrices into the nodes, which marks their subtrees for a transform update
+    const XMVECTOR zero = XMVectorZero();
+    for (const int n : animated)
+    {
+        const XMMATRIX local = XMMatrixAffineTransformation(XMLoadFloat3(&m_scale[n]), zero,
+                                                            XMLoadFloat4(&m_rotation[n]), XMLoadFloat3(&m_translation[n]));
+        m_nodes[n]->SetMatrix(local);
+    }
+}
+
+void XM_CALLCONV NodeAnimator::StoreChannelValue(const AnimationChannel& channel, FXMVECTOR value)
+{
+    switch (channel.path)
+    {
+    case AnimationChannel::ROTATION:    XMStoreFloat4(&m_rotation[channel.jointIndex], value); break;
+    case AnimationChannel::TRANSLATION: XMStoreFloat3(&m_translation[channel.jointIndex], value); break;
+    default:                            XMStoreFloat3(&m_scale[channel.jointIndex], value); break;
+    }
+}
+
+void NodeAnimator::RunBenchmark()
+{
+    constexpr int kFrames = 10000;
+    const wchar_t* file = L"Resources\\scene.gltf";
+
+    tinygltf::Model model;
+    if (!GltfUtils::LoadModel(model, file))
+    {
+        Log::Error(L"Node animation benchmark: cannot load %s", file);
+        return;
+    }
+
+    // Flat stand-ins for the scene nodes; the hierarchy does not matter for the sampling cost
+    std::vector<SceneNode> standIns(model.nodes.size());
+    std::vector<SceneNode*> nodes(model.nodes.size());
+    for (size_t n = 0; n < nodes.size(); n++)
+        nodes[n] = &standIns[n];
+
+    NodeAnimator animator;
+    if (!animator.Load(model, nodes))
+    {
+        Log::Error(L"Node animation benchmark: no animated nodes in %s", file);
+        return;
+    }
+
+    for (unsigned int a = 0; a < animator.GetAnimationCount(); a++)
+    {
+        animator.PlayAnimation(a);
+        const size_t channels = animator.m_animations[a].m_channels.size();
+        if (channels == 0)
+            continue;
+
+        const float duration = std::max(animator.GetDuration(), 0.001f);
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (int f = 0; f < kFrames; f++)
+            animator.Evaluate(duration * f / 240.0f);
+        const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+        Log::Info(L"Node animation benchmark, clip %u \"%S\": %zu channels on %zu of %zu nodes, %.3f us/frame",
+                  a, animator.m_animations[a].m_name.c_str(), channels, animator.m_animatedNodes[a].size(),
+                  model.nodes.size(), seconds * 1e6 / kFrames);
+    }
+}
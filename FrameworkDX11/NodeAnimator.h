@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <DirectXMath.h>
+#include "tiny_gltf.h"
+
+#include "Animation.h"
+
+class SceneNode;
+
+// Plays the glTF animation channels that target plain nodes - props, cameras, anything that is not a
+// skin joint (those are the Skeleton's) - onto the scene graph's nodes.
+//
+// The animated nodes are gathered once at load into parallel arrays like the Skeleton's joints, so a
+// frame is three flat passes: reset the nodes the clip animates to their rest TRS, sample every channel
+// into them, and write the composed matrices into the nodes' local transforms. Only those nodes are
+// marked dirty, so only their subtrees get new global transforms (see SceneNode::UpdateTransforms).
+class NodeAnimator
+{
+public:
+    // Binds the node channels of every animation in model. nodes holds the scene node built from each
+    // glTF node (null where there is none); nodes that are joints of a skin are left alone. Returns
+    // false if no animation moves any of the nodes.
+    bool Load(const tinygltf::Model& model, const std::vector<SceneNode*>& nodes);
+    void Clear();
+
+    bool IsEmpty() const { return m_nodes.empty(); }
+    unsigned int GetAnimationCount() const { return (unsigned int)m_animations.size(); }
+    size_t GetNodeCount() const { return m_nodes.size(); }
+    size_t GetChannelCount() const;
+
+    // Same indices as the file's animations (and so as the Skeleton's clips)
+    void PlayAnimation(unsigned int animation);
+    int GetCurrentAnimation() const { return m_currentAnimation; }
+    float GetDuration() const;
+
+    // Samples the current animation at time (wrapped into the clip) into the nodes' local transforms
+    void Evaluate(float time);
+
+    // Binds the node channels of scene.gltf to stand-in nodes and logs the cost of a frame's evaluation
+    static void RunBenchmark();
+
+private:
+    void XM_CALLCONV StoreChannelValue(const AnimationChannel& channel, DirectX::FXMVECTOR value);
+
+    // Node channels only, jointIndex being the index into the arrays below; samplers no channel uses
+    // are dropped
+    std::vector<Animation>              m_animations;
+    std::vector<std::vector<int>>       m_animatedNodes;    // per animation, the nodes it moves
+
+    // Per animated node
+    std::vector<SceneNode*>             m_nodes;
+    std::vector<DirectX::XMFLOAT3>      m_restTranslation;
+    std::vector<DirectX::XMFLOAT4>      m_restRotation;
+    std::vector<DirectX::XMFLOAT3>      m_restScale;
+    std::vector<DirectX::XMFLOAT3>      m_translation;
+    std::vector<DirectX::XMFLOAT4>      m_rotation;
+    std::vector<DirectX::XMFLOAT3>      m_scale;
+
+    int                                 m_currentAnimation = -1;
+    std::vector<size_t>                 m_samplerCursors;
+};
@@ -0,0 +1,115 @@
+#include "PaletteRing.h"
+#include "ConstantBuffers.h"
+#include "RenderStateTracker.h"
+
+#include <algorithm>
+
+using namespace DirectX;
+
+HRESULT PaletteRing::Create(ID3D11Device* device, UINT capacity)
+{
+	Release();
+	m_device = device;
+
+	// Appending needs driver support for NO_OVERWRITE maps on dynamic buffers read through a view
+	D3D11_FEATURE_DATA_D3D11_OPTIONS options = {};
+	if (SUCCEEDED(device->CheckFeatureSupport(D3D11_FEATURE_D3D11_OPTIONS, &options, sizeof(options))))
+		m_noOverwrite = options.MapNoOverwriteOnDynamicBufferSRV != FALSE;
+
+	return Grow(capacity);
+}
+
+void PaletteRing::Release()
+{
+	m_srv.Reset();
+	m_buffer.Reset();
+	m_device.Reset();
+	m_capacity = 0;
+	m_offset = 0;
+	m_noOverwrite = false;
+	m_mapped = false;
+}
+
+HRESULT PaletteRing::Grow(UINT required)
+{
+	UINT capacity = std::max(m_capacity, 256u);
+	while (capacity < required)
+		capacity *= 2;
+
+	D3D11_BUFFER_DESC bd = {};
+	bd.Usage = D3D11_USAGE_DYNAMIC;
+	bd.ByteWidth = capacity * sizeof(XMFLOAT3X4);
+	bd.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+	bd.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+	bd.StructureByteStride = sizeof(XMFLOAT3X4);
+
+	Microsoft::WRL::ComPtr<ID3D11Buffer> buffer;
+	HRESULT hr = m_device->CreateBuffer(&bd, nullptr, &buffer);
+	if (FAILED(hr))
+		return hr;
+
+	D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+	srvDesc.Format = DXGI_FORMAT_UNKNOWN;
+	srvDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+	srvDesc.Buffer.FirstElement = 0;
+	srvDesc.Buffer.NumElements = capacity;
+
+	Microsoft::WRL::ComPtr<ID3D11ShaderResourceView> srv;
+	hr = m_device->CreateShaderResourceView(buffer.Get(), &srvDesc, &srv);
+	if (FAILED(hr))
+		return hr;
+
+	m_buffer = buffer;
+	m_srv = srv;
+	m_capacity = capacity;
+	m_offset = capacity;	// forces a DISCARD on the next map
+	return S_OK;
+}
+
+XMFLOAT3X4* PaletteRing::Map(ID3D11DeviceContext* context, UINT count, UINT& firstMatrix, ConstantBufferStats* stats)
+{
+	if (!m_device || m_mapped || count == 0)
+		return nullptr;
+
+	if (count > m_capacity && FAILED(Grow(count)))
+		return nullptr;
+
+	// Wrap around, or every batch without NO_OVERWRITE - DISCARD hands us a fresh buffer so the GPU
+	// can keep reading the palettes of earlier draws
+	D3D11_MAP mapType = D3D11_MAP_WRITE_NO_OVERWRITE;
+	if (!m_noOverwrite || m_offset + count > m_capacity)
+	{
+		mapType = D3D11_MAP_WRITE_DISCARD;
+		if (stats && m_noOverwrite && m_offset < m_capacity)
+			stats->ringWraps++;
+		m_offset = 0;
+	}
+
+	D3D11_MAPPED_SUBRESOURCE mapped = {};
+	if (FAILED(context->Map(m_buffer.Get(), 0, mapType, 0, &mapped)))
+		return nullptr;
+	m_mapped = true;
+
+	firstMatrix = m_offset;
+	m_offset += count;
+
+	if (stats)
+	{
+		stats->bytesUploaded += count * sizeof(XMFLOAT3X4);
+		stats->uploads++;
+	}
+	return static_cast<XMFLOAT3X4*>(mapped.pData) + firstMatrix;
+}
+
+void PaletteRing::Unmap(ID3D11DeviceContext* context, RenderStateTracker& tracker)
+{
+	if (!m_mapped)
+		return;
+
+	context->Unmap(m_buffer.Get(), 0);
+	m_mapped = false;
+
+	ID3D11ShaderResourceView* srv = m_srv.Get();
+	tracker.SetShaderResources(RenderStateTracker::eVertexStage, kSlot, 1, &srv);
+}
@@ -0,0 +1,47 @@
+// Skinning palettes of every skinned draw in a frame, in one dynamic structured buffer of 3x4 matrices.
+//
+// Callers map a batch, write their palettes straight into it (see Skeleton::GetSkinningMatrices), then
+// bind the buffer once to the vertex shader. Draws find their palette through the offset in their
+// per-draw constants, so there is no joint limit and only the joints a skeleton has are uploaded.
+// Like ConstantBufferRing, later batches of a frame are appended with WRITE_NO_OVERWRITE where the
+// driver allows it on shader resource buffers, and the buffer is renamed with DISCARD when it wraps.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include <DirectXMath.h>
+#include "wrl.h"
+
+class RenderStateTracker;
+struct ConstantBufferStats;
+
+class PaletteRing
+{
+public:
+	// Vertex shader slot of g_palette in skinned_shader.hlsl
+	static constexpr UINT kSlot = 8;
+
+	HRESULT Create(ID3D11Device* device, UINT capacity = 16 * 1024);
+	void	Release();
+
+	// Maps room for count matrices and returns where to write them; firstMatrix is the index of the
+	// first one in the buffer. Grows the buffer if it is too small. Returns null on failure.
+	DirectX::XMFLOAT3X4*	Map(ID3D11DeviceContext* context, UINT count, UINT& firstMatrix, ConstantBufferStats* stats = nullptr);
+
+	// Unmaps the batch and binds the buffer to the vertex shader
+	void	Unmap(ID3D11DeviceContext* context, RenderStateTracker& tracker);
+
+	bool	IsAppending() const { return m_noOverwrite; }
+	UINT	GetCapacity() const { return m_capacity; }
+
+private:
+	HRESULT	Grow(UINT required);
+
+	Microsoft::WRL::ComPtr<ID3D11Device>				m_device;
+	Microsoft::WRL::ComPtr<ID3D11Buffer>				m_buffer;
+	Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>	m_srv;
+	UINT	m_capacity = 0;		// in matrices
+	UINT	m_offset = 0;
+	bool	m_noOverwrite = false;
+	bool	m_mapped = false;
+};
@@ -0,0 +1,48 @@
+#include "PosePool.h"
+
+using namespace DirectX;
+
+PosePool& PosePool::ForThread()
+{
+    static thread_local PosePool pool;
+    return pool;
+}
+
+LocalPose* PosePool::Acquire(size_t jointCount)
+{
+    LocalPose* pose;
+    if (m_free.empty())
+    {
+        m_poses.push_back(std::make_unique<LocalPose>());
+        m_free.reserve(m_poses.size());
+        pose = m_poses.back().get();
+        m_growCount++;
+    }
+    else
+    {
+        pose = m_free.back();
+        m_free.pop_back();
+        if (pose->GetCapacity() < jointCount)
+            m_growCount++;
+    }
+
+    pose->Resize(jointCount);
+    return pose;
+}
+
+void PosePool::Release(LocalPose* pose)
+{
+    if (pose)
+        m_free.push_back(pose);
+}
+
+size_t PosePool::GetMemorySize() const
+{
+    size_t size = m_poses.capacity() * sizeof(std::unique_ptr<LocalPose>) + m_free.capacity() * sizeof(LocalPose*);
+    for (const std::unique_ptr<LocalPose>& pose : m_poses)
+    {
+        size += sizeof(LocalPose) + pose->translation.capacity() * sizeof(XMFLOAT3) +
+                pose->rotation.capacity() * sizeof(XMFLOAT4) + pose->scale.capacity() * sizeof(XMFLOAT3);
+    }
+    return size;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <DirectXMath.h>
+
+// The local TRS of every joint of a skeleton, as parallel arrays in the skeleton's joint order (the
+// same layout as the Skeleton's own local pose).
+struct LocalPose
+{
+    std::vector<DirectX::XMFLOAT3>  translation;
+    std::vector<DirectX::XMFLOAT4>  rotation;
+    std::vector<DirectX::XMFLOAT3>  scale;
+
+    size_t GetJointCount() const { return rotation.size(); }
+    size_t GetCapacity() const { return rotation.capacity(); }
+    void Resize(size_t jointCount)
+    {
+        translation.resize(jointCount);
+        rotation.resize(jointCount);
+        scale.resize(jointCount);
+    }
+};
+
+// Scratch poses for blending, one pool per thread.
+//
+// Poses are handed out and taken back in stack order and keep their arrays between uses, so once a
+// thread has evaluated its deepest blend tree for its largest skeleton, acquiring a pose allocates
+// nothing. GetGrowCount() counts the times a pose had to be created or enlarged.
+class PosePool
+{
+public:
+    // A pose acquired for the scope of the lease
+    class Lease
+    {
+    public:
+        Lease(PosePool& pool, size_t jointCount) : m_pool(pool), m_pose(pool.Acquire(jointCount)) {}
+        ~Lease() { m_pool.Release(m_pose); }
+
+        Lease(const Lease&) = delete;
+        Lease& operator = (const Lease&) = delete;
+
+        LocalPose& operator * () const { return *m_pose; }
+        LocalPose* operator -> () const { return m_pose; }
+
+    private:
+        PosePool&   m_pool;
+        LocalPose*  m_pose;
+    };
+
+    // The calling thread's pool
+    static PosePool& ForThread();
+
+    // A pose with jointCount joints; its contents are whatever its last user left in it
+    LocalPose* Acquire(size_t jointCount);
+    void Release(LocalPose* pose);
+
+    size_t GetPoseCount() const { return m_poses.size(); }
+    size_t GetInUseCount() const { return m_poses.size() - m_free.size(); }
+    size_t GetGrowCount() const { return m_growCount; }
+    size_t GetMemorySize() const;
+
+private:
+    std::vector<std::unique_ptr<LocalPose>> m_poses;
+    std::vector<LocalPose*>                 m_free;     // reserved for every pose, so releasing never allocates
+    size_t                                  m_growCount = 0;
+};
@@ -0,0 +1,322 @@
+#include "RenderStateTracker.h"
+
+#include "utils.hpp"
+
+#include <algorithm>
+
+namespace
+{
+	// Value no live COM object can have; stored in every slot by Invalidate() so the next bind always goes through
+	template <typename T>
+	T* UnknownState()
+	{
+		return reinterpret_cast<T*>(~uintptr_t(0));
+	}
+}
+
+//--------------------------------------------------------------------------------------
+// StateObjectCache
+//--------------------------------------------------------------------------------------
+
+template <typename Desc, typename State, typename CreateFn>
+State* StateObjectCache::Lookup(Table<Desc, State>& table, const Desc& desc, CreateFn create)
+{
+	auto& bucket = table[Utils::HashBytes(&desc, sizeof(Desc))];
+	for (auto& entry : bucket)
+	{
+		if (memcmp(&entry.first, &desc, sizeof(Desc)) == 0)
+		{
+			m_hits++;
+			return entry.second.Get();
+		}
+	}
+
+	Microsoft::WRL::ComPtr<State> state;
+	if (!m_device || FAILED(create(desc, state.GetAddressOf())))
+		return nullptr;
+
+	m_misses++;
+	bucket.emplace_back(desc, state);
+	return state.Get();
+}
+
+ID3D11SamplerState* StateObjectCache::GetSamplerState(const D3D11_SAMPLER_DESC& desc)
+{
+	return Lookup(m_samplers, desc, [this](const D3D11_SAMPLER_DESC& d, ID3D11SamplerState** out)
+		{ return m_device->CreateSamplerState(&d, out); });
+}
+
+ID3D11RasterizerState* StateObjectCache::GetRasterizerState(const D3D11_RASTERIZER_DESC& desc)
+{
+	return Lookup(m_rasterizers, desc, [this](const D3D11_RASTERIZER_DESC& d, ID3D11RasterizerState** out)
+		{ return m_device->CreateRasterizerState(&d, out); });
+}
+
+ID3D11BlendState* StateObjectCache::GetBlendState(const D3D11_BLEND_DESC& desc)
+{
+	return Lookup(m_blends, desc, [this](const D3D11_BLEND_DESC& d, ID3D11BlendState** out)
+		{ return m_device->CreateBlendState(&d, out); });
+}
+
+ID3D11DepthStencilState* StateObjectCache::GetDepthStencilState(const D3D11_DEPTH_STENCIL_DESC& desc)
+{
+	return Lookup(m_depthStencils, desc, [this](const D3D11_DEPTH_STENCIL_DESC& d, ID3D11DepthStencilState** out)
+		{ return m_device->CreateDepthStencilState(&d, out); });
+}
+
+void StateObjectCache::Clear()
+{
+	m_samplers.clear();
+	m_rasterizers.clear();
+	m_blends.clear();
+	m_depthStencils.clear();
+	m_device.Reset();
+}
+
+size_t StateObjectCache::GetObjectCount() const
+{
+	size_t count = 0;
+	for (const auto& bucket : m_samplers)		count += bucket.second.size();
+	for (const auto& bucket : m_rasterizers)	count += bucket.second.size();
+	for (const auto& bucket : m_blends)			count += bucket.second.size();
+	for (const auto& bucket : m_depthStencils)	count += bucket.second.size();
+	return count;
+}
+
+//--------------------------------------------------------------------------------------
+// RenderStateTracker
+//--------------------------------------------------------------------------------------
+
+void RenderStateTracker::Init(ID3D11DeviceContext* context, ID3D11DeviceContext1* context1)
+{
+	m_context = context;
+	m_context1 = context1;
+	Invalidate();
+	m_counters.Reset();
+}
+
+void RenderStateTracker::Invalidate()
+{
+	m_vertexShader = UnknownState<ID3D11VertexShader>();
+	m_pixelShader = UnknownState<ID3D11PixelShader>();
+
+	for (StageState* stage : { &m_vs, &m_ps })
+	{
+		for (auto& cb : stage->constantBuffers)
+			cb = { UnknownState<ID3D11Buffer>(), 0, 0 };
+		std::fill(std::begin(stage->shaderResources), std::end(stage->shaderResources), UnknownState<ID3D11ShaderResourceView>());
+		std::fill(std::begin(stage->samplers), std::end(stage->samplers), UnknownState<ID3D11SamplerState>());
+	}
+
+	m_inputLayout = UnknownState<ID3D11InputLayout>();
+	m_vertexBuffer = UnknownState<ID3D11Buffer>();
+	m_indexBuffer = UnknownState<ID3D11Buffer>();
+	m_topology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
+
+	m_rtv = UnknownState<ID3D11RenderTargetView>();
+	m_dsv = UnknownState<ID3D11DepthStencilView>();
+	m_blendState = UnknownState<ID3D11BlendState>();
+	m_depthStencilState = UnknownState<ID3D11DepthStencilState>();
+	m_rasterizerState = UnknownState<ID3D11RasterizerState>();
+}
+
+void RenderStateTracker::VSSetShader(ID3D11VertexShader* shader)
+{
+	if (!Track(shader != m_vertexShader))
+		return;
+	m_context->VSSetShader(shader, nullptr, 0);
+	m_vertexShader = shader;
+}
+
+void RenderStateTracker::PSSetShader(ID3D11PixelShader* shader)
+{
+	if (!Track(shader != m_pixelShader))
+		return;
+	m_context->PSSetShader(shader, nullptr, 0);
+	m_pixelShader = shader;
+}
+
+void RenderStateTracker::SetConstantBuffer(UINT stages, UINT slot, ID3D11Buffer* buffer, UINT firstConstant, UINT numConstants)
+{
+	const ConstantBufferBinding binding = { buffer, firstConstant, numConstants };
+	if (stages & eVertexStage)
+		SetConstantBufferStage(eVertexStage, slot, binding);
+	if (stages & ePixelStage)
+		SetConstantBufferStage(ePixelStage, slot, binding);
+}
+
+void RenderStateTracker::SetConstantBufferStage(Stage stage, UINT slot, const ConstantBufferBinding& binding)
+{
+	if (slot >= kConstantBufferSlots)
+		return;
+
+	StageState& state = (stage == eVertexStage) ? m_vs : m_ps;
+	if (!Track(!(state.constantBuffers[slot] == binding)))
+		return;
+
+	ID3D11Buffer* buffer = binding.buffer;
+	if (binding.numConstants > 0 && m_context1)
+	{
+		if (stage == eVertexStage)
+			m_context1->VSSetConstantBuffers1(slot, 1, &buffer, &binding.firstConstant, &binding.numConstants);
+		else
+			m_context1->PSSetConstantBuffers1(slot, 1, &buffer, &binding.firstConstant, &binding.numConstants);
+	}
+	else
+	{
+		if (stage == eVertexStage)
+			m_context->VSSetConstantBuffers(slot, 1, &buffer);
+		else
+			m_context->PSSetConstantBuffers(slot, 1, &buffer);
+	}
+	state.constantBuffers[slot] = binding;
+}
+
+void RenderStateTracker::SetShaderResources(UINT stages, UINT startSlot, UINT count, ID3D11ShaderResourceView* const* views)
+{
+	if (stages & eVertexStage)
+		SetShaderResourcesStage(eVertexStage, startSlot, count, views);
+	if (stages & ePixelStage)
+		SetShaderResourcesStage(ePixelStage, startSlot, count, views);
+}
+
+void RenderStateTracker::SetShaderResourcesStage(Stage stage, UINT startSlot, UINT count, ID3D11ShaderResourceView* const* views)
+{
+	StageState& state = (stage == eVertexStage) ? m_vs : m_ps;
+	auto set = [this, stage](UINT start, UINT num, ID3D11ShaderResourceView* const* v)
+	{
+		if (stage == eVertexStage)
+			m_context->VSSetShaderResources(start, num, v);
+		else
+			m_context->PSSetShaderResources(start, num, v);
+	};
+
+	if (startSlot + count > kShaderResourceSlots)
+	{
+		Track(true);
+		set(startSlot, count, views);
+		return;
+	}
+
+	// Only issue the smallest contiguous range that actually changed
+	UINT first = count, last = 0;
+	for (UINT i = 0; i < count; i++)
+	{
+		if (state.shaderResources[startSlot + i] != views[i])
+		{
+			first = std::min(first, i);
+			last = i;
+		}
+	}
+	if (!Track(first < count))
+		return;
+
+	set(startSlot + first, last - first + 1, views + first);
+	for (UINT i = first; i <= last; i++)
+		state.shaderResources[startSlot + i] = views[i];
+}
+
+void RenderStateTracker::SetSamplers(UINT stages, UINT startSlot, UINT count, ID3D11SamplerState* const* samplers)
+{
+	if (stages & eVertexStage)
+		SetSamplersStage(eVertexStage, startSlot, count, samplers);
+	if (stages & ePixelStage)
+		SetSamplersStage(ePixelStage, startSlot, count, samplers);
+}
+
+void RenderStateTracker::SetSamplersStage(Stage stage, UINT startSlot, UINT count, ID3D11SamplerState* const* samplers)
+{
+	if (startSlot + count > kSamplerSlots)
+		return;
+
+	StageState& state = (stage == eVertexStage) ? m_vs : m_ps;
+
+	UINT first = count, last = 0;
+	for (UINT i = 0; i < count; i++)
+	{
+		if (state.samplers[startSlot + i] != samplers[i])
+		{
+			first = std::min(first, i);
+			last = i;
+		}
+	}
+	if (!Track(first < count))
+		return;
+
+	if (stage == eVertexStage)
+		m_context->VSSetSamplers(startSlot + first, last - first + 1, samplers + first);
+	else
+		m_context->PSSetSamplers(startSlot + first, last - first + 1, samplers + first);
+	for (UINT i = first; i <= last; i++)
+		state.samplers[startSlot + i] = samplers[i];
+}
+
+void RenderStateTracker::IASetInputLayout(ID3D11InputLayout* layout)
+{
+	if (!Track(layout != m_inputLayout))
+		return;
+	m_context->IASetInputLayout(layout);
+	m_inputLayout = layout;
+}
+
+void RenderStateTracker::IASetVertexBuffer(ID3D11Buffer* buffer, UINT stride, UINT offset)
+{
+	if (!Track(buffer != m_vertexBuffer || stride != m_vertexStride || offset != m_vertexOffset))
+		return;
+	m_context->IASetVertexBuffers(0, 1, &buffer, &stride, &offset);
+	m_vertexBuffer = buffer;
+	m_vertexStride = stride;
+	m_vertexOffset = offset;
+}
+
+void RenderStateTracker::IASetIndexBuffer(ID3D11Buffer* buffer, DXGI_FORMAT format, UINT offset)
+{
+	if (!Track(buffer != m_indexBuffer || format != m_indexFormat || offset != m_indexOffset))
+		return;
+	m_context->IASetIndexBuffer(buffer, format, offset);
+	m_indexBuffer = buffer;
+	m_indexFormat = format;
+	m_indexOffset = offset;
+}
+
+void RenderStateTracker::IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY topology)
+{
+	if (!Track(topology != m_topology))
+		return;
+	m_context->IASetPrimitiveTopology(topology);
+	m_topology = topology;
+}
+
+void RenderStateTracker::OMSetRenderTargets(ID3D11RenderTargetView* rtv, ID3D11DepthStencilView* dsv)
+{
+	if (!Track(rtv != m_rtv || dsv != m_dsv))
+		return;
+	m_context->OMSetRenderTargets(rtv ? 1 : 0, rtv ? &rtv : nullptr, dsv);
+	m_rtv = rtv;
+	m_dsv = dsv;
+}
+
+void RenderStateTracker::OMSetBlendState(ID3D11BlendState* state)
+{
+	if (!Track(state != m_blendState))
+		return;
+	m_context->OMSetBlendState(state, nullptr, 0xffffffff);
+	m_blendState = state;
+}
+
+void RenderStateTracker::OMSetDepthStencilState(ID3D11DepthStencilState* state, UINT stencilRef)
+{
+	if (!Track(state != m_depthStencilState || stencilRef != m_stencilRef))
+		return;
+	m_context->OMSetDepthStencilState(state, stencilRef);
+	m_depthStencilState = state;
+	m_stencilRef = stencilRef;
+}
+
+void RenderStateTracker::RSSetState(ID3D11RasterizerState* state)
+{
+	if (!Track(state != m_rasterizerState))
+		return;
+	m_context->RSSetState(state);
+	m_rasterizerState = state;
+}
@@ -0,0 +1,168 @@
+// Render state shadowing over the immediate context.
+//
+// RenderStateTracker remembers what is bound (shaders, constant buffers, SRVs, samplers, IA state,
+// render targets and fixed function states) and drops calls that would bind the same thing again.
+// StateObjectCache hands out one sampler / rasterizer / blend / depth-stencil object per unique
+// description so scene code can ask for states by description without creating duplicates.
+//
+// The tracker only knows about calls that go through it. Anything that binds directly on the
+// context (e.g. ClearState) must be followed by Invalidate(). The ImGui DX11 backend backs up and
+// restores the state it touches, so it doesn't need one.
+//
+// Bindings are remembered as raw pointers. If an object is released and a new one happens to be
+// created at the same address while still "bound", the rebind would be filtered - call Invalidate()
+// after freeing resources that might still be bound.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include "wrl.h"
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+struct RenderStateCounters
+{
+	UINT	issued = 0;
+	UINT	filtered = 0;
+
+	void Reset() { *this = RenderStateCounters(); }
+};
+
+class StateObjectCache
+{
+public:
+	void	Init(ID3D11Device* device) { m_device = device; }
+	void	Clear();
+
+	ID3D11SamplerState*			GetSamplerState(const D3D11_SAMPLER_DESC& desc);
+	ID3D11RasterizerState*		GetRasterizerState(const D3D11_RASTERIZER_DESC& desc);
+	ID3D11BlendState*			GetBlendState(const D3D11_BLEND_DESC& desc);
+	ID3D11DepthStencilState*	GetDepthStencilState(const D3D11_DEPTH_STENCIL_DESC& desc);
+
+	size_t	GetObjectCount() const;
+	UINT	GetHits() const { return m_hits; }
+	UINT	GetMisses() const { return m_misses; }
+
+private:
+	// Hash buckets of (description, object); the description is compared in full on lookup
+	template <typename Desc, typename State>
+	using Table = std::unordered_map<uint64_t, std::vector<std::pair<Desc, Microsoft::WRL::ComPtr<State>>>>;
+
+	template <typename Desc, typename State, typename CreateFn>
+	State* Lookup(Table<Desc, State>& table, const Desc& desc, CreateFn create);
+
+	Microsoft::WRL::ComPtr<ID3D11Device>						m_device;
+	Table<D3D11_SAMPLER_DESC, ID3D11SamplerState>				m_samplers;
+	Table<D3D11_RASTERIZER_DESC, ID3D11RasterizerState>			m_rasterizers;
+	Table<D3D11_BLEND_DESC, ID3D11BlendState>					m_blends;
+	Table<D3D11_DEPTH_STENCIL_DESC, ID3D11DepthStencilState>	m_depthStencils;
+	UINT	m_hits = 0;
+	UINT	m_misses = 0;
+};
+
+class RenderStateTracker
+{
+public:
+	static constexpr UINT kConstantBufferSlots = D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT;
+	static constexpr UINT kShaderResourceSlots = 32;	// higher slots are passed through untracked
+	static constexpr UINT kSamplerSlots = D3D11_COMMONSHADER_SAMPLER_SLOT_COUNT;
+
+	enum Stage
+	{
+		eVertexStage = 1,
+		ePixelStage = 2,
+		eBothStages = eVertexStage | ePixelStage,
+	};
+
+	void	Init(ID3D11DeviceContext* context, ID3D11DeviceContext1* context1);
+	void	Invalidate();
+
+	// Shaders
+	void	VSSetShader(ID3D11VertexShader* shader);
+	void	PSSetShader(ID3D11PixelShader* shader);
+
+	// Constant buffers - numConstants == 0 binds the whole buffer, otherwise the 11.1 offset variant is used
+	void	SetConstantBuffer(UINT stages, UINT slot, ID3D11Buffer* buffer, UINT firstConstant = 0, UINT numConstants = 0);
+
+	// Shader resources and samplers
+	void	SetShaderResources(UINT stages, UINT startSlot, UINT count, ID3D11ShaderResourceView* const* views);
+	void	SetSamplers(UINT stages, UINT startSlot, UINT count, ID3D11SamplerState* const* samplers);
+
+	// Input assembler
+	void	IASetInputLayout(ID3D11InputLayout* layout);
+	void	IASetVertexBuffer(ID3D11Buffer* buffer, UINT stride, UINT offset);
+	void	IASetIndexBuffer(ID3D11Buffer* buffer, DXGI_FORMAT format, UINT offset);
+	void	IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY topology);
+
+	// Output merger / rasterizer
+	void	OMSetRenderTargets(ID3D11RenderTargetView* rtv, ID3D11DepthStencilView* dsv);
+	void	OMSetBlendState(ID3D11BlendState* state);
+	void	OMSetDepthStencilState(ID3D11DepthStencilState* state, UINT stencilRef);
+	void	RSSetState(ID3D11RasterizerState* state);
+
+	const RenderStateCounters&	GetCounters() const { return m_counters; }
+	void						ResetCounters() { m_counters.Reset(); }
+
+	ID3D11DeviceContext*		GetContext() const { return m_context; }
+
+private:
+	struct ConstantBufferBinding
+	{
+		ID3D11Buffer*	buffer = nullptr;
+		UINT			firstConstant = 0;
+		UINT			numConstants = 0;
+
+		bool operator == (const ConstantBufferBinding& o) const
+		{
+			return buffer == o.buffer && firstConstant == o.firstConstant && numConstants == o.numConstants;
+		}
+	};
+
+	struct StageState
+	{
+		ConstantBufferBinding		constantBuffers[kConstantBufferSlots];
+		ID3D11ShaderResourceView*	shaderResources[kShaderResourceSlots];
+		ID3D11SamplerState*			samplers[kSamplerSlots];
+	};
+
+	void	SetConstantBufferStage(Stage stage, UINT slot, const ConstantBufferBinding& binding);
+	void	SetShaderResourcesStage(Stage stage, UINT startSlot, UINT count, ID3D11ShaderResourceView* const* views);
+	void	SetSamplersStage(Stage stage, UINT startSlot, UINT count, ID3D11SamplerState* const* samplers);
+
+	// Returns true when the call must be issued, and counts it either way
+	bool	Track(bool changed)
+	{
+		if (changed)
+			m_counters.issued++;
+		else
+			m_counters.filtered++;
+		return changed;
+	}
+
+	ID3D11DeviceContext*	m_context = nullptr;
+	ID3D11DeviceContext1*	m_context1 = nullptr;
+
+	ID3D11VertexShader*		m_vertexShader = nullptr;
+	ID3D11PixelShader*		m_pixelShader = nullptr;
+	StageState				m_vs = {};
+	StageState				m_ps = {};
+
+	ID3D11InputLayout*		m_inputLayout = nullptr;
+	ID3D11Buffer*			m_vertexBuffer = nullptr;
+	UINT					m_vertexStride = 0;
+	UINT					m_vertexOffset = 0;
+	ID3D11Buffer*			m_indexBuffer = nullptr;
+	DXGI_FORMAT				m_indexFormat = DXGI_FORMAT_UNKNOWN;
+	UINT					m_indexOffset = 0;
+	D3D11_PRIMITIVE_TOPOLOGY m_topology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
+
+	ID3D11RenderTargetView*	m_rtv = nullptr;
+	ID3D11DepthStencilView*	m_dsv = nullptr;
+	ID3D11BlendState*		m_blendState = nullptr;
+	ID3D11DepthStencilState* m_depthStencilState = nullptr;
+	UINT					m_stencilRef = 0;
+	ID3D11RasterizerState*	m_rasterizerState = nullptr;
+
+	RenderStateCounters		m_counters;
+};
@@ -1,8 +1,9 @@
 #include "Scene.h"
-#include "DDSTextureLoader.h"
 #include <iostream>
 #include "DX11Renderer.h"
+#include "log.hpp"
 #include <algorithm>
+#include <random>
 
 // Initialization function for the scene
 HRESULT Scene::init(HWND hwnd, const Microsoft::WRL::ComPtr<ID3D11Device>& device, const Microsoft::WRL::ComPtr<ID3D11DeviceContext>& context, DX11Renderer* renderer)
@@ -17,19 +18,26 @@ HRESULT Scene::init(HWND hwnd, const Microsoft::WRL::ComPtr<ID3D11Device>& devic
     GetClientRect(hwnd, &rc);
     UINT width = rc.right - rc.left;
     UINT height = rc.bottom - rc.top;
+    m_viewportHeight = height;
     HRESULT hr;
 
     // Initialize the context, renderer, and scene object
-    m_ctx.Init(device.Get(), context.Get(), renderer);
+    m_ctx.Init(device.Get(), context.Get(), renderer, &renderer->m_stateTracker, &renderer->m_stateObjectCache);
     // Load a 3D model (e.g., a sphere) from a .gltf file into the scene object
     
     bool ok = m_sceneobject.LoadGLTF(m_ctx, L"Resources\\sphere.gltf");
-    bool ok2 = m_sceneobject2.LoadGLTF(m_ctx, L"Resources\\simplerig.gltf");
+    bool ok2 = m_sceneobject2.LoadGLTFWithSkeleton(m_ctx, L"Resources\\simplerig.gltf");
 	//bool ok3 = m_sceneobject3.LoadGLTF(m_ctx, L"Resources\\box.gltf");
+    // Only drawn once setCrowdSize() asks for it
+    if (!m_crowd.LoadGLTFWithSkeleton(m_ctx, L"Resources\\RiggedFigure.gltf"))
+        Log::Warning(L"Scene: no crowd, cannot load Resources\\RiggedFigure.gltf");
+    m_crowd.AddTranslationToRoots({ 0.0, -1.0, 4.0 });
 	m_objects[0] = &m_sceneobject;
     m_objects[1] = &m_sceneobject2;
     //m_objects[2] = &m_sceneobject3;
     m_sceneobject2.AddScaleToRoots(0.5f);
+    // The sphere is the material preview - it always uses the editable default material
+    m_sceneobject.SetMaterial(kDefaultMaterial);
     if (!ok)
 		return E_FAIL;  // If loading fails, return an error
 
@@ -44,69 +52,46 @@ HRESULT Scene::init(HWND hwnd, const Microsoft::WRL::ComPtr<ID3D11Device>& devic
     // Create a camera with initial position, target, and up vector
     m_pCamera = new Camera(XMFLOAT3(0, 0, -6), XMFLOAT3(0, 0, 1), XMFLOAT3(0.0f, 1.0f, 0.0f), width, height);
 
-    // Create the constant buffer for transformation matrices (view, projection, etc.)
-    D3D11_BUFFER_DESC bd = {};
-    bd.Usage = D3D11_USAGE_DEFAULT;
-    bd.ByteWidth = sizeof(ConstantBufferSwitch);
-    bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    bd.CPUAccessFlags = 0;
-    hr = m_pd3dDevice->CreateBuffer(&bd, nullptr, &m_pConstantBufferSwitch);
+    // Create the constant buffers, one per update frequency
+    hr = m_cbPerView.Create(m_pd3dDevice.Get());
     if (FAILED(hr))
         return hr;  // If buffer creation fails, return the error
-
-    bd = {};
-    bd.Usage = D3D11_USAGE_DEFAULT;
-    bd.ByteWidth = sizeof(ConstantBufferlight);
-    bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    bd.CPUAccessFlags = 0;
-    hr = m_pd3dDevice->CreateBuffer(&bd, nullptr, &m_pConstantBufferlight);
+    hr = m_cbSolidColour.Create(m_pd3dDevice.Get());
     if (FAILED(hr))
-        return hr;  // If buffer creation fails, return the error
+        return hr;
 
     // Set up light properties
     setupLightProperties();
 
     // Create the light constant buffer to send light data to the GPU
-    bd.Usage = D3D11_USAGE_DEFAULT;
-    bd.ByteWidth = sizeof(LightPropertiesConstantBuffer);
-    bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    bd.CPUAccessFlags = 0;
-    hr = m_pd3dDevice->CreateBuffer(&bd, nullptr, &m_pLightConstantBuffer);
-    if (FAILED(hr))
-        return hr;  // If buffer creation fails, return the error
-
-    // Load texture resources
-    hr = CreateDDSTextureFromFile(m_pd3dDevice.Get(), L"Resources\\rusty_metal_04_diff.dds", nullptr, &m_pTextureDiffuse);
-    if (FAILED(hr))
-        return hr;
-    hr = CreateDDSTextureFromFile(m_pd3dDevice.Get(), L"Resources\\rusty_metal_04_metal.dds", nullptr, &m_pTextureMetallic);
-    if (FAILED(hr))
-        return hr;
-    hr = CreateDDSTextureFromFile(m_pd3dDevice.Get(), L"Resources\\rusty_metal_04_rough.dds", nullptr, &m_pTextureRoughness);
-    if (FAILED(hr))
-        return hr;/*
-    hr = CreateDDSTextureFromFile(m_pd3dDevice.Get(), L"Resources\\space_albedo.dds", nullptr, &m_pTextureDiffuse);
+    hr = m_cbLights.Create(m_pd3dDevice.Get());
     if (FAILED(hr))
         return hr;
-    hr = CreateDDSTextureFromFile(m_pd3dDevice.Get(), L"Resources\\space_metallic.dds", nullptr, &m_pTextureMetallic);
-    if (FAILED(hr))
-        return hr;
-    hr = CreateDDSTextureFromFile(m_pd3dDevice.Get(), L"Resources\\space_rough.dds", nullptr, &m_pTextureRoughness);*/
-    if (FAILED(hr))
-        return hr;
-    hr = CreateDDSTextureFromFile(m_pd3dDevice.Get(), L"Resources\\SpecularCM.dds", nullptr, &m_pTextureSpecularIBL);
-    if (FAILED(hr))
-        return hr;
-    hr = CreateDDSTextureFromFile(m_pd3dDevice.Get(), L"Resources\\DiffuseCM.dds", nullptr, &m_pTextureDiffuseIBL);
+
+    // Per-cluster light lists for shader_me
+    hr = m_clusteredLighting.Init(m_pd3dDevice.Get(), width, height);
     if (FAILED(hr))
         return hr;
 
-
-    // place this where other textures are sent to the pixel shader
-
-    m_pImmediateContext->PSSetShaderResources(5, 1, &m_pTextureSpecularIBL);
-
-    m_pImmediateContext->PSSetShaderResources(6, 1, &m_pTextureDiffuseIBL);
+    // Load texture resources. Only the mip tails are read here, the streamer brings in the rest as the
+    // draws need it (see TextureStreamer) - which is why the views are looked up every frame.
+    AssetRegistry& assets = renderer->m_assets;
+    m_textureDiffuse = assets.AcquireTexture(L"Resources\\rusty_metal_04_diff.dds");
+    m_textureMetallic = assets.AcquireTexture(L"Resources\\rusty_metal_04_metal.dds");
+    m_textureRoughness = assets.AcquireTexture(L"Resources\\rusty_metal_04_rough.dds");
+    /*m_textureDiffuse = assets.AcquireTexture(L"Resources\\space_albedo.dds");
+    m_textureMetallic = assets.AcquireTexture(L"Resources\\space_metallic.dds");
+    m_textureRoughness = assets.AcquireTexture(L"Resources\\space_rough.dds");*/
+    m_textureSpecularIBL = assets.AcquireTexture(L"Resources\\SpecularCM.dds");
+    m_textureDiffuseIBL = assets.AcquireTexture(L"Resources\\DiffuseCM.dds");
+    for (const AssetRegistry::TextureRef& texture : { m_textureDiffuse, m_textureMetallic, m_textureRoughness, m_textureSpecularIBL, m_textureDiffuseIBL })
+    {
+        if (!texture)
+            return E_FAIL;
+    }
+    const TextureStreamer::Handle defaultTextures[MaterialLibrary::kTextureSlots] =
+        { m_textureDiffuse->handle, m_textureMetallic->handle, m_textureRoughness->handle };
+    renderer->m_materials.SetStreamedTextures(kDefaultMaterial, defaultTextures);
 
     // Set up a sampler state for texture sampling (anisotropic filtering)
     D3D11_SAMPLER_DESC sampDesc;
@@ -118,7 +103,9 @@ HRESULT Scene::init(HWND hwnd, const Microsoft::WRL::ComPtr<ID3D11Device>& devic
     sampDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
     sampDesc.MinLOD = 0;
     sampDesc.MaxLOD = D3D11_FLOAT32_MAX;
-    hr = m_pd3dDevice->CreateSamplerState(&sampDesc, &m_pSamplerLinear);
+    m_pSamplerLinear = renderer->m_stateObjectCache.GetSamplerState(sampDesc);
+    if (m_pSamplerLinear == nullptr)
+        return E_FAIL;
 
     return S_OK;  // Return success
 }
@@ -126,6 +113,18 @@ HRESULT Scene::init(HWND hwnd, const Microsoft::WRL::ComPtr<ID3D11Device>& devic
 // Cleanup function, deletes the camera
 void Scene::cleanUp()
 {
+    // Dropping the last references unloads the textures, so the default material lets go of them first
+    ID3D11ShaderResourceView* noViews[MaterialLibrary::kTextureSlots] = {};
+    const TextureStreamer::Handle noTextures[MaterialLibrary::kTextureSlots] =
+        { TextureStreamer::kInvalidHandle, TextureStreamer::kInvalidHandle, TextureStreamer::kInvalidHandle };
+    m_pRenderer->m_materials.SetDefaultTextures(noViews);
+    m_pRenderer->m_materials.SetStreamedTextures(kDefaultMaterial, noTextures);
+    m_textureDiffuse.reset();
+    m_textureMetallic.reset();
+    m_textureRoughness.reset();
+    m_textureSpecularIBL.reset();
+    m_textureDiffuseIBL.reset();
+    m_clusteredLighting.Release();
     delete m_pCamera;
 }
 
@@ -157,17 +156,45 @@ void Scene::setupLightProperties()
     
     LightPosition = XMFLOAT4(-5, 5, -6, 1);
     light2.Position = LightPosition;
-    for (int x = 0; x < MAX_LIGHTS; x++)
+
+    // Store the lights in the scene
+    m_lights.clear();
+    m_lights.push_back(light);
+    m_lights.push_back(light2);
+}
+
+// Scatters point lights with a short reach around the origin, for testing the clustered lighting
+void Scene::addRandomLights(int count)
+{
+    static std::mt19937 rng(5489u);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> colour(0.2f, 1.0f);
+
+    for (int i = 0; i < count; i++)
     {
-        m_lightProperties.Lights[x] = light2;
-        m_lightProperties.Lights[x].Enabled = false;
+        Light light;
+        light.Enabled = static_cast<int>(true);
+        light.LightType = PointLight;
+        light.Color = XMFLOAT4(colour(rng), colour(rng), colour(rng), 1);
+        light.Position = XMFLOAT4(position(rng), position(rng) * 0.5f, position(rng), 1);
+        light.ConstantAttenuation = 1.0f;
+        light.LinearAttenuation = 0.0f;
+        light.QuadraticAttenuation = 4.0f;  // about 8 units of reach
+        m_lights.push_back(light);
     }
+}
 
-    // Update the light properties struct
-    m_lightProperties.EyePosition = XMFLOAT4(m_pCamera->getPosition().x, m_pCamera->getPosition().y, m_pCamera->getPosition().z, 1);
-    m_lightProperties.Lights[0] = light;  // Store the light in the light properties
-    m_lightProperties.Lights[1] = light2;  // Store the light in the light properties
-    
+void Scene::setCrowdSize(int count)
+{
+    m_crowdSize = std::max(count, 0);
+    m_crowd.SetInstanceGrid((unsigned int)m_crowdSize, 1.5f);
+}
+
+void Scene::setCrowdBaked(bool baked)
+{
+    m_crowdBaked = baked;
+    m_crowd.BakeAnimations(baked ? 30.0f : 0.0f);
+    m_crowd.SetInstanceGrid((unsigned int)m_crowdSize, 1.5f);
 }
 
 //void Scene::setTexture(int tId)
@@ -179,9 +206,9 @@ void Scene::setupLightProperties()
 
 void Scene::setLightPos(int lightIndex, XMFLOAT4 pos)
 {
-    if (lightIndex >= 0 && lightIndex < MAX_LIGHTS) 
+    if (lightIndex >= 0 && lightIndex < (int)m_lights.size())
     {
-		m_lightProperties.Lights[lightIndex].Position = pos;
+		m_lights[lightIndex].Position = pos;
     }
 }
 
@@ -234,49 +261,97 @@ void Scene::update(const float deltaTime)
 
 
 
-    // Bind texture resources to pixel shader stages
-    m_pImmediateContext->PSSetShaderResources(0, 1, &m_pTextureDiffuse);
-    m_pImmediateContext->PSSetShaderResources(1, 1, &m_pTextureMetallic);
-    m_pImmediateContext->PSSetShaderResources(2, 1, &m_pTextureRoughness);
-	m_pImmediateContext->PSSetShaderResources(3, 1, &m_pTextureDiffuseIBL);
-	m_pImmediateContext->PSSetShaderResources(4, 1, &m_pTextureSpecularIBL);
+    // Streamed textures get a new view each time a level comes in
+    TextureStreamer& streamer = m_pRenderer->m_textureStreamer;
+    if (streamer.GetViewVersion() != m_textureViewVersion)
+    {
+        ID3D11ShaderResourceView* defaultTextures[MaterialLibrary::kTextureSlots] =
+            { streamer.GetView(m_textureDiffuse->handle), streamer.GetView(m_textureMetallic->handle), streamer.GetView(m_textureRoughness->handle) };
+        m_pRenderer->m_materials.SetDefaultTextures(defaultTextures);
+        m_textureViewVersion = streamer.GetViewVersion();
+    }
 
-    m_pImmediateContext->PSSetSamplers(0, 1, &m_pSamplerLinear);
+    // Bind the IBL maps - material textures (t0-t2) are bound per draw by the material library.
+    // The tracker drops them if nothing changed since last frame. They are sampled over the whole
+    // screen, so they are wanted at full detail.
+    streamer.RequestMip(m_textureDiffuseIBL->handle, 0);
+    streamer.RequestMip(m_textureSpecularIBL->handle, 0);
+    RenderStateTracker& tracker = m_pRenderer->m_stateTracker;
+    ID3D11ShaderResourceView* iblTextures[] = { streamer.GetView(m_textureDiffuseIBL->handle), streamer.GetView(m_textureSpecularIBL->handle) };
+    tracker.SetShaderResources(RenderStateTracker::ePixelStage, 3, ARRAYSIZE(iblTextures), iblTextures);
+
+    tracker.SetSamplers(RenderStateTracker::ePixelStage, 0, 1, &m_pSamplerLinear);
+
+    ConstantBufferStats* stats = &m_pRenderer->m_cbStats;
+    stats->legacyBytes += kLegacyPerFrameBytes;
+
+    // Per-view block - changes only when the camera moves
+    CbPerView cbView;
+    cbView.mView = XMMatrixTranspose(getCamera()->getViewMatrix());  // Transpose for HLSL compatibility
+    cbView.mProjection = XMMatrixTranspose(getCamera()->getProjectionMatrix());  // Transpose for HLSL compatibility
+    cbView.EyePosition = XMFLOAT4(m_pCamera->getPosition().x, m_pCamera->getPosition().y, m_pCamera->getPosition().z, 1);
+    cbView.IBLType = type;
+    cbView.padding = XMFLOAT3(0, 0, 0);
+    m_cbPerView.Update(m_pImmediateContext.Get(), cbView, stats);
+
+    // Default material - changes only when the ImGui sliders move. glTF materials are immutable.
+    // The shader scales the maps by the factors, so textured the sliders are left out as before
+    const bool textured = textureSelect == 1;
+    CbPerMaterial cbMaterial = {};
+    cbMaterial.albedo = textured ? XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f) : XMFLOAT4(albedo.x, albedo.y, albedo.z, 1.0f);
+    cbMaterial.metal = textured ? 1.0f : metal;
+    cbMaterial.rough = textured ? 1.0f : rough;
+    cbMaterial.textureSelect = textureSelect;
+    cbMaterial.albedoGrey = 0;
+    m_pRenderer->m_materials.UpdateDefault(m_pImmediateContext.Get(), cbMaterial, stats);
+
+    // Per-frame block - changes only when one of the first MAX_LIGHTS lights is edited
+    for (int x = 0; x < MAX_LIGHTS; x++)
+    {
+        if (x < (int)m_lights.size())
+        {
+            m_lightProperties.Lights[x] = m_lights[x];
+        }
+        else
+        {
+            m_lightProperties.Lights[x] = Light();
+        }
+    }
+    m_cbLights.Update(m_pImmediateContext.Get(), m_lightProperties, stats);
 
-    // Prepare the constant buffer with the updated view and projection matrices
-    ConstantBufferSwitch cb;
-    cb.mWorld = XMMatrixTranspose(XMMatrixIdentity());  // Identity world matrix
-    cb.mView = XMMatrixTranspose(getCamera()->getViewMatrix());  // Transpose for HLSL compatibility
-    cb.mProjection = XMMatrixTranspose(getCamera()->getProjectionMatrix());  // Transpose for HLSL compatibility
-    cb.vOutputColor = XMFLOAT4(0, 0, 1, 1);  // Placeholder for output color
+    // Clustered light lists - rebuilt every frame as they depend on the camera
+    m_clusteredLighting.Assign(m_lights, getCamera()->getViewMatrix(), getCamera()->getProjectionMatrix());
+    m_clusteredLighting.Upload(m_pImmediateContext.Get(), stats);
+    m_clusteredLighting.Bind(tracker);
 
-	cb.frank = XMFLOAT4(albedo.x, albedo.y, albedo.z, 1.0f);
-    cb.metal = metal;
-    cb.rough = rough;
-    cb.type = type;
-    cb.textureSelect = textureSelect;
+    tracker.SetConstantBuffer(RenderStateTracker::eBothStages, 3, m_cbPerView.Get());
+    tracker.SetConstantBuffer(RenderStateTracker::ePixelStage, 1, m_cbLights.Get());
 
 
-    m_pImmediateContext->UpdateSubresource(m_pConstantBufferSwitch.Get(), 0, nullptr, &cb, 0, 0);
+    m_sceneobject.AnimateFrame(m_ctx, deltaTime);
+	m_sceneobject2.AnimateFrame(m_ctx, deltaTime);
 
-    m_lightProperties.EyePosition = XMFLOAT4(m_pCamera->getPosition().x, m_pCamera->getPosition().y, m_pCamera->getPosition().z, 1);
-    
-    m_pImmediateContext->UpdateSubresource(m_pLightConstantBuffer.Get(), 0, nullptr, &m_lightProperties, 0, 0);
-    ID3D11Buffer* buf = m_pLightConstantBuffer.Get();
-    m_pImmediateContext->PSSetConstantBuffers(1, 1, &buf);
+    // Pose every skeleton at once, so the work is spread over the job system instead of done draw by draw
+    m_sceneobject2.GatherAnimated(m_animationScheduler);
+    if (m_crowdSize > 0)
+    {
+        m_crowd.AnimateFrame(m_ctx, deltaTime);
+        m_crowd.GatherAnimated(m_animationScheduler);
+    }
+    m_animationScheduler.Update(deltaTime, getCamera()->getViewMatrix(), getCamera()->getProjectionMatrix());
 
+    // The draws ask for texture detail by their size on screen
+    m_ctx.SetView(getCamera()->getViewMatrix(), getCamera()->getProjectionMatrix(), (float)m_viewportHeight);
 
-    m_sceneobject.AnimateFrame(m_ctx);
     m_sceneobject.RenderFrame(m_ctx, deltaTime);
-
-	m_sceneobject2.AnimateFrame(m_ctx);
 	m_sceneobject2.RenderFrame(m_ctx, deltaTime);
+    if (m_crowdSize > 0)
+        m_crowd.RenderFrame(m_ctx, deltaTime);
 
 	ConstantBufferlight cb2;
     cb2.vOutputColor2 = XMFLOAT4(0, 0, 1, 1);
-    m_pImmediateContext->UpdateSubresource(m_pConstantBufferlight.Get(), 0, nullptr, &cb2, 0, 0);
+    m_cbSolidColour.Update(m_pImmediateContext.Get(), cb2, stats);
 
-    m_pImmediateContext->PSSetShader(m_pRenderer->m_pPixelSolidShader.Get(),nullptr,0);
-    ID3D11Buffer* cbSwitch = m_pConstantBufferlight.Get();
-    m_pImmediateContext->PSSetConstantBuffers(2, 1, &cbSwitch);
+    tracker.PSSetShader(m_pRenderer->m_pPixelSolidShader.Get());
+    tracker.SetConstantBuffer(RenderStateTracker::ePixelStage, 2, m_cbSolidColour.Get());
 }
\ No newline at end of file
@@ -21,7 +21,10 @@
 #include <vector>
 #include "wrl.h"
 #include "structures.h"
+#include "ConstantBuffers.h"
+#include "ClusteredLighting.h"
 #include "scenegraph.h"
+#include "AssetRegistry.h"
 
 class DX11Renderer;
 
@@ -43,13 +46,23 @@ public:
 	
 	const LightPropertiesConstantBuffer& getLightProperties() { return m_lightProperties; }
 
+	void		addLight(const Light& light) { m_lights.push_back(light); }
+	void		removeLight() { if (!m_lights.empty()) m_lights.pop_back(); }
+	void		addRandomLights(int count);
+
+	// Draws count copies of the animated crowd character (0 to hide the crowd)
+	void		setCrowdSize(int count);
+	int			getCrowdSize() const { return m_crowdSize; }
+	// Plays the crowd from palettes baked at load (see BakedAnimation) instead of evaluating every pose
+	void		setCrowdBaked(bool baked);
+	bool		isCrowdBaked() const { return m_crowdBaked; }
+
 	int textureIndex = 0;
 	XMFLOAT3 albedo = XMFLOAT3(1.0f, 1.0f, 1.0f);
 	float metal = 0.0f;
 	float rough = 0.0f;
 	float type = 2.0f;
 	float textureSelect = 1.0f;
-	int lightCount = 2;
 
 
 	friend class Dx11Renderer;
@@ -65,17 +78,26 @@ public:
 	
 	Microsoft::WRL::ComPtr <ID3D11Device>			m_pd3dDevice;
 	Microsoft::WRL::ComPtr <ID3D11DeviceContext>	m_pImmediateContext;
-	Microsoft::WRL::ComPtr <ID3D11Buffer>			m_pConstantBufferlight;
-	Microsoft::WRL::ComPtr <ID3D11Buffer>			m_pConstantBufferSwitch;
-	Microsoft::WRL::ComPtr <ID3D11Buffer>			m_pLightConstantBuffer;
-	Microsoft::WRL::ComPtr <ID3D11Buffer>			m_pCustomConstantBuffer;
 
+	// Constant buffers by update frequency - each one is only uploaded when its contents change
+	ConstantBuffer<CbPerView>						m_cbPerView;
+	ConstantBuffer<LightPropertiesConstantBuffer>	m_cbLights;
+	ConstantBuffer<ConstantBufferlight>				m_cbSolidColour;
 
-	LightPropertiesConstantBuffer m_lightProperties;
+
+	// Every light in the scene, shaded through the clustered light lists. The first MAX_LIGHTS are
+	// also copied into m_lightProperties for the shaders that still read the b1 array.
+	std::vector<Light>				m_lights;
+	LightPropertiesConstantBuffer	m_lightProperties;
+	ClusteredLighting				m_clusteredLighting;
 	IRenderingContext m_ctx;
 	SceneGraph m_sceneobject;
 	SceneGraph m_sceneobject2;
 	SceneGraph m_sceneobject3;
+	SceneGraph m_crowd;
+
+	// Updates every skeleton of the frame before anything is drawn
+	AnimationScheduler m_animationScheduler;
 
 	vector<SceneGraph*> m_objects = vector<SceneGraph*>(100);
 
@@ -83,27 +105,22 @@ public:
 	DirectX::XMFLOAT3 m_endPos = { 3.0f, 0.0f, 0.0f };
 	float m_t = 2.0f;
 	float m_direction = 1.0f; // To control the ping-pong
+	int m_crowdSize = 0;
+	bool m_crowdBaked = false;
 
 	DirectX::XMFLOAT4 m_startRot;
 	DirectX::XMFLOAT4 m_endRot;
 
 private:
-	ID3D11ShaderResourceView* m_pTextureDiffuse;
-	ID3D11ShaderResourceView* m_pTextureNormal;
-	ID3D11ShaderResourceView* m_pTextureMetallic;
-	ID3D11ShaderResourceView* m_pTextureRoughness;
-	ID3D11ShaderResourceView* m_pTextureAmbientOcclusion;
-	ID3D11ShaderResourceView* m_pTextureSpecularIBL;
-	ID3D11ShaderResourceView* m_pTextureDiffuseIBL;
-
-	ID3D11ShaderResourceView* m_pPaveTextureDiffuse;
-	ID3D11ShaderResourceView* m_pPaveTextureNormal;
-	ID3D11ShaderResourceView* m_pPaveTextureMetallic;
-	ID3D11ShaderResourceView* m_pPaveTextureRoughness;
-	ID3D11ShaderResourceView* m_pPaveTextureAmbientOcclusion;
-	ID3D11ShaderResourceView* m_pPaveTextureSpecularIBL;
-	ID3D11ShaderResourceView* m_pPaveTextureDiffuseIBL;
-
-	ID3D11SamplerState* m_pSamplerLinear;
+	// Shared through the renderer's AssetRegistry, streamed by its TextureStreamer
+	AssetRegistry::TextureRef m_textureDiffuse;
+	AssetRegistry::TextureRef m_textureMetallic;
+	AssetRegistry::TextureRef m_textureRoughness;
+	AssetRegistry::TextureRef m_textureSpecularIBL;
+	AssetRegistry::TextureRef m_textureDiffuseIBL;
+	UINT m_textureViewVersion = ~0u;
+	UINT m_viewportHeight = 0;
+
+	ID3D11SamplerState* m_pSamplerLinear;	// owned by the renderer's StateObjectCache
 };
 
@@ -0,0 +1,481 @@
+#include "ShaderCache.h"
+#include "JobSystem.h"
+
+#include "log.hpp"
+#include "utils.hpp"
+
+#include "d3dcompiler.h"
+#include "wrl.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+
+using Microsoft::WRL::ComPtr;
+
+// Bump when the key layout changes so stale blobs are never picked up
+static constexpr uint32_t kCacheVersion = 1;
+
+static std::wstring DirectoryOf(const std::wstring& path)
+{
+	const size_t slash = path.find_last_of(L"\\/");
+	return slash == std::wstring::npos ? std::wstring() : path.substr(0, slash + 1);
+}
+
+static std::wstring JoinPath(const std::wstring& directory, const std::string& name)
+{
+	std::wstring path = directory + Utils::StringToWstring(name);
+	std::replace(path.begin(), path.end(), L'/', L'\\');
+	return path;
+}
+
+// Names of the files a source #includes, in order - conditional includes are picked up too,
+// which at worst invalidates a little more often than needed
+static std::vector<std::string> FindIncludes(const std::string& source)
+{
+	std::vector<std::string> includes;
+	size_t pos = 0;
+	while (pos < source.size())
+	{
+		size_t end = source.find('\n', pos);
+		if (end == std::string::npos)
+			end = source.size();
+
+		size_t i = source.find_first_not_of(" \t", pos);
+		if (i < end && source[i] == '#')
+		{
+			i = source.find_first_not_of(" \t", i + 1);
+			if (i < end && source.compare(i, 7, "include") == 0)
+			{
+				i = source.find_first_of("\"<", i + 7);
+				if (i < end)
+				{
+					const char close = source[i] == '<' ? '>' : '"';
+					const size_t nameEnd = source.find(close, i + 1);
+					if (nameEnd < end)
+						includes.push_back(source.substr(i + 1, nameEnd - i - 1));
+				}
+			}
+		}
+		pos = end + 1;
+	}
+	return includes;
+}
+
+#pragma region D3DShaderCompiler
+
+namespace
+{
+	// Feeds #includes to D3DCompile through the compiler's ReadFile, relative to the including file
+	class IncludeHandler : public ID3DInclude
+	{
+	public:
+		IncludeHandler(IShaderCompiler& compiler, const std::wstring& directory)
+			: m_compiler(compiler), m_rootDirectory(directory) {}
+
+		HRESULT __stdcall Open(D3D_INCLUDE_TYPE, LPCSTR fileName, LPCVOID parentData, LPCVOID* data, UINT* bytes) override
+		{
+			auto parent = m_directories.find(parentData);
+			const std::wstring path = JoinPath(parent != m_directories.end() ? parent->second : m_rootDirectory, fileName);
+
+			auto file = std::make_unique<std::string>();
+			if (!m_compiler.ReadFile(path, *file))
+				return E_FAIL;
+
+			*data = file->data();
+			*bytes = (UINT)file->size();
+			m_directories[file->data()] = DirectoryOf(path);
+			m_files.push_back(std::move(file));
+			return S_OK;
+		}
+
+		HRESULT __stdcall Close(LPCVOID) override
+		{
+			return S_OK;	// freed with the handler
+		}
+
+	private:
+		IShaderCompiler&							m_compiler;
+		std::wstring								m_rootDirectory;
+		std::map<LPCVOID, std::wstring>				m_directories;
+		std::vector<std::unique_ptr<std::string>>	m_files;
+	};
+}
+
+bool D3DShaderCompiler::ReadFile(const std::wstring& path, std::string& contents)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+	contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return true;
+}
+
+HRESULT D3DShaderCompiler::Compile(const std::string& source, const std::wstring& path, const ShaderPermutation& permutation,
+								   UINT flags, std::vector<uint8_t>& bytecode, std::string& errors)
+{
+	std::vector<D3D_SHADER_MACRO> macros;
+	for (const auto& define : permutation.defines)
+		macros.push_back({ define.first.c_str(), define.second.c_str() });
+	macros.push_back({ nullptr, nullptr });
+
+	IncludeHandler includes(*this, DirectoryOf(path));
+	const std::string sourceName = Utils::WstringToString(path);
+
+	ComPtr<ID3DBlob> blob;
+	ComPtr<ID3DBlob> errorBlob;
+	const HRESULT hr = D3DCompile(source.data(), source.size(), sourceName.c_str(), macros.data(), &includes,
+								  permutation.entryPoint.c_str(), permutation.target.c_str(), flags, 0, &blob, &errorBlob);
+	if (errorBlob)
+		errors.assign(static_cast<const char*>(errorBlob->GetBufferPointer()), errorBlob->GetBufferSize());
+	if (FAILED(hr))
+		return hr;
+
+	const uint8_t* data = static_cast<const uint8_t*>(blob->GetBufferPointer());
+	bytecode.assign(data, data + blob->GetBufferSize());
+	return S_OK;
+}
+
+#pragma endregion
+
+#pragma region ShaderCache
+
+UINT ShaderCache::DefaultFlags()
+{
+	UINT flags = D3DCOMPILE_ENABLE_STRICTNESS;
+#ifdef _DEBUG
+	// Embed debug information and skip optimisation for a better shader debugging experience
+	flags |= D3DCOMPILE_DEBUG | D3DCOMPILE_SKIP_OPTIMIZATION;
+#endif
+	return flags;
+}
+
+ShaderCache::Handle ShaderCache::Add(const ShaderPermutation& permutation)
+{
+	std::string id = Utils::WstringToString(permutation.file) + "|" + permutation.entryPoint + "|" + permutation.target;
+	for (const auto& define : permutation.defines)
+		id += "|" + define.first + "=" + define.second;
+
+	for (size_t i = 0; i < m_entries.size(); i++)
+	{
+		if (m_entries[i].id == id)
+			return (Handle)i;
+	}
+
+	Entry entry;
+	entry.permutation = permutation;
+	entry.id = std::move(id);
+	m_entries.push_back(std::move(entry));
+	return (Handle)(m_entries.size() - 1);
+}
+
+const std::vector<uint8_t>* ShaderCache::GetBytecode(Handle handle) const
+{
+	return IsValid(handle) ? &m_entries[handle].bytecode : nullptr;
+}
+
+void ShaderCache::HashIncludes(const std::wstring& path, const std::string& source, std::vector<std::wstring>& visited, uint64_t& hash)
+{
+	const std::wstring directory = DirectoryOf(path);
+	for (const std::string& name : FindIncludes(source))
+	{
+		const std::wstring includePath = JoinPath(directory, name);
+		if (std::find(visited.begin(), visited.end(), includePath) != visited.end())
+			continue;
+		visited.push_back(includePath);
+
+		hash = Utils::HashBytes(name.data(), name.size(), hash);
+
+		std::string contents;
+		if (!m_compiler->ReadFile(includePath, contents))
+			continue;	// the compile will report it
+		hash = Utils::HashBytes(contents.data(), contents.size(), hash);
+		HashIncludes(includePath, contents, visited, hash);
+	}
+}
+
+uint64_t ShaderCache::ComputeKey(const Entry& entry)
+{
+	const ShaderPermutation& permutation = entry.permutation;
+
+	uint64_t hash = Utils::HashBytes(&kCacheVersion, sizeof(kCacheVersion));
+	hash = Utils::HashBytes(&m_flags, sizeof(m_flags), hash);
+	hash = Utils::HashBytes(permutation.entryPoint.c_str(), permutation.entryPoint.size() + 1, hash);
+	hash = Utils::HashBytes(permutation.target.c_str(), permutation.target.size() + 1, hash);
+	for (const auto& define : permutation.defines)
+	{
+		hash = Utils::HashBytes(define.first.c_str(), define.first.size() + 1, hash);
+		hash = Utils::HashBytes(define.second.c_str(), define.second.size() + 1, hash);
+	}
+	hash = Utils::HashBytes(entry.source.data(), entry.source.size(), hash);
+
+	std::vector<std::wstring> visited;
+	HashIncludes(permutation.file, entry.source, visited, hash);
+	return hash;
+}
+
+std::wstring ShaderCache::GetCachePath(uint64_t key) const
+{
+	wchar_t name[32];
+	swprintf_s(name, L"%016llx.cso", (unsigned long long)key);
+	return (std::filesystem::path(m_directory) / name).wstring();
+}
+
+bool ShaderCache::LoadBlob(uint64_t key, std::vector<uint8_t>& bytecode) const
+{
+	std::ifstream file(GetCachePath(key), std::ios::binary);
+	if (!file)
+		return false;
+	bytecode.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return !bytecode.empty();
+}
+
+void ShaderCache::StoreBlob(uint64_t key, const std::vector<uint8_t>& bytecode) const
+{
+	// Written under a temporary name and renamed, so a crash never leaves a truncated blob behind
+	const std::filesystem::path path = GetCachePath(key);
+	std::filesystem::path temp = path;
+	temp += L".tmp";
+	{
+		std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+		if (!file)
+			return;
+		file.write(reinterpret_cast<const char*>(bytecode.data()), bytecode.size());
+		if (!file)
+			return;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temp, path, error);
+	if (error)
+		std::filesystem::remove(temp, error);
+}
+
+void ShaderCache::CompileEntry(Entry& entry)
+{
+	entry.result = m_compiler->Compile(entry.source, entry.permutation.file, entry.permutation, m_flags, entry.bytecode, entry.errors);
+	if (SUCCEEDED(entry.result))
+		StoreBlob(entry.key, entry.bytecode);
+}
+
+HRESULT ShaderCache::Build()
+{
+	const auto start = std::chrono::high_resolution_clock::now();
+	m_stats = Stats();
+
+	std::error_code error;
+	std::filesystem::create_directories(m_directory, error);
+
+	// Hash and look up on this thread - it's only file reads
+	std::vector<Entry*> misses;
+	for (size_t i = m_built; i < m_entries.size(); i++)
+	{
+		Entry& entry = m_entries[i];
+		if (!m_compiler->ReadFile(entry.permutation.file, entry.source))
+		{
+			entry.result = HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+			entry.errors = "Cannot open " + Utils::WstringToString(entry.permutation.file);
+			continue;
+		}
+
+		entry.key = ComputeKey(entry);
+		if (LoadBlob(entry.key, entry.bytecode))
+		{
+			entry.result = S_OK;
+			m_stats.diskHits++;
+			continue;
+		}
+		misses.push_back(&entry);
+	}
+
+	if (m_parallel && misses.size() > 1)
+	{
+		std::vector<std::future<void>> jobs;
+		jobs.reserve(misses.size());
+		for (Entry* entry : misses)
+			jobs.push_back(JobSystem::Get().Submit([this, entry]() { CompileEntry(*entry); }));
+		for (auto& job : jobs)
+			job.wait();
+	}
+	else
+	{
+		for (Entry* entry : misses)
+			CompileEntry(*entry);
+	}
+
+	// Report on this thread once everything is done
+	HRESULT hr = S_OK;
+	for (size_t i = m_built; i < m_entries.size(); i++)
+	{
+		Entry& entry = m_entries[i];
+		entry.source.clear();
+		entry.source.shrink_to_fit();
+
+		if (FAILED(entry.result))
+		{
+			m_stats.failed++;
+			hr = E_FAIL;
+			Log::Error(L"ShaderCache: %s %S(%S) failed: %S", entry.permutation.file.c_str(),
+					   entry.permutation.entryPoint.c_str(), entry.permutation.target.c_str(), entry.errors.c_str());
+			OutputDebugStringA(entry.errors.c_str());
+		}
+		else if (!entry.errors.empty())
+		{
+			Log::Debug(L"ShaderCache: %S warnings: %S", entry.id.c_str(), entry.errors.c_str());
+		}
+	}
+	m_stats.compiled = (UINT)misses.size() - m_stats.failed;
+	m_built = m_entries.size();
+
+	m_stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	Log::Info(L"ShaderCache: %u loaded from disk, %u compiled, %u failed in %.1f ms",
+			  m_stats.diskHits, m_stats.compiled, m_stats.failed, m_stats.buildMs);
+	return hr;
+}
+
+#pragma endregion
+
+#pragma region Self test
+
+namespace
+{
+	// In memory files; "bytecode" is a digest of everything the real compiler would see
+	class StubShaderCompiler : public IShaderCompiler
+	{
+	public:
+		std::map<std::wstring, std::string>	files;
+		std::atomic<int>					compiles{ 0 };
+
+		bool ReadFile(const std::wstring& path, std::string& contents) override
+		{
+			auto it = files.find(path);
+			if (it == files.end())
+				return false;
+			contents = it->second;
+			return true;
+		}
+
+		HRESULT Compile(const std::string& source, const std::wstring& path, const ShaderPermutation& permutation,
+						UINT flags, std::vector<uint8_t>& bytecode, std::string& errors) override
+		{
+			compiles++;
+			if (source.find("syntax error") != std::string::npos)
+			{
+				errors = "stub: syntax error";
+				return E_FAIL;
+			}
+
+			std::string expanded = source;
+			for (const std::string& name : FindIncludes(source))
+			{
+				std::string contents;
+				ReadFile(JoinPath(DirectoryOf(path), name), contents);
+				expanded += contents;
+			}
+			expanded += permutation.entryPoint + permutation.target + std::to_string(flags);
+			for (const auto& define : permutation.defines)
+				expanded += define.first + define.second;
+
+			const uint64_t digest = Utils::HashBytes(expanded.data(), expanded.size());
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&digest);
+			bytecode.assign(bytes, bytes + sizeof(digest));
+			return S_OK;
+		}
+	};
+}
+
+bool ShaderCache::RunSelfTest()
+{
+	const std::wstring directory = L"ShaderCache\\selftest";
+	std::error_code error;
+	std::filesystem::remove_all(directory, error);
+
+	StubShaderCompiler stub;
+	stub.files[L"shaders\\lit.hlsl"] = "#include \"common.hlsli\"\nfloat4 PS() { return 0; }\n";
+	stub.files[L"shaders\\common.hlsli"] = "#include \"sub/math.hlsli\"\n";
+	stub.files[L"shaders\\sub\\math.hlsli"] = "static const float PI = 3.14159265f;\n";
+	stub.files[L"shaders\\unlit.hlsl"] = "float4 PS() { return 1; }\n";
+	stub.files[L"shaders\\broken.hlsl"] = "syntax error\n";
+
+	const ShaderPermutation permutations[] =
+	{
+		{ L"shaders\\lit.hlsl", "PS", "ps_5_0", { { "MAX_LIGHTS", "1" } } },
+		{ L"shaders\\lit.hlsl", "PS", "ps_5_0", { { "MAX_LIGHTS", "4" } } },
+		{ L"shaders\\unlit.hlsl", "PS", "ps_5_0", {} },
+	};
+
+	bool passed = true;
+	auto check = [&passed](bool condition, const wchar_t* what)
+	{
+		if (!condition)
+		{
+			Log::Error(L"ShaderCache self test: %s", what);
+			passed = false;
+		}
+	};
+
+	// Builds a fresh cache over the same directory, as a new launch would
+	auto build = [&](UINT flags, std::vector<Handle>& handles, Stats& stats) -> std::unique_ptr<ShaderCache>
+	{
+		auto cache = std::make_unique<ShaderCache>();
+		cache->SetCompiler(&stub);
+		cache->SetCacheDirectory(directory);
+		cache->SetFlags(flags);
+		handles.clear();
+		for (const ShaderPermutation& permutation : permutations)
+			handles.push_back(cache->Add(permutation));
+		cache->Build();
+		stats = cache->GetStats();
+		return cache;
+	};
+
+	std::vector<Handle> handles;
+	Stats stats;
+
+	// Cold cache - everything compiles, in parallel
+	auto first = build(0, handles, stats);
+	check(stub.compiles == 3 && stats.compiled == 3 && stats.diskHits == 0, L"cold build should compile every permutation");
+	check(first->Add(permutations[0]) == handles[0], L"adding a permutation twice should return the same handle");
+	check(first->GetKey(handles[0]) != first->GetKey(handles[1]), L"defines should change the key");
+
+	// Warm cache - nothing compiles and the blobs match
+	stub.compiles = 0;
+	auto second = build(0, handles, stats);
+	check(stub.compiles == 0 && stats.diskHits == 3, L"warm build should load every permutation from disk");
+	for (Handle handle : handles)
+		check(second->GetBytecode(handle) && first->GetBytecode(handle) && *second->GetBytecode(handle) == *first->GetBytecode(handle),
+			  L"cached bytecode should match the compiled bytecode");
+
+	// Editing a nested include invalidates only the permutations that include it
+	stub.files[L"shaders\\sub\\math.hlsli"] = "static const float PI = 3.14159f;\n";
+	stub.compiles = 0;
+	auto third = build(0, handles, stats);
+	check(stub.compiles == 2 && stats.diskHits == 1, L"include edit should recompile exactly the two lit permutations");
+	check(third->IsValid(handles[0]) && *third->GetBytecode(handles[0]) != *first->GetBytecode(handles[0]), L"include edit should change the bytecode");
+
+	// Different compiler flags never share blobs
+	stub.compiles = 0;
+	build(1, handles, stats);
+	check(stub.compiles == 3 && stats.diskHits == 0, L"flag change should recompile everything");
+
+	// Failures are reported per permutation and never cached
+	ShaderCache broken;
+	broken.SetCompiler(&stub);
+	broken.SetCacheDirectory(directory);
+	const Handle bad = broken.Add({ L"shaders\\broken.hlsl", "PS", "ps_5_0", {} });
+	const Handle good = broken.Add(permutations[2]);
+	check(FAILED(broken.Build()) && !broken.IsValid(bad) && broken.IsValid(good), L"a failed compile should only invalidate its own permutation");
+	check(!std::filesystem::exists(broken.GetCachePath(broken.GetKey(bad))), L"a failed compile should not be cached");
+
+	std::filesystem::remove_all(directory, error);
+
+	if (passed)
+		Log::Info(L"ShaderCache self test passed");
+	return passed;
+}
+
+#pragma endregion
@@ -0,0 +1,117 @@
+// Shader permutations and a persistent bytecode cache.
+//
+// A permutation is one file + entry point + target + set of defines. Each one is keyed by a hash of
+// its source, everything it #includes, its defines and the compiler flags; the bytecode is kept on
+// disk under that key, so a launch with unchanged shaders loads blobs instead of compiling. Cache
+// misses are compiled in parallel on the JobSystem.
+//
+// All file access and compilation goes through IShaderCompiler, so the cache can run against a
+// stub (see RunSelfTest) without touching D3DCompiler.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct ShaderPermutation
+{
+	std::wstring	file;
+	std::string		entryPoint;
+	std::string		target;		// e.g. "vs_5_0"
+	std::vector<std::pair<std::string, std::string>>	defines;
+};
+
+class IShaderCompiler
+{
+public:
+	virtual ~IShaderCompiler() = default;
+
+	// Both may be called from several worker threads at once
+	virtual bool	ReadFile(const std::wstring& path, std::string& contents) = 0;
+	virtual HRESULT	Compile(const std::string& source, const std::wstring& path, const ShaderPermutation& permutation,
+							UINT flags, std::vector<uint8_t>& bytecode, std::string& errors) = 0;
+};
+
+// The real thing - D3DCompile, with #includes resolved relative to the including file
+class D3DShaderCompiler : public IShaderCompiler
+{
+public:
+	bool	ReadFile(const std::wstring& path, std::string& contents) override;
+	HRESULT	Compile(const std::string& source, const std::wstring& path, const ShaderPermutation& permutation,
+					UINT flags, std::vector<uint8_t>& bytecode, std::string& errors) override;
+};
+
+class ShaderCache
+{
+public:
+	using Handle = uint32_t;
+	static constexpr Handle kInvalidHandle = ~0u;
+
+	struct Stats
+	{
+		UINT	diskHits = 0;
+		UINT	compiled = 0;
+		UINT	failed = 0;
+		double	buildMs = 0.0;
+	};
+
+	ShaderCache() = default;
+	ShaderCache(const ShaderCache&) = delete;
+	ShaderCache& operator = (const ShaderCache&) = delete;
+
+	// Strict compilation, plus debug info and no optimisation in debug builds
+	static UINT	DefaultFlags();
+
+	void	SetCompiler(IShaderCompiler* compiler) { m_compiler = compiler ? compiler : &m_d3dCompiler; }
+	void	SetCacheDirectory(const std::wstring& directory) { m_directory = directory; }
+	void	SetFlags(UINT flags) { m_flags = flags; }
+	void	SetParallel(bool parallel) { m_parallel = parallel; }
+
+	// Registers a permutation; adding the same one twice returns the same handle
+	Handle	Add(const ShaderPermutation& permutation);
+
+	// Resolves everything added since the last Build() - from disk where possible, compiling the rest.
+	// Returns E_FAIL if any permutation failed to compile (the others are still usable).
+	HRESULT	Build();
+
+	bool	IsValid(Handle handle) const { return handle < m_entries.size() && SUCCEEDED(m_entries[handle].result); }
+	const std::vector<uint8_t>*	GetBytecode(Handle handle) const;
+	uint64_t	GetKey(Handle handle) const { return handle < m_entries.size() ? m_entries[handle].key : 0; }
+	size_t		GetCount() const { return m_entries.size(); }
+	const Stats&	GetStats() const { return m_stats; }
+
+	// Runs the hashing and caching logic against a stub compiler and logs the result
+	static bool	RunSelfTest();
+
+private:
+	struct Entry
+	{
+		ShaderPermutation		permutation;
+		std::string				id;			// file|entry|target|defines, for Add() de-duplication
+		uint64_t				key = 0;
+		std::string				source;
+		std::vector<uint8_t>	bytecode;
+		std::string				errors;
+		HRESULT					result = E_PENDING;
+	};
+
+	uint64_t		ComputeKey(const Entry& entry);
+	void			HashIncludes(const std::wstring& path, const std::string& source, std::vector<std::wstring>& visited, uint64_t& hash);
+	std::wstring	GetCachePath(uint64_t key) const;
+	bool			LoadBlob(uint64_t key, std::vector<uint8_t>& bytecode) const;
+	void			StoreBlob(uint64_t key, const std::vector<uint8_t>& bytecode) const;
+	void			CompileEntry(Entry& entry);
+
+	D3DShaderCompiler	m_d3dCompiler;
+	IShaderCompiler*	m_compiler = &m_d3dCompiler;
+	std::wstring		m_directory = L"ShaderCache";
+	UINT				m_flags = DefaultFlags();
+	bool				m_parallel = true;
+
+	std::vector<Entry>	m_entries;
+	size_t				m_built = 0;	// entries before this index are resolved
+	Stats				m_stats;
+};
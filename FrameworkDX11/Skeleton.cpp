@@ -1,56 +1,1069 @@
 #include "Skeleton.h"
 #include "Animation.h"
+#include "gltf_utils.hpp"
+#include "log.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
 #include <map>
 
 using namespace DirectX;
 
 
-Skeleton::Skeleton() : m_currentAnimationTime(0), m_pCurrentAnimation(nullptr), m_animationCount(0)
+Skeleton::Skeleton() : m_currentAnimationTime(0)
 {
     XMStoreFloat4x4(&m_rootTransform, XMMatrixIdentity());
 }
 
 void Skeleton::PlayAnimation(const unsigned int animation)
 {
+    if (animation >= GetAnimationCount())
+        return;
 
+    m_currentAnimation = (int)animation;
+    m_currentAnimationTime = m_clips->animations[animation].GetStartTime();
+    m_lodFrame = 0;
 }
 
-// Helper function to get a node's local transform.
-// This avoids code duplication.
-DirectX::XMFLOAT4X4 GetNodeLocalTransform(const tinygltf::Node& node)
+// Helper function to get a node's local transform as translation / rotation / scale.
+static void GetNodeLocalTRS(const tinygltf::Node& node, XMFLOAT3& translation, XMFLOAT4& rotation, XMFLOAT3& scale)
 {
-    DirectX::XMFLOAT4X4 ret;
+    translation = XMFLOAT3(0.0f, 0.0f, 0.0f);
+    rotation = XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f);
+    scale = XMFLOAT3(1.0f, 1.0f, 1.0f);
 
-    return ret;
+    if (node.matrix.size() == 16)
+    {
+        // glTF matrices are column major for column vectors, which is the same memory layout as
+        // DirectXMath's row major matrices for row vectors
+        XMFLOAT4X4 m;
+        for (int i = 0; i < 16; i++)
+            (&m._11)[i] = (float)node.matrix[i];
+
+        XMVECTOR s, r, t;
+        if (XMMatrixDecompose(&s, &r, &t, XMLoadFloat4x4(&m)))
+        {
+            XMStoreFloat3(&translation, t);
+            XMStoreFloat4(&rotation, r);
+            XMStoreFloat3(&scale, s);
+        }
+        return;
+    }
+
+    if (node.translation.size() == 3)
+        translation = XMFLOAT3((float)node.translation[0], (float)node.translation[1], (float)node.translation[2]);
+    if (node.rotation.size() == 4)
+        rotation = XMFLOAT4((float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2], (float)node.rotation[3]);
+    if (node.scale.size() == 3)
+        scale = XMFLOAT3((float)node.scale[0], (float)node.scale[1], (float)node.scale[2]);
 }
 
-const void Skeleton::GetSkinningMatrices(DirectX::XMMATRIX* matrixlist, unsigned int arraylength) const
+static XMMATRIX GetNodeLocalMatrix(const tinygltf::Node& node)
 {
+    XMFLOAT3 t, s;
+    XMFLOAT4 r;
+    GetNodeLocalTRS(node, t, r, s);
+    return XMMatrixAffineTransformation(XMLoadFloat3(&s), XMVectorZero(), XMLoadFloat4(&r), XMLoadFloat3(&t));
+}
 
+// Node to scene root, walking up the parents
+static XMMATRIX GetNodeGlobalMatrix(const tinygltf::Model& model, const std::vector<int>& nodeParents, int nodeIdx)
+{
+    XMMATRIX global = XMMatrixIdentity();
+    for (int n = nodeIdx; n >= 0; n = nodeParents[n])
+        global = XMMatrixMultiply(global, GetNodeLocalMatrix(model.nodes[n]));
+    return global;
 }
 
-bool Skeleton::LoadFromGltf(const tinygltf::Model& model)
+bool Skeleton::LoadFromGltf(const tinygltf::Model& model, int skinIndex, const std::wstring& clipKey)
 {
+    *this = Skeleton();
+
+    if (skinIndex < 0 || skinIndex >= (int)model.skins.size())
+        return false;
+    const tinygltf::Skin& skin = model.skins[skinIndex];
+    if (skin.joints.empty())
+        return false;
+
+    std::vector<int> nodeParents(model.nodes.size(), -1);
+    for (size_t n = 0; n < model.nodes.size(); n++)
+    {
+        for (int child : model.nodes[n].children)
+        {
+            if (child >= 0 && child < (int)nodeParents.size())
+                nodeParents[child] = (int)n;
+        }
+    }
+
+    std::map<int, int> nodeToSkinJoint;
+    for (size_t i = 0; i < skin.joints.size(); i++)
+        nodeToSkinJoint[skin.joints[i]] = (int)i;
+
+    // A joint's parent is its nearest ancestor that is also a joint
+    const size_t jointCount = skin.joints.size();
+    std::vector<int> skinParent(jointCount, -1);
+    std::vector<int> depth(jointCount, 0);
+    for (size_t i = 0; i < jointCount; i++)
+    {
+        for (int n = nodeParents[skin.joints[i]]; n >= 0; n = nodeParents[n])
+        {
+            auto it = nodeToSkinJoint.find(n);
+            if (it == nodeToSkinJoint.end())
+                continue;
+            if (skinParent[i] < 0)
+                skinParent[i] = it->second;
+            depth[i]++;
+        }
+    }
+
+    // Sorting by depth puts every parent before its children
+    std::vector<int> order(jointCount);
+    for (size_t i = 0; i < jointCount; i++)
+        order[i] = (int)i;
+    std::stable_sort(order.begin(), order.end(), [&depth](int a, int b) { return depth[a] < depth[b]; });
+
+    std::vector<int> skinToSorted(jointCount);
+    for (size_t i = 0; i < jointCount; i++)
+        skinToSorted[order[i]] = (int)i;
+
+    // The pose is produced in the space of the skinned mesh node; the renderer applies its world matrix
+    XMMATRIX meshInverse = XMMatrixIdentity();
+    for (size_t n = 0; n < model.nodes.size(); n++)
+    {
+        if (model.nodes[n].skin == skinIndex)
+        {
+            meshInverse = XMMatrixInverse(nullptr, GetNodeGlobalMatrix(model, nodeParents, (int)n));
+            break;
+        }
+    }
+
+    std::vector<XMFLOAT4X4> inverseBinds(jointCount);
+    for (auto& m : inverseBinds)
+        XMStoreFloat4x4(&m, XMMatrixIdentity());
+    if (skin.inverseBindMatrices >= 0)
+    {
+        const tinygltf::Accessor& accessor = model.accessors[skin.inverseBindMatrices];
+        const tinygltf::BufferView& bufferView = model.bufferViews[accessor.bufferView];
+        const tinygltf::Buffer& buffer = model.buffers[bufferView.buffer];
+        const size_t stride = bufferView.byteStride ? bufferView.byteStride : sizeof(XMFLOAT4X4);
+        const unsigned char* data = &buffer.data[bufferView.byteOffset + accessor.byteOffset];
+        for (size_t i = 0; i < std::min(jointCount, (size_t)accessor.count); i++)
+            memcpy(&inverseBinds[i], data + i * stride, sizeof(XMFLOAT4X4));
+    }
+
+    m_parents.resize(jointCount);
+    m_skinJoint.resize(jointCount);
+    m_names.resize(jointCount);
+    m_restTranslation.resize(jointCount);
+    m_restRotation.resize(jointCount);
+    m_restScale.resize(jointCount);
+    m_inverseBind.resize(jointCount);
+    m_meshTransforms.resize(jointCount);
+    m_rootBase.resize(jointCount);
+
+    std::map<int, int> nodeToJoint;
+    bool firstRoot = true;
+    for (size_t i = 0; i < jointCount; i++)
+    {
+        const int skinJoint = order[i];
+        const int nodeIdx = skin.joints[skinJoint];
+        const tinygltf::Node& node = model.nodes[nodeIdx];
+
+        m_skinJoint[i] = skinJoint;
+        m_parents[i] = skinParent[skinJoint] >= 0 ? skinToSorted[skinParent[skinJoint]] : -1;
+        m_names[i] = node.name;
+        GetNodeLocalTRS(node, m_restTranslation[i], m_restRotation[i], m_restScale[i]);
+        m_inverseBind[i] = inverseBinds[skinJoint];
+        nodeToJoint[nodeIdx] = (int)i;
+
+        XMMATRIX base = XMMatrixIdentity();
+        if (m_parents[i] < 0)
+        {
+            const XMMATRIX above = nodeParents[nodeIdx] >= 0 ? GetNodeGlobalMatrix(model, nodeParents, nodeParents[nodeIdx]) : XMMatrixIdentity();
+            if (firstRoot)
+            {
+                XMStoreFloat4x4(&m_rootTransform, above);
+                firstRoot = false;
+            }
+            base = XMMatrixMultiply(above, meshInverse);
+        }
+        XMStoreFloat4x4(&m_rootBase[i], base);
+    }
+
+    m_localTranslation = m_restTranslation;
+    m_localRotation = m_restRotation;
+    m_localScale = m_restScale;
+
+    auto loadClips = [&model, &nodeToJoint]()
+    {
+        AnimationClipSet clips;
+        for (unsigned int a = 0; a < model.animations.size(); a++)
+        {
+            Animation animation;
+            if (animation.LoadFromGltf(model, nodeToJoint, a))
+                clips.animations.push_back(std::move(animation));
+        }
+        return clips;
+    };
+
+    if (clipKey.empty())
+    {
+        m_clips = std::make_shared<AnimationClipSet>(loadClips());
+    }
+    else
+    {
+        m_clips = AnimationLibrary::Get().GetOrBuild(clipKey, [&]()
+        {
+            AnimationClipSet clips = loadClips();
+            const float tolerance = AnimationLibrary::Get().GetCompressionTolerance();
+            if (tolerance > 0.0f)
+                CompressClips(clips, tolerance);
+            return clips;
+        });
+    }
+
+    m_isLoaded = true;
+    EvaluatePose((const Animation*)nullptr, 0.0f);
+
+    for (const XMFLOAT4X4& m : m_meshTransforms)
+        m_radius = std::max(m_radius, XMVectorGetX(XMVector3Length(XMVectorSet(m._41, m._42, m._43, 0.0f))));
     return true;
 }
 
-void Skeleton::Update(float deltaTime)
+bool Skeleton::Update(float deltaTime, unsigned int interval)
 {
+    if (!m_isLoaded)
+        return false;
+
+    const Animation* animation = CurrentAnimation();
+    const CompressedAnimation* compressed = animation && HasCompressedAnimations() ? &m_clips->compressed[m_currentAnimation] : nullptr;
+    float start = 0.0f;
+    float duration = 0.0f;
+    if (animation)
+    {
+        start = animation->GetStartTime();
+        duration = animation->GetEndTime() - start;
+    }
+
+    // Loop the clip
+    auto wrap = [start, duration](float time)
+    {
+        return duration > 0.0f ? start + fmodf(std::max(time - start, 0.0f), duration) : start;
+    };
+    if (animation)
+        m_currentAnimationTime = wrap(m_currentAnimationTime + deltaTime);
+
+    // Baked clips have nothing to evaluate, GetSkinningMatrices() reads the palette for the time
+    if (CurrentBakedAnimation() != nullptr)
+    {
+        m_lodInterval = 1;
+        m_lodFrame = 0;
+        return false;
+    }
 
+    auto evaluate = [&](float time)
+    {
+        if (compressed)
+            EvaluatePose(compressed, time);
+        else
+            EvaluatePose(animation, time);
+    };
+
+    if (interval <= 1 || !animation)
+    {
+        m_lodInterval = 1;
+        m_lodFrame = 0;
+        evaluate(m_currentAnimationTime);
+        return true;
+    }
+
+    const bool evaluated = m_lodFrame == 0 || interval != m_lodInterval;
+    if (evaluated)
+    {
+        // A new interval: evaluate the pose for its last frame, assuming the frame time stays the same,
+        // and blend towards it from what is on screen now
+        m_lodInterval = interval;
+        m_lodFrame = 0;
+        m_lodFrom = m_meshTransforms;
+        evaluate(wrap(m_currentAnimationTime + (interval - 1) * deltaTime));
+        m_lodTo = m_meshTransforms;
+    }
+
+    const float t = (float)(m_lodFrame + 1) / m_lodInterval;
+    for (size_t i = 0; i < m_meshTransforms.size(); i++)
+    {
+        const XMMATRIX from = XMLoadFloat4x4(&m_lodFrom[i]);
+        const XMMATRIX to = XMLoadFloat4x4(&m_lodTo[i]);
+        XMMATRIX blend;
+        for (int r = 0; r < 4; r++)
+            blend.r[r] = XMVectorLerp(from.r[r], to.r[r], t);
+        XMStoreFloat4x4(&m_meshTransforms[i], blend);
+    }
+    m_lodFrame = (m_lodFrame + 1) % m_lodInterval;
+    return evaluated;
 }
 
-DirectX::XMMATRIX GetLocalAnimatedMatrixForJoint(
-    const Joint& joint,
-    int jointIndex,
-    const Animation* animation, // Use a pointer to allow for nullptr
-    float timeInSeconds)
+void Skeleton::ResetToRestPose()
 {
-    
-    return DirectX::XMMatrixIdentity();
+    // Joints without a channel keep their rest pose
+    std::copy(m_restTranslation.begin(), m_restTranslation.end(), m_localTranslation.begin());
+    std::copy(m_restRotation.begin(), m_restRotation.end(), m_localRotation.begin());
+    std::copy(m_restScale.begin(), m_restScale.end(), m_localScale.begin());
 }
 
-void Skeleton::UpdateJointTransform(int jointIndex, const Animation* anim, float time, const DirectX::XMMATRIX& parentTransform)
+void Skeleton::EvaluatePose(const Animation* animation, float timeInSeconds)
 {
-    
-}
\ No newline at end of file
+    if (!m_isLoaded)
+        return;
+
+    ResetToRestPose();
+    if (animation)
+        SampleChannels(*animation, timeInSeconds);
+
+    ComputeMeshSpaceTransforms();
+}
+
+void Skeleton::EvaluatePose(const CompressedAnimation* animation, float timeInSeconds)
+{
+    if (!m_isLoaded)
+        return;
+
+    ResetToRestPose();
+    if (animation)
+    {
+        animation->Sample(timeInSeconds, m_compressedCursor, m_localTranslation.data(), m_localRotation.data(),
+                          m_localScale.data(), (int)m_parents.size());
+    }
+
+    ComputeMeshSpaceTransforms();
+}
+
+void Skeleton::GetRestPose(LocalPose& pose) const
+{
+    pose.translation = m_restTranslation;
+    pose.rotation = m_restRotation;
+    pose.scale = m_restScale;
+}
+
+void Skeleton::SampleLocalPose(unsigned int animation, float time, ClipCursor& cursor, LocalPose& pose)
+{
+    if (!m_isLoaded)
+        return;
+
+    ResetToRestPose();
+    if (m_clips && animation < m_clips->animations.size())
+    {
+        if (HasCompressedAnimations())
+        {
+            m_clips->compressed[animation].Sample(time, cursor.compressed, m_localTranslation.data(),
+                                                  m_localRotation.data(), m_localScale.data(), (int)m_parents.size());
+        }
+        else
+        {
+            // The clip's cursors stand in for the skeleton's own while it is sampled
+            std::swap(m_cursorAnimation, cursor.animation);
+            m_samplerCursors.swap(cursor.samplers);
+            SampleChannels(m_clips->animations[animation], time);
+            std::swap(m_cursorAnimation, cursor.animation);
+            m_samplerCursors.swap(cursor.samplers);
+        }
+    }
+
+    pose.Resize(m_parents.size());
+    std::copy(m_localTranslation.begin(), m_localTranslation.end(), pose.translation.begin());
+    std::copy(m_localRotation.begin(), m_localRotation.end(), pose.rotation.begin());
+    std::copy(m_localScale.begin(), m_localScale.end(), pose.scale.begin());
+}
+
+void Skeleton::SetLocalPose(const LocalPose& pose)
+{
+    if (!m_isLoaded || pose.GetJointCount() != m_parents.size())
+        return;
+
+    std::copy(pose.translation.begin(), pose.translation.end(), m_localTranslation.begin());
+    std::copy(pose.rotation.begin(), pose.rotation.end(), m_localRotation.begin());
+    std::copy(pose.scale.begin(), pose.scale.end(), m_localScale.begin());
+
+    // Whatever Update() was blending towards is stale now
+    m_lodInterval = 1;
+    m_lodFrame = 0;
+    ComputeMeshSpaceTransforms();
+}
+
+int Skeleton::GetJointIndex(const std::string& name) const
+{
+    const auto it = std::find(m_names.begin(), m_names.end(), name);
+    return it != m_names.end() ? (int)(it - m_names.begin()) : -1;
+}
+
+std::vector<float> Skeleton::MakeJointMask(const std::string& root, float weight) const
+{
+    const int rootJoint = GetJointIndex(root);
+    if (rootJoint < 0)
+        return std::vector<float>();
+
+    // Parents come first, so every joint can take its parent's weight
+    std::vector<float> mask(m_parents.size(), 0.0f);
+    for (size_t i = 0; i < mask.size(); i++)
+    {
+        if ((int)i == rootJoint)
+            mask[i] = weight;
+        else if (m_parents[i] >= 0)
+            mask[i] = mask[m_parents[i]];
+    }
+    return mask;
+}
+
+void Skeleton::ComputeJointTolerances(float tolerance, std::vector<CompressedAnimation::Tolerance>& tolerances) const
+{
+    // How far each joint reaches: the longest chain of bones below it, each bone counted once. Children
+    // come after their parents, so every child's reach is final before it is added to its parent's.
+    const size_t jointCount = m_parents.size();
+    std::vector<float> length(jointCount);
+    std::vector<float> reach(jointCount, 0.0f);
+    std::vector<bool> leaf(jointCount, true);
+    for (size_t i = 0; i < jointCount; i++)
+    {
+        length[i] = XMVectorGetX(XMVector3Length(XMLoadFloat3(&m_restTranslation[i])));
+        if (m_parents[i] >= 0)
+            leaf[m_parents[i]] = false;
+    }
+    for (size_t i = jointCount; i-- > 0;)
+    {
+        const int parent = m_parents[i];
+        if (parent >= 0)
+            reach[parent] = std::max(reach[parent], reach[i] + length[i]);
+    }
+
+    float size = 0.0f;
+    for (size_t i = 0; i < jointCount; i++)
+    {
+        if (m_parents[i] < 0)
+            size = std::max(size, reach[i]);
+    }
+    const float distance = tolerance * (size > 0.0f ? size : 1.0f);
+
+    // An error of angle a at a joint moves whatever is reach away by about a * reach, and the same goes for
+    // a relative error in scale. A leaf's own bone length stands in for the vertices it moves.
+    tolerances.resize(jointCount);
+    for (size_t i = 0; i < jointCount; i++)
+    {
+        const float lever = std::max(leaf[i] ? length[i] : reach[i], distance);
+        tolerances[i].translation = distance;
+        tolerances[i].rotation = distance / lever;
+        tolerances[i].scale = distance / lever;
+    }
+}
+
+void Skeleton::CompressClips(AnimationClipSet& clips, float tolerance) const
+{
+    std::vector<CompressedAnimation::Tolerance> tolerances;
+    ComputeJointTolerances(tolerance, tolerances);
+
+    clips.compressed.clear();
+    for (const Animation& animation : clips.animations)
+    {
+        // Keep the two lists parallel; a clip with nothing to compress has nothing to play either
+        CompressedAnimation compressed;
+        if (!compressed.Compress(animation, tolerances, CompressedAnimation::Tolerance()))
+            compressed = CompressedAnimation();
+        clips.compressed.push_back(std::move(compressed));
+    }
+}
+
+void Skeleton::CompressAnimations(float tolerance)
+{
+    if (!m_clips)
+        return;
+
+    // The clips may be shared, so this skeleton gets its own compressed copy
+    std::shared_ptr<AnimationClipSet> clips = std::make_shared<AnimationClipSet>();
+    clips->animations = m_clips->animations;
+    CompressClips(*clips, tolerance);
+    m_clips = clips;
+    m_compressedCursor = CompressedAnimation::Cursor();
+}
+
+void Skeleton::BakeAnimations(float framesPerSecond)
+{
+    if (!m_clips)
+        return;
+
+    // As with compression, the clips may be shared, so this skeleton gets its own baked copy
+    std::shared_ptr<AnimationClipSet> clips = std::make_shared<AnimationClipSet>(*m_clips);
+    clips->baked.clear();
+    if (framesPerSecond > 0.0f)
+    {
+        clips->baked.resize(clips->animations.size());
+        for (size_t a = 0; a < clips->animations.size(); a++)
+            clips->baked[a].Bake(*this, clips->animations[a], framesPerSecond);
+    }
+    m_clips = clips;
+}
+
+void Skeleton::SampleChannels(const Animation& animation, float time)
+{
+    const int jointCount = (int)m_parents.size();
+
+    if (&animation != m_cursorAnimation || m_samplerCursors.size() != animation.m_samplers.size())
+    {
+        m_cursorAnimation = &animation;
+        m_samplerCursors.assign(animation.m_samplers.size(), 0);
+    }
+
+    // Linear and step channels are written straight away; cubic ones are collected and evaluated as a batch
+    m_cubicBatch.clear();
+    m_cubicChannels.clear();
+
+    for (const AnimationChannel& channel : animation.m_channels)
+    {
+        if (channel.jointIndex < 0 || channel.jointIndex >= jointCount ||
+            channel.samplerIndex < 0 || channel.samplerIndex >= (int)animation.m_samplers.size())
+            continue;
+
+        const AnimationSampler& sampler = animation.m_samplers[channel.samplerIndex];
+        const size_t count = sampler.GetKeyCount();
+        const bool rotation = channel.path == AnimationChannel::ROTATION;
+        if (count == 0 || rotation == sampler.vec4_values.empty())
+            continue;
+
+        // Keyframes either side of the time, and how far between them it is
+        size_t search = sampler.timestamps.size();
+        float t = 0.0f;
+        const size_t k0 = sampler.FindSegment(time, m_useCursors ? m_samplerCursors[channel.samplerIndex] : search, t);
+
+        // Cubic segments are left for the batch; the sampler interpolates everything else
+        if (sampler.interpolation == AnimationSampler::CUBICSPLINE && k0 + 1 < count && sampler.segments.size() >= (k0 + 1) * 4)
+        {
+            m_cubicBatch.push_back({ &sampler.segments[k0 * 4], t });
+            m_cubicChannels.push_back(&channel);
+            continue;
+        }
+        StoreChannelValue(channel, sampler.Interpolate(k0, t, rotation));
+    }
+
+    if (m_cubicBatch.empty())
+        return;
+
+    m_cubicResults.resize(m_cubicBatch.size());
+    EvaluateCubicSegments(m_cubicBatch.data(), m_cubicBatch.size(), m_cubicResults.data());
+    for (size_t i = 0; i < m_cubicBatch.size(); i++)
+    {
+        const AnimationChannel& channel = *m_cubicChannels[i];
+        XMVECTOR value = XMLoadFloat4(&m_cubicResults[i]);
+        if (channel.path == AnimationChannel::ROTATION)
+            value = XMQuaternionNormalize(value);
+        StoreChannelValue(channel, value);
+    }
+}
+
+void XM_CALLCONV Skeleton::StoreChannelValue(const AnimationChannel& channel, FXMVECTOR value)
+{
+    switch (channel.path)
+    {
+    case AnimationChannel::ROTATION:    XMStoreFloat4(&m_localRotation[channel.jointIndex], value); break;
+    case AnimationChannel::TRANSLATION: XMStoreFloat3(&m_localTranslation[channel.jointIndex], value); break;
+    default:                            XMStoreFloat3(&m_localScale[channel.jointIndex], value); break;
+    }
+}
+
+void Skeleton::ComputeMeshSpaceTransforms()
+{
+    // Parents come first, so each joint's parent is already final when it is reached
+    const XMVECTOR zero = XMVectorZero();
+    for (size_t i = 0; i < m_parents.size(); i++)
+    {
+        const XMMATRIX local = XMMatrixAffineTransformation(XMLoadFloat3(&m_localScale[i]), zero,
+                                                            XMLoadFloat4(&m_localRotation[i]), XMLoadFloat3(&m_localTranslation[i]));
+        const int parent = m_parents[i];
+        const XMMATRIX parentTransform = parent < 0 ? XMLoadFloat4x4(&m_rootBase[i]) : XMLoadFloat4x4(&m_meshTransforms[parent]);
+        XMStoreFloat4x4(&m_meshTransforms[i], XMMatrixMultiply(local, parentTransform));
+    }
+}
+
+void Skeleton::GetSkinningMatrices(DirectX::XMMATRIX* matrixlist, unsigned int arraylength) const
+{
+    if (const BakedAnimation* baked = CurrentBakedAnimation())
+    {
+        baked->Sample(baked->GetPosition(m_currentAnimationTime), matrixlist, arraylength);
+        return;
+    }
+
+    for (size_t i = 0; i < m_parents.size(); i++)
+    {
+        const int slot = m_skinJoint[i];
+        if (slot >= (int)arraylength)
+            continue;
+        const XMMATRIX skin = XMMatrixMultiply(XMLoadFloat4x4(&m_inverseBind[i]), XMLoadFloat4x4(&m_meshTransforms[i]));
+        matrixlist[slot] = XMMatrixTranspose(skin);
+    }
+}
+
+void Skeleton::GetSkinningMatrices(DirectX::XMFLOAT3X4* matrixlist, unsigned int arraylength) const
+{
+    if (const BakedAnimation* baked = CurrentBakedAnimation())
+    {
+        baked->Sample(baked->GetPosition(m_currentAnimationTime), matrixlist, arraylength);
+        return;
+    }
+
+    for (size_t i = 0; i < m_parents.size(); i++)
+    {
+        const int slot = m_skinJoint[i];
+        if (slot >= (int)arraylength)
+            continue;
+        const XMMATRIX skin = XMMatrixMultiply(XMLoadFloat4x4(&m_inverseBind[i]), XMLoadFloat4x4(&m_meshTransforms[i]));
+        XMStoreFloat3x4(&matrixlist[slot], skin);
+    }
+}
+
+Skeleton::PaletteKey Skeleton::GetPaletteKey() const
+{
+    const BakedAnimation* baked = CurrentBakedAnimation();
+    if (baked == nullptr)
+        return { this, 0 };
+    return { baked, baked->GetPosition(m_currentAnimationTime) };
+}
+
+void Skeleton::RunBenchmark()
+{
+    constexpr int kInstances = 1000;
+    constexpr int kFrames = 20;
+    const wchar_t* files[] = { L"Resources\\RiggedFigure.gltf", L"Resources\\Fox.gltf" };
+
+    for (const wchar_t* file : files)
+    {
+        tinygltf::Model model;
+        Skeleton skeleton;
+        if (!GltfUtils::LoadModel(model, file) || !skeleton.LoadFromGltf(model) || skeleton.GetAnimationCount() == 0)
+        {
+            Log::Error(L"Skeleton benchmark: cannot load an animated skin from %s", file);
+            continue;
+        }
+
+        skeleton.PlayAnimation(0);
+        const Animation* animation = skeleton.CurrentAnimation();
+        const float duration = std::max(animation->GetEndTime(), 0.001f);
+        const unsigned int bones = skeleton.GetBoneCount();
+
+        // The instances share the rig and clip and differ in time; each writes its own palette
+        std::vector<XMMATRIX> palettes((size_t)kInstances * bones);
+        auto instanceTime = [duration](int instance, int frame)
+        {
+            return fmodf(instance * 0.037f + frame / 60.0f, duration);
+        };
+
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (int frame = 0; frame < kFrames; frame++)
+        {
+            for (int i = 0; i < kInstances; i++)
+            {
+                skeleton.EvaluatePose(animation, instanceTime(i, frame));
+                skeleton.GetSkinningMatrices(&palettes[(size_t)i * bones], bones);
+            }
+        }
+        const double linearMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / kFrames;
+
+        // Reference: the recursive, per joint children list evaluation this replaces, with its own
+        // intermediate skinning matrix array copied out at the end
+        std::vector<std::vector<int>> children(bones);
+        std::vector<int> roots;
+        for (unsigned int j = 0; j < bones; j++)
+        {
+            if (skeleton.m_parents[j] < 0)
+                roots.push_back(j);
+            else
+                children[skeleton.m_parents[j]].push_back(j);
+        }
+        std::vector<XMFLOAT4X4> skinning(bones);
+        std::function<void(int, const XMMATRIX&)> visit = [&](int joint, const XMMATRIX& parentTransform)
+        {
+            const XMMATRIX local = XMMatrixScalingFromVector(XMLoadFloat3(&skeleton.m_localScale[joint])) *
+                                   XMMatrixRotationQuaternion(XMLoadFloat4(&skeleton.m_localRotation[joint])) *
+                                   XMMatrixTranslationFromVector(XMLoadFloat3(&skeleton.m_localTranslation[joint]));
+            const XMMATRIX global = local * parentTransform;
+            XMStoreFloat4x4(&skinning[skeleton.m_skinJoint[joint]], XMMatrixTranspose(XMLoadFloat4x4(&skeleton.m_inverseBind[joint]) * global));
+            for (int child : children[joint])
+                visit(child, global);
+        };
+
+        std::vector<XMMATRIX> reference((size_t)kInstances * bones);
+        const auto referenceStart = std::chrono::high_resolution_clock::now();
+        for (int frame = 0; frame < kFrames; frame++)
+        {
+            for (int i = 0; i < kInstances; i++)
+            {
+                skeleton.ResetToRestPose();
+                skeleton.SampleChannels(*animation, instanceTime(i, frame));
+                for (int root : roots)
+                    visit(root, XMLoadFloat4x4(&skeleton.m_rootBase[root]));
+                for (unsigned int j = 0; j < bones; j++)
+                    reference[(size_t)i * bones + j] = XMLoadFloat4x4(&skinning[j]);
+            }
+        }
+        const double referenceMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - referenceStart).count() / kFrames;
+
+        float maxError = 0.0f;
+        for (size_t m = 0; m < palettes.size(); m++)
+        {
+            const XMVECTOR diff[4] =
+            {
+                XMVectorAbs(XMVectorSubtract(palettes[m].r[0], reference[m].r[0])),
+                XMVectorAbs(XMVectorSubtract(palettes[m].r[1], reference[m].r[1])),
+                XMVectorAbs(XMVectorSubtract(palettes[m].r[2], reference[m].r[2])),
+                XMVectorAbs(XMVectorSubtract(palettes[m].r[3], reference[m].r[3])),
+            };
+            const XMVECTOR largest = XMVectorMax(XMVectorMax(diff[0], diff[1]), XMVectorMax(diff[2], diff[3]));
+            XMFLOAT4 l;
+            XMStoreFloat4(&l, largest);
+            maxError = std::max(maxError, std::max(std::max(l.x, l.y), std::max(l.z, l.w)));
+        }
+
+        Log::Info(L"Skeleton benchmark %s: %u joints, %zu channels, %d instances - linear SoA %.3f ms/frame (%.2f us each), "
+                  L"recursive reference %.3f ms/frame, max difference %g",
+                  file, bones, animation->m_channels.size(), kInstances, linearMs, linearMs * 1000.0 / kInstances, referenceMs, maxError);
+    }
+}
+
+// A long clip with a translation, rotation and scale channel for every joint, wobbling around the rest pose.
+// Cubic spline clips get tangents matching the wobble.
+Animation Skeleton::MakeSyntheticClip(const Skeleton& skeleton, float length, float keyRate, AnimationSampler::InterpolationType interpolation)
+{
+    const unsigned int bones = skeleton.GetBoneCount();
+    const size_t keyCount = (size_t)(length * keyRate) + 1;
+    const bool cubic = interpolation == AnimationSampler::CUBICSPLINE;
+    Animation clip;
+    clip.m_name = "synthetic";
+    for (unsigned int j = 0; j < bones; j++)
+    {
+        for (int path = AnimationChannel::TRANSLATION; path <= AnimationChannel::SCALE; path++)
+        {
+            auto value = [&](float time)
+            {
+                const float wobble = 0.1f * sinf(time * 3.0f + j);
+                if (path == AnimationChannel::ROTATION)
+                {
+                    return XMQuaternionMultiply(XMLoadFloat4(&skeleton.m_restRotation[j]),
+                                                XMQuaternionRotationRollPitchYaw(wobble, wobble * 0.5f, 0.0f));
+                }
+                const XMFLOAT3& rest = path == AnimationChannel::TRANSLATION ? skeleton.m_restTranslation[j] : skeleton.m_restScale[j];
+                return XMVectorSet(rest.x + wobble, rest.y, rest.z - wobble, 0.0f);
+            };
+            auto push = [&](AnimationSampler& sampler, FXMVECTOR v)
+            {
+                XMFLOAT4 f;
+                XMStoreFloat4(&f, v);
+                if (path == AnimationChannel::ROTATION)
+                    sampler.vec4_values.push_back(f);
+                else
+                    sampler.vec3_values.push_back(XMFLOAT3(f.x, f.y, f.z));
+            };
+
+            AnimationSampler sampler;
+            sampler.interpolation = interpolation;
+            sampler.timestamps.resize(keyCount);
+            for (size_t k = 0; k < keyCount; k++)
+            {
+                const float time = k / keyRate;
+                sampler.timestamps[k] = time;
+                if (cubic)
+                {
+                    // Central difference; in and out tangents are the same for a smooth curve
+                    const float h = 0.001f;
+                    const XMVECTOR tangent = XMVectorScale(XMVectorSubtract(value(time + h), value(time - h)), 0.5f / h);
+                    push(sampler, tangent);
+                    push(sampler, value(time));
+                    push(sampler, tangent);
+                }
+                else
+                {
+                    push(sampler, value(time));
+                }
+            }
+            sampler.BuildSegments();
+
+            AnimationChannel channel;
+            channel.path = (AnimationChannel::PathType)path;
+            channel.jointIndex = (int)j;
+            channel.samplerIndex = (int)clip.m_samplers.size();
+            clip.m_samplers.push_back(std::move(sampler));
+            clip.m_channels.push_back(channel);
+        }
+    }
+    return clip;
+}
+
+void Skeleton::RunSamplingBenchmark()
+{
+    constexpr float kClipLength = 120.0f;     // seconds
+    constexpr float kKeyRate = 30.0f;         // keys per second, per channel
+    constexpr float kFrameRate = 60.0f;
+    constexpr int kSeeks = 20000;
+
+    tinygltf::Model model;
+    Skeleton skeleton;
+    if (!GltfUtils::LoadModel(model, L"Resources\\Fox.gltf") || !skeleton.LoadFromGltf(model))
+    {
+        Log::Error(L"Sampling benchmark: cannot load the skin from Resources\\Fox.gltf");
+        return;
+    }
+
+    const unsigned int bones = skeleton.GetBoneCount();
+    const size_t keyCount = (size_t)(kClipLength * kKeyRate) + 1;
+    const Animation clip = MakeSyntheticClip(skeleton, kClipLength, kKeyRate);
+
+    // Two passes through the clip at the frame rate, so the loop back to the start is included
+    std::vector<float> playback;
+    for (float time = 0.0f; time < 2.0f * kClipLength; time += 1.0f / kFrameRate)
+        playback.push_back(fmodf(time, kClipLength));
+
+    std::vector<float> seeks(kSeeks);
+    unsigned int seed = 12345;
+    for (float& time : seeks)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        time = (seed >> 8) * (kClipLength / 16777216.0f);
+    }
+
+    auto channelsPerSecond = [&](const std::vector<float>& times, bool useCursors)
+    {
+        skeleton.m_useCursors = useCursors;
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (float time : times)
+            skeleton.SampleChannels(clip, time);
+        const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        return seconds > 0.0 ? times.size() * clip.m_channels.size() / seconds : 0.0;
+    };
+
+    const double searchRate = channelsPerSecond(playback, false);
+    const double cursorRate = channelsPerSecond(playback, true);
+    const double seekRate = channelsPerSecond(seeks, true);
+
+    // Both ways must land on the same keys
+    Skeleton searched = skeleton;
+    searched.m_useCursors = false;
+    skeleton.m_useCursors = true;
+    float maxError = 0.0f;
+    for (float time : playback)
+    {
+        skeleton.SampleChannels(clip, time);
+        searched.SampleChannels(clip, time);
+        for (unsigned int j = 0; j < bones; j++)
+        {
+            const XMVECTOR diff = XMVectorMax(XMVectorAbs(XMVectorSubtract(XMLoadFloat4(&skeleton.m_localRotation[j]), XMLoadFloat4(&searched.m_localRotation[j]))),
+                                              XMVectorAbs(XMVectorSubtract(XMLoadFloat3(&skeleton.m_localTranslation[j]), XMLoadFloat3(&searched.m_localTranslation[j]))));
+            XMFLOAT4 d;
+            XMStoreFloat4(&d, diff);
+            maxError = std::max(maxError, std::max(std::max(d.x, d.y), std::max(d.z, d.w)));
+        }
+    }
+
+    Log::Info(L"Sampling benchmark: %zu channels, %zu keys each - playback with binary search %.1f M channels/s, "
+              L"with cursors %.1f M channels/s (%.2fx), random seeks %.1f M channels/s, max difference %g",
+              clip.m_channels.size(), keyCount, searchRate / 1e6, cursorRate / 1e6,
+              searchRate > 0.0 ? cursorRate / searchRate : 0.0, seekRate / 1e6, maxError);
+
+    // The same clip as cubic splines: batched polynomials from the precomputed coefficients, against
+    // evaluating the Hermite basis from the keys and tangents per channel
+    const Animation cubicClip = MakeSyntheticClip(skeleton, kClipLength, kKeyRate, AnimationSampler::CUBICSPLINE);
+    std::vector<XMFLOAT4> hermite(cubicClip.m_channels.size());
+    std::vector<size_t> hermiteCursors(cubicClip.m_samplers.size(), 0);
+    auto sampleHermite = [&](float time)
+    {
+        for (size_t c = 0; c < cubicClip.m_channels.size(); c++)
+        {
+            const AnimationChannel& channel = cubicClip.m_channels[c];
+            const AnimationSampler& sampler = cubicClip.m_samplers[channel.samplerIndex];
+            float t;
+            const size_t k0 = sampler.FindSegment(time, hermiteCursors[channel.samplerIndex], t);
+            const size_t k1 = std::min(k0 + 1, sampler.GetKeyCount() - 1);
+            const float span = sampler.timestamps[k1] - sampler.timestamps[k0];
+            auto load = [&](size_t index)
+            {
+                return channel.path == AnimationChannel::ROTATION ? XMLoadFloat4(&sampler.vec4_values[index]) : XMLoadFloat3(&sampler.vec3_values[index]);
+            };
+            XMVECTOR v = XMVectorHermite(load(k0 * 3 + 1), XMVectorScale(load(k0 * 3 + 2), span),
+                                         load(k1 * 3 + 1), XMVectorScale(load(k1 * 3), span), t);
+            if (channel.path == AnimationChannel::ROTATION)
+                v = XMQuaternionNormalize(v);
+            XMStoreFloat4(&hermite[c], v);
+        }
+    };
+
+    skeleton.m_useCursors = true;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (float time : playback)
+        skeleton.SampleChannels(cubicClip, time);
+    const double batchSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    start = std::chrono::high_resolution_clock::now();
+    for (float time : playback)
+        sampleHermite(time);
+    const double hermiteSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    float maxCubicError = 0.0f;
+    for (float time : playback)
+    {
+        skeleton.SampleChannels(cubicClip, time);
+        sampleHermite(time);
+        for (size_t c = 0; c < cubicClip.m_channels.size(); c++)
+        {
+            const AnimationChannel& channel = cubicClip.m_channels[c];
+            const XMVECTOR value = channel.path == AnimationChannel::ROTATION ? XMLoadFloat4(&skeleton.m_localRotation[channel.jointIndex])
+                                 : channel.path == AnimationChannel::TRANSLATION ? XMLoadFloat3(&skeleton.m_localTranslation[channel.jointIndex])
+                                 : XMLoadFloat3(&skeleton.m_localScale[channel.jointIndex]);
+            XMFLOAT4 d;
+            XMStoreFloat4(&d, XMVectorAbs(XMVectorSubtract(value, XMLoadFloat4(&hermite[c]))));
+            maxCubicError = std::max(maxCubicError, std::max(std::max(d.x, d.y), std::max(d.z, d.w)));
+        }
+    }
+
+    const double cubicChannels = (double)playback.size() * cubicClip.m_channels.size();
+    Log::Info(L"Sampling benchmark, cubic spline: batched coefficients %.1f M channels/s, Hermite per channel %.1f M channels/s, "
+              L"max difference %g",
+              batchSeconds > 0.0 ? cubicChannels / batchSeconds / 1e6 : 0.0,
+              hermiteSeconds > 0.0 ? cubicChannels / hermiteSeconds / 1e6 : 0.0, maxCubicError);
+}
+
+void Skeleton::RunCompressionBenchmark()
+{
+    constexpr float kTolerance = 0.001f;        // of the skeleton's size
+    constexpr float kSampleRate = 120.0f;
+
+    struct Case
+    {
+        const wchar_t* file;
+        bool synthetic;
+    };
+    const Case cases[] = { { L"Resources\\RiggedFigure.gltf", false }, { L"Resources\\Fox.gltf", false }, { L"Resources\\Fox.gltf", true } };
+
+    for (const Case& test : cases)
+    {
+        tinygltf::Model model;
+        Skeleton skeleton;
+        if (!GltfUtils::LoadModel(model, test.file) || !skeleton.LoadFromGltf(model))
+        {
+            Log::Error(L"Compression benchmark: cannot load the skin from %s", test.file);
+            continue;
+        }
+        if (test.synthetic)
+        {
+            std::shared_ptr<AnimationClipSet> clips = std::make_shared<AnimationClipSet>();
+            clips->animations.push_back(MakeSyntheticClip(skeleton, 120.0f, 30.0f));
+            skeleton.m_clips = clips;
+        }
+
+        skeleton.CompressAnimations(kTolerance);
+        Skeleton source = skeleton;
+        const unsigned int bones = skeleton.GetBoneCount();
+
+        float size = 0.0f;
+        for (unsigned int j = 0; j < bones; j++)
+            size = std::max(size, XMVectorGetX(XMVector3Length(XMLoadFloat4x4(&skeleton.m_meshTransforms[j]).r[3])));
+
+        for (size_t a = 0; a < skeleton.m_clips->animations.size(); a++)
+        {
+            const Animation& animation = skeleton.m_clips->animations[a];
+            const CompressedAnimation& compressed = skeleton.m_clips->compressed[a];
+
+            // Forward playback, then a few seeks backwards through the clip
+            std::vector<float> times;
+            for (float time = 0.0f; time <= compressed.GetDuration(); time += 1.0f / kSampleRate)
+                times.push_back(time);
+            for (int seek = 0; seek < 64; seek++)
+                times.push_back(compressed.GetDuration() * (63 - seek) / 63.0f);
+
+            float maxPosition = 0.0f;
+            float maxRotation = 0.0f;
+            double sourceMs = 0.0, compressedMs = 0.0;
+            for (float time : times)
+            {
+                const auto start = std::chrono::high_resolution_clock::now();
+                source.EvaluatePose(&animation, time);
+                const auto middle = std::chrono::high_resolution_clock::now();
+                skeleton.EvaluatePose(&compressed, time);
+                const auto end = std::chrono::high_resolution_clock::now();
+                sourceMs += std::chrono::duration<double, std::milli>(middle - start).count();
+                compressedMs += std::chrono::duration<double, std::milli>(end - middle).count();
+
+                for (unsigned int j = 0; j < bones; j++)
+                {
+                    const XMVECTOR p0 = XMLoadFloat4x4(&source.m_meshTransforms[j]).r[3];
+                    const XMVECTOR p1 = XMLoadFloat4x4(&skeleton.m_meshTransforms[j]).r[3];
+                    maxPosition = std::max(maxPosition, XMVectorGetX(XMVector3Length(XMVectorSubtract(p0, p1))));
+
+                    const float d = fabsf(XMVectorGetX(XMVector4Dot(XMLoadFloat4(&source.m_localRotation[j]), XMLoadFloat4(&skeleton.m_localRotation[j]))));
+                    maxRotation = std::max(maxRotation, 2.0f * acosf(std::min(d, 1.0f)));
+                }
+            }
+
+            const size_t sourceBytes = CompressedAnimation::GetMemorySize(animation);
+            const size_t compressedBytes = compressed.GetMemorySize();
+            Log::Info(L"Compression benchmark %s '%S': %.1f s, %zu of %zu keys kept, %zu -> %zu bytes (%.1f:1), "
+                      L"max joint position error %g (%.3f%% of the skeleton), max local rotation error %.4f rad, "
+                      L"pose %.2f us from source, %.2f us compressed",
+                      test.file, animation.m_name.c_str(), compressed.GetDuration(), compressed.GetKeyCount(), compressed.GetSourceKeyCount(),
+                      sourceBytes, compressedBytes, compressedBytes ? (double)sourceBytes / compressedBytes : 0.0,
+                      maxPosition, size > 0.0f ? 100.0f * maxPosition / size : 0.0f, maxRotation,
+                      1000.0 * sourceMs / times.size(), 1000.0 * compressedMs / times.size());
+        }
+    }
+
+    // Clips of a single pose: one key per channel, and two keys per channel that both fall at time 0.
+    // Either is one block of two keys per channel and plays back the pose it was made from.
+    tinygltf::Model model;
+    Skeleton skeleton;
+    if (!GltfUtils::LoadModel(model, L"Resources\\Fox.gltf") || !skeleton.LoadFromGltf(model))
+    {
+        Log::Error(L"Compression benchmark: cannot load the skin from Resources\\Fox.gltf");
+        return;
+    }
+    std::shared_ptr<AnimationClipSet> poses = std::make_shared<AnimationClipSet>();
+    poses->animations.push_back(MakeSyntheticClip(skeleton, 0.0f, 30.0f));
+    Animation doubled = poses->animations[0];
+    for (AnimationSampler& sampler : doubled.m_samplers)
+    {
+        sampler.timestamps.push_back(sampler.timestamps[0]);
+        if (!sampler.vec3_values.empty())
+            sampler.vec3_values.push_back(sampler.vec3_values[0]);
+        if (!sampler.vec4_values.empty())
+            sampler.vec4_values.push_back(sampler.vec4_values[0]);
+        sampler.BuildSegments();
+    }
+    poses->animations.push_back(std::move(doubled));
+    skeleton.m_clips = poses;
+    skeleton.CompressAnimations(kTolerance);
+    Skeleton source = skeleton;
+
+    for (size_t a = 0; a < skeleton.m_clips->animations.size(); a++)
+    {
+        const Animation& animation = skeleton.m_clips->animations[a];
+        const CompressedAnimation& compressed = skeleton.m_clips->compressed[a];
+        bool passed = compressed.GetDuration() == 0.0f && compressed.GetBlockCount() == 1 &&
+                      compressed.GetKeyCount() == 2 * animation.m_channels.size();
+
+        float maxPosition = 0.0f;
+        for (float time : { 0.0f, 0.5f, -1.0f })
+        {
+            source.EvaluatePose(&animation, time);
+            skeleton.EvaluatePose(&compressed, time);
+            for (unsigned int j = 0; j < skeleton.GetBoneCount(); j++)
+            {
+                const XMVECTOR p0 = XMLoadFloat4x4(&source.m_meshTransforms[j]).r[3];
+                const XMVECTOR p1 = XMLoadFloat4x4(&skeleton.m_meshTransforms[j]).r[3];
+                maxPosition = std::max(maxPosition, XMVectorGetX(XMVector3Length(XMVectorSubtract(p0, p1))));
+            }
+        }
+        passed = passed && maxPosition < 0.01f;
+
+        if (passed)
+            Log::Info(L"Compression benchmark: %zu key single pose clip kept as %zu keys in %zu bytes",
+                      compressed.GetSourceKeyCount(), compressed.GetKeyCount(), compressed.GetMemorySize());
+        else
+            Log::Error(L"Compression benchmark: %zu key single pose clip has %zu blocks and %zu keys, max joint position error %g",
+                       compressed.GetSourceKeyCount(), compressed.GetBlockCount(), compressed.GetKeyCount(), maxPosition);
+    }
+}
@@ -6,70 +6,181 @@
 #include "tiny_gltf.h"
 
 #include "Animation.h"
-
-struct Joint
-{
-    // The name of the joint, useful for debugging.
-    std::string name = "unknown";
-
-    // The transform of the bone in its parent's space at the time of binding.
-    DirectX::XMFLOAT4X4  localBindTransform{};
-
-    // The inverse of the bone's transform in model space at the time of binding.
-    DirectX::XMFLOAT4X4  inverseBindMatrix{};
-
-    // Indices of the children of this joint in the skeleton's main joint list.
-    std::vector<int> children;
-
-    // The final transform of the bone in model space for the current animation frame.
-    // This is calculated at runtime by combining the local animated pose with the parent's final transform.
-    DirectX::XMFLOAT4X4 finalTransform{};
-};
-
+#include "AnimationLibrary.h"
+#include "CompressedAnimation.h"
+#include "PosePool.h"
+
+// A skinned skeleton and its animations.
+//
+// Joints are stored as parallel arrays (structure of arrays), sorted so that every joint comes after
+// its parent. Evaluating a pose is then three flat passes with no recursion:
+//   1. reset the local TRS to the rest pose and sample every channel of the current animation into it
+//   2. one linear pass building mesh space matrices, each joint multiplying onto its already done parent
+//   3. GetSkinningMatrices() folds in the inverse bind matrices while writing into the caller's buffer
+// Each skeleton keeps a keyframe cursor per sampler of the last animation it sampled, so normal playback
+// finds its keys without searching.
 class Skeleton
 {
 public:
+    // Identifies a palette: skeletons with equal keys produce identical skinning matrices
+    struct PaletteKey
+    {
+        const void* source;     // the skeleton itself, or the baked clip it plays
+        uint32_t    position;   // BakedAnimation::GetPosition() when baked
+
+        bool operator==(const PaletteKey& other) const { return source == other.source && position == other.position; }
+        bool operator!=(const PaletteKey& other) const { return !(*this == other); }
+        bool operator<(const PaletteKey& other) const { return source != other.source ? source < other.source : position < other.position; }
+    };
+
+    // Keyframe cursors of one clip, for sampling several clips into one skeleton's poses without each
+    // restarting the others' key searches (see BlendTree)
+    struct ClipCursor
+    {
+        const Animation*            animation = nullptr;
+        std::vector<size_t>         samplers;
+        CompressedAnimation::Cursor compressed;
+    };
 
     Skeleton();
 
-    // Loads the skeleton hierarchy and matrices from a glTF model.
-    // Returns true on success.
-    bool LoadFromGltf(const tinygltf::Model& model);
-
-    // Updates the pose of the skeleton based on the animation time.
-    void Update(float deltaTime);
-
-    // Returns the final skinning matrices ready to be sent to the GPU.
-    const void GetSkinningMatrices(DirectX::XMMATRIX* matrixlist, unsigned int arraylength) const;
-    const unsigned int GetBoneCount() { return m_skinningMatrices.size(); }
-    const DirectX::XMMATRIX& GetRootTransform() const { return XMLoadFloat4x4(&m_rootTransform); }
-
-    unsigned int GetAnimationCount() { return m_animationCount; }
+    // Loads the joint hierarchy, rest pose, inverse bind matrices and all animations of one glTF skin.
+    // With a clip key the animations come from the AnimationLibrary, loaded (and compressed) only by
+    // the first skeleton to ask for them. Returns true on success.
+    bool LoadFromGltf(const tinygltf::Model& model, int skinIndex = 0, const std::wstring& clipKey = std::wstring());
+
+    // Advances the current animation. The pose is evaluated every interval-th call only; the calls in
+    // between blend the mesh space transforms from the last shown pose towards one evaluated ahead for
+    // the end of the interval. Returns true if a pose was evaluated. Safe to call for different
+    // skeletons from several threads at once.
+    bool Update(float deltaTime, unsigned int interval = 1);
+
+    // Evaluates the pose of an animation (a null Animation* for the rest pose) at an absolute time.
+    void EvaluatePose(const Animation* animation, float timeInSeconds);
+    void EvaluatePose(const CompressedAnimation* animation, float timeInSeconds);
+
+    // Builds a compressed copy of every animation, which Update() plays from then on. tolerance is the
+    // largest acceptable joint position error as a fraction of the skeleton's size (its longest chain).
+    void CompressAnimations(float tolerance);
+    bool HasCompressedAnimations() const { return m_clips && !m_clips->compressed.empty(); }
+
+    // Pre-samples every animation into skinning palettes at about framesPerSecond (0 drops them). From
+    // then on Update() only advances the time and GetSkinningMatrices() blends two baked frames.
+    void BakeAnimations(float framesPerSecond);
+    bool HasBakedAnimations() const { return m_clips && !m_clips->baked.empty(); }
+    const BakedAnimation* CurrentBakedAnimation() const { return m_currentAnimation >= 0 && HasBakedAnimations() ? &m_clips->baked[m_currentAnimation] : nullptr; }
+    size_t GetAnimationMemorySize(bool compressed) const { return m_clips ? m_clips->GetMemorySize(compressed) : 0; }
+    std::shared_ptr<const AnimationClipSet> GetClips() const { return m_clips; }
+
+    // Writes the skinning matrices (transposed, ready for the GPU) in glTF joint order, which is the
+    // order the vertices' JOINTS_0 indices refer to. Joints past arraylength are dropped.
+    void GetSkinningMatrices(DirectX::XMMATRIX* matrixlist, unsigned int arraylength) const;
+    // The same as 3x4 matrices (the transposed matrices without their last row)
+    void GetSkinningMatrices(DirectX::XMFLOAT3X4* matrixlist, unsigned int arraylength) const;
+    PaletteKey GetPaletteKey() const;
+    unsigned int GetBoneCount() const { return (unsigned int)m_parents.size(); }
+    DirectX::XMMATRIX GetRootTransform() const { return XMLoadFloat4x4(&m_rootTransform); }
+    // Distance of the furthest joint from the mesh origin in the rest pose
+    float GetRadius() const { return m_radius; }
+
+    unsigned int GetAnimationCount() const { return m_clips ? (unsigned int)m_clips->animations.size() : 0; }
     void PlayAnimation(const unsigned int animation);
-    bool IsLoaded() { return m_isLoaded; }
-    Animation* CurrentAnimation() { return m_pCurrentAnimation; }
+    bool IsLoaded() const { return m_isLoaded; }
+    int GetCurrentAnimationIndex() const { return m_currentAnimation; }
+    const Animation* CurrentAnimation() const { return m_currentAnimation >= 0 ? &m_clips->animations[m_currentAnimation] : nullptr; }
+    float GetAnimationTime() const { return m_currentAnimationTime; }
+    // Morph target weights of a glTF node from the current animation at the current time. Returns false
+    // if it does not animate them.
+    bool GetMorphWeights(int nodeIndex, float* weights, size_t count)
+    {
+        const Animation* animation = CurrentAnimation();
+        return animation && animation->SampleWeights(nodeIndex, m_currentAnimationTime, weights, count, m_weightCursors);
+    }
+    void SetAnimationTime(float time) { m_currentAnimationTime = time; }
+
+    // Local poses for blending, in the skeleton's joint order. SampleLocalPose() samples an animation
+    // at an absolute time over the rest pose, from its compressed copy if there is one; SetLocalPose()
+    // makes a pose the current one and builds its mesh space transforms. Neither allocates once the
+    // cursor and pose have been used with the skeleton.
+    void GetRestPose(LocalPose& pose) const;
+    void SampleLocalPose(unsigned int animation, float time, ClipCursor& cursor, LocalPose& pose);
+    void SetLocalPose(const LocalPose& pose);
+
+    int GetJointIndex(const std::string& name) const;
+    // Per joint weights for a layer: weight for the named joint and everything below it, 0 elsewhere.
+    // Empty if there is no such joint.
+    std::vector<float> MakeJointMask(const std::string& root, float weight = 1.0f) const;
+
+    // Times pose evaluation of 1000 instances of RiggedFigure.gltf and Fox.gltf and checks the result
+    // against a straightforward recursive evaluation. Results go to the log.
+    static void RunBenchmark();
+
+    // Times channel sampling on a long synthetic clip for Fox.gltf's rig - forward playback with and
+    // without the keyframe cursors, random seeks, and cubic splines batched and not - and logs channels
+    // per second.
+    static void RunSamplingBenchmark();
+
+    // Compresses the clips of RiggedFigure.gltf and Fox.gltf and a long synthetic clip, and logs the
+    // memory saved and the largest joint position and rotation errors against the source. Also checks that
+    // clips of a single pose (one key, or keys all at time 0) compress to one block.
+    static void RunCompressionBenchmark();
 
 private:
-    // Change the signature to accept a pointer.
-    void UpdateJointTransform(int jointIndex, const Animation* anim, float time, const DirectX::XMMATRIX& parentTransform);
-
-    // The flat list of all joints that make up this skeleton.
-    std::vector<Joint> m_joints;
-
-    // A list of indices for the root joints (those without a parent in the skeleton).
-    std::vector<int> m_rootJointIndices;
-
-    // The final matrices sent to the shader, calculated by multiplying the
-    // inverse bind matrix by the final animated transform for each joint.
-    std::vector<DirectX::XMFLOAT4X4> m_skinningMatrices;
-
-    DirectX::XMFLOAT4X4 m_rootTransform;
-
-    unsigned int            m_animationCount;
-    std::vector<Animation>  m_animations;
-    Animation* m_pCurrentAnimation;
-    float                   m_currentAnimationTime;
-    bool                    m_isLoaded = false;
+    void SampleChannels(const Animation& animation, float time);
+    void XM_CALLCONV StoreChannelValue(const AnimationChannel& channel, DirectX::FXMVECTOR value);
+    void ComputeMeshSpaceTransforms();
+    void ResetToRestPose();
+    void ComputeJointTolerances(float tolerance, std::vector<CompressedAnimation::Tolerance>& tolerances) const;
+    void CompressClips(AnimationClipSet& clips, float tolerance) const;
+
+    static Animation MakeSyntheticClip(const Skeleton& skeleton, float length, float keyRate,
+                                       AnimationSampler::InterpolationType interpolation = AnimationSampler::LINEAR);
+
+    // Per joint, sorted parents first. Index i here is not the glTF skin joint index, see m_skinJoint.
+    std::vector<int>                    m_parents;          // -1 for roots
+    std::vector<int>                    m_skinJoint;        // position in the glTF skin's joint list
+    std::vector<std::string>            m_names;
+
+    std::vector<DirectX::XMFLOAT3>      m_restTranslation;
+    std::vector<DirectX::XMFLOAT4>      m_restRotation;
+    std::vector<DirectX::XMFLOAT3>      m_restScale;
+
+    std::vector<DirectX::XMFLOAT3>      m_localTranslation;
+    std::vector<DirectX::XMFLOAT4>      m_localRotation;
+    std::vector<DirectX::XMFLOAT3>      m_localScale;
+
+    std::vector<DirectX::XMFLOAT4X4>    m_inverseBind;
+    std::vector<DirectX::XMFLOAT4X4>    m_meshTransforms;   // joint -> mesh space for the current pose
+
+    // For roots: everything above the skeleton in the node tree, followed by the inverse of the skinned
+    // mesh node's global transform, so that the pose comes out in the mesh's own space. Unused otherwise.
+    std::vector<DirectX::XMFLOAT4X4>    m_rootBase;
+
+    DirectX::XMFLOAT4X4                 m_rootTransform;
+    float                               m_radius = 0.0f;
+
+    // Shared with every other skeleton playing the same clips
+    std::shared_ptr<const AnimationClipSet> m_clips;
+    CompressedAnimation::Cursor         m_compressedCursor;
+    int                                 m_currentAnimation = -1;
+    float                               m_currentAnimationTime;
+    bool                                m_isLoaded = false;
+
+    // Keyframe cursor per sampler of m_cursorAnimation (see AnimationSampler::FindKeyframe)
+    const Animation*                    m_cursorAnimation = nullptr;
+    std::vector<size_t>                 m_samplerCursors;
+    bool                                m_useCursors = true;
+    // The same for the morph weight samplers of the current animation, see GetMorphWeights()
+    std::vector<size_t>                 m_weightCursors;
+
+    // Update rate LOD: the pose shown at the start of the interval and the one it is heading for
+    std::vector<DirectX::XMFLOAT4X4>    m_lodFrom;
+    std::vector<DirectX::XMFLOAT4X4>    m_lodTo;
+    unsigned int                        m_lodInterval = 1;
+    unsigned int                        m_lodFrame = 0;
+
+    // Scratch for SampleChannels(), kept to avoid allocating every frame
+    std::vector<CubicSegmentSample>     m_cubicBatch;
+    std::vector<const AnimationChannel*> m_cubicChannels;
+    std::vector<DirectX::XMFLOAT4>      m_cubicResults;
 };
-
-
@@ -0,0 +1,1088 @@
+#include "TextureCooker.h"
+
+#include "ColorConversion.h"
+#include "JobSystem.h"
+#include "log.hpp"
+#include "stb_image.h"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace
+{
+	static constexpr uint32_t kCookerVersion = 2;
+
+	// DDS container, written with the DX10 extension so every format is described the same way
+#pragma pack(push, 1)
+	struct DdsPixelFormat
+	{
+		uint32_t	size;
+		uint32_t	flags;
+		uint32_t	fourCC;
+		uint32_t	rgbBitCount;
+		uint32_t	masks[4];
+	};
+
+	struct DdsHeader
+	{
+		uint32_t		size;
+		uint32_t		flags;
+		uint32_t		height;
+		uint32_t		width;
+		uint32_t		pitchOrLinearSize;
+		uint32_t		depth;
+		uint32_t		mipMapCount;
+		uint32_t		reserved1[11];
+		DdsPixelFormat	ddspf;
+		uint32_t		caps[4];
+		uint32_t		reserved2;
+	};
+
+	struct DdsHeaderDx10
+	{
+		uint32_t	dxgiFormat;
+		uint32_t	resourceDimension;
+		uint32_t	miscFlag;
+		uint32_t	arraySize;
+		uint32_t	miscFlags2;
+	};
+#pragma pack(pop)
+
+	static_assert(sizeof(DdsHeader) == 124, "DDS header size mismatch");
+	static_assert(sizeof(DdsHeaderDx10) == 20, "DDS DX10 header size mismatch");
+
+	static constexpr uint32_t kDdsMagic = 0x20534444;		// "DDS "
+	static constexpr uint32_t kFourCCDx10 = 0x30315844;		// "DX10"
+	static constexpr size_t kDdsHeaderBytes = sizeof(uint32_t) + sizeof(DdsHeader) + sizeof(DdsHeaderDx10);
+
+	bool IsBC1(DXGI_FORMAT format) { return format == DXGI_FORMAT_BC1_UNORM || format == DXGI_FORMAT_BC1_UNORM_SRGB; }
+	bool IsBC3(DXGI_FORMAT format) { return format == DXGI_FORMAT_BC3_UNORM || format == DXGI_FORMAT_BC3_UNORM_SRGB; }
+	bool IsBC7(DXGI_FORMAT format) { return format == DXGI_FORMAT_BC7_UNORM || format == DXGI_FORMAT_BC7_UNORM_SRGB; }
+
+	UINT GetBlockBytes(DXGI_FORMAT format)
+	{
+		return (IsBC1(format) || format == DXGI_FORMAT_BC4_UNORM) ? 8 : 16;
+	}
+
+	UINT GetBlockCount(UINT size)
+	{
+		return std::max(1u, (size + 3) / 4);
+	}
+
+	// Index of each texel's nearest palette entry by squared distance over all four channels (channels
+	// not compared are zero in both), ties going to the lower index. Returns the summed distance.
+	uint32_t SelectIndicesScalar(const uint8_t texels[64], const uint8_t* palette, UINT count, uint8_t indices[16])
+	{
+		uint32_t total = 0;
+		for (UINT i = 0; i < 16; i++)
+		{
+			const uint8_t* texel = texels + i * 4;
+			uint32_t best = UINT32_MAX;
+			for (UINT entry = 0; entry < count; entry++)
+			{
+				uint32_t distance = 0;
+				for (UINT c = 0; c < 4; c++)
+				{
+					const int d = (int)texel[c] - (int)palette[entry * 4 + c];
+					distance += (uint32_t)(d * d);
+				}
+				if (distance < best)
+				{
+					best = distance;
+					indices[i] = (uint8_t)entry;
+				}
+			}
+			total += best;
+		}
+		return total;
+	}
+
+	// The same, four texels at a time
+	uint32_t SelectIndicesSSE(const uint8_t texels[64], const uint8_t* palette, UINT count, uint8_t indices[16])
+	{
+		const __m128i zero = _mm_setzero_si128();
+		alignas(16) int32_t distances[4];
+		alignas(16) int32_t chosen[4];
+		uint32_t total = 0;
+		for (UINT group = 0; group < 4; group++)
+		{
+			// Texels 0-1 and 2-3 of the group as 16-bit channels
+			const __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(texels + group * 16));
+			const __m128i low = _mm_unpacklo_epi8(packed, zero);
+			const __m128i high = _mm_unpackhi_epi8(packed, zero);
+
+			__m128i best = _mm_set1_epi32(INT32_MAX);
+			__m128i bestIndex = zero;
+			for (UINT entry = 0; entry < count; entry++)
+			{
+				int32_t color;
+				memcpy(&color, palette + entry * 4, sizeof(color));
+				const __m128i value = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+				const __m128i dLow = _mm_sub_epi16(low, value);
+				const __m128i dHigh = _mm_sub_epi16(high, value);
+
+				// r*r + g*g and b*b + a*a per texel, the two halves then added across
+				const __m128 sumLow = _mm_castsi128_ps(_mm_madd_epi16(dLow, dLow));
+				const __m128 sumHigh = _mm_castsi128_ps(_mm_madd_epi16(dHigh, dHigh));
+				const __m128i distance = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(sumLow, sumHigh, _MM_SHUFFLE(2, 0, 2, 0))),
+													   _mm_castps_si128(_mm_shuffle_ps(sumLow, sumHigh, _MM_SHUFFLE(3, 1, 3, 1))));
+
+				const __m128i closer = _mm_cmplt_epi32(distance, best);
+				best = _mm_or_si128(_mm_and_si128(closer, distance), _mm_andnot_si128(closer, best));
+				bestIndex = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32((int)entry)), _mm_andnot_si128(closer, bestIndex));
+			}
+
+			_mm_store_si128(reinterpret_cast<__m128i*>(distances), best);
+			_mm_store_si128(reinterpret_cast<__m128i*>(chosen), bestIndex);
+			for (UINT i = 0; i < 4; i++)
+			{
+				indices[group * 4 + i] = (uint8_t)chosen[i];
+				total += (uint32_t)distances[i];
+			}
+		}
+		return total;
+	}
+
+	uint32_t SelectIndices(TextureCooker::Kernel kernel, const uint8_t texels[64], const uint8_t* palette, UINT count, uint8_t indices[16])
+	{
+		return kernel == TextureCooker::eSSE ? SelectIndicesSSE(texels, palette, count, indices)
+											 : SelectIndicesScalar(texels, palette, count, indices);
+	}
+
+	// Start endpoints: the two texels furthest apart along the principal axis of channels [0, channels)
+	void FitPrincipalAxis(const uint8_t texels[64], UINT channels, float e0[4], float e1[4])
+	{
+		float mean[4] = {};
+		for (UINT i = 0; i < 16; i++)
+		{
+			for (UINT c = 0; c < channels; c++)
+				mean[c] += texels[i * 4 + c];
+		}
+		for (UINT c = 0; c < channels; c++)
+			mean[c] /= 16.0f;
+
+		float covariance[4][4] = {};
+		for (UINT i = 0; i < 16; i++)
+		{
+			float d[4] = {};
+			for (UINT c = 0; c < channels; c++)
+				d[c] = texels[i * 4 + c] - mean[c];
+			for (UINT a = 0; a < channels; a++)
+			{
+				for (UINT b = 0; b < channels; b++)
+					covariance[a][b] += d[a] * d[b];
+			}
+		}
+
+		// Power iteration, from the row of the channel varying the most
+		UINT widest = 0;
+		for (UINT c = 1; c < channels; c++)
+		{
+			if (covariance[c][c] > covariance[widest][widest])
+				widest = c;
+		}
+		float axis[4] = {};
+		for (UINT c = 0; c < channels; c++)
+			axis[c] = covariance[widest][c];
+		for (int iteration = 0; iteration < 8; iteration++)
+		{
+			float next[4] = {};
+			float length = 0.0f;
+			for (UINT a = 0; a < channels; a++)
+			{
+				for (UINT b = 0; b < channels; b++)
+					next[a] += covariance[a][b] * axis[b];
+				length = std::max(length, std::fabs(next[a]));
+			}
+			if (length <= 0.0f)
+				break;
+			for (UINT c = 0; c < channels; c++)
+				axis[c] = next[c] / length;
+		}
+
+		float lowest = FLT_MAX;
+		float highest = -FLT_MAX;
+		UINT low = 0;
+		UINT high = 0;
+		for (UINT i = 0; i < 16; i++)
+		{
+			float projection = 0.0f;
+			for (UINT c = 0; c < channels; c++)
+				projection += (texels[i * 4 + c] - mean[c]) * axis[c];
+			if (projection < lowest)
+			{
+				lowest = projection;
+				low = i;
+			}
+			if (projection > highest)
+			{
+				highest = projection;
+				high = i;
+			}
+		}
+		for (UINT c = 0; c < 4; c++)
+		{
+			e0[c] = c < channels ? texels[low * 4 + c] : 0.0f;
+			e1[c] = c < channels ? texels[high * 4 + c] : 0.0f;
+		}
+	}
+
+	// Least squares endpoints for the chosen indices; weights[i] places palette entry i between e0 (0)
+	// and e1 (1). False when every texel chose the same weight, which leaves nothing to solve.
+	bool RefitEndpoints(const uint8_t texels[64], UINT channels, const uint8_t indices[16], const float* weights, float e0[4], float e1[4])
+	{
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+		float at[4] = {}, bt[4] = {};
+		for (UINT i = 0; i < 16; i++)
+		{
+			const float b = weights[indices[i]];
+			const float a = 1.0f - b;
+			aa += a * a;
+			ab += a * b;
+			bb += b * b;
+			for (UINT c = 0; c < channels; c++)
+			{
+				at[c] += a * texels[i * 4 + c];
+				bt[c] += b * texels[i * 4 + c];
+			}
+		}
+
+		const float det = aa * bb - ab * ab;
+		if (det < 1e-3f)
+			return false;
+		for (UINT c = 0; c < channels; c++)
+		{
+			e0[c] = std::min(std::max((bb * at[c] - ab * bt[c]) / det, 0.0f), 255.0f);
+			e1[c] = std::min(std::max((aa * bt[c] - ab * at[c]) / det, 0.0f), 255.0f);
+		}
+		return true;
+	}
+
+	// A copy of one channel of the texels in R, the others zero
+	void ExtractChannel(const uint8_t texels[64], UINT channel, uint8_t out[64])
+	{
+		memset(out, 0, 64);
+		for (UINT i = 0; i < 16; i++)
+			out[i * 4] = texels[i * 4 + channel];
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// BC1 colour block (also the colour half of BC3)
+
+	static constexpr float kColorWeights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+	uint16_t To565(const float c[4])
+	{
+		const UINT r = (UINT)(c[0] * 31.0f / 255.0f + 0.5f);
+		const UINT g = (UINT)(c[1] * 63.0f / 255.0f + 0.5f);
+		const UINT b = (UINT)(c[2] * 31.0f / 255.0f + 0.5f);
+		return (uint16_t)((r << 11) | (g << 5) | b);
+	}
+
+	void From565(uint16_t color, uint8_t rgba[4])
+	{
+		const UINT r = (color >> 11) & 31;
+		const UINT g = (color >> 5) & 63;
+		const UINT b = color & 31;
+		rgba[0] = (uint8_t)((r << 3) | (r >> 2));
+		rgba[1] = (uint8_t)((g << 2) | (g >> 4));
+		rgba[2] = (uint8_t)((b << 3) | (b >> 2));
+		rgba[3] = 0;
+	}
+
+	// Packs a four colour block for endpoints a and b (texels' alpha zeroed), returning its error
+	uint32_t PackColor(const uint8_t texels[64], uint16_t a, uint16_t b, TextureCooker::Kernel kernel, uint8_t block[8], uint8_t indices[16])
+	{
+		// a > b selects four colours; a == b decodes index 0 as a either way
+		if (a < b)
+			std::swap(a, b);
+		uint8_t palette[16] = {};
+		From565(a, palette);
+		From565(b, palette + 4);
+		for (UINT c = 0; c < 3; c++)
+		{
+			palette[8 + c] = (uint8_t)((2 * palette[c] + palette[4 + c] + 1) / 3);
+			palette[12 + c] = (uint8_t)((palette[c] + 2 * palette[4 + c] + 1) / 3);
+		}
+		const uint32_t error = SelectIndices(kernel, texels, palette, a == b ? 1 : 4, indices);
+
+		uint32_t bits = 0;
+		for (UINT i = 0; i < 16; i++)
+			bits |= (uint32_t)indices[i] << (2 * i);
+		block[0] = (uint8_t)a;
+		block[1] = (uint8_t)(a >> 8);
+		block[2] = (uint8_t)b;
+		block[3] = (uint8_t)(b >> 8);
+		memcpy(block + 4, &bits, sizeof(bits));
+		return error;
+	}
+
+	void EncodeColor(const uint8_t texels[64], uint8_t block[8], TextureCooker::Kernel kernel)
+	{
+		uint8_t rgb[64];
+		memcpy(rgb, texels, sizeof(rgb));
+		for (UINT i = 0; i < 16; i++)
+			rgb[i * 4 + 3] = 0;
+
+		float e0[4], e1[4];
+		uint8_t indices[16];
+		FitPrincipalAxis(rgb, 3, e0, e1);
+		const uint32_t error = PackColor(rgb, To565(e0), To565(e1), kernel, block, indices);
+		if (error > 0 && RefitEndpoints(rgb, 3, indices, kColorWeights, e0, e1))
+		{
+			uint8_t refitted[8];
+			if (PackColor(rgb, To565(e0), To565(e1), kernel, refitted, indices) < error)
+				memcpy(block, refitted, sizeof(refitted));
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// BC4 value block (also the alpha half of BC3 and both halves of BC5)
+
+	static constexpr float kValueWeights[8] = { 0.0f, 1.0f, 1.0f / 7.0f, 2.0f / 7.0f, 3.0f / 7.0f, 4.0f / 7.0f, 5.0f / 7.0f, 6.0f / 7.0f };
+
+	// Packs an eight value block (a > b) for values in R of texels, returning its error
+	uint32_t PackValues(const uint8_t texels[64], int a, int b, TextureCooker::Kernel kernel, uint8_t block[8], uint8_t indices[16])
+	{
+		if (a < b)
+			std::swap(a, b);
+		uint8_t palette[32] = {};
+		palette[0] = (uint8_t)a;
+		palette[4] = (uint8_t)b;
+		for (int i = 2; i < 8; i++)
+			palette[i * 4] = (uint8_t)(((8 - i) * a + (i - 1) * b + 3) / 7);
+		const uint32_t error = SelectIndices(kernel, texels, palette, a == b ? 1 : 8, indices);
+
+		uint64_t bits = 0;
+		for (UINT i = 0; i < 16; i++)
+			bits |= (uint64_t)indices[i] << (3 * i);
+		block[0] = (uint8_t)a;
+		block[1] = (uint8_t)b;
+		for (UINT i = 0; i < 6; i++)
+			block[2 + i] = (uint8_t)(bits >> (8 * i));
+		return error;
+	}
+
+	void EncodeValues(const uint8_t texels[64], uint8_t block[8], TextureCooker::Kernel kernel)
+	{
+		int lowest = 255;
+		int highest = 0;
+		for (UINT i = 0; i < 16; i++)
+		{
+			lowest = std::min(lowest, (int)texels[i * 4]);
+			highest = std::max(highest, (int)texels[i * 4]);
+		}
+
+		uint8_t indices[16];
+		const uint32_t error = PackValues(texels, highest, lowest, kernel, block, indices);
+		float e0[4] = { (float)highest }, e1[4] = { (float)lowest };
+		if (error > 0 && RefitEndpoints(texels, 1, indices, kValueWeights, e0, e1))
+		{
+			uint8_t refitted[8];
+			if (PackValues(texels, (int)(e0[0] + 0.5f), (int)(e1[0] + 0.5f), kernel, refitted, indices) < error)
+				memcpy(block, refitted, sizeof(refitted));
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// BC7 mode 6: one RGBA endpoint pair of 7 bits per channel plus a low bit each, 4-bit indices
+
+	static constexpr int kBC7Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	struct BitWriter
+	{
+		uint8_t*	data;
+		UINT		position = 0;
+
+		void Write(UINT value, UINT bits)
+		{
+			for (UINT i = 0; i < bits; i++, position++)
+			{
+				if (value & (1u << i))
+					data[position >> 3] |= (uint8_t)(1u << (position & 7));
+			}
+		}
+	};
+
+	// 7 bits per channel and the low bit that lands closer
+	void QuantizeBC7Endpoint(const float e[4], uint8_t q[4], uint8_t& pbit)
+	{
+		float bestError = FLT_MAX;
+		for (UINT p = 0; p < 2; p++)
+		{
+			uint8_t candidate[4];
+			float error = 0.0f;
+			for (UINT c = 0; c < 4; c++)
+			{
+				const int value = std::min(std::max((int)((e[c] - p) * 0.5f + 0.5f), 0), 127);
+				const float d = (float)(value * 2 + (int)p) - e[c];
+				error += d * d;
+				candidate[c] = (uint8_t)value;
+			}
+			if (error < bestError)
+			{
+				bestError = error;
+				memcpy(q, candidate, sizeof(candidate));
+				pbit = (uint8_t)p;
+			}
+		}
+	}
+
+	uint32_t PackBC7(const uint8_t texels[64], const float e0[4], const float e1[4], TextureCooker::Kernel kernel, uint8_t block[16], uint8_t indices[16])
+	{
+		uint8_t q[2][4];
+		uint8_t p[2];
+		QuantizeBC7Endpoint(e0, q[0], p[0]);
+		QuantizeBC7Endpoint(e1, q[1], p[1]);
+
+		uint8_t palette[64];
+		for (UINT i = 0; i < 16; i++)
+		{
+			for (UINT c = 0; c < 4; c++)
+			{
+				const int a = q[0][c] * 2 + p[0];
+				const int b = q[1][c] * 2 + p[1];
+				palette[i * 4 + c] = (uint8_t)(((64 - kBC7Weights[i]) * a + kBC7Weights[i] * b + 32) >> 6);
+			}
+		}
+		const uint32_t error = SelectIndices(kernel, texels, palette, 16, indices);
+
+		// The first index has an implicit 0 top bit; the weights are symmetric, so swapping the
+		// endpoints and flipping the indices decodes the same
+		if (indices[0] & 8)
+		{
+			std::swap(q[0], q[1]);
+			std::swap(p[0], p[1]);
+			for (UINT i = 0; i < 16; i++)
+				indices[i] = (uint8_t)(15 - indices[i]);
+		}
+
+		memset(block, 0, 16);
+		BitWriter writer = { block };
+		writer.Write(1u << 6, 7);
+		for (UINT c = 0; c < 4; c++)
+		{
+			writer.Write(q[0][c], 7);
+			writer.Write(q[1][c], 7);
+		}
+		writer.Write(p[0], 1);
+		writer.Write(p[1], 1);
+		writer.Write(indices[0], 3);
+		for (UINT i = 1; i < 16; i++)
+			writer.Write(indices[i], 4);
+		return error;
+	}
+
+	//------------------------------------------------------------------------------------------------
+	// Decoders, for the self test and benchmark errors
+
+	void DecodeColor(const uint8_t block[8], uint8_t rgba[64], bool fourColors)
+	{
+		const uint16_t a = (uint16_t)(block[0] | (block[1] << 8));
+		const uint16_t b = (uint16_t)(block[2] | (block[3] << 8));
+		uint8_t palette[16];
+		From565(a, palette);
+		From565(b, palette + 4);
+		for (UINT c = 0; c < 3; c++)
+		{
+			if (fourColors || a > b)
+			{
+				palette[8 + c] = (uint8_t)((2 * palette[c] + palette[4 + c] + 1) / 3);
+				palette[12 + c] = (uint8_t)((palette[c] + 2 * palette[4 + c] + 1) / 3);
+			}
+			else
+			{
+				palette[8 + c] = (uint8_t)((palette[c] + palette[4 + c] + 1) / 2);
+				palette[12 + c] = 0;
+			}
+		}
+		palette[3] = palette[7] = palette[11] = 255;
+		palette[15] = (fourColors || a > b) ? 255 : 0;
+
+		uint32_t bits;
+		memcpy(&bits, block + 4, sizeof(bits));
+		for (UINT i = 0; i < 16; i++)
+			memcpy(rgba + i * 4, palette + ((bits >> (2 * i)) & 3) * 4, 4);
+	}
+
+	void DecodeValues(const uint8_t block[8], uint8_t* out, UINT stride)
+	{
+		const int a = block[0];
+		const int b = block[1];
+		uint8_t palette[8] = { (uint8_t)a, (uint8_t)b };
+		if (a > b)
+		{
+			for (int i = 2; i < 8; i++)
+				palette[i] = (uint8_t)(((8 - i) * a + (i - 1) * b + 3) / 7);
+		}
+		else
+		{
+			for (int i = 2; i < 6; i++)
+				palette[i] = (uint8_t)(((6 - i) * a + (i - 1) * b + 2) / 5);
+			palette[6] = 0;
+			palette[7] = 255;
+		}
+
+		uint64_t bits = 0;
+		for (UINT i = 0; i < 6; i++)
+			bits |= (uint64_t)block[2 + i] << (8 * i);
+		for (UINT i = 0; i < 16; i++)
+			out[i * stride] = palette[(bits >> (3 * i)) & 7];
+	}
+
+	// Mode 6 only, which is all the encoder writes; false for anything else
+	bool DecodeBC7(const uint8_t block[16], uint8_t rgba[64])
+	{
+		UINT position = 0;
+		auto read = [&](UINT bits)
+		{
+			UINT value = 0;
+			for (UINT i = 0; i < bits; i++, position++)
+				value |= ((block[position >> 3] >> (position & 7)) & 1u) << i;
+			return value;
+		};
+		if (read(7) != (1u << 6))
+			return false;
+
+		UINT q[2][4];
+		for (UINT c = 0; c < 4; c++)
+		{
+			q[0][c] = read(7);
+			q[1][c] = read(7);
+		}
+		const UINT p0 = read(1);
+		const UINT p1 = read(1);
+		for (UINT i = 0; i < 16; i++)
+		{
+			const UINT index = read(i == 0 ? 3 : 4);
+			for (UINT c = 0; c < 4; c++)
+			{
+				const int a = (int)(q[0][c] * 2 + p0);
+				const int b = (int)(q[1][c] * 2 + p1);
+				rgba[i * 4 + c] = (uint8_t)(((64 - kBC7Weights[index]) * a + kBC7Weights[index] * b + 32) >> 6);
+			}
+		}
+		return true;
+	}
+
+	// A whole level back to RGBA8 (BC4 into R, BC5 into R and G, the rest of those channels zero)
+	void DecodeLevel(const uint8_t* blocks, UINT width, UINT height, DXGI_FORMAT format, std::vector<uint8_t>& rgba)
+	{
+		rgba.assign((size_t)width * height * 4, 0);
+		const UINT blocksX = GetBlockCount(width);
+		const UINT blockBytes = GetBlockBytes(format);
+		for (UINT by = 0; by < GetBlockCount(height); by++)
+		{
+			for (UINT bx = 0; bx < blocksX; bx++)
+			{
+				const uint8_t* block = blocks + ((size_t)by * blocksX + bx) * blockBytes;
+				uint8_t texels[64] = {};
+				if (IsBC1(format))
+					DecodeColor(block, texels, false);
+				else if (IsBC3(format))
+				{
+					DecodeColor(block + 8, texels, true);
+					DecodeValues(block, texels + 3, 4);
+				}
+				else if (format == DXGI_FORMAT_BC4_UNORM)
+					DecodeValues(block, texels, 4);
+				else if (format == DXGI_FORMAT_BC5_UNORM)
+				{
+					DecodeValues(block, texels, 4);
+					DecodeValues(block + 8, texels + 1, 4);
+				}
+				else
+					DecodeBC7(block, texels);
+
+				for (UINT y = 0; y < 4 && by * 4 + y < height; y++)
+				{
+					for (UINT x = 0; x < 4 && bx * 4 + x < width; x++)
+						memcpy(&rgba[(((size_t)by * 4 + y) * width + bx * 4 + x) * 4], texels + (y * 4 + x) * 4, 4);
+				}
+			}
+		}
+	}
+
+	//------------------------------------------------------------------------------------------------
+
+	void CompressBlocks(const uint8_t* rgba, UINT width, UINT height, DXGI_FORMAT format, TextureCooker::Kernel kernel, bool parallel,
+						uint8_t* blocks)
+	{
+		const UINT blocksX = GetBlockCount(width);
+		const UINT blocksY = GetBlockCount(height);
+		const UINT blockBytes = GetBlockBytes(format);
+		auto encodeRows = [&](size_t begin, size_t end)
+		{
+			uint8_t texels[64];
+			for (size_t by = begin; by < end; by++)
+			{
+				for (UINT bx = 0; bx < blocksX; bx++)
+				{
+					// Levels smaller than a block repeat their edge texels
+					for (UINT y = 0; y < 4; y++)
+					{
+						const size_t row = std::min((UINT)by * 4 + y, height - 1) * (size_t)width;
+						for (UINT x = 0; x < 4; x++)
+							memcpy(texels + (y * 4 + x) * 4, rgba + (row + std::min(bx * 4 + x, width - 1)) * 4, 4);
+					}
+
+					uint8_t* block = blocks + (by * blocksX + bx) * blockBytes;
+					if (IsBC1(format))
+						TextureCooker::EncodeBC1(texels, block, kernel);
+					else if (IsBC3(format))
+						TextureCooker::EncodeBC3(texels, block, kernel);
+					else if (format == DXGI_FORMAT_BC4_UNORM)
+						TextureCooker::EncodeBC4(texels, block, kernel);
+					else if (format == DXGI_FORMAT_BC5_UNORM)
+						TextureCooker::EncodeBC5(texels, block, kernel);
+					else
+						TextureCooker::EncodeBC7(texels, block, kernel);
+				}
+			}
+		};
+
+		if (parallel)
+			JobSystem::Get().ParallelFor(blocksY, 1, encodeRows);
+		else
+			encodeRows(0, blocksY);
+	}
+
+	// Peak signal to noise ratio over channels [0, channels) of two RGBA8 images
+	double GetPsnr(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b, UINT channels)
+	{
+		double sum = 0.0;
+		for (size_t i = 0; i < a.size(); i += 4)
+		{
+			for (UINT c = 0; c < channels; c++)
+			{
+				const double d = (double)a[i + c] - (double)b[i + c];
+				sum += d * d;
+			}
+		}
+		const double mse = sum / (double)(a.size() / 4 * channels);
+		return mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0;
+	}
+}
+
+void TextureCooker::EncodeBC1(const uint8_t texels[64], uint8_t block[8], Kernel kernel)
+{
+	EncodeColor(texels, block, kernel);
+}
+
+void TextureCooker::EncodeBC3(const uint8_t texels[64], uint8_t block[16], Kernel kernel)
+{
+	uint8_t alpha[64];
+	ExtractChannel(texels, 3, alpha);
+	EncodeValues(alpha, block, kernel);
+	EncodeColor(texels, block + 8, kernel);
+}
+
+void TextureCooker::EncodeBC4(const uint8_t texels[64], uint8_t block[8], Kernel kernel)
+{
+	uint8_t red[64];
+	ExtractChannel(texels, 0, red);
+	EncodeValues(red, block, kernel);
+}
+
+void TextureCooker::EncodeBC5(const uint8_t texels[64], uint8_t block[16], Kernel kernel)
+{
+	uint8_t channel[64];
+	ExtractChannel(texels, 0, channel);
+	EncodeValues(channel, block, kernel);
+	ExtractChannel(texels, 1, channel);
+	EncodeValues(channel, block + 8, kernel);
+}
+
+void TextureCooker::EncodeBC7(const uint8_t texels[64], uint8_t block[16], Kernel kernel)
+{
+	static float weights[16];
+	static const bool initialised = [&]()
+	{
+		for (UINT i = 0; i < 16; i++)
+			weights[i] = kBC7Weights[i] / 64.0f;
+		return true;
+	}();
+	(void)initialised;
+
+	float e0[4], e1[4];
+	uint8_t indices[16];
+	FitPrincipalAxis(texels, 4, e0, e1);
+	const uint32_t error = PackBC7(texels, e0, e1, kernel, block, indices);
+	if (error > 0 && RefitEndpoints(texels, 4, indices, weights, e0, e1))
+	{
+		uint8_t refitted[16];
+		if (PackBC7(texels, e0, e1, kernel, refitted, indices) < error)
+			memcpy(block, refitted, sizeof(refitted));
+	}
+}
+
+DXGI_FORMAT TextureCooker::GetFormat(Role role, bool opaque) const
+{
+	switch (role)
+	{
+	case eNormal:
+		return DXGI_FORMAT_BC5_UNORM;
+	case eSingle:
+		return DXGI_FORMAT_BC4_UNORM;
+	default:
+		if (m_settings.highQuality)
+			return m_settings.srgb ? DXGI_FORMAT_BC7_UNORM_SRGB : DXGI_FORMAT_BC7_UNORM;
+		if (opaque)
+			return m_settings.srgb ? DXGI_FORMAT_BC1_UNORM_SRGB : DXGI_FORMAT_BC1_UNORM;
+		return m_settings.srgb ? DXGI_FORMAT_BC3_UNORM_SRGB : DXGI_FORMAT_BC3_UNORM;
+	}
+}
+
+void TextureCooker::CompressLevel(const uint8_t* rgba, UINT width, UINT height, DXGI_FORMAT format, uint8_t* blocks) const
+{
+	CompressBlocks(rgba, width, height, format, m_settings.kernel, m_settings.parallel, blocks);
+}
+
+std::wstring TextureCooker::GetCachePath(uint64_t key) const
+{
+	wchar_t name[32];
+	swprintf_s(name, L"%016llx.dds", (unsigned long long)key);
+	return (std::filesystem::path(m_directory) / name).wstring();
+}
+
+bool TextureCooker::LoadCached(uint64_t key, std::vector<uint8_t>& dds) const
+{
+	std::ifstream file(GetCachePath(key), std::ios::binary);
+	if (!file)
+		return false;
+	dds.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+	uint32_t magic = 0;
+	if (dds.size() > kDdsHeaderBytes)
+		memcpy(&magic, dds.data(), sizeof(magic));
+	return magic == kDdsMagic;
+}
+
+void TextureCooker::StoreCached(uint64_t key, const std::vector<uint8_t>& dds) const
+{
+	std::error_code error;
+	std::filesystem::create_directories(m_directory, error);
+
+	// Written under a temporary name and renamed, so a crash never leaves a truncated file behind
+	const std::filesystem::path path = GetCachePath(key);
+	std::filesystem::path temp = path;
+	temp += L".tmp";
+	{
+		std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+		if (!file)
+			return;
+		file.write(reinterpret_cast<const char*>(dds.data()), dds.size());
+		if (!file)
+			return;
+	}
+
+	std::filesystem::rename(temp, path, error);
+	if (error)
+		std::filesystem::remove(temp, error);
+}
+
+bool TextureCooker::Cook(const Image& image, Role role, std::vector<uint8_t>& dds, int channel)
+{
+	dds.clear();
+	if (!image.pixels || image.width == 0 || image.height == 0 || image.components < 1 || image.components > 4 ||
+		image.width % 4 != 0 || image.height % 4 != 0)
+		return false;
+
+	const auto start = std::chrono::steady_clock::now();
+
+	// Everything is encoded from RGBA8: eSingle keeps its channel in R, eNormal XYZ in RGB (Z only for
+	// the mips, BC5 keeps X and Y)
+	const UINT components = image.components;
+	const UINT single = channel >= 0 ? std::min((UINT)channel, components - 1) : 0;
+	const size_t texelCount = (size_t)image.width * image.height;
+	std::vector<uint8_t> rgba(texelCount * 4, 0);
+	bool opaque = true;
+	for (size_t i = 0; i < texelCount; i++)
+	{
+		const uint8_t* src = image.pixels + i * components;
+		uint8_t* dst = &rgba[i * 4];
+		switch (role)
+		{
+		case eSingle:
+			dst[0] = src[single];
+			break;
+		case eNormal:
+			dst[0] = src[0];
+			dst[1] = src[std::min(1u, components - 1)];
+			if (components >= 3)
+				dst[2] = src[2];
+			break;
+		default:
+			// Grey, grey and alpha, RGB or RGBA
+			dst[0] = src[0];
+			dst[1] = src[components >= 3 ? 1 : 0];
+			dst[2] = src[components >= 3 ? 2 : 0];
+			dst[3] = (components == 2 || components == 4) ? src[components - 1] : 255;
+			opaque = opaque && dst[3] == 255;
+			break;
+		}
+	}
+
+	if (role == eNormal && components < 3)
+	{
+		const ColorConversion::Kernel kernel = m_settings.kernel == eSSE ? ColorConversion::eSSE : ColorConversion::eScalar;
+		ColorConversion::ReconstructNormalZ(rgba.data(), texelCount, kernel);
+	}
+
+	const DXGI_FORMAT format = GetFormat(role, opaque);
+	const UINT levels = m_settings.mips ? MipGenerator::GetLevelCount(image.width, image.height) : 1;
+
+	uint64_t sourceBytes = 0;
+	for (UINT level = 0; level < levels; level++)
+		sourceBytes += (uint64_t)std::max(image.width >> level, 1u) * std::max(image.height >> level, 1u) * (role == eSingle ? 1 : 4);
+	m_stats.sourceBytes += sourceBytes;
+
+	// The role and channel are in the pixels already, the settings in the format and level count
+	const uint32_t header[] = { kCookerVersion, (uint32_t)format, levels, (uint32_t)m_settings.mipFilter, image.width, image.height };
+	const uint64_t key = Utils::HashBytes(rgba.data(), rgba.size(), Utils::HashBytes(header, sizeof(header)));
+	if (LoadCached(key, dds))
+	{
+		m_stats.cacheHits++;
+		m_stats.cookedBytes += dds.size() - kDdsHeaderBytes;
+		m_stats.cookMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return true;
+	}
+
+	size_t dataBytes = 0;
+	for (UINT level = 0; level < levels; level++)
+		dataBytes += (size_t)GetBlockCount(image.width >> level) * GetBlockCount(image.height >> level) * GetBlockBytes(format);
+	dds.assign(kDdsHeaderBytes + dataBytes, 0);
+
+	DdsHeader ddsHeader = {};
+	ddsHeader.size = sizeof(DdsHeader);
+	ddsHeader.flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000;	// caps, height, width, pixel format, mip count, linear size
+	ddsHeader.height = image.height;
+	ddsHeader.width = image.width;
+	ddsHeader.pitchOrLinearSize = GetBlockCount(image.width) * GetBlockCount(image.height) * GetBlockBytes(format);
+	ddsHeader.mipMapCount = levels;
+	ddsHeader.ddspf.size = sizeof(DdsPixelFormat);
+	ddsHeader.ddspf.flags = 0x4;	// four CC
+	ddsHeader.ddspf.fourCC = kFourCCDx10;
+	ddsHeader.caps[0] = 0x1000 | (levels > 1 ? 0x8 | 0x400000 : 0);	// texture, complex and mipmap
+	const DdsHeaderDx10 dx10 = { (uint32_t)format, (uint32_t)D3D11_RESOURCE_DIMENSION_TEXTURE2D, 0, 1, 0 };
+	memcpy(dds.data(), &kDdsMagic, sizeof(kDdsMagic));
+	memcpy(dds.data() + sizeof(kDdsMagic), &ddsHeader, sizeof(ddsHeader));
+	memcpy(dds.data() + sizeof(kDdsMagic) + sizeof(ddsHeader), &dx10, sizeof(dx10));
+
+	// Colour is taken to be sRGB encoded, as glTF base colour and emissive images are
+	std::vector<MipGenerator::Level> mips;
+	if (levels > 1)
+	{
+		MipGenerator::Settings mipSettings;
+		mipSettings.filter = m_settings.mipFilter;
+		mipSettings.parallel = m_settings.parallel;
+		const MipGenerator::Content content = role == eColor ? MipGenerator::eSrgb : role == eNormal ? MipGenerator::eNormal : MipGenerator::eLinear;
+		MipGenerator::Generate(rgba.data(), image.width, image.height, 4, 8, content, mipSettings, mips);
+	}
+
+	uint8_t* blocks = dds.data() + kDdsHeaderBytes;
+	for (UINT level = 0; level < levels; level++)
+	{
+		const UINT width = level == 0 ? image.width : mips[level - 1].width;
+		const UINT height = level == 0 ? image.height : mips[level - 1].height;
+		CompressLevel(level == 0 ? rgba.data() : mips[level - 1].pixels.data(), width, height, format, blocks);
+		blocks += (size_t)GetBlockCount(width) * GetBlockCount(height) * GetBlockBytes(format);
+	}
+
+	StoreCached(key, dds);
+	m_stats.cooked++;
+	m_stats.cookedBytes += dataBytes;
+	m_stats.cookMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return true;
+}
+
+bool TextureCooker::RunSelfTest()
+{
+	bool passed = true;
+	auto check = [&passed](bool condition, const wchar_t* what)
+	{
+		if (!condition)
+		{
+			Log::Error(L"TextureCooker self test: %s", what);
+			passed = false;
+		}
+	};
+
+	// A smooth gradient, and the same with noise, both with varying alpha
+	const UINT size = 64;
+	std::vector<uint8_t> images[2];
+	for (int noisy = 0; noisy < 2; noisy++)
+	{
+		std::vector<uint8_t>& rgba = images[noisy];
+		rgba.resize(size * size * 4);
+		uint32_t seed = 12345;
+		for (UINT y = 0; y < size; y++)
+		{
+			for (UINT x = 0; x < size; x++)
+			{
+				for (UINT c = 0; c < 4; c++)
+				{
+					seed = seed * 1664525u + 1013904223u;
+					const int noise = noisy ? (int)(seed >> 27) - 16 : 0;
+					const int base = c == 0 ? x * 4 : c == 1 ? y * 4 : c == 2 ? (x + y) * 2 : 255 - x * 2;
+					rgba[(y * size + x) * 4 + c] = (uint8_t)std::min(std::max(base + noise, 0), 255);
+				}
+			}
+		}
+	}
+
+	// Lowest acceptable PSNR (dB) of each format on the smooth and the noisy image, over the channels it keeps
+	struct Case
+	{
+		DXGI_FORMAT	format;
+		UINT		channels;
+		double		minPsnr[2];
+	};
+	const Case cases[] = {
+		{ DXGI_FORMAT_BC1_UNORM, 3, { 36.0, 29.0 } },
+		{ DXGI_FORMAT_BC3_UNORM, 4, { 37.0, 30.0 } },
+		{ DXGI_FORMAT_BC4_UNORM, 1, { 48.0, 43.0 } },
+		{ DXGI_FORMAT_BC5_UNORM, 2, { 48.0, 43.0 } },
+		{ DXGI_FORMAT_BC7_UNORM, 4, { 38.0, 29.0 } },
+	};
+
+	for (const Case& test : cases)
+	{
+		const size_t bytes = (size_t)GetBlockCount(size) * GetBlockCount(size) * GetBlockBytes(test.format);
+		for (int noisy = 0; noisy < 2; noisy++)
+		{
+			std::vector<uint8_t> scalar(bytes), sse(bytes), parallel(bytes), decoded;
+			CompressBlocks(images[noisy].data(), size, size, test.format, eScalar, false, scalar.data());
+			CompressBlocks(images[noisy].data(), size, size, test.format, eSSE, false, sse.data());
+			CompressBlocks(images[noisy].data(), size, size, test.format, eSSE, true, parallel.data());
+			check(scalar == sse, L"the scalar and SSE kernels should give the same blocks");
+			check(sse == parallel, L"serial and parallel encoding should give the same blocks");
+
+			DecodeLevel(sse.data(), size, size, test.format, decoded);
+			const double psnr = GetPsnr(images[noisy], decoded, test.channels);
+			Log::Info(L"TextureCooker self test: format %u, %s image: %.2f dB", (UINT)test.format, noisy ? L"noisy" : L"smooth", psnr);
+			check(psnr >= test.minPsnr[noisy], L"encoding error above the limit");
+		}
+	}
+
+	// Solid blocks come back exactly
+	std::vector<uint8_t> solid(8 * 8 * 4, 0);
+	for (size_t i = 0; i < solid.size(); i += 4)
+	{
+		solid[i] = 200;
+		solid[i + 1] = 100;
+		solid[i + 2] = 50;
+		solid[i + 3] = 255;
+	}
+	std::vector<uint8_t> blocks(4 * 16), decoded;
+	CompressBlocks(solid.data(), 8, 8, DXGI_FORMAT_BC4_UNORM, eSSE, false, blocks.data());
+	DecodeLevel(blocks.data(), 8, 8, DXGI_FORMAT_BC4_UNORM, decoded);
+	check(GetPsnr(solid, decoded, 1) >= 99.0, L"a solid BC4 block should be exact");
+	CompressBlocks(solid.data(), 8, 8, DXGI_FORMAT_BC7_UNORM, eSSE, false, blocks.data());
+	DecodeLevel(blocks.data(), 8, 8, DXGI_FORMAT_BC7_UNORM, decoded);
+	check(GetPsnr(solid, decoded, 4) >= 45.0, L"a solid BC7 block should be close to exact");
+
+	// Cooking the same image twice hits the cache, and images that cannot be block compressed are refused
+	TextureCooker cooker;
+	const std::wstring directory = L"TextureCache\\selftest";
+	cooker.SetCacheDirectory(directory);
+	std::error_code error;
+	std::filesystem::remove_all(directory, error);
+
+	Image image;
+	image.pixels = images[1].data();
+	image.width = size;
+	image.height = size;
+	std::vector<uint8_t> first, second;
+	check(cooker.Cook(image, eColor, first) && cooker.Cook(image, eColor, second), L"cannot cook the test image");
+	check(first == second && cooker.GetStats().cooked == 1 && cooker.GetStats().cacheHits == 1, L"the second cook should come from the cache");
+	check(first.size() == kDdsHeaderBytes + (16 * 16 + 8 * 8 + 4 * 4 + 2 * 2 + 1 + 1 + 1) * 16, L"the mip chain has the wrong size");
+	image.width = size - 2;
+	check(!cooker.Cook(image, eColor, first), L"a top level not a multiple of 4 should be refused");
+	std::filesystem::remove_all(directory, error);
+
+	if (passed)
+		Log::Info(L"TextureCooker self test passed");
+	return passed;
+}
+
+void TextureCooker::RunBenchmark()
+{
+	constexpr int kIterations = 3;
+	struct Source
+	{
+		const char*	file;
+		Role		role;
+		bool		highQuality;
+	};
+	const Source sources[] = {
+		{ "Resources\\Texture.png", eColor, false },
+		{ "Resources\\Texture.png", eColor, true },
+		{ "Resources\\rusty_metal_04_diff.png", eColor, false },
+		{ "Resources\\rusty_metal_04_nor_gl.png", eNormal, false },
+		{ "Resources\\rusty_metal_04_rough.png", eSingle, false },
+	};
+
+	Log::Info(L"TextureCooker benchmark: top level only, %u worker threads", JobSystem::Get().GetWorkerCount());
+	for (const Source& source : sources)
+	{
+		int width = 0, height = 0, components = 0;
+		stbi_uc* pixels = stbi_load(source.file, &width, &height, &components, 4);
+		if (!pixels)
+		{
+			Log::Error(L"  cannot load %S", source.file);
+			continue;
+		}
+
+		// The encoders' RGBA8 input, as Cook() builds it
+		std::vector<uint8_t> rgba(pixels, pixels + (size_t)width * height * 4);
+		stbi_image_free(pixels);
+		for (size_t i = 0; i < rgba.size(); i += 4)
+		{
+			if (source.role == eSingle)
+				rgba[i + 1] = rgba[i + 2] = rgba[i + 3] = 0;
+			else if (source.role == eNormal)
+				rgba[i + 2] = rgba[i + 3] = 0;
+		}
+
+		TextureCooker cooker;
+		cooker.GetSettings().highQuality = source.highQuality;
+		bool opaque = true;
+		for (size_t i = 3; i < rgba.size() && source.role == eColor; i += 4)
+			opaque = opaque && rgba[i] == 255;
+		const DXGI_FORMAT format = cooker.GetFormat(source.role, opaque);
+		const size_t bytes = (size_t)GetBlockCount(width) * GetBlockCount(height) * GetBlockBytes(format);
+		const size_t uncompressed = (size_t)width * height * (source.role == eSingle ? 1 : 4);
+		std::vector<uint8_t> blocks(bytes);
+
+		double ms[2][2] = {};
+		for (int kernel = 0; kernel < 2; kernel++)
+		{
+			for (int parallel = 0; parallel < 2; parallel++)
+			{
+				const auto start = std::chrono::steady_clock::now();
+				for (int i = 0; i < kIterations; i++)
+					CompressBlocks(rgba.data(), width, height, format, (Kernel)kernel, parallel != 0, blocks.data());
+				ms[kernel][parallel] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / kIterations;
+			}
+		}
+
+		std::vector<uint8_t> decoded;
+		DecodeLevel(blocks.data(), width, height, format, decoded);
+		const UINT channels = source.role == eSingle ? 1 : source.role == eNormal ? 2 : (opaque ? 3 : 4);
+		const double megapixels = (double)width * height / 1e6;
+		Log::Info(L"  %-36S %4dx%-4d format %2u: scalar %7.1f / %6.1f ms, SSE %7.1f / %6.1f ms (serial / parallel, %.1f Mpix/s best), "
+				  L"%.2f dB, %zu KB -> %zu KB (x%.1f)",
+				  source.file, width, height, (UINT)format, ms[eScalar][0], ms[eScalar][1], ms[eSSE][0], ms[eSSE][1],
+				  megapixels / (ms[eSSE][1] / 1000.0), GetPsnr(rgba, decoded, channels), uncompressed / 1024, bytes / 1024,
+				  (double)uncompressed / bytes);
+	}
+}
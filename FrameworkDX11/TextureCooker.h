@@ -0,0 +1,110 @@
+// Block compression of decoded images into DDS files, done on first use and cached on disk.
+//
+// The format follows what the texture is for:
+//
+//	- eColor: BC1 when every texel is opaque, BC3 when not; BC7 for both with Settings::highQuality
+//	- eNormal: BC5, X and Y only - Z is rebuilt in the shader
+//	- eSingle: BC4, one channel (metalness, roughness, occlusion...)
+//
+// That is 4 bits a texel for BC1 and BC4 and 8 for the others, against 32 for RGBA8 (8 for R8).
+// The mip chain comes from the MipGenerator (colour filtered as sRGB, normals renormalised), and
+// every level is split into rows of 4x4 blocks over the JobSystem. A block's endpoints start at the
+// texels furthest apart along the principal axis of its colours; each texel then takes its nearest
+// palette entry - the hot loop, four texels at a time with SSE2 - and the endpoints are refitted to
+// those choices by least squares, keeping whichever fit is better. BC7 is encoded in mode 6 only
+// (one RGBA endpoint pair with 4-bit indices). The scalar and SSE2 kernels give identical blocks.
+//
+// The cooked DDS is kept on disk under a hash of the pixels, the role and the settings, so a launch
+// with unchanged images loads it instead of encoding again.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include "MipGenerator.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class TextureCooker
+{
+public:
+	enum Role
+	{
+		eColor,
+		eNormal,
+		eSingle,
+	};
+
+	enum Kernel
+	{
+		eScalar,
+		eSSE,
+	};
+
+	struct Settings
+	{
+		bool					highQuality = false;	// BC7 for colour
+		bool					srgb = false;			// colour in *_SRGB formats
+		bool					mips = true;			// the full chain rather than the top level only
+		MipGenerator::Filter	mipFilter = MipGenerator::eKaiser;
+		bool					parallel = true;
+		Kernel					kernel = eSSE;
+	};
+
+	struct Stats
+	{
+		UINT		cooked = 0;
+		UINT		cacheHits = 0;
+		uint64_t	sourceBytes = 0;	// the same levels as RGBA8, or R8 for eSingle
+		uint64_t	cookedBytes = 0;
+		double		cookMs = 0.0;		// encoding and cache look ups
+	};
+
+	// A decoded image, 8 bits per component, rows tightly packed
+	struct Image
+	{
+		const uint8_t*	pixels = nullptr;
+		UINT			width = 0;
+		UINT			height = 0;
+		UINT			components = 4;		// 1 to 4
+	};
+
+	TextureCooker() = default;
+	TextureCooker(const TextureCooker&) = delete;
+	TextureCooker& operator = (const TextureCooker&) = delete;
+
+	Settings&	GetSettings() { return m_settings; }
+	void	SetCacheDirectory(const std::wstring& directory) { m_directory = directory; }
+
+	// Compresses image for role into a DDS file in memory, from the cache when cooked before. channel
+	// picks the component eSingle keeps (-1 for the first). False if the image cannot be block
+	// compressed: the top level has to be a multiple of 4 texels across and down.
+	bool	Cook(const Image& image, Role role, std::vector<uint8_t>& dds, int channel = -1);
+
+	DXGI_FORMAT	GetFormat(Role role, bool opaque) const;
+	const Stats&	GetStats() const { return m_stats; }
+
+	// Encoders for one block of 4x4 RGBA8 texels in row order. BC4 reads R, BC5 R and G.
+	static void	EncodeBC1(const uint8_t texels[64], uint8_t block[8], Kernel kernel);
+	static void	EncodeBC3(const uint8_t texels[64], uint8_t block[16], Kernel kernel);
+	static void	EncodeBC4(const uint8_t texels[64], uint8_t block[8], Kernel kernel);
+	static void	EncodeBC5(const uint8_t texels[64], uint8_t block[16], Kernel kernel);
+	static void	EncodeBC7(const uint8_t texels[64], uint8_t block[16], Kernel kernel);
+
+	// Checks the error of every format against thresholds, that the kernels and the serial and
+	// parallel paths agree, and the cache round trip
+	static bool	RunSelfTest();
+	// Cooks the sample PNGs in every format with each kernel, serially and in parallel
+	static void	RunBenchmark();
+
+private:
+	// Blocks of one level of a RGBA8 image
+	void	CompressLevel(const uint8_t* rgba, UINT width, UINT height, DXGI_FORMAT format, uint8_t* blocks) const;
+	std::wstring	GetCachePath(uint64_t key) const;
+	bool	LoadCached(uint64_t key, std::vector<uint8_t>& dds) const;
+	void	StoreCached(uint64_t key, const std::vector<uint8_t>& dds) const;
+
+	Settings		m_settings;
+	std::wstring	m_directory = L"TextureCache";
+	Stats			m_stats;
+};
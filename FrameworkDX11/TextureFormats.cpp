@@ -0,0 +1,127 @@
+#include "TextureFormats.h"
+
+#include "log.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+TextureFormats::Layout TextureFormats::GetNativeLayout(UINT components, UINT bits, bool srgb)
+{
+	static const DXGI_FORMAT kFormats8[4] = { DXGI_FORMAT_R8_UNORM, DXGI_FORMAT_R8G8_UNORM, DXGI_FORMAT_R8G8B8A8_UNORM, DXGI_FORMAT_R8G8B8A8_UNORM };
+	static const DXGI_FORMAT kFormats16[4] = { DXGI_FORMAT_R16_UNORM, DXGI_FORMAT_R16G16_UNORM, DXGI_FORMAT_R16G16B16A16_UNORM, DXGI_FORMAT_R16G16B16A16_UNORM };
+
+	Layout layout;
+	if (components < 1 || components > 4 || (bits != 8 && bits != 16))
+		return layout;
+
+	layout.components = components == 3 ? 4 : components;
+	layout.bytesPerComponent = bits / 8;
+	layout.format = bits == 8 ? kFormats8[components - 1] : kFormats16[components - 1];
+	if (srgb && layout.format == DXGI_FORMAT_R8G8B8A8_UNORM)
+		layout.format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+	return layout;
+}
+
+void TextureFormats::Repack(const uint8_t* src, size_t count, UINT components, int channel, const Layout& layout,
+							std::vector<uint8_t>& dst)
+{
+	const UINT size = layout.bytesPerComponent;
+	dst.assign(count * layout.GetBytesPerTexel(), 0);
+	if (channel < 0 && layout.components == components)
+	{
+		memcpy(dst.data(), src, dst.size());
+		return;
+	}
+
+	const UINT first = channel >= 0 ? std::min((UINT)channel, components - 1) : 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		const uint8_t* in = src + i * components * size;
+		uint8_t* out = dst.data() + i * layout.GetBytesPerTexel();
+		for (UINT c = 0; c < layout.components; c++)
+		{
+			if (channel >= 0 || c < components)
+				memcpy(out + c * size, in + (first + c) * size, size);
+			else if (c == 3)
+				memset(out + c * size, 0xff, size);
+		}
+	}
+}
+
+bool TextureFormats::RunSelfTest()
+{
+	bool passed = true;
+	auto check = [&passed](bool condition, const wchar_t* what)
+	{
+		if (!condition)
+		{
+			Log::Error(L"TextureFormats self test: %s", what);
+			passed = false;
+		}
+	};
+
+	// The table: channel count and size are kept, RGB is padded, sRGB only where DXGI has it
+	struct Expected
+	{
+		UINT		components;
+		UINT		bits;
+		bool		srgb;
+		DXGI_FORMAT	format;
+		UINT		bytesPerTexel;
+	};
+	const Expected table[] = {
+		{ 1, 8, false, DXGI_FORMAT_R8_UNORM, 1 },
+		{ 2, 8, false, DXGI_FORMAT_R8G8_UNORM, 2 },
+		{ 3, 8, false, DXGI_FORMAT_R8G8B8A8_UNORM, 4 },
+		{ 4, 8, false, DXGI_FORMAT_R8G8B8A8_UNORM, 4 },
+		{ 1, 8, true, DXGI_FORMAT_R8_UNORM, 1 },
+		{ 3, 8, true, DXGI_FORMAT_R8G8B8A8_UNORM_SRGB, 4 },
+		{ 4, 8, true, DXGI_FORMAT_R8G8B8A8_UNORM_SRGB, 4 },
+		{ 1, 16, false, DXGI_FORMAT_R16_UNORM, 2 },
+		{ 2, 16, false, DXGI_FORMAT_R16G16_UNORM, 4 },
+		{ 3, 16, false, DXGI_FORMAT_R16G16B16A16_UNORM, 8 },
+		{ 4, 16, true, DXGI_FORMAT_R16G16B16A16_UNORM, 8 },
+		{ 0, 8, false, DXGI_FORMAT_UNKNOWN, 0 },
+		{ 5, 8, false, DXGI_FORMAT_UNKNOWN, 0 },
+		{ 4, 32, false, DXGI_FORMAT_UNKNOWN, 0 },
+	};
+	for (const Expected& expected : table)
+	{
+		const Layout layout = GetNativeLayout(expected.components, expected.bits, expected.srgb);
+		if (layout.format != expected.format || layout.GetBytesPerTexel() != expected.bytesPerTexel)
+		{
+			Log::Error(L"TextureFormats self test: %u x %u bit%s gave format %u, %u bytes a texel", expected.components,
+					   expected.bits, expected.srgb ? L" sRGB" : L"", (UINT)layout.format, layout.GetBytesPerTexel());
+			passed = false;
+		}
+	}
+
+	// Repacking: RGB gains an opaque alpha, a picked channel comes out alone, 16 bit values stay whole
+	const uint8_t rgb8[] = { 1, 2, 3, 4, 5, 6 };
+	std::vector<uint8_t> out;
+	Repack(rgb8, 2, 3, -1, GetNativeLayout(3, 8, false), out);
+	check(out == std::vector<uint8_t>({ 1, 2, 3, 255, 4, 5, 6, 255 }), L"8 bit RGB should be padded with opaque alpha");
+	Repack(rgb8, 2, 3, 2, GetNativeLayout(1, 8, false), out);
+	check(out == std::vector<uint8_t>({ 3, 6 }), L"a picked channel should come out alone");
+	Repack(rgb8, 3, 2, -1, GetNativeLayout(2, 8, false), out);
+	check(out == std::vector<uint8_t>({ 1, 2, 3, 4, 5, 6 }), L"grey and alpha should be kept as it is");
+
+	const uint16_t rgb16[] = { 0x1234, 0xabcd, 0x00ff };
+	Repack(reinterpret_cast<const uint8_t*>(rgb16), 1, 3, -1, GetNativeLayout(3, 16, false), out);
+	uint16_t rgba16[4] = {};
+	memcpy(rgba16, out.data(), std::min(out.size(), sizeof(rgba16)));
+	check(out.size() == 8 && rgba16[0] == 0x1234 && rgba16[1] == 0xabcd && rgba16[2] == 0x00ff && rgba16[3] == 0xffff,
+		  L"16 bit RGB should be padded with opaque alpha");
+	Repack(reinterpret_cast<const uint8_t*>(rgb16), 1, 3, 1, GetNativeLayout(1, 16, false), out);
+	check(out.size() == 2 && out[0] == 0xcd && out[1] == 0xab, L"a picked 16 bit channel should come out whole");
+
+	// Against the old expansion to RGBA32F (16 bytes a texel)
+	Log::Info(L"TextureFormats: bytes per texel grey %u, grey + alpha %u, RGB %u, 16 bit grey %u, 16 bit RGBA %u (RGBA32F 16)",
+			  GetNativeLayout(1, 8, false).GetBytesPerTexel(), GetNativeLayout(2, 8, false).GetBytesPerTexel(),
+			  GetNativeLayout(3, 8, false).GetBytesPerTexel(), GetNativeLayout(1, 16, false).GetBytesPerTexel(),
+			  GetNativeLayout(4, 16, false).GetBytesPerTexel());
+
+	if (passed)
+		Log::Info(L"TextureFormats self test passed");
+	return passed;
+}
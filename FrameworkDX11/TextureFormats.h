@@ -0,0 +1,38 @@
+// The DXGI formats decoded images are uploaded in, and the repacking that gets them there.
+//
+// An image keeps its own precision and channel count where DXGI has a matching format: 8 bit images
+// go up as R8, R8G8 or R8G8B8A8 (UNORM or SRGB), 16 bit ones as R16, R16G16 or R16G16B16A16. There
+// are no three channel formats of either size, so RGB gains an opaque alpha, the nearest native
+// layout. Nothing is expanded to float, and constant factors are left to the shader, so a grey
+// 8 bit image takes a quarter of the memory it would as RGBA8 and a sixteenth of RGBA32F.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include <cstdint>
+#include <vector>
+
+class TextureFormats
+{
+public:
+	struct Layout
+	{
+		DXGI_FORMAT	format = DXGI_FORMAT_UNKNOWN;
+		UINT		components = 0;		// as uploaded
+		UINT		bytesPerComponent = 0;
+
+		UINT	GetBytesPerTexel() const { return components * bytesPerComponent; }
+	};
+
+	// The native layout of an image with components (1 to 4) of bits (8 or 16) each; UNKNOWN if there
+	// is none. srgb only applies to 8 bit RGB(A), the only sRGB formats DXGI has.
+	static Layout	GetNativeLayout(UINT components, UINT bits, bool srgb);
+
+	// Repacks count texels of components channels into layout, keeping channel only when it is not
+	// -1 (layout then has to have one component). Missing channels are 0, missing alpha opaque.
+	static void	Repack(const uint8_t* src, size_t count, UINT components, int channel, const Layout& layout,
+					   std::vector<uint8_t>& dst);
+
+	// Checks the layout table and repacking for every channel count and size
+	static bool	RunSelfTest();
+};
@@ -0,0 +1,511 @@
+#include "TexturePacker.h"
+
+#include "log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <set>
+#include <tuple>
+
+using namespace DirectX;
+
+namespace
+{
+	static constexpr UINT kNotPacked = ~0u;
+
+	// Textures going into the same array (or the same atlas pages)
+	struct Group
+	{
+		DXGI_FORMAT			format;
+		UINT				width;
+		UINT				height;
+		UINT				levels;
+		bool				atlas;
+		std::vector<size_t>	members;
+	};
+
+	struct Spot
+	{
+		UINT	page;
+		UINT	x;
+		UINT	y;
+	};
+
+	UINT FloorPowerOfTwo(UINT value)
+	{
+		UINT power = 1;
+		while (power * 2 <= value)
+			power *= 2;
+		return power;
+	}
+
+	UINT CeilPowerOfTwo(UINT value)
+	{
+		UINT power = 1;
+		while (power < value)
+			power *= 2;
+		return power;
+	}
+
+	// Puts cells (sorted tallest first) on shelves filling pages of size x size; returns the page count
+	UINT PlaceOnShelves(const std::vector<std::pair<UINT, UINT>>& cells, UINT size, std::vector<Spot>& spots)
+	{
+		spots.resize(cells.size());
+		UINT page = 0, x = 0, y = 0, shelfHeight = 0;
+		for (size_t i = 0; i < cells.size(); i++)
+		{
+			if (x + cells[i].first > size)
+			{
+				x = 0;
+				y += shelfHeight;
+				shelfHeight = 0;
+			}
+			if (y + cells[i].second > size)
+			{
+				page++;
+				x = y = shelfHeight = 0;
+			}
+			spots[i] = { page, x, y };
+			x += cells[i].first;
+			shelfHeight = std::max(shelfHeight, cells[i].second);
+		}
+		return cells.empty() ? 0 : page + 1;
+	}
+}
+
+UINT TexturePacker::GetBytesPerTexel(DXGI_FORMAT format)
+{
+	switch (format)
+	{
+	case DXGI_FORMAT_R8_UNORM:
+		return 1;
+	case DXGI_FORMAT_R8G8_UNORM:
+	case DXGI_FORMAT_R16_UNORM:
+	case DXGI_FORMAT_R16_FLOAT:
+		return 2;
+	case DXGI_FORMAT_R8G8B8A8_UNORM:
+	case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+	case DXGI_FORMAT_B8G8R8A8_UNORM:
+	case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+	case DXGI_FORMAT_R16G16_UNORM:
+	case DXGI_FORMAT_R32_FLOAT:
+		return 4;
+	case DXGI_FORMAT_R16G16B16A16_UNORM:
+	case DXGI_FORMAT_R16G16B16A16_FLOAT:
+		return 8;
+	case DXGI_FORMAT_R32G32B32A32_FLOAT:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
+void TexturePacker::Plan(const std::vector<Texture>& textures, const Settings& settings, std::vector<Array>& arrays,
+						 std::vector<Placement>& placements)
+{
+	arrays.clear();
+	placements.assign(textures.size(), Placement());
+	for (Placement& placement : placements)
+		placement.array = kNotPacked;
+
+	const UINT padding = FloorPowerOfTwo(std::max(settings.padding, 1u));
+	const UINT atlasLevels = (UINT)std::log2(padding) + 1;
+	const UINT maxSlices = std::max(settings.maxSlices, 1u);
+	const UINT maxAtlasTexture = settings.atlasSize > padding * 2 ? std::min(settings.maxAtlasTexture, settings.atlasSize - padding * 2) : 0;
+
+	// Groups in the order their first texture comes, so the result follows the input
+	std::vector<Group> groups;
+	for (size_t i = 0; i < textures.size(); i++)
+	{
+		const Texture& texture = textures[i];
+		if (texture.levels.empty() || texture.format == DXGI_FORMAT_UNKNOWN)
+			continue;
+
+		const UINT width = texture.levels[0].width;
+		const UINT height = texture.levels[0].height;
+		const UINT levels = (UINT)texture.levels.size();
+		const bool atlas = GetBytesPerTexel(texture.format) != 0 && width <= maxAtlasTexture && height <= maxAtlasTexture &&
+			width % padding == 0 && height % padding == 0 && levels >= atlasLevels;
+		auto group = std::find_if(groups.begin(), groups.end(), [&](const Group& g)
+			{
+				return g.format == texture.format && g.atlas == atlas && (atlas || (g.width == width && g.height == height && g.levels == levels));
+			});
+		if (group == groups.end())
+			group = groups.insert(groups.end(), { texture.format, width, height, levels, atlas, {} });
+		group->members.push_back(i);
+	}
+
+	for (const Group& group : groups)
+	{
+		if (!group.atlas)
+		{
+			for (size_t first = 0; first < group.members.size(); first += maxSlices)
+			{
+				Array array;
+				array.format = group.format;
+				array.width = group.width;
+				array.height = group.height;
+				array.levels = group.levels;
+				array.slices = (UINT)std::min<size_t>(maxSlices, group.members.size() - first);
+				for (UINT slice = 0; slice < array.slices; slice++)
+				{
+					Placement& placement = placements[group.members[first + slice]];
+					placement.array = (UINT)arrays.size();
+					placement.slice = slice;
+				}
+				arrays.push_back(std::move(array));
+			}
+			continue;
+		}
+
+		// Tallest first, the widest of equal heights first, which keeps the shelves full
+		std::vector<size_t> members = group.members;
+		auto size = [&](size_t i) { return std::make_pair(textures[i].levels[0].height, textures[i].levels[0].width); };
+		std::stable_sort(members.begin(), members.end(), [&](size_t a, size_t b) { return size(a) > size(b); });
+		std::vector<std::pair<UINT, UINT>> cells;
+		UINT largest = 0;
+		for (size_t i : members)
+		{
+			cells.push_back({ textures[i].levels[0].width + padding * 2, textures[i].levels[0].height + padding * 2 });
+			largest = std::max({ largest, cells.back().first, cells.back().second });
+		}
+
+		// The smallest page everything fits on, or as many of the largest as it takes
+		std::vector<Spot> spots;
+		UINT pageSize = CeilPowerOfTwo(largest);
+		while (pageSize < settings.atlasSize && PlaceOnShelves(cells, pageSize, spots) > 1)
+			pageSize *= 2;
+		pageSize = std::min(pageSize, settings.atlasSize);
+		const UINT pages = PlaceOnShelves(cells, pageSize, spots);
+
+		const UINT firstArray = (UINT)arrays.size();
+		for (UINT first = 0; first < pages; first += maxSlices)
+		{
+			Array array;
+			array.format = group.format;
+			array.width = array.height = pageSize;
+			array.levels = atlasLevels;
+			array.slices = std::min(maxSlices, pages - first);
+			array.atlas = true;
+			arrays.push_back(std::move(array));
+		}
+		for (size_t m = 0; m < members.size(); m++)
+		{
+			const Level& top = textures[members[m]].levels[0];
+			Placement& placement = placements[members[m]];
+			placement.array = firstArray + spots[m].page / maxSlices;
+			placement.slice = spots[m].page % maxSlices;
+			placement.x = spots[m].x + padding;
+			placement.y = spots[m].y + padding;
+			placement.rect = XMFLOAT4((float)top.width / pageSize, (float)top.height / pageSize,
+									  (float)placement.x / pageSize, (float)placement.y / pageSize);
+		}
+	}
+}
+
+void TexturePacker::Pack(const std::vector<Texture>& textures, const Settings& settings, std::vector<Array>& arrays,
+						 std::vector<Placement>& placements)
+{
+	Plan(textures, settings, arrays, placements);
+	const UINT padding = FloorPowerOfTwo(std::max(settings.padding, 1u));
+
+	for (Array& array : arrays)
+	{
+		array.subresources.assign((size_t)array.slices * array.levels, D3D11_SUBRESOURCE_DATA());
+		if (!array.atlas)
+			continue;
+
+		const UINT texelBytes = GetBytesPerTexel(array.format);
+		array.pages.resize(array.subresources.size());
+		for (UINT slice = 0; slice < array.slices; slice++)
+		{
+			for (UINT level = 0; level < array.levels; level++)
+			{
+				const UINT size = std::max(array.width >> level, 1u);
+				std::vector<uint8_t>& page = array.pages[(size_t)slice * array.levels + level];
+				page.assign((size_t)size * size * texelBytes, 0);
+				D3D11_SUBRESOURCE_DATA& subresource = array.subresources[(size_t)slice * array.levels + level];
+				subresource.pSysMem = page.data();
+				subresource.SysMemPitch = size * texelBytes;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < textures.size(); i++)
+	{
+		const Placement& placement = placements[i];
+		if (placement.array == kNotPacked)
+			continue;
+
+		Array& array = arrays[placement.array];
+		const Texture& texture = textures[i];
+		if (!array.atlas)
+		{
+			for (UINT level = 0; level < array.levels; level++)
+			{
+				D3D11_SUBRESOURCE_DATA& subresource = array.subresources[(size_t)placement.slice * array.levels + level];
+				subresource.pSysMem = texture.levels[level].data;
+				subresource.SysMemPitch = texture.levels[level].rowPitch;
+			}
+			continue;
+		}
+
+		// Every level with its border, the texture's rows and columns wrapped around
+		const UINT texelBytes = GetBytesPerTexel(array.format);
+		for (UINT level = 0; level < array.levels; level++)
+		{
+			const Level& src = texture.levels[level];
+			const UINT border = padding >> level;
+			const UINT pitch = std::max(array.width >> level, 1u) * texelBytes;
+			uint8_t* page = array.pages[(size_t)placement.slice * array.levels + level].data();
+			const UINT left = (placement.x >> level) - border;
+			const UINT top = (placement.y >> level) - border;
+			for (UINT row = 0; row < src.height + border * 2; row++)
+			{
+				const UINT srcRow = (row + src.height - border) % src.height;
+				const uint8_t* in = src.data + (size_t)srcRow * src.rowPitch;
+				uint8_t* out = page + (size_t)(top + row) * pitch + (size_t)left * texelBytes;
+				memcpy(out, in + (size_t)(src.width - border) * texelBytes, (size_t)border * texelBytes);
+				memcpy(out + (size_t)border * texelBytes, in, (size_t)src.width * texelBytes);
+				memcpy(out + (size_t)(border + src.width) * texelBytes, in, (size_t)border * texelBytes);
+			}
+		}
+	}
+}
+
+bool TexturePacker::RunSelfTest()
+{
+	bool passed = true;
+	auto check = [&passed](bool condition, const wchar_t* what)
+	{
+		if (!condition)
+		{
+			Log::Error(L"TexturePacker self test: %s", what);
+			passed = false;
+		}
+	};
+
+	// Textures with full chains whose every texel is different, so misplaced copies show
+	std::vector<std::vector<std::vector<uint8_t>>> storage;
+	auto makeTexture = [&storage](DXGI_FORMAT format, UINT width, UINT height)
+	{
+		const UINT texelBytes = std::max(GetBytesPerTexel(format), 1u);
+		const UINT fullChain = (UINT)std::log2(std::max(width, height)) + 1;
+		Texture texture;
+		texture.format = format;
+		storage.emplace_back();
+		for (UINT level = 0; level < fullChain; level++)
+		{
+			const UINT w = std::max(width >> level, 1u), h = std::max(height >> level, 1u);
+			std::vector<uint8_t> texels((size_t)w * h * texelBytes);
+			for (size_t t = 0; t < texels.size(); t++)
+				texels[t] = (uint8_t)(t * 7 + level * 31 + storage.size() * 57);
+			storage.back().push_back(std::move(texels));
+			texture.levels.push_back({ storage.back().back().data(), w, h, w * texelBytes });
+		}
+		return texture;
+	};
+	// The texel of an atlas level, or of a texture level with its coordinates wrapped
+	auto pageTexel = [](const Array& array, UINT slice, UINT level, UINT x, UINT y)
+	{
+		const D3D11_SUBRESOURCE_DATA& subresource = array.subresources[(size_t)slice * array.levels + level];
+		return static_cast<const uint8_t*>(subresource.pSysMem) + (size_t)y * subresource.SysMemPitch + (size_t)x * GetBytesPerTexel(array.format);
+	};
+	auto textureTexel = [](const Texture& texture, UINT level, int x, int y)
+	{
+		const Level& src = texture.levels[level];
+		x = (x % (int)src.width + src.width) % src.width;
+		y = (y % (int)src.height + src.height) % src.height;
+		return src.data + (size_t)y * src.rowPitch + (size_t)x * GetBytesPerTexel(texture.format);
+	};
+
+	Settings settings;
+	std::vector<Texture> textures;
+	for (int i = 0; i < 3; i++)
+		textures.push_back(makeTexture(DXGI_FORMAT_BC1_UNORM, 512, 512));
+	textures.push_back(makeTexture(DXGI_FORMAT_BC1_UNORM, 64, 64));				// compressed: arrayed, not atlased
+	textures.push_back(makeTexture(DXGI_FORMAT_R8G8B8A8_UNORM, 1024, 1024));	// too large to atlas
+	textures.push_back(makeTexture(DXGI_FORMAT_R8G8B8A8_UNORM, 64, 64));
+	textures.push_back(makeTexture(DXGI_FORMAT_R8G8B8A8_UNORM, 128, 32));
+	textures.push_back(makeTexture(DXGI_FORMAT_R8G8B8A8_UNORM, 256, 256));
+	textures.push_back(makeTexture(DXGI_FORMAT_R8G8B8A8_UNORM, 8, 8));
+	textures.push_back(makeTexture(DXGI_FORMAT_R8G8B8A8_UNORM, 100, 100));		// not a multiple of the padding
+	textures.push_back(makeTexture(DXGI_FORMAT_R8_UNORM, 64, 64));
+	textures.push_back(makeTexture(DXGI_FORMAT_R8_UNORM, 1, 1));
+	textures.push_back(Texture());												// nothing to pack
+
+	std::vector<Array> arrays;
+	std::vector<Placement> placements;
+	Pack(textures, settings, arrays, placements);
+
+	// Grouping
+	check(arrays.size() == 7, L"expected 7 arrays");
+	if (arrays.size() == 7)
+	{
+		check(placements[0].array == placements[1].array && placements[1].array == placements[2].array &&
+			  arrays[placements[0].array].slices == 3, L"same format and size textures should share an array");
+		check(placements[0].slice == 0 && placements[1].slice == 1 && placements[2].slice == 2, L"slices should follow the input");
+		check(!arrays[placements[3].array].atlas && arrays[placements[3].array].slices == 1, L"block compressed textures should not be atlased");
+		check(!arrays[placements[4].array].atlas, L"large textures should not be atlased");
+		check(!arrays[placements[9].array].atlas && !arrays[placements[11].array].atlas, L"odd sizes should not be atlased");
+		const Array& atlas = arrays[placements[5].array];
+		check(atlas.atlas && atlas.slices == 1 && atlas.width == 512 && atlas.levels == 4, L"small RGBA textures should share one 512 page of 4 levels");
+		check(placements[6].array == placements[5].array && placements[7].array == placements[5].array && placements[8].array == placements[5].array,
+			  L"small textures of a format should share an atlas");
+		check(arrays[placements[10].array].atlas && arrays[placements[10].array].width == 128, L"an atlas should shrink to its textures");
+		check(placements[12].array == kNotPacked, L"a texture without levels should be left out");
+	}
+
+	// Atlas cells: inside the page, aligned, apart, and the rect where the texels are
+	std::vector<std::tuple<UINT, UINT, UINT, UINT, UINT, UINT>> cells;	// array, slice, x0, y0, x1, y1
+	bool placed = true;
+	for (size_t i = 0; i < textures.size(); i++)
+	{
+		if (placements[i].array == kNotPacked || !arrays[placements[i].array].atlas)
+			continue;
+		const Placement& p = placements[i];
+		const Array& array = arrays[p.array];
+		const UINT w = textures[i].levels[0].width, h = textures[i].levels[0].height;
+		placed = placed && p.x % settings.padding == 0 && p.y % settings.padding == 0 && p.x >= settings.padding && p.y >= settings.padding &&
+			p.x + w + settings.padding <= array.width && p.y + h + settings.padding <= array.height;
+		placed = placed && p.rect.x == (float)w / array.width && p.rect.z == (float)p.x / array.width && p.rect.w == (float)p.y / array.height;
+		for (const auto& cell : cells)
+		{
+			if (std::get<0>(cell) == p.array && std::get<1>(cell) == p.slice && p.x - settings.padding < std::get<4>(cell) &&
+				std::get<2>(cell) < p.x + w + settings.padding && p.y - settings.padding < std::get<5>(cell) && std::get<3>(cell) < p.y + h + settings.padding)
+				placed = false;
+		}
+		cells.emplace_back(p.array, p.slice, p.x - settings.padding, p.y - settings.padding, p.x + w + settings.padding, p.y + h + settings.padding);
+	}
+	check(placed, L"atlas cells should be aligned, inside their page and apart");
+
+	// Texels: every atlas level holds the texture's level and its wrapped border; arrays point at the levels
+	bool copied = true;
+	for (size_t i = 0; i < textures.size() && copied; i++)
+	{
+		const Placement& p = placements[i];
+		if (p.array == kNotPacked)
+			continue;
+		const Array& array = arrays[p.array];
+		const UINT texelBytes = GetBytesPerTexel(array.format);
+		for (UINT level = 0; level < array.levels && copied; level++)
+		{
+			if (!array.atlas)
+			{
+				copied = array.subresources[(size_t)p.slice * array.levels + level].pSysMem == textures[i].levels[level].data;
+				continue;
+			}
+			const int border = (int)(settings.padding >> level);
+			const int w = (int)textures[i].levels[level].width, h = (int)textures[i].levels[level].height;
+			for (int y = -border; y < h + border && copied; y++)
+			{
+				for (int x = -border; x < w + border && copied; x++)
+				{
+					copied = memcmp(pageTexel(array, p.slice, level, (p.x >> level) + x, (p.y >> level) + y),
+									textureTexel(textures[i], level, x, y), texelBytes) == 0;
+				}
+			}
+		}
+	}
+	check(copied, L"packed levels should hold the textures' texels, atlas borders wrapped");
+
+	// Remapped UVs, tiled and negative ones included, land on the texel the texture itself has there
+	bool remapped = true;
+	for (size_t i = 0; i < textures.size(); i++)
+	{
+		const Placement& p = placements[i];
+		if (p.array == kNotPacked || !arrays[p.array].atlas)
+			continue;
+		const Array& array = arrays[p.array];
+		const UINT w = textures[i].levels[0].width, h = textures[i].levels[0].height;
+		for (int t = 0; t < 64; t++)
+		{
+			const int x = (t * 37) % w, y = (t * 53) % h, tile = t % 5 - 2;
+			const float u = (x + 0.5f) / w + tile, v = (y + 0.5f) / h - tile;
+			const float atlasU = p.rect.z + (u - std::floor(u)) * p.rect.x;
+			const float atlasV = p.rect.w + (v - std::floor(v)) * p.rect.y;
+			remapped = remapped && memcmp(pageTexel(array, p.slice, 0, (UINT)(atlasU * array.width), (UINT)(atlasV * array.height)),
+										  textureTexel(textures[i], 0, x, y), GetBytesPerTexel(array.format)) == 0;
+		}
+	}
+	check(remapped, L"remapped UVs should sample the textures' own texels");
+
+	// Limits: full pages spill onto more slices, and slices onto more arrays
+	Settings small;
+	small.atlasSize = 1024;
+	small.maxSlices = 2;
+	std::vector<Texture> many(20, makeTexture(DXGI_FORMAT_R8_UNORM, 256, 256));
+	Plan(many, small, arrays, placements);
+	// 272 texel cells, 3 by 3 on a page: 3 pages in arrays of 2 slices
+	check(arrays.size() == 2 && arrays[0].slices == 2 && arrays[1].slices == 1 && arrays[0].width == 1024, L"full pages should spill over");
+	check(placements[19].array == 1 && placements[19].slice == 0, L"the last texture should be on the third page");
+	std::vector<Texture> same(5, makeTexture(DXGI_FORMAT_BC1_UNORM, 512, 512));
+	Plan(same, small, arrays, placements);
+	check(arrays.size() == 3 && arrays[2].slices == 1, L"arrays should be split at the slice limit");
+
+	if (passed)
+		Log::Info(L"TexturePacker self test passed");
+	return passed;
+}
+
+void TexturePacker::RunBenchmark()
+{
+	// Materials of an albedo map and metal and roughness maps of the same size, as glTF models have
+	constexpr UINT kMaterials = 96;
+	constexpr int kIterations = 5;
+	const UINT sizes[] = { 64, 128, 256, 512, 1024 };
+	std::vector<std::vector<uint8_t>> storage;
+	std::vector<Texture> textures;
+	uint32_t seed = 12345;
+	for (UINT m = 0; m < kMaterials; m++)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		const UINT size = sizes[(seed >> 24) % 5];
+		for (DXGI_FORMAT format : { DXGI_FORMAT_R8G8B8A8_UNORM, DXGI_FORMAT_R8_UNORM, DXGI_FORMAT_R8_UNORM })
+		{
+			Texture texture;
+			texture.format = format;
+			for (UINT level = 0; (size >> level) > 0; level++)
+			{
+				const UINT w = size >> level;
+				storage.emplace_back((size_t)w * w * GetBytesPerTexel(format), (uint8_t)level);
+				texture.levels.push_back({ storage.back().data(), w, w, w * GetBytesPerTexel(format) });
+			}
+			textures.push_back(std::move(texture));
+		}
+	}
+
+	std::vector<Array> arrays;
+	std::vector<Placement> placements;
+	const auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < kIterations; i++)
+		Pack(textures, Settings(), arrays, placements);
+	const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / kIterations;
+
+	uint64_t atlasTexels = 0, usedTexels = 0;
+	UINT atlasPages = 0;
+	for (const Array& array : arrays)
+	{
+		if (array.atlas)
+		{
+			atlasPages += array.slices;
+			atlasTexels += (uint64_t)array.width * array.height * array.slices;
+		}
+	}
+	for (size_t i = 0; i < textures.size(); i++)
+	{
+		if (arrays[placements[i].array].atlas)
+			usedTexels += (uint64_t)textures[i].levels[0].width * textures[i].levels[0].height;
+	}
+
+	// Each material used to bind its own three views; now materials bind the arrays of their maps
+	std::set<std::tuple<UINT, UINT, UINT>> textureSets;
+	for (UINT m = 0; m < kMaterials; m++)
+		textureSets.insert({ placements[m * 3].array, placements[m * 3 + 1].array, placements[m * 3 + 2].array });
+
+	Log::Info(L"TexturePacker benchmark: %u materials, %zu textures packed in %.2f ms", kMaterials, textures.size(), ms);
+	Log::Info(L"  %zu arrays, %u atlas pages %.0f%% filled, %zu distinct texture sets (was %u)", arrays.size(), atlasPages,
+			  atlasTexels ? 100.0 * usedTexels / atlasTexels : 0.0, textureSets.size(), kMaterials);
+}
@@ -0,0 +1,92 @@
+// Packing of material textures into Texture2DArrays, so draws with different materials can share
+// their texture binds.
+//
+// Textures of the same format, size and level count become slices of one array. Small uncompressed
+// textures are packed into atlas pages instead, themselves the slices of an array per format: each
+// sits on shelves in a cell with a border of padding texels on every side, filled with its own texels
+// wrapped around, so bilinear filtering and repeating UVs see the texture's far edge. Cells are
+// aligned to the padding and atlases keep log2(padding) + 1 levels, so down to the last level no
+// texel mixes two textures and a border at least one texel wide remains. Pages are cut to the
+// smallest power of two their textures fit on.
+//
+// A packed texture is found by its slice and a UV rect (scale in xy, offset in zw) the shader maps
+// frac(uv) through; a whole slice has the rect (1, 1, 0, 0). Block compressed textures are only
+// ever arrayed, as their blocks cannot be bordered texel by texel.
+//
+// Everything here is on the CPU - Pack() gives the subresources to create the arrays from - so the
+// packing can be checked without a device.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include <DirectXMath.h>
+#include <cstdint>
+#include <vector>
+
+class TexturePacker
+{
+public:
+	struct Settings
+	{
+		UINT	atlasSize = 2048;		// largest atlas page
+		UINT	maxAtlasTexture = 256;	// textures no wider or taller than this are atlased
+		UINT	padding = 8;			// border texels around atlased textures, a power of 2
+		UINT	maxSlices = 256;		// per array (D3D11 allows 2048)
+	};
+
+	struct Level
+	{
+		const uint8_t*	data = nullptr;
+		UINT			width = 0;
+		UINT			height = 0;
+		UINT			rowPitch = 0;
+	};
+
+	// A texture to pack, with its full chain of levels, the top one first
+	struct Texture
+	{
+		DXGI_FORMAT			format = DXGI_FORMAT_UNKNOWN;
+		std::vector<Level>	levels;
+	};
+
+	// Where a texture went
+	struct Placement
+	{
+		UINT				array = 0;
+		UINT				slice = 0;
+		UINT				x = 0;		// top left texel in the atlas page, 0 in a plain array
+		UINT				y = 0;
+		DirectX::XMFLOAT4	rect = DirectX::XMFLOAT4(1.0f, 1.0f, 0.0f, 0.0f);
+	};
+
+	// A Texture2DArray to create
+	struct Array
+	{
+		DXGI_FORMAT								format = DXGI_FORMAT_UNKNOWN;
+		UINT									width = 0;
+		UINT									height = 0;
+		UINT									levels = 0;
+		UINT									slices = 0;
+		bool									atlas = false;
+		std::vector<D3D11_SUBRESOURCE_DATA>		subresources;	// slice by slice, levels within a slice
+		std::vector<std::vector<uint8_t>>		pages;			// the atlas levels they point into
+	};
+
+	// Texel size of an uncompressed format, 0 for block compressed or unknown ones
+	static UINT	GetBytesPerTexel(DXGI_FORMAT format);
+
+	// Works out the arrays and where each texture goes in them, without touching texels. placements
+	// follows textures; a texture with no levels or an unknown format is left out, with array ~0u.
+	static void	Plan(const std::vector<Texture>& textures, const Settings& settings, std::vector<Array>& arrays,
+					 std::vector<Placement>& placements);
+	// Plans, then assembles the atlas pages and lists the subresources of every array. Slices of plain
+	// arrays point at the textures' own levels, which have to outlive the arrays' creation.
+	static void	Pack(const std::vector<Texture>& textures, const Settings& settings, std::vector<Array>& arrays,
+					 std::vector<Placement>& placements);
+
+	// Checks grouping, atlas placement (in bounds, aligned, not overlapping), the wrapped borders of
+	// every atlas level and that remapped UVs land on the texels of the original textures
+	static bool	RunSelfTest();
+	// Packs a set of synthetic material textures and reports the time, atlas use and binds saved
+	static void	RunBenchmark();
+};
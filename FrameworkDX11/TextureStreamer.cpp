@@ -0,0 +1,685 @@
+#include "TextureStreamer.h"
+
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <psapi.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+
+using namespace DirectX;
+using Microsoft::WRL::ComPtr;
+
+HRESULT TextureStreamer::Init(ID3D11Device* device, ID3D11DeviceContext* context)
+{
+	Release();
+	if (!device || !context)
+		return E_INVALIDARG;
+
+	m_device = device;
+	m_context = context;
+	m_start = std::chrono::steady_clock::now();
+
+	m_stop = false;
+	const UINT threads = std::max(m_settings.ioThreads, 1u);
+	for (UINT i = 0; i < threads; i++)
+		m_threads.emplace_back(&TextureStreamer::IoThread, this);
+	return S_OK;
+}
+
+void TextureStreamer::Release()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_requestMutex);
+		m_stop = true;
+		m_requests.clear();
+	}
+	m_requestReady.notify_all();
+	for (std::thread& thread : m_threads)
+		thread.join();
+	m_threads.clear();
+
+	m_results.clear();
+	m_ready.clear();
+	m_entries.clear();
+	m_inFlight = 0;
+	m_inFlightBytes = 0;
+	m_levelsStreamed = 0;
+	m_bytesStreamed = 0;
+	m_levelsEvicted = 0;
+	m_deferred = 0;
+	m_frame = 1;
+	m_bytesRead = 0;
+	m_loadMs = 0.0;
+	m_firstFrameMs = -1.0;
+	m_fullQualityMs = -1.0;
+	m_context.Reset();
+	m_device.Reset();
+}
+
+double TextureStreamer::GetElapsedMs() const
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+UINT TextureStreamer::GetTailMip(const DDS_TEXTURE_LAYOUT& layout) const
+{
+	if (!m_settings.streaming)
+		return 0;
+
+	UINT mip = 0;
+	while (mip + 1 < layout.mipCount && std::max(layout.width >> mip, layout.height >> mip) > m_settings.tailSize)
+		mip++;
+	return mip;
+}
+
+uint64_t TextureStreamer::GetLevelBytes(const DDS_TEXTURE_LAYOUT& layout, UINT mip)
+{
+	return GetDDSSubresourceLayout(layout, mip, 0).size * layout.arraySize;
+}
+
+uint64_t TextureStreamer::GetLevelRange(const DDS_TEXTURE_LAYOUT& layout, UINT firstMip, UINT endMip, UINT slice, size_t& offset)
+{
+	const DDS_SUBRESOURCE_LAYOUT first = GetDDSSubresourceLayout(layout, firstMip, slice);
+	const DDS_SUBRESOURCE_LAYOUT last = GetDDSSubresourceLayout(layout, endMip - 1, slice);
+	offset = first.offset;
+	return last.offset + last.size - first.offset;
+}
+
+uint64_t TextureStreamer::TouchLevels(const DDS_MAPPED_FILE& file, const DDS_TEXTURE_LAYOUT& layout, UINT firstMip, UINT endMip)
+{
+	// One read per page faults the levels in here rather than in the upload on the render thread
+	static constexpr size_t kPageSize = 4096;
+	const uint8_t* data = file.data.get();
+	uint64_t bytes = 0;
+	uint8_t sum = 0;
+	for (UINT slice = 0; slice < layout.arraySize; slice++)
+	{
+		size_t offset = 0;
+		const size_t size = (size_t)GetLevelRange(layout, firstMip, endMip, slice, offset);
+		for (size_t page = 0; page < size; page += kPageSize)
+			sum += *(volatile const uint8_t*)(data + offset + page);
+		sum += *(volatile const uint8_t*)(data + offset + size - 1);
+		bytes += size;
+	}
+	(void)sum;
+	return bytes;
+}
+
+HRESULT TextureStreamer::CreateTexture(const DDS_TEXTURE_LAYOUT& layout, UINT firstMip, const D3D11_SUBRESOURCE_DATA* initData,
+									   ComPtr<ID3D11Resource>& resource, ComPtr<ID3D11ShaderResourceView>& view) const
+{
+	const DDS_SUBRESOURCE_LAYOUT top = GetDDSSubresourceLayout(layout, firstMip, 0);
+
+	D3D11_TEXTURE2D_DESC desc = {};
+	desc.Width = top.width;
+	desc.Height = top.height;
+	desc.MipLevels = layout.mipCount - firstMip;
+	desc.ArraySize = layout.arraySize;
+	desc.Format = layout.format;
+	desc.SampleDesc.Count = 1;
+	desc.Usage = D3D11_USAGE_DEFAULT;
+	desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	desc.MiscFlags = layout.isCubeMap ? D3D11_RESOURCE_MISC_TEXTURECUBE : 0;
+
+	ComPtr<ID3D11Texture2D> texture;
+	HRESULT hr = m_device->CreateTexture2D(&desc, initData, &texture);
+	if (FAILED(hr))
+		return hr;
+
+	D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc = {};
+	viewDesc.Format = layout.format;
+	if (layout.isCubeMap && layout.arraySize > 6)
+	{
+		viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURECUBEARRAY;
+		viewDesc.TextureCubeArray.MipLevels = desc.MipLevels;
+		viewDesc.TextureCubeArray.NumCubes = layout.arraySize / 6;
+	}
+	else if (layout.isCubeMap)
+	{
+		viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURECUBE;
+		viewDesc.TextureCube.MipLevels = desc.MipLevels;
+	}
+	else if (layout.arraySize > 1)
+	{
+		viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2DARRAY;
+		viewDesc.Texture2DArray.MipLevels = desc.MipLevels;
+		viewDesc.Texture2DArray.ArraySize = layout.arraySize;
+	}
+	else
+	{
+		viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+		viewDesc.Texture2D.MipLevels = desc.MipLevels;
+	}
+
+	hr = m_device->CreateShaderResourceView(texture.Get(), &viewDesc, &view);
+	if (FAILED(hr))
+		return hr;
+
+	resource = texture;
+	return S_OK;
+}
+
+TextureStreamer::Handle TextureStreamer::Load(const std::wstring& file)
+{
+	if (!m_device)
+		return kInvalidHandle;
+
+	const auto start = std::chrono::steady_clock::now();
+	Entry entry;
+	entry.file = file;
+
+	// Levels are uploaded straight from the mapping, nothing is read into a copy first
+	DDS_MAPPED_FILE mapped;
+	HRESULT hr = MapDDSFile(file.c_str(), &mapped);
+	if (FAILED(hr))
+	{
+		Log::Error(L"TextureStreamer: cannot open %s (0x%08x)", file.c_str(), (unsigned int)hr);
+		return kInvalidHandle;
+	}
+	const uint8_t* bytes = mapped.data.get();
+	const size_t fileSize = mapped.size;
+	const size_t headerSize = std::min(fileSize, DDS_MAX_HEADER_SIZE);
+	hr = GetDDSTextureLayout(bytes, headerSize, fileSize, &entry.layout);
+
+	if (hr == HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED))
+	{
+		// Loaded whole, the way it was before streaming
+		hr = CreateDDSTextureFromMemory(m_device.Get(), bytes, fileSize, &entry.resource, &entry.view);
+		if (FAILED(hr))
+		{
+			Log::Error(L"TextureStreamer: cannot load %s (0x%08x)", file.c_str(), (unsigned int)hr);
+			return kInvalidHandle;
+		}
+		entry.residentBytes = fileSize;
+		m_bytesRead += fileSize;
+	}
+	else
+	{
+		if (FAILED(hr))
+		{
+			Log::Error(L"TextureStreamer: %s is not a valid DDS file (0x%08x)", file.c_str(), (unsigned int)hr);
+			return kInvalidHandle;
+		}
+
+		// Subresources go mip by mip within each slice, pointing into the mapping; GetDDSTextureLayout()
+		// has checked the file holds them all
+		const DDS_TEXTURE_LAYOUT& layout = entry.layout;
+		const UINT tailMip = GetTailMip(layout);
+		const UINT levels = layout.mipCount - tailMip;
+		std::vector<D3D11_SUBRESOURCE_DATA> initData(levels * layout.arraySize);
+		for (UINT slice = 0; slice < layout.arraySize; slice++)
+		{
+			for (UINT mip = tailMip; mip < layout.mipCount; mip++)
+			{
+				const DDS_SUBRESOURCE_LAYOUT subresource = GetDDSSubresourceLayout(layout, mip, slice);
+				D3D11_SUBRESOURCE_DATA& init = initData[D3D11CalcSubresource(mip - tailMip, slice, levels)];
+				init.pSysMem = bytes + subresource.offset;
+				init.SysMemPitch = subresource.rowPitch;
+				init.SysMemSlicePitch = (UINT)subresource.size;
+			}
+		}
+
+		hr = CreateTexture(layout, tailMip, initData.data(), entry.resource, entry.view);
+		if (FAILED(hr))
+		{
+			Log::Error(L"TextureStreamer: cannot create the texture for %s (0x%08x)", file.c_str(), (unsigned int)hr);
+			return kInvalidHandle;
+		}
+
+		// Only the bytes read already are hashed; textures with the same hash are compared in full by
+		// HasSameContent() before anything is shared
+		uint64_t contentHash = Utils::HashBytes(bytes, headerSize, Utils::HashBytes(&fileSize, sizeof(fileSize)));
+		uint64_t tailBytes = 0;
+		for (UINT slice = 0; slice < layout.arraySize; slice++)
+		{
+			size_t offset = 0;
+			const size_t size = (size_t)GetLevelRange(layout, tailMip, layout.mipCount, slice, offset);
+			contentHash = Utils::HashBytes(bytes + offset, size, contentHash);
+			tailBytes += size;
+		}
+		m_bytesRead += tailBytes;
+
+		entry.streamed = true;
+		entry.contentHash = contentHash;
+		entry.tailMip = tailMip;
+		entry.residentMip = tailMip;
+		entry.residentBytes = tailBytes;
+	}
+
+	const Handle handle = (Handle)m_entries.size();
+	m_entries.push_back(std::move(entry));
+	m_viewVersion++;
+	m_loadMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return handle;
+}
+
+bool TextureStreamer::HasSameContent(Handle a, Handle b)
+{
+	if (a >= m_entries.size() || b >= m_entries.size() || !m_entries[a].streamed || !m_entries[b].streamed ||
+		m_entries[a].contentHash != m_entries[b].contentHash)
+		return false;
+	if (a == b)
+		return true;
+
+	const auto start = std::chrono::steady_clock::now();
+	DDS_MAPPED_FILE first, second;
+	if (FAILED(MapDDSFile(m_entries[a].file.c_str(), &first)) || FAILED(MapDDSFile(m_entries[b].file.c_str(), &second)) ||
+		first.size != second.size)
+		return false;
+
+	// A chunk at a time, so files differing early are not read to the end
+	constexpr size_t kChunk = 1u << 20;
+	bool same = true;
+	size_t compared = 0;
+	while (same && compared < first.size)
+	{
+		const size_t size = std::min(kChunk, first.size - compared);
+		same = memcmp(first.data.get() + compared, second.data.get() + compared, size) == 0;
+		compared += size;
+	}
+	m_bytesRead += 2 * (uint64_t)compared;
+	m_loadMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return same;
+}
+
+void TextureStreamer::Unload(Handle handle)
+{
+	if (handle >= m_entries.size())
+		return;
+
+	// A level still being read no longer matches pendingMip and is dropped when it arrives
+	Entry& entry = m_entries[handle];
+	entry.streamed = false;
+	entry.pendingMip = -1;
+	entry.resource.Reset();
+	entry.view.Reset();
+	entry.residentMip = 0;
+	entry.residentBytes = 0;
+	entry.requiredMip = ~0u;
+	m_viewVersion++;
+}
+
+void TextureStreamer::RequestMip(Handle handle, UINT mip)
+{
+	if (handle >= m_entries.size() || !m_entries[handle].streamed)
+		return;
+
+	// Levels at or below the finest already requested this frame are stamped already
+	Entry& entry = m_entries[handle];
+	mip = std::min(mip, entry.tailMip);
+	if (mip >= entry.requestedMip)
+		return;
+	for (UINT level = mip; level < std::min(entry.requestedMip, entry.tailMip); level++)
+		entry.lastNeeded[level] = m_frame;
+	entry.requestedMip = mip;
+}
+
+void TextureStreamer::RequestScreenSize(Handle handle, float pixels)
+{
+	if (handle >= m_entries.size() || !m_entries[handle].streamed)
+		return;
+
+	// The coarsest level still having a texel per pixel
+	const DDS_TEXTURE_LAYOUT& layout = m_entries[handle].layout;
+	const UINT size = std::max(layout.width, layout.height);
+	UINT mip = 0;
+	while (mip + 1 < layout.mipCount && (float)(size >> (mip + 1)) >= pixels)
+		mip++;
+	RequestMip(handle, mip);
+}
+
+void TextureStreamer::QueueLevel(Handle handle, UINT mip)
+{
+	Entry& entry = m_entries[handle];
+	entry.pendingMip = (int)mip;
+	m_inFlight++;
+	m_inFlightBytes += GetLevelBytes(entry.layout, mip);
+
+	{
+		std::lock_guard<std::mutex> lock(m_requestMutex);
+		m_requests.push_back({ handle, mip, entry.file, entry.layout });
+	}
+	m_requestReady.notify_one();
+}
+
+void TextureStreamer::IoThread()
+{
+	for (;;)
+	{
+		Request request;
+		{
+			std::unique_lock<std::mutex> lock(m_requestMutex);
+			m_requestReady.wait(lock, [this]() { return m_stop || !m_requests.empty(); });
+			if (m_stop)
+				return;
+			request = std::move(m_requests.front());
+			m_requests.pop_front();
+		}
+
+		Result result;
+		result.handle = request.handle;
+		result.mip = request.mip;
+		// The file may have changed since Load(), so it must still hold every slice
+		const DDS_TEXTURE_LAYOUT& layout = request.layout;
+		result.ok = SUCCEEDED(MapDDSFile(request.file.c_str(), &result.file)) &&
+					result.file.size >= layout.dataOffset + layout.sliceSize * layout.arraySize;
+		if (result.ok)
+			m_bytesRead += TouchLevels(result.file, layout, request.mip, request.mip + 1);
+
+		std::lock_guard<std::mutex> lock(m_resultMutex);
+		m_results.push_back(std::move(result));
+	}
+}
+
+bool TextureStreamer::SwapInLevel(Entry& entry, UINT mip, const DDS_MAPPED_FILE& file)
+{
+	const DDS_TEXTURE_LAYOUT& layout = entry.layout;
+	ComPtr<ID3D11Resource> resource;
+	ComPtr<ID3D11ShaderResourceView> view;
+	const HRESULT hr = CreateTexture(layout, mip, nullptr, resource, view);
+	if (FAILED(hr))
+	{
+		Log::Error(L"TextureStreamer: cannot create mip %u of %s (0x%08x)", mip, entry.file.c_str(), (unsigned int)hr);
+		return false;
+	}
+
+	// The new level from the mapping, the ones already resident from the old texture
+	const UINT levels = layout.mipCount - mip;
+	const UINT oldLevels = layout.mipCount - entry.residentMip;
+	for (UINT slice = 0; slice < layout.arraySize; slice++)
+	{
+		const DDS_SUBRESOURCE_LAYOUT level = GetDDSSubresourceLayout(layout, mip, slice);
+		m_context->UpdateSubresource(resource.Get(), D3D11CalcSubresource(0, slice, levels), nullptr,
+									 file.data.get() + level.offset, level.rowPitch, (UINT)level.size);
+		for (UINT old = 0; old < oldLevels; old++)
+		{
+			m_context->CopySubresourceRegion(resource.Get(), D3D11CalcSubresource(entry.residentMip - mip + old, slice, levels), 0, 0, 0,
+											 entry.resource.Get(), D3D11CalcSubresource(old, slice, oldLevels), nullptr);
+		}
+	}
+
+	entry.resource = resource;
+	entry.view = view;
+	entry.residentMip = mip;
+	entry.residentBytes += GetLevelBytes(layout, mip);
+	return true;
+}
+
+bool TextureStreamer::EvictLevel(Entry& entry)
+{
+	const DDS_TEXTURE_LAYOUT& layout = entry.layout;
+	const UINT mip = entry.residentMip + 1;
+	ComPtr<ID3D11Resource> resource;
+	ComPtr<ID3D11ShaderResourceView> view;
+	const HRESULT hr = CreateTexture(layout, mip, nullptr, resource, view);
+	if (FAILED(hr))
+	{
+		Log::Error(L"TextureStreamer: cannot evict mip %u of %s (0x%08x)", entry.residentMip, entry.file.c_str(), (unsigned int)hr);
+		return false;
+	}
+
+	// Every level but the top one from the old texture
+	const UINT levels = layout.mipCount - mip;
+	for (UINT slice = 0; slice < layout.arraySize; slice++)
+	{
+		for (UINT level = 0; level < levels; level++)
+		{
+			m_context->CopySubresourceRegion(resource.Get(), D3D11CalcSubresource(level, slice, levels), 0, 0, 0,
+											 entry.resource.Get(), D3D11CalcSubresource(level + 1, slice, levels + 1), nullptr);
+		}
+	}
+
+	entry.residentBytes -= GetLevelBytes(layout, entry.residentMip);
+	entry.resource = resource;
+	entry.view = view;
+	entry.residentMip = mip;
+	m_levelsEvicted++;
+	return true;
+}
+
+uint64_t TextureStreamer::GetResidentTotal() const
+{
+	uint64_t total = 0;
+	for (const Entry& entry : m_entries)
+		total += entry.residentBytes;
+	return total;
+}
+
+bool TextureStreamer::MakeRoom(uint64_t bytes, uint32_t neededFrame, bool& evicted)
+{
+	if (m_settings.budgetBytes == 0)
+		return true;
+
+	// Levels in flight are counted as resident, they will be soon
+	uint64_t total = GetResidentTotal() + m_inFlightBytes;
+	while (total + bytes > m_settings.budgetBytes)
+	{
+		Entry* victim = nullptr;
+		for (Entry& entry : m_entries)
+		{
+			if (!entry.streamed || entry.pendingMip >= 0 || entry.residentMip >= entry.tailMip ||
+				entry.lastNeeded[entry.residentMip] >= neededFrame)
+				continue;
+			if (victim == nullptr || entry.lastNeeded[entry.residentMip] < victim->lastNeeded[victim->residentMip])
+				victim = &entry;
+		}
+		if (victim == nullptr)
+			return false;
+
+		const uint64_t before = victim->residentBytes;
+		if (!EvictLevel(*victim))
+			return false;
+		total -= before - victim->residentBytes;
+		evicted = true;
+	}
+	return true;
+}
+
+bool TextureStreamer::UpdateResidency()
+{
+	// The requests made since the last call are the last frame's
+	const uint32_t lastFrame = m_frame++;
+	bool evicted = false;
+	m_deferred = 0;
+	for (Handle handle = 0; handle < (Handle)m_entries.size(); handle++)
+	{
+		Entry& entry = m_entries[handle];
+		entry.requiredMip = entry.requestedMip;
+		entry.requestedMip = ~0u;
+		if (!entry.streamed || entry.pendingMip >= 0 || entry.requiredMip >= entry.residentMip)
+			continue;
+
+		// One level at a time, the next one is queued when this one is in
+		const UINT mip = entry.residentMip - 1;
+		if (MakeRoom(GetLevelBytes(entry.layout, mip), lastFrame, evicted))
+			QueueLevel(handle, mip);
+		else
+			m_deferred++;
+	}
+
+	// The budget may have been lowered
+	MakeRoom(0, lastFrame, evicted);
+	return evicted;
+}
+
+bool TextureStreamer::Update()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_resultMutex);
+		std::move(m_results.begin(), m_results.end(), std::back_inserter(m_ready));
+		m_results.clear();
+	}
+
+	bool changed = false;
+	size_t uploaded = 0;
+	size_t done = 0;
+	for (; done < m_ready.size() && uploaded < m_settings.uploadBytesPerFrame; done++)
+	{
+		Result& result = m_ready[done];
+		m_inFlight--;
+		if (result.handle >= m_entries.size())
+			continue;
+
+		Entry& entry = m_entries[result.handle];
+		m_inFlightBytes -= GetLevelBytes(entry.layout, result.mip);
+		if (entry.pendingMip != (int)result.mip)
+			continue;
+		entry.pendingMip = -1;
+		if (!result.ok)
+		{
+			Log::Error(L"TextureStreamer: cannot read mip %u of %s, it stays at mip %u", result.mip, entry.file.c_str(), entry.residentMip);
+			continue;
+		}
+		if (!SwapInLevel(entry, result.mip, result.file))
+			continue;
+
+		const uint64_t bytes = GetLevelBytes(entry.layout, result.mip);
+		changed = true;
+		uploaded += (size_t)bytes;
+		m_bytesStreamed += bytes;
+		m_levelsStreamed++;
+	}
+	m_ready.erase(m_ready.begin(), m_ready.begin() + done);
+
+	if (UpdateResidency())
+		changed = true;
+	if (changed)
+		m_viewVersion++;
+
+	if (m_fullQualityMs < 0.0 && m_levelsStreamed > 0 && m_inFlight == 0 && m_deferred == 0)
+	{
+		m_fullQualityMs = GetElapsedMs();
+		const Stats stats = GetStats();
+		Log::Info(L"TextureStreamer: %u textures at full quality %.1f ms after start (first frame at %.1f ms), %llu bytes read",
+				  stats.textures, m_fullQualityMs, m_firstFrameMs, stats.bytesRead);
+	}
+	return changed;
+}
+
+void TextureStreamer::MarkFirstFrame()
+{
+	if (m_firstFrameMs < 0.0)
+		m_firstFrameMs = GetElapsedMs();
+}
+
+TextureStreamer::Stats TextureStreamer::GetStats() const
+{
+	Stats stats;
+	for (const Entry& entry : m_entries)
+	{
+		if (!entry.view)
+			continue;
+		stats.textures++;
+		if (entry.residentMip == 0 && entry.pendingMip < 0)
+			stats.fullyResident++;
+		stats.residentBytes += entry.residentBytes;
+	}
+	stats.levelsStreamed = m_levelsStreamed;
+	stats.bytesRead = m_bytesRead;
+	stats.bytesStreamed = m_bytesStreamed;
+	stats.levelsEvicted = m_levelsEvicted;
+	stats.deferred = m_deferred;
+	stats.loadMs = m_loadMs;
+	stats.firstFrameMs = m_firstFrameMs;
+	stats.fullQualityMs = m_fullQualityMs;
+	return stats;
+}
+
+namespace
+{
+	// Committed memory private to the process: a heap copy of a file counts, pages of a mapped file do not
+	SIZE_T GetPrivateBytes()
+	{
+		PROCESS_MEMORY_COUNTERS_EX counters = {};
+		GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters));
+		return counters.PrivateUsage;
+	}
+}
+
+void TextureStreamer::RunLoadBenchmark(ID3D11Device* device)
+{
+	constexpr int kIterations = 20;
+	const wchar_t* files[] = { L"Resources\\SpecularCM.dds", L"Resources\\DiffuseCM.dds", L"Resources\\PavingStones.dds",
+							   L"Resources\\rusty_metal_04_diff.dds", L"Resources\\stone.dds" };
+
+	// What LoadTextureDataFromFile did before mapping: the whole file read into a heap buffer
+	const std::function<HRESULT(const wchar_t*)> loadCopy = [device](const wchar_t* file)
+	{
+		std::ifstream stream(file, std::ios::binary | std::ios::ate);
+		if (!stream)
+			return E_FAIL;
+		std::vector<uint8_t> data((size_t)stream.tellg());
+		stream.seekg(0);
+		stream.read((char*)data.data(), (std::streamsize)data.size());
+		if (!stream)
+			return E_FAIL;
+		ComPtr<ID3D11ShaderResourceView> view;
+		return CreateDDSTextureFromMemory(device, data.data(), data.size(), nullptr, &view);
+	};
+	const std::function<HRESULT(const wchar_t*)> loadMapped = [device](const wchar_t* file)
+	{
+		ComPtr<ID3D11ShaderResourceView> view;
+		return CreateDDSTextureFromFile(device, file, nullptr, &view);
+	};
+
+	// Mean time per load, and the highest private memory above the start sampled on another thread
+	// while the loads run. A warm-up load first puts the file in the file cache for both.
+	auto measure = [](const std::function<HRESULT(const wchar_t*)>& load, const wchar_t* file, double& ms, SIZE_T& peak)
+	{
+		if (FAILED(load(file)))
+			return false;
+
+		const SIZE_T base = GetPrivateBytes();
+		std::atomic<bool> done{ false };
+		std::atomic<SIZE_T> highest{ base };
+		std::thread sampler([&]()
+			{
+				while (!done)
+				{
+					const SIZE_T now = GetPrivateBytes();
+					if (now > highest)
+						highest = now;
+					std::this_thread::yield();
+				}
+			});
+
+		bool ok = true;
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < kIterations && ok; i++)
+			ok = SUCCEEDED(load(file));
+		ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / kIterations;
+		done = true;
+		sampler.join();
+		peak = highest - base;
+		return ok;
+	};
+
+	Log::Info(L"DDS load benchmark: %d loads per file, heap copy vs. mapped file", kIterations);
+	double totalMs[2] = {};
+	SIZE_T maxPeak[2] = {};
+	for (const wchar_t* file : files)
+	{
+		double ms[2] = {};
+		SIZE_T peak[2] = {};
+		if (!measure(loadCopy, file, ms[0], peak[0]) || !measure(loadMapped, file, ms[1], peak[1]))
+		{
+			Log::Error(L"  cannot load %s", file);
+			continue;
+		}
+
+		Log::Info(L"  %-36s copy %6.3f ms, peak +%6.1f KB   mapped %6.3f ms, peak +%6.1f KB",
+				  file, ms[0], peak[0] / 1024.0, ms[1], peak[1] / 1024.0);
+		for (int i = 0; i < 2; i++)
+		{
+			totalMs[i] += ms[i];
+			maxPeak[i] = std::max(maxPeak[i], peak[i]);
+		}
+	}
+	Log::Info(L"  all files: copy %.3f ms, peak +%.1f KB   mapped %.3f ms, peak +%.1f KB",
+			  totalMs[0], maxPeak[0] / 1024.0, totalMs[1], maxPeak[1] / 1024.0);
+}
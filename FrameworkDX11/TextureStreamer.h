@@ -0,0 +1,204 @@
+// Progressive DDS texture streaming.
+//
+// Load() maps a file (MapDDSFile), checks its header in place and creates a texture of just its mip
+// tail (the levels no larger than Settings::tailSize), so there is something to bind straight away.
+// The larger levels are paged in on background I/O threads, one level per request from the tail
+// upwards, and Update() - once a frame on the render thread - swaps each one in: a texture one level
+// larger is created, the new level is uploaded into it, the levels already resident are copied across
+// on the GPU and the view is replaced. Views therefore change while a texture streams; users look them
+// up by handle (GetView()) every frame, or when GetViewVersion() changes.
+//
+// Levels above the tail are only streamed in when something asks for them: the renderer calls
+// RequestMip() / RequestScreenSize() while collecting the frame's draws, and Update() queues the next
+// level of every texture whose resident mip is coarser than the finest one requested. With a memory
+// budget set, levels are admitted only while they fit; when they do not, the top levels that went the
+// longest without being needed are evicted first (the texture is recreated without them, copying the
+// rest on the GPU) and streamed back in when requested again. The tail is never evicted.
+//
+// Every upload reads straight from the mapping, so no level is ever copied into a heap buffer first.
+//
+// Layouts the streamer does not handle (volume textures, planar formats) are loaded whole through
+// CreateDDSTextureFromMemory, from the same mapping.
+
+#pragma once
+
+#include <d3d11_1.h>
+#include "wrl.h"
+#include "DDSTextureLoader.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TextureStreamer
+{
+public:
+	using Handle = uint32_t;
+	static constexpr Handle kInvalidHandle = ~0u;
+
+	struct Settings
+	{
+		bool	streaming = true;					// false loads every level in Load(), as before streaming
+		UINT	tailSize = 64;						// levels up to this size are loaded by Load() itself
+		UINT	ioThreads = 2;						// read by Init()
+		size_t	uploadBytesPerFrame = 8u << 20;		// Update() stops swapping levels in past this
+		uint64_t	budgetBytes = 0;				// resident texture memory, 0 for no limit
+	};
+
+	struct Stats
+	{
+		UINT		textures = 0;
+		UINT		fullyResident = 0;
+		UINT		levelsStreamed = 0;
+		uint64_t	residentBytes = 0;
+		uint64_t	bytesRead = 0;			// by Load() and the I/O threads
+		uint64_t	bytesStreamed = 0;		// uploaded by Update(), counting levels streamed back in after eviction
+		UINT		levelsEvicted = 0;
+		UINT		deferred = 0;			// textures last frame below their requested detail for lack of budget
+		double		loadMs = 0.0;			// spent in Load()
+		double		firstFrameMs = -1.0;	// from Init() to MarkFirstFrame(), -1 until then
+		double		fullQualityMs = -1.0;	// from Init() to every requested level first being resident
+	};
+
+	TextureStreamer() = default;
+	~TextureStreamer() { Release(); }
+	TextureStreamer(const TextureStreamer&) = delete;
+	TextureStreamer& operator = (const TextureStreamer&) = delete;
+
+	Settings&	GetSettings() { return m_settings; }
+
+	HRESULT	Init(ID3D11Device* device, ID3D11DeviceContext* context);
+	void	Release();
+
+	// Creates the texture from the mip tail. kInvalidHandle if the file cannot be read (logged).
+	Handle	Load(const std::wstring& file);
+	// Frees the texture straight away; levels still being read are dropped. Handles are not reused.
+	void	Unload(Handle handle);
+
+	// The texture is drawn this frame and needs levels down to mip. Render thread only.
+	void	RequestMip(Handle handle, UINT mip);
+	// Same, for a texture mapped once across pixels on screen
+	void	RequestScreenSize(Handle handle, float pixels);
+
+	// Swaps in the levels read since the last call, within the upload budget, then streams and evicts
+	// levels for the requests made since. Render thread only. Returns true if any view changed.
+	bool	Update();
+
+	// Call after the first Present(); the time goes into the stats
+	void	MarkFirstFrame();
+
+	ID3D11ShaderResourceView*	GetView(Handle handle) const { return handle < m_entries.size() ? m_entries[handle].view.Get() : nullptr; }
+	UINT	GetViewVersion() const { return m_viewVersion; }
+	UINT	GetResidentMip(Handle handle) const { return handle < m_entries.size() ? m_entries[handle].residentMip : 0; }
+	UINT	GetMipCount(Handle handle) const { return handle < m_entries.size() ? m_entries[handle].layout.mipCount : 0; }
+	UINT	GetRequiredMip(Handle handle) const { return handle < m_entries.size() ? m_entries[handle].requiredMip : 0; }
+	uint64_t	GetResidentBytes(Handle handle) const { return handle < m_entries.size() ? m_entries[handle].residentBytes : 0; }
+	const std::wstring&	GetFile(Handle handle) const { return m_entries[handle].file; }
+	// Hash of the file size, header and mip tail, 0 for textures loaded whole. Files differing only in
+	// their larger levels hash the same, so a match is only a candidate for HasSameContent().
+	uint64_t	GetContentHash(Handle handle) const { return handle < m_entries.size() ? m_entries[handle].contentHash : 0; }
+	// Compares the files of two loaded textures byte by byte, stopping at the first difference. Only
+	// textures with the same content hash are compared; the bytes and time go into the stats.
+	bool	HasSameContent(Handle a, Handle b);
+	bool	IsLoaded(Handle handle) const { return GetView(handle) != nullptr; }
+	size_t	GetCount() const { return m_entries.size(); }
+	bool	IsStreaming() const { return m_inFlight > 0; }
+	Stats	GetStats() const;
+
+	// Times loading the sample DDS files from a heap copy (as the loader used to) and from a mapping,
+	// with the peak private memory of each
+	static void	RunLoadBenchmark(ID3D11Device* device);
+
+private:
+	struct Entry
+	{
+		std::wstring									file;
+		DirectX::DDS_TEXTURE_LAYOUT						layout = {};
+		bool											streamed = false;	// false when loaded whole
+		uint64_t										contentHash = 0;
+		Microsoft::WRL::ComPtr<ID3D11Resource>			resource;
+		Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>	view;
+		UINT											residentMip = 0;	// most detailed level in the texture
+		int												pendingMip = -1;	// level being read, -1 for none
+		uint64_t										residentBytes = 0;
+
+		// Residency
+		UINT											tailMip = 0;		// never evicted
+		UINT											requestedMip = ~0u;	// finest requested this frame
+		UINT											requiredMip = ~0u;	// finest requested last frame
+		uint32_t										lastNeeded[D3D11_REQ_MIP_LEVELS] = {};	// frame each level was last requested
+	};
+
+	// What an I/O thread needs to read one level, copied so the threads never touch m_entries
+	struct Request
+	{
+		Handle							handle;
+		UINT							mip;
+		std::wstring					file;
+		DirectX::DDS_TEXTURE_LAYOUT		layout;
+	};
+
+	struct Result
+	{
+		Handle							handle;
+		UINT							mip;
+		bool							ok;
+		DirectX::DDS_MAPPED_FILE		file;		// the level is uploaded from here, already paged in
+	};
+
+	// Bytes of levels [firstMip, endMip) of slice, which are contiguous in the file from offset
+	static uint64_t	GetLevelRange(const DirectX::DDS_TEXTURE_LAYOUT& layout, UINT firstMip, UINT endMip, UINT slice, size_t& offset);
+	// Reads a byte of every page of levels [firstMip, endMip) of every slice, returning their size
+	static uint64_t	TouchLevels(const DirectX::DDS_MAPPED_FILE& file, const DirectX::DDS_TEXTURE_LAYOUT& layout, UINT firstMip, UINT endMip);
+	UINT	GetTailMip(const DirectX::DDS_TEXTURE_LAYOUT& layout) const;
+
+	HRESULT	CreateTexture(const DirectX::DDS_TEXTURE_LAYOUT& layout, UINT firstMip, const D3D11_SUBRESOURCE_DATA* initData,
+						  Microsoft::WRL::ComPtr<ID3D11Resource>& resource, Microsoft::WRL::ComPtr<ID3D11ShaderResourceView>& view) const;
+	bool	SwapInLevel(Entry& entry, UINT mip, const DirectX::DDS_MAPPED_FILE& file);
+	bool	EvictLevel(Entry& entry);
+	void	QueueLevel(Handle handle, UINT mip);
+
+	// Queues the next level of the textures below their requested detail, evicting for them
+	bool	UpdateResidency();
+	// Evicts the least recently needed top levels, none needed in neededFrame, until bytes more fit the
+	// budget. False if they cannot be made to fit.
+	bool	MakeRoom(uint64_t bytes, uint32_t neededFrame, bool& evicted);
+	uint64_t	GetResidentTotal() const;
+	static uint64_t	GetLevelBytes(const DirectX::DDS_TEXTURE_LAYOUT& layout, UINT mip);
+	void	IoThread();
+	double	GetElapsedMs() const;
+
+	Microsoft::WRL::ComPtr<ID3D11Device>		m_device;
+	Microsoft::WRL::ComPtr<ID3D11DeviceContext>	m_context;
+	Settings				m_settings;
+	std::vector<Entry>		m_entries;
+	std::vector<Result>		m_ready;			// read, waiting for upload budget
+	UINT					m_inFlight = 0;		// levels queued or read but not swapped in yet
+	uint64_t				m_inFlightBytes = 0;
+	UINT					m_viewVersion = 0;
+	UINT					m_levelsStreamed = 0;
+	uint64_t				m_bytesStreamed = 0;
+	UINT					m_levelsEvicted = 0;
+	UINT					m_deferred = 0;
+	uint32_t				m_frame = 1;		// advanced by Update(), requests are stamped with it
+
+	std::chrono::steady_clock::time_point	m_start;
+	double					m_loadMs = 0.0;
+	double					m_firstFrameMs = -1.0;
+	double					m_fullQualityMs = -1.0;
+
+	std::vector<std::thread>	m_threads;
+	std::mutex					m_requestMutex;
+	std::condition_variable		m_requestReady;
+	std::deque<Request>			m_requests;
+	bool						m_stop = false;
+	std::mutex					m_resultMutex;
+	std::vector<Result>			m_results;
+	std::atomic<uint64_t>		m_bytesRead{ 0 };
+};
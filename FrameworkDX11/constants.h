@@ -3,4 +3,3 @@
 
 #define SCREEN_WIDTH 1280
 #define SCREEN_HEIGHT 720
-constexpr unsigned int max_bones = 100;
\ No newline at end of file
@@ -13,6 +13,8 @@
 using namespace DirectX;
 
 class DX11Renderer;
+class RenderStateTracker;
+class StateObjectCache;
 
 // Used by a scene to access necessary renderer internals
 class IRenderingContext // TODO - this should be renamed as it is no longer an interface
@@ -25,10 +27,13 @@ public:
 
     IRenderingContext() = default;
 
-    void Init(ID3D11Device* d, ID3D11DeviceContext* c, DX11Renderer* r) {
+    void Init(ID3D11Device* d, ID3D11DeviceContext* c, DX11Renderer* r,
+              RenderStateTracker* t = nullptr, StateObjectCache* s = nullptr) {
         m_device = d;  
         m_context = c;
         m_renderer = r;
+        m_stateTracker = t;
+        m_stateObjectCache = s;
     }; 
 
     virtual ID3D11Device* GetDevice() {
@@ -50,8 +55,37 @@ public:
         return m_renderer;
     }
 
+    // Optional - binds go straight to the immediate context when there is no tracker
+    RenderStateTracker* GetStateTracker() {
+        return m_stateTracker;
+    }
+
+    StateObjectCache* GetStateObjectCache() {
+        return m_stateObjectCache;
+    }
+
+    // Camera of the frame being drawn, for screen size estimates (e.g. texture residency)
+    void SetView(const XMMATRIX& view, const XMMATRIX& projection, float viewportHeight) {
+        XMStoreFloat4x4(&m_view, view);
+        m_viewportHeight = viewportHeight;
+        m_pixelsPerUnit = XMVectorGetY(projection.r[1]) * viewportHeight * 0.5f; // at distance 1
+    }
+
+    // Height in pixels of a sphere on screen; the viewport height once the camera is inside it
+    float GetProjectedSize(FXMVECTOR center, float radius) const {
+        const float depth = XMVectorGetZ(XMVector3TransformCoord(center, XMLoadFloat4x4(&m_view)));
+        if (depth <= radius)
+            return depth + radius > 0.0f ? m_viewportHeight : 0.0f;
+        return 2.0f * radius * m_pixelsPerUnit / depth;
+    }
+
 private:
     ID3D11Device* m_device;
     ID3D11DeviceContext* m_context;
     DX11Renderer* m_renderer;
+    RenderStateTracker* m_stateTracker = nullptr;
+    StateObjectCache* m_stateObjectCache = nullptr;
+    XMFLOAT4X4 m_view = {};
+    float m_viewportHeight = 0.0f;
+    float m_pixelsPerUnit = 0.0f;
 };
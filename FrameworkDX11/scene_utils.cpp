@@ -1,5 +1,6 @@
 #include "scene_utils.hpp"
 
+#include "ColorConversion.h"
 #include "constants.hpp"
 #include "utils.hpp"
 
@@ -61,56 +62,14 @@ bool SceneUtils::CreateConstantTextureSRV(IRenderingContext &ctx,
 }
 
 
-bool SceneUtils::ConvertImageToFloat(std::vector<unsigned char> &floatImage,
-                                     const tinygltf::Image &srcImage,
-                                     XMFLOAT4 constFactor)
-{
-    const size_t floatDataSize = srcImage.width * srcImage.height * 4 * sizeof(float);
-    floatImage.resize(floatDataSize);
-    if (floatImage.size() != floatDataSize)
-        return false;
-
-    auto floatPtr = reinterpret_cast<float*>(floatImage.data());
-
-    if (srcImage.component == 4 &&
-        srcImage.bits == 8 &&
-        srcImage.pixel_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE)
-    {
-        auto srcPtr = reinterpret_cast<const uint8_t*>(srcImage.image.data());
-
-        for (size_t x = 0; x < srcImage.width; x++)
-            for (size_t y = 0; y < srcImage.height; y++)
-            {
-                for (size_t comp = 0; comp < srcImage.component; comp++, srcPtr++, floatPtr++)
-                    *floatPtr = (*srcPtr / 255.f) * GetComponent(constFactor, comp);
-            }
-
-        return true;
-    }
-    else
-        return false;
-}
-
-
-const FLOAT& SceneUtils::GetComponent(const XMFLOAT4 &vec, size_t comp)
-{
-    return *(reinterpret_cast<const FLOAT*>(&vec) + comp);
-}
-
-
 #define SRGB_TO_LINEAR_PRECISE
 
 float SceneUtils::SrgbValueToLinear(uint8_t v)
 {
-    const float f = v / 255.f;
-
 #ifdef SRGB_TO_LINEAR_PRECISE
-    if (f <= 0.04045f)
-        return f / 12.92f;
-    else
-        return pow((f + 0.055f) / 1.055f, 2.4f);
+    return ColorConversion::GetSrgbTable(8)[v];
 #else
-    return pow(f, 2.2f);
+    return pow(v / 255.f, 2.2f);
 #endif
 }
 
@@ -35,12 +35,6 @@ namespace SceneUtils
                                   ID3D11ShaderResourceView *&srv,
                                   XMFLOAT4 color);
 
-    bool ConvertImageToFloat(std::vector<unsigned char> &floatImage,
-                             const tinygltf::Image &srcImage,
-                             XMFLOAT4 constFactor);
-
-    const FLOAT& GetComponent(const XMFLOAT4 &vec, size_t comp);
-
     float SrgbValueToLinear(uint8_t v);
 
     XMFLOAT4 SrgbColorToFloat(uint8_t r, uint8_t g, uint8_t b, float intensity = 1.0f);
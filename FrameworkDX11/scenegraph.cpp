@@ -9,11 +9,14 @@
 #include "Scene.h"
 
 #include "DX11Renderer.h"
+#include "RenderStateTracker.h"
 #include "structures.h"
 
 
+#include <algorithm>
 #include <cassert>
 #include <array>
+#include <functional>
 #include <vector>
 
 #define UNUSED_COLOR XMFLOAT4(1.f, 0.f, 1.f, 1.f)
@@ -79,23 +82,6 @@ struct CbSceneNode
     XMFLOAT4 MeshColor; // May be eventually replaced by the emmisive component of the standard surface shader
 };
 
-struct CbScenePrimitive
-{
-    // Metallness
-    XMFLOAT4 BaseColorFactor;
-    XMFLOAT4 MetallicRoughnessFactor;
-
-    // Specularity
-    XMFLOAT4 DiffuseColorFactor;
-    XMFLOAT4 SpecularFactor;
-
-    // Both workflows
-    float    NormalTexScale;
-    float    OcclusionTexStrength;
-    float    padding[2];  // padding to 16 bytes
-    XMFLOAT4 EmissionFactor;
-};
-
 SceneGraph::SceneGraph(const SceneId sceneId) :
     mSceneId(sceneId)
 {
@@ -374,16 +360,121 @@ void printAnimations(tinygltf::Model model)
     }
 }
 
-void SceneGraph::AnimateFrame(IRenderingContext& ctx)
+void SceneGraph::AnimateFrame(IRenderingContext& ctx, float deltaTime)
 {
     if (!ctx.IsValid())
         return;
 
+    // Props move in step with the character when there is one
+    if (!mNodeAnimator.IsEmpty())
+    {
+        const Skeleton* skeleton = nullptr;
+        if (!mInstances.empty() && !mInstances[0].skeletons.empty() && mInstances[0].skeletons[0].IsLoaded())
+            skeleton = &mInstances[0].skeletons[0];
+        else if (!mRootNodes.empty() && mRootNodes[0].m_skeleton.IsLoaded())
+            skeleton = &mRootNodes[0].m_skeleton;
+
+        if (skeleton != nullptr && skeleton->GetCurrentAnimationIndex() >= 0)
+        {
+            mNodeAnimator.PlayAnimation((unsigned int)skeleton->GetCurrentAnimationIndex());
+            mNodeAnimationTime = skeleton->GetAnimationTime();
+        }
+        else
+        {
+            mNodeAnimationTime += deltaTime;
+        }
+        mNodeAnimator.Evaluate(mNodeAnimationTime);
+    }
+
     // Scene geometry
     for (auto& node : mRootNodes)
         node.Animate(ctx);
 }
 
+void SceneGraph::SetInstanceGrid(unsigned int count, float spacing)
+{
+    mInstances.clear();
+    mInstances.reserve(count);
+
+    const unsigned int columns = std::max(1u, (unsigned int)ceilf(sqrtf((float)count)));
+    for (unsigned int i = 0; i < count; i++)
+    {
+        Instance instance;
+        const float x = ((float)(i % columns) - 0.5f * (columns - 1)) * spacing;
+        const float z = (float)(i / columns) * spacing;
+        XMStoreFloat4x4(&instance.world, XMMatrixTranslation(x, 0.0f, z));
+
+        // Copies share the clips; spread the start times so the crowd does not move in lockstep
+        instance.skeletons.reserve(mRootNodes.size());
+        for (const auto& root : mRootNodes)
+        {
+            Skeleton skeleton = root.m_skeleton;
+            if (skeleton.IsLoaded() && skeleton.GetAnimationCount() > 0)
+            {
+                skeleton.PlayAnimation(0);
+                skeleton.SetAnimationTime(skeleton.CurrentAnimation()->GetStartTime() + 0.37f * i);
+            }
+            instance.skeletons.push_back(std::move(skeleton));
+        }
+        mInstances.push_back(std::move(instance));
+    }
+
+    std::function<bool(const SceneNode&)> hasMorphTargets = [&](const SceneNode& node)
+    {
+        if (!node.mMorphWeights.empty())
+            return true;
+        for (const auto& child : node.mChildren)
+        {
+            if (hasMorphTargets(child))
+                return true;
+        }
+        return false;
+    };
+    if (count > 1 && std::any_of(mRootNodes.begin(), mRootNodes.end(), hasMorphTargets))
+        Log::Warning(L"Instances share the morphed vertices: all %u copies show the morph weights of the first", count);
+}
+
+void SceneGraph::BakeAnimations(float framesPerSecond)
+{
+    for (auto& root : mRootNodes)
+    {
+        if (root.m_skeleton.IsLoaded())
+            root.m_skeleton.BakeAnimations(framesPerSecond);
+    }
+}
+
+void SceneGraph::GatherAnimated(AnimationScheduler& scheduler)
+{
+    auto add = [&](Skeleton& skeleton, const XMMATRIX& world)
+    {
+        if (!skeleton.IsLoaded())
+            return;
+        if (skeleton.CurrentAnimation() == nullptr && skeleton.GetAnimationCount() > 0)
+            skeleton.PlayAnimation(0);
+        scheduler.Add(&skeleton, world);
+    };
+
+    if (!mInstances.empty())
+    {
+        for (auto& instance : mInstances)
+        {
+            const XMMATRIX instanceWorld = XMLoadFloat4x4(&instance.world);
+            for (size_t r = 0; r < mRootNodes.size(); r++)
+                add(instance.skeletons[r], mRootNodes[r].mGlobalMtrx * instanceWorld);
+        }
+        return;
+    }
+
+    std::function<void(SceneNode&)> gather = [&](SceneNode& node)
+    {
+        add(node.m_skeleton, node.mGlobalMtrx);
+        for (auto &child : node.mChildren)
+            gather(child);
+    };
+    for (auto &node : mRootNodes)
+        gather(node);
+}
+
 XMMATRIX SceneGraph::GetMatrixOfRoot() const
 {
     return mRootNodes[0].GetWorldMtrx();
@@ -416,6 +507,9 @@ bool SceneGraph::LoadGLTF(IRenderingContext &ctx,
    if (!LoadSceneFromGltf(ctx, model, logPrefix))
         return false;
 
+    AssignMaterials(ctx, model);
+    BindNodeAnimations(model);
+
    // SetupDefaultLights();
 
     Log::Debug(L"");
@@ -435,9 +529,12 @@ bool SceneGraph::LoadGLTFWithSkeleton(IRenderingContext& ctx,
     if (!GltfUtils::LoadModel(model, filePath))
         return false;
 
-    if (!LoadSceneFromGltfWithSkeleton(ctx, model, logPrefix))
+    if (!LoadSceneFromGltfWithSkeleton(ctx, model, filePath, logPrefix))
         return false;
 
+    AssignMaterials(ctx, model);
+    BindNodeAnimations(model);
+
 //    SetupDefaultLights();
 
     Log::Debug(L"");
@@ -480,6 +577,7 @@ bool SceneGraph::LoadSceneFromGltf(IRenderingContext &ctx,
 
 bool SceneGraph::LoadSceneFromGltfWithSkeleton(IRenderingContext& ctx,
     const tinygltf::Model& model,
+    const std::wstring& filePath,
     const std::wstring& logPrefix)
 {
     // Choose one scene
@@ -509,7 +607,15 @@ bool SceneGraph::LoadSceneFromGltfWithSkeleton(IRenderingContext& ctx,
         printWeightsToBones(model);
         printAnimations(model);
 
-        sceneNode.m_skeleton.LoadFromGltf(model);
+        // Clips come from the animation library, so loading the same file again shares them. They are
+        // played back compressed, to within the library's tolerance (0.1% of the skeleton's size).
+        if (sceneNode.m_skeleton.LoadFromGltf(model, 0, filePath + L"#0"))
+        {
+            Log::Debug(L"%sAnimations: %zu bytes, %zu compressed",
+                       logPrefix.c_str(),
+                       sceneNode.m_skeleton.GetAnimationMemorySize(false),
+                       sceneNode.m_skeleton.GetAnimationMemorySize(true));
+        }
         sceneNode.m_skeleton.Update(0);
         
         if (!LoadSceneNodeFromGLTF(ctx, sceneNode, model, nodeIdx, logPrefix + L"   "))
@@ -570,9 +676,6 @@ void SceneGraph::Destroy()
     Utils::ReleaseAndMakeNull(mCbScene);
     Utils::ReleaseAndMakeNull(mCbFrame);
     Utils::ReleaseAndMakeNull(mCbSceneNode);
-    Utils::ReleaseAndMakeNull(mCbScenePrimitive);
-
-    Utils::ReleaseAndMakeNull(mSamplerLinear);
 
     mRootNodes.clear();
 }
@@ -628,60 +731,258 @@ void SceneGraph::RenderFrame(IRenderingContext& ctx, const float deltaTime)
     if (!ctx.IsValid())
         return;
 
-    ConstantBufferSwitch* data = &ctx.getDXRenderer()->m_ConstantBufferDataSwitch;
-    data->mView = XMMatrixTranspose(ctx.getDXRenderer()->m_pScene->m_pCamera->getViewMatrix());
-    data->mProjection = XMMatrixTranspose(XMLoadFloat4x4(&ctx.getDXRenderer()->m_matProjection));
-	data->frank = XMFLOAT4(ctx.getDXRenderer()->m_pScene->albedo.x, ctx.getDXRenderer()->m_pScene->albedo.y, ctx.getDXRenderer()->m_pScene->albedo.z, 1.0f);
-    data->metal = ctx.getDXRenderer()->m_pScene->metal;
-    data->rough = ctx.getDXRenderer()->m_pScene->rough;
-    data->type = ctx.getDXRenderer()->m_pScene->type;
-    data->textureSelect = ctx.getDXRenderer()->m_pScene->textureSelect;
+    DX11Renderer* renderer = ctx.getDXRenderer();
+    RenderStateTracker* tracker = ctx.GetStateTracker() ? ctx.GetStateTracker() : &renderer->m_stateTracker;
 
-    // Scene geometry
-    for (auto& node : mRootNodes)
-        RenderNode(ctx, node, XMMatrixIdentity(), deltaTime);
+    UpdateMorphTargets(ctx);
+
+    // Gather the scene geometry, then sort by texture set, material and node: materials sharing their
+    // textures (packed into arrays) follow each other, so only their constants are rebound
+    mDrawList.clear();
+    mDrawTransforms.clear();
+    mDrawSkeletons.clear();
+    if (mInstances.empty())
+    {
+        for (auto& node : mRootNodes)
+            CollectNode(ctx, node, XMMatrixIdentity(), nullptr);
+    }
+    else
+    {
+        for (const auto& instance : mInstances)
+        {
+            const XMMATRIX instanceWorld = XMLoadFloat4x4(&instance.world);
+            for (size_t r = 0; r < mRootNodes.size(); r++)
+                CollectNode(ctx, mRootNodes[r], instanceWorld, nullptr,
+                            instance.skeletons[r].IsLoaded() ? &instance.skeletons[r] : nullptr);
+        }
+    }
+
+    std::sort(mDrawList.begin(), mDrawList.end(), [](const DrawItem& a, const DrawItem& b)
+        {
+            if (a.textureSet != b.textureSet)
+                return a.textureSet < b.textureSet;
+            if (a.material != b.material)
+                return a.material < b.material;
+            return a.transformIdx < b.transformIdx;
+        });
+
+    WritePalettes(ctx, *tracker);
+
+    tracker->VSSetShader(renderer->m_pVertexShader.Get());
+
+    uint32_t boundTransform = UINT32_MAX;
+    for (const auto& item : mDrawList)
+    {
+        renderer->m_cbStats.legacyBytes += kLegacyPerDrawBytes;
+
+        renderer->m_materials.Bind(*tracker, item.material);
+
+        // store world in the per-draw block, view / projection live in the per-view buffer.
+        // Consecutive primitives of the same node share it, so it is only pushed when the node changes.
+        if (item.transformIdx != boundTransform)
+        {
+            const CbPerDraw& cbDraw = mDrawTransforms[item.transformIdx];
+            renderer->m_cbRing.Push(ctx.GetImmediateContext(), 0, &cbDraw, sizeof(cbDraw), &renderer->m_cbStats, tracker);
+            boundTransform = item.transformIdx;
+        }
 
+        item.primitive->DrawGeometry(ctx, renderer->m_pVertexLayout.Get());
+    }
 }
 
 
-void SceneGraph::RenderNode(IRenderingContext &ctx,
-                       SceneNode &node,
-                       const XMMATRIX &parentWorldMtrx,
-                        const float deltaTime)
+void SceneGraph::WritePalettes(IRenderingContext &ctx, RenderStateTracker &tracker)
 {
-    if (!ctx.IsValid())
+    DX11Renderer* renderer = ctx.getDXRenderer();
+
+    // Nodes with equal palette keys (e.g. instances at the same baked frame) share one palette
+    mPaletteRefs.clear();
+    for (uint32_t t = 0; t < (uint32_t)mDrawSkeletons.size(); t++)
+    {
+        if (mDrawSkeletons[t] != nullptr)
+            mPaletteRefs.push_back({ mDrawSkeletons[t]->GetPaletteKey(), t });
+    }
+    if (mPaletteRefs.empty())
         return;
+    std::sort(mPaletteRefs.begin(), mPaletteRefs.end(), [](const PaletteRef& a, const PaletteRef& b)
+        {
+            return a.key < b.key;
+        });
 
-    XMMATRIX world = node.mWorldMtrx * parentWorldMtrx;
-    ConstantBufferSwitch* data = &ctx.getDXRenderer()->m_ConstantBufferDataSwitch;
-    if (node.m_skeleton.IsLoaded())
+    UINT total = 0;
+    for (size_t i = 0; i < mPaletteRefs.size(); i++)
     {
-        if (node.m_skeleton.CurrentAnimation() == nullptr)
-            node.m_skeleton.PlayAnimation(0);
-        node.m_skeleton.Update(deltaTime);
+        if (i == 0 || mPaletteRefs[i].key != mPaletteRefs[i - 1].key)
+            total += mDrawSkeletons[mPaletteRefs[i].transformIdx]->GetBoneCount();
     }
 
-    // Draw current node
-    for (auto &primitive : node.mPrimitives)
+    // Written straight into the mapped ring. If that fails the nodes keep a joint count of 0 and
+    // are drawn in their bind pose.
+    UINT first = 0;
+    XMFLOAT3X4* palettes = renderer->m_paletteRing.Map(ctx.GetImmediateContext(), total, first, &renderer->m_cbStats);
+    if (palettes == nullptr)
+        return;
+
+    UINT offset = 0;
+    UINT count = 0;
+    for (size_t i = 0; i < mPaletteRefs.size(); i++)
     {
-        // update the per-node constant buffer
-        auto immCtx = ctx.GetImmediateContext();
-        
-        // store world and the view / projection in a constant buffer for the vertex shader to use
-        data->mWorld = DirectX::XMMatrixTranspose(world);
-        ctx.GetImmediateContext()->UpdateSubresource(ctx.getDXRenderer()->m_pScene->m_pConstantBufferSwitch.Get(), 0, nullptr, data, 0, 0);
+        if (i == 0 || mPaletteRefs[i].key != mPaletteRefs[i - 1].key)
+        {
+            offset += count;
+            const Skeleton* skeleton = mDrawSkeletons[mPaletteRefs[i].transformIdx];
+            count = skeleton->GetBoneCount();
+            skeleton->GetSkinningMatrices(palettes + offset, count);
+            renderer->m_cbStats.legacyBytes += kLegacyPaletteBytes;
+        }
+        CbPerDraw& cbDraw = mDrawTransforms[mPaletteRefs[i].transformIdx];
+        cbDraw.paletteOffset = first + offset;
+        cbDraw.jointCount = count;
+    }
+
+    renderer->m_paletteRing.Unmap(ctx.GetImmediateContext(), tracker);
+}
+
+
+void SceneGraph::RequestTextureDetail(IRenderingContext &ctx, const ScenePrimitive &primitive, const XMMATRIX &world)
+{
+    DX11Renderer* renderer = ctx.getDXRenderer();
+    const TextureStreamer::Handle* textures = renderer->m_materials.GetStreamedTextures(primitive.mMaterial);
+    if (textures == nullptr)
+        return;
+
+    // The bounding sphere in world space, scaled by the largest axis so it still encloses the primitive.
+    // Taking the texture as mapped once across it, it needs a texel per pixel of its height on screen.
+    const XMVECTOR center = XMVector3TransformCoord(XMLoadFloat3(&primitive.mBoundsCenter), world);
+    const float scale = sqrtf(std::max({ XMVectorGetX(XMVector3LengthSq(world.r[0])),
+                                         XMVectorGetX(XMVector3LengthSq(world.r[1])),
+                                         XMVectorGetX(XMVector3LengthSq(world.r[2])) }));
+    const float pixels = ctx.GetProjectedSize(center, primitive.mBoundsRadius * scale);
+    for (UINT slot = 0; slot < MaterialLibrary::kTextureSlots; slot++)
+        renderer->m_textureStreamer.RequestScreenSize(textures[slot], pixels);
+}
+
+
+void SceneGraph::UpdateMorphTargets(IRenderingContext &ctx)
+{
+    std::function<void(SceneNode&, Skeleton*)> update = [&](SceneNode& node, Skeleton* skeleton)
+    {
+        if (node.m_skeleton.IsLoaded() && skeleton == nullptr)
+            skeleton = &node.m_skeleton;
+
+        if (!node.mMorphWeights.empty())
+        {
+            if (skeleton != nullptr)
+                skeleton->GetMorphWeights(node.mGltfNodeIdx, node.mMorphWeights.data(), node.mMorphWeights.size());
+            for (auto &primitive : node.mPrimitives)
+                primitive.ApplyMorphWeights(ctx, node.mMorphWeights.data(), node.mMorphWeights.size());
+        }
+
+        for (auto &child : node.mChildren)
+            update(child, skeleton);
+    };
 
-        // Render a cube
-        ctx.GetImmediateContext()->VSSetShader(ctx.getDXRenderer()->m_pVertexShader.Get(), nullptr, 0);
-        ctx.GetImmediateContext()->VSSetConstantBuffers(0, 1, ctx.getDXRenderer()->m_pScene->m_pConstantBufferSwitch.GetAddressOf());
-        ctx.GetImmediateContext()->PSSetConstantBuffers(0, 1, ctx.getDXRenderer()->m_pScene->m_pConstantBufferSwitch.GetAddressOf());
+    for (size_t r = 0; r < mRootNodes.size(); r++)
+    {
+        // Instances share the morphed vertices, so the first one drives them for all
+        Skeleton* skeleton = nullptr;
+        if (!mInstances.empty() && mInstances[0].skeletons[r].IsLoaded())
+            skeleton = &mInstances[0].skeletons[r];
+        update(mRootNodes[r], skeleton);
+    }
+}
+
+
+void SceneGraph::CollectNode(IRenderingContext &ctx,
+                             SceneNode &node,
+                             const XMMATRIX &instanceWorldMtrx,
+                             const Skeleton *skeleton,
+                             const Skeleton *instanceSkeleton)
+{
+    const XMMATRIX world = node.mGlobalMtrx * instanceWorldMtrx;
+    if (instanceSkeleton != nullptr)
+        skeleton = instanceSkeleton;
+    else if (node.m_skeleton.IsLoaded())
+        skeleton = &node.m_skeleton;
 
-        primitive.DrawGeometry(ctx, ctx.getDXRenderer()->m_pVertexLayout.Get());
+    if (!node.mPrimitives.empty())
+    {
+        CbPerDraw cbDraw;
+        cbDraw.mWorld = DirectX::XMMatrixTranspose(world);
+        cbDraw.paletteOffset = 0;
+        cbDraw.jointCount = 0;      // set by WritePalettes() for skinned nodes
+        cbDraw.padding = XMUINT2(0, 0);
+        const uint32_t transformIdx = (uint32_t)mDrawTransforms.size();
+        mDrawTransforms.push_back(cbDraw);
+        mDrawSkeletons.push_back(skeleton);
+
+        for (const auto &primitive : node.mPrimitives)
+        {
+            const uint32_t textureSet = ctx.getDXRenderer()->m_materials.GetTextureSet(primitive.mMaterial);
+            mDrawList.push_back({ &primitive, primitive.mMaterial, textureSet, transformIdx });
+            RequestTextureDetail(ctx, primitive, world);
+        }
     }
 
     // Children
     for (auto &child : node.mChildren)
-        RenderNode(ctx, child, world, deltaTime);
+        CollectNode(ctx, child, instanceWorldMtrx, skeleton);
+}
+
+
+void SceneGraph::BindNodeAnimations(const tinygltf::Model &model)
+{
+    std::vector<SceneNode*> nodes(model.nodes.size(), nullptr);
+    std::function<void(SceneNode&)> index = [&](SceneNode& node)
+    {
+        if (node.mGltfNodeIdx >= 0 && node.mGltfNodeIdx < (int)nodes.size())
+            nodes[node.mGltfNodeIdx] = &node;
+        for (auto &child : node.mChildren)
+            index(child);
+    };
+    for (auto &node : mRootNodes)
+        index(node);
+
+    mNodeAnimationTime = 0.0f;
+    if (mNodeAnimator.Load(model, nodes))
+        Log::Debug(L"Node animations: %zu channels on %zu nodes", mNodeAnimator.GetChannelCount(), mNodeAnimator.GetNodeCount());
+}
+
+
+void SceneGraph::AssignMaterials(IRenderingContext &ctx, const tinygltf::Model &model)
+{
+    DX11Renderer* renderer = ctx.getDXRenderer();
+    if (renderer == nullptr)
+        return;
+
+    const std::vector<MaterialHandle> handles = renderer->m_materials.LoadFromGltf(model);
+
+    std::function<void(SceneNode&)> assign = [&](SceneNode& node)
+    {
+        for (auto &primitive : node.mPrimitives)
+        {
+            const int idx = primitive.GetMaterialIdx();
+            primitive.SetMaterial((idx >= 0 && idx < (int)handles.size()) ? handles[idx] : kDefaultMaterial);
+        }
+        for (auto &child : node.mChildren)
+            assign(child);
+    };
+    for (auto &node : mRootNodes)
+        assign(node);
+}
+
+
+void SceneGraph::SetMaterial(MaterialHandle handle)
+{
+    std::function<void(SceneNode&)> assign = [&](SceneNode& node)
+    {
+        for (auto &primitive : node.mPrimitives)
+            primitive.SetMaterial(handle);
+        for (auto &child : node.mChildren)
+            assign(child);
+    };
+    for (auto &node : mRootNodes)
+        assign(node);
 }
 
 ScenePrimitive::ScenePrimitive()
@@ -692,9 +993,15 @@ ScenePrimitive::ScenePrimitive(const ScenePrimitive &src) :
     mIndices(src.mIndices),
     mTopology(src.mTopology),
     mIsTangentPresent(src.mIsTangentPresent),
+    mBoundsCenter(src.mBoundsCenter),
+    mBoundsRadius(src.mBoundsRadius),
+    mMorphTargets(src.mMorphTargets),
+    mMorphedVertices(src.mMorphedVertices),
     mVertexBuffer(src.mVertexBuffer),
     mIndexBuffer(src.mIndexBuffer),
-    mMaterialIdx(src.mMaterialIdx)
+    mMesh(src.mMesh),
+    mMaterialIdx(src.mMaterialIdx),
+    mMaterial(src.mMaterial)
 {
     // We are creating new references of device resources
     Utils::SafeAddRef(mVertexBuffer);
@@ -706,9 +1013,15 @@ ScenePrimitive::ScenePrimitive(ScenePrimitive &&src) :
     mIndices(std::move(src.mIndices)),
     mIsTangentPresent(Utils::Exchange(src.mIsTangentPresent, false)),
     mTopology(Utils::Exchange(src.mTopology, D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED)),
+    mBoundsCenter(src.mBoundsCenter),
+    mBoundsRadius(Utils::Exchange(src.mBoundsRadius, 0.0f)),
+    mMorphTargets(std::move(src.mMorphTargets)),
+    mMorphedVertices(std::move(src.mMorphedVertices)),
     mVertexBuffer(Utils::Exchange(src.mVertexBuffer, nullptr)),
     mIndexBuffer(Utils::Exchange(src.mIndexBuffer, nullptr)),
-    mMaterialIdx(Utils::Exchange(src.mMaterialIdx, -1))
+    mMesh(std::move(src.mMesh)),
+    mMaterialIdx(Utils::Exchange(src.mMaterialIdx, -1)),
+    mMaterial(Utils::Exchange(src.mMaterial, kDefaultMaterial))
 {}
 
 ScenePrimitive& ScenePrimitive::operator =(const ScenePrimitive &src)
@@ -717,14 +1030,20 @@ ScenePrimitive& ScenePrimitive::operator =(const ScenePrimitive &src)
     mIndices = src.mIndices;
     mIsTangentPresent = src.mIsTangentPresent;
     mTopology = src.mTopology;
+    mBoundsCenter = src.mBoundsCenter;
+    mBoundsRadius = src.mBoundsRadius;
+    mMorphTargets = src.mMorphTargets;
+    mMorphedVertices = src.mMorphedVertices;
     mVertexBuffer = src.mVertexBuffer;
     mIndexBuffer = src.mIndexBuffer;
+    mMesh = src.mMesh;
 
     // We are creating new references of device resources
     Utils::SafeAddRef(mVertexBuffer);
     Utils::SafeAddRef(mIndexBuffer);
 
     mMaterialIdx = src.mMaterialIdx;
+    mMaterial = src.mMaterial;
 
     return *this;
 }
@@ -735,10 +1054,16 @@ ScenePrimitive& ScenePrimitive::operator =(ScenePrimitive &&src)
     mIndices = std::move(src.mIndices);
     mIsTangentPresent = Utils::Exchange(src.mIsTangentPresent, false);
     mTopology = Utils::Exchange(src.mTopology, D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED);
+    mBoundsCenter = src.mBoundsCenter;
+    mBoundsRadius = Utils::Exchange(src.mBoundsRadius, 0.0f);
+    mMorphTargets = std::move(src.mMorphTargets);
+    mMorphedVertices = std::move(src.mMorphedVertices);
     mVertexBuffer = Utils::Exchange(src.mVertexBuffer, nullptr);
     mIndexBuffer = Utils::Exchange(src.mIndexBuffer, nullptr);
+    mMesh = std::move(src.mMesh);
 
     mMaterialIdx = Utils::Exchange(src.mMaterialIdx, -1);
+    mMaterial = Utils::Exchange(src.mMaterial, kDefaultMaterial);
 
     return *this;
 }
@@ -753,6 +1078,7 @@ bool ScenePrimitive::CreateQuad(IRenderingContext & ctx)
 {
     if (!GenerateQuadGeometry())
         return false;
+    ComputeBounds();
     if (!CreateDeviceBuffers(ctx))
         return false;
 
@@ -764,6 +1090,7 @@ bool ScenePrimitive::CreateCube(IRenderingContext & ctx)
 {
     if (!GenerateCubeGeometry())
         return false;
+    ComputeBounds();
     if (!CreateDeviceBuffers(ctx))
         return false;
 
@@ -775,6 +1102,7 @@ bool ScenePrimitive::CreateOctahedron(IRenderingContext & ctx)
 {
     if (!GenerateOctahedronGeometry())
         return false;
+    ComputeBounds();
     if (!CreateDeviceBuffers(ctx))
         return false;
 
@@ -788,6 +1116,7 @@ bool ScenePrimitive::CreateSphere(IRenderingContext & ctx,
 {
     if (!GenerateSphereGeometry(vertSegmCount, stripCount))
         return false;
+    ComputeBounds();
     if (!CreateDeviceBuffers(ctx))
         return false;
 
@@ -1030,6 +1359,7 @@ bool ScenePrimitive::LoadFromGLTF(IRenderingContext & ctx,
 {
     if (!LoadDataFromGLTF(model, mesh, primitiveIdx, logPrefix))
         return false;
+    ComputeBounds();
     if (!CreateDeviceBuffers(ctx))
         return false;
 
@@ -1037,6 +1367,15 @@ bool ScenePrimitive::LoadFromGLTF(IRenderingContext & ctx,
 }
 
 
+bool ScenePrimitive::LoadGeometryFromGLTF(const tinygltf::Model &model,
+                                          const tinygltf::Mesh &mesh,
+                                          const int primitiveIdx,
+                                          const std::wstring &logPrefix)
+{
+    return LoadDataFromGLTF(model, mesh, primitiveIdx, logPrefix);
+}
+
+
 bool ScenePrimitive::LoadDataFromGLTF(const tinygltf::Model &model,
                                       const tinygltf::Mesh &mesh,
                                       const int primitiveIdx,
@@ -1492,6 +1831,15 @@ bool ScenePrimitive::LoadDataFromGLTF(const tinygltf::Model &model,
 
     CalculateTangentsIfNeeded(subItemsLogPrefix);
 
+    // Morph targets
+    mMorphedVertices.clear();
+    if (!primitive.targets.empty())
+    {
+        if (!mMorphTargets.LoadFromGltf(model, primitive, mVertices.size(), subItemsLogPrefix))
+            return false;
+        mMorphedVertices = mVertices;
+    }
+
     return true;
 }
 
@@ -1752,6 +2100,35 @@ void ScenePrimitive::SetTangent(const float intangent[],
 }
 
 
+void ScenePrimitive::ComputeBounds()
+{
+    if (mVertices.empty())
+    {
+        mBoundsCenter = XMFLOAT3(0.0f, 0.0f, 0.0f);
+        mBoundsRadius = 0.0f;
+        return;
+    }
+
+    // Around the centre of the box, which is close enough to the smallest sphere for estimates
+    XMVECTOR minPos = XMLoadFloat3(&mVertices[0].Pos);
+    XMVECTOR maxPos = minPos;
+    for (const auto &vertex : mVertices)
+    {
+        const XMVECTOR pos = XMLoadFloat3(&vertex.Pos);
+        minPos = XMVectorMin(minPos, pos);
+        maxPos = XMVectorMax(maxPos, pos);
+    }
+    const XMVECTOR center = XMVectorScale(XMVectorAdd(minPos, maxPos), 0.5f);
+
+    XMVECTOR radiusSq = XMVectorZero();
+    for (const auto &vertex : mVertices)
+        radiusSq = XMVectorMax(radiusSq, XMVector3LengthSq(XMVectorSubtract(XMLoadFloat3(&vertex.Pos), center)));
+
+    XMStoreFloat3(&mBoundsCenter, center);
+    mBoundsRadius = sqrtf(XMVectorGetX(radiusSq));
+}
+
+
 bool ScenePrimitive::CreateDeviceBuffers(IRenderingContext & ctx)
 {
     DestroyDeviceBuffers();
@@ -1760,6 +2137,22 @@ bool ScenePrimitive::CreateDeviceBuffers(IRenderingContext & ctx)
     if (!device)
         return false;
 
+    // Geometry that is never updated is shared with any other primitive uploading the same
+    DX11Renderer* renderer = ctx.getDXRenderer();
+    if (renderer != nullptr && !HasMorphTargets())
+    {
+        mMesh = renderer->m_assets.AcquireMesh(mVertices.data(), (UINT)(sizeof(SceneVertex) * mVertices.size()),
+                                               mIndices.data(), (UINT)(sizeof(uint32_t) * mIndices.size()));
+        if (!mMesh)
+            return false;
+
+        mVertexBuffer = mMesh->vertices->buffer.Get();
+        mIndexBuffer = mMesh->indices->buffer.Get();
+        Utils::SafeAddRef(mVertexBuffer);
+        Utils::SafeAddRef(mIndexBuffer);
+        return true;
+    }
+
     HRESULT hr = S_OK;
 
     D3D11_BUFFER_DESC bd;
@@ -1813,6 +2206,8 @@ void ScenePrimitive::DestroyGeomData()
 {
     mVertices.clear();
     mIndices.clear();
+    mMorphTargets = MorphTargets();
+    mMorphedVertices.clear();
     mTopology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
 }
 
@@ -1821,6 +2216,26 @@ void ScenePrimitive::DestroyDeviceBuffers()
 {
     Utils::ReleaseAndMakeNull(mVertexBuffer);
     Utils::ReleaseAndMakeNull(mIndexBuffer);
+    mMesh.reset();
+}
+
+
+void ScenePrimitive::ApplyMorphWeights(IRenderingContext &ctx, const float *weights, size_t count)
+{
+    if (mMorphTargets.IsEmpty() || !mVertexBuffer)
+        return;
+
+    const MorphTargets::Range range = mMorphTargets.Apply(mVertices.data(), weights, count, mMorphedVertices.data());
+    if (range.IsEmpty())
+        return;
+
+    // Only the span of vertices that moved (or moved back) goes to the GPU
+    D3D11_BOX box = {};
+    box.left = range.first * (UINT)sizeof(SceneVertex);
+    box.right = range.end * (UINT)sizeof(SceneVertex);
+    box.bottom = 1;
+    box.back = 1;
+    ctx.GetImmediateContext()->UpdateSubresource(mVertexBuffer, 0, &box, &mMorphedVertices[range.first], 0, 0);
 }
 
 
@@ -1828,12 +2243,22 @@ void ScenePrimitive::DrawGeometry(IRenderingContext &ctx, ID3D11InputLayout* ver
 {
     auto immCtx = ctx.GetImmediateContext();
 
-    immCtx->IASetInputLayout(vertexLayout);
     UINT stride = sizeof(SceneVertex);
     UINT offset = 0;
-    immCtx->IASetVertexBuffers(0, 1, &mVertexBuffer, &stride, &offset);
-    immCtx->IASetIndexBuffer(mIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
-    immCtx->IASetPrimitiveTopology(mTopology);
+    if (auto tracker = ctx.GetStateTracker())
+    {
+        tracker->IASetInputLayout(vertexLayout);
+        tracker->IASetVertexBuffer(mVertexBuffer, stride, offset);
+        tracker->IASetIndexBuffer(mIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+        tracker->IASetPrimitiveTopology(mTopology);
+    }
+    else
+    {
+        immCtx->IASetInputLayout(vertexLayout);
+        immCtx->IASetVertexBuffers(0, 1, &mVertexBuffer, &stride, &offset);
+        immCtx->IASetIndexBuffer(mIndexBuffer, DXGI_FORMAT_R32_UINT, 0);
+        immCtx->IASetPrimitiveTopology(mTopology);
+    }
 
     immCtx->DrawIndexed((UINT)mIndices.size(), 0, 0);
 }
@@ -1842,7 +2267,9 @@ void ScenePrimitive::DrawGeometry(IRenderingContext &ctx, ID3D11InputLayout* ver
 SceneNode::SceneNode(bool isRootNode) :
     mIsRootNode(isRootNode),
     mLocalMtrx(XMMatrixIdentity()),
-    mWorldMtrx(XMMatrixIdentity())
+    mWorldMtrx(XMMatrixIdentity()),
+    mGlobalMtrx(XMMatrixIdentity()),
+    mTransformDirty(true)
 {}
 
 ScenePrimitive* SceneNode::CreateEmptyPrimitive()
@@ -1858,6 +2285,7 @@ ScenePrimitive* SceneNode::CreateEmptyPrimitive()
 void SceneNode::SetIdentity()
 {
     mLocalMtrx = XMMatrixIdentity();
+    mTransformDirty = true;
 }
 
 void SceneNode::AddScale(double scale)
@@ -1878,16 +2306,19 @@ void SceneNode::AddScale(const std::vector<double> &vec)
     const auto mtrx = XMMatrixScaling((float)vec[0], (float)vec[1], (float)vec[2]);
 
     mLocalMtrx = mLocalMtrx * mtrx;
+    mTransformDirty = true;
 }
 
 void SceneNode::AddMatrix(const XMMATRIX& matrix)
 {
     mLocalMtrx = mLocalMtrx * matrix;
+    mTransformDirty = true;
 }
 
 void SceneNode::SetMatrix(const XMMATRIX& matrix)
 {
     mLocalMtrx = matrix;
+    mTransformDirty = true;
 }
 
 
@@ -1907,6 +2338,7 @@ void SceneNode::AddRotationQuaternion(const std::vector<double> &vec)
     const auto mtrx = XMMatrixRotationQuaternion(xmQuaternion);
 
     mLocalMtrx = mLocalMtrx * mtrx;
+    mTransformDirty = true;
 }
 
 void SceneNode::AddTranslation(const std::vector<double> &vec)
@@ -1922,6 +2354,7 @@ void SceneNode::AddTranslation(const std::vector<double> &vec)
     const auto mtrx = XMMatrixTranslation((float)vec[0], (float)vec[1], (float)vec[2]);
 
     mLocalMtrx = mLocalMtrx * mtrx;
+    mTransformDirty = true;
 }
 
 void SceneNode::AddMatrix(const std::vector<double> &vec)
@@ -1941,6 +2374,7 @@ void SceneNode::AddMatrix(const std::vector<double> &vec)
         (float)vec[12], (float)vec[13], (float)vec[14], (float)vec[15]);
 
     mLocalMtrx = mLocalMtrx * mtrx;
+    mTransformDirty = true;
 }
 
 bool SceneNode::LoadSphere(IRenderingContext& ctx)
@@ -2047,7 +2481,21 @@ bool SceneNode::LoadFromGLTF(IRenderingContext & ctx,
                 return false;
             mPrimitives.push_back(std::move(primitive));
         }
+
+        // Default morph weights, the node's overriding the mesh's
+        size_t targetCount = 0;
+        for (const auto &primitive : mPrimitives)
+            targetCount = std::max(targetCount, primitive.mMorphTargets.GetTargetCount());
+        mMorphWeights.clear();
+        if (targetCount > 0)
+        {
+            const std::vector<double> &defaults = !node.weights.empty() ? node.weights : mesh.weights;
+            mMorphWeights.assign(targetCount, 0.0f);
+            for (size_t i = 0; i < std::min(targetCount, defaults.size()); ++i)
+                mMorphWeights[i] = (float)defaults[i];
+        }
     }
+    mGltfNodeIdx = nodeIdx;
 
     return true;
 }
@@ -2069,8 +2517,20 @@ void SceneNode::Animate(IRenderingContext &ctx)
     //else
    //     mWorldMtrx = mLocalMtrx;
 
-    mWorldMtrx = mLocalMtrx;
+    UpdateTransforms(XMMatrixIdentity(), false);
+}
+
+
+void SceneNode::UpdateTransforms(const XMMATRIX &parentGlobalMtrx, bool parentChanged)
+{
+    const bool changed = parentChanged || mTransformDirty;
+    if (changed)
+    {
+        mWorldMtrx = mLocalMtrx;
+        mGlobalMtrx = mWorldMtrx * parentGlobalMtrx;
+        mTransformDirty = false;
+    }
 
     for (auto &child : mChildren)
-        child.Animate(ctx);
+        child.UpdateTransforms(mGlobalMtrx, changed);
 }
@@ -20,6 +20,11 @@
 
 #include <DirectXMath.h>
 #include "Skeleton.h"
+#include "Material.h"
+#include "AnimationScheduler.h"
+#include "MorphTargets.h"
+#include "NodeAnimator.h"
+#include "structures.h"
 
 using namespace DirectX;
 
@@ -71,6 +76,12 @@ public:
                       const int primitiveIdx,
                       const std::wstring &logPrefix);
 
+    // CPU side geometry only, without device buffers
+    bool LoadGeometryFromGLTF(const tinygltf::Model &model,
+                              const tinygltf::Mesh &mesh,
+                              const int primitiveIdx,
+                              const std::wstring &logPrefix);
+
     // Uses mikktspace tangent space calculator by Morten S. Mikkelsen.
     // Requires position, normal, and texture coordinates to be already loaded.
     bool CalculateTangentsIfNeeded(const std::wstring &logPrefix = std::wstring());
@@ -92,6 +103,14 @@ public:
     void SetMaterialIdx(int idx) { mMaterialIdx = idx; };
     int GetMaterialIdx() const { return mMaterialIdx; };
 
+    void SetMaterial(MaterialHandle handle) { mMaterial = handle; };
+    MaterialHandle GetMaterial() const { return mMaterial; };
+
+    // Morphs the vertices by the weights of the primitive's morph targets and uploads the span that
+    // changed. Does nothing for primitives without targets or when the weights have not changed.
+    void ApplyMorphWeights(IRenderingContext &ctx, const float *weights, size_t count);
+    bool HasMorphTargets() const { return !mMorphTargets.IsEmpty(); }
+
     void Destroy();
 
 private:
@@ -107,6 +126,7 @@ private:
                               const std::wstring &logPrefix);
 
     void FillFaceStripsCacheIfNeeded() const;
+    void ComputeBounds();
     bool CreateDeviceBuffers(IRenderingContext &ctx);
 
     void DestroyGeomData();
@@ -120,6 +140,14 @@ public:
     D3D11_PRIMITIVE_TOPOLOGY    mTopology = D3D_PRIMITIVE_TOPOLOGY_UNDEFINED;
     bool                        mIsTangentPresent = false;
 
+    // Bounding sphere of mVertices (of the bind pose for skinned primitives)
+    XMFLOAT3                    mBoundsCenter = XMFLOAT3(0.0f, 0.0f, 0.0f);
+    float                       mBoundsRadius = 0.0f;
+
+    // Morph targets, and the morphed copy of mVertices the vertex buffer holds when there are any
+    MorphTargets                mMorphTargets;
+    std::vector<SceneVertex>    mMorphedVertices;
+
     // Cached geometry data
     struct FaceStrip
     {
@@ -130,12 +158,15 @@ public:
     mutable std::vector<FaceStrip>  mFaceStrips;
     mutable size_t                  mFaceStripsTotalCount = 0;
 
-    // Device geometry data
+    // Device geometry data. Unless the vertices are morphed the buffers belong to mMesh, shared with
+    // every primitive of the same geometry (see AssetRegistry).
     ID3D11Buffer*               mVertexBuffer = nullptr;
     ID3D11Buffer*               mIndexBuffer = nullptr;
+    AssetRegistry::MeshRef      mMesh;
 
     // Material
-    int                         mMaterialIdx = -1;
+    int                         mMaterialIdx = -1;  // glTF material index
+    MaterialHandle              mMaterial = kDefaultMaterial;
 };
 
 
@@ -166,8 +197,14 @@ public:
 
     void Animate(IRenderingContext &ctx);
 
+    // Recomputes the global transforms of the subtrees below nodes whose local transform changed since
+    // the last call, and leaves the rest alone
+    void UpdateTransforms(const XMMATRIX &parentGlobalMtrx, bool parentChanged);
+
     XMMATRIX GetWorldMtrx() const { return mWorldMtrx; }
-	void SetWorldMtrx(const XMMATRIX& mtrx) { mWorldMtrx = mtrx; }
+	void SetWorldMtrx(const XMMATRIX& mtrx) { mLocalMtrx = mWorldMtrx = mtrx; mTransformDirty = true; }
+    // Node to scene root, as of the last UpdateTransforms()
+    XMMATRIX GetGlobalMtrx() const { return mGlobalMtrx; }
     Skeleton* GetSkeleton() {
         return &m_skeleton;
     }
@@ -179,10 +216,16 @@ private:
     std::vector<SceneNode>      mChildren;
     Skeleton                    m_skeleton;
 
+    // Morph target weights of the node's mesh: the node's or mesh's defaults until an animation sets them
+    std::vector<float>          mMorphWeights;
+    int                         mGltfNodeIdx = -1;
+
 private:
     bool        mIsRootNode;
     XMMATRIX    mLocalMtrx;
     XMMATRIX    mWorldMtrx;
+    XMMATRIX    mGlobalMtrx;
+    bool        mTransformDirty;
 };
 
 class SceneGraph : public IScene
@@ -220,7 +263,26 @@ public:
     void AddMatrixToRoots(const XMMATRIX& mat);
 
 
-    void AnimateFrame(IRenderingContext& ctx);
+    // Plays the node animations of the file (following the clip and time of its skeleton, if it has
+    // one, otherwise advancing by deltaTime) and updates the global transforms of the nodes that moved
+    void AnimateFrame(IRenderingContext& ctx, float deltaTime = 0.0f);
+
+    // Draws the scene count times on a square grid, spacing apart, instead of once. Every copy
+    // animates its own copy of the skeletons from a different start time; the clips are shared.
+    // Morph targets are not per copy: all of them take the first copy's weights.
+    void SetInstanceGrid(unsigned int count, float spacing);
+    size_t GetInstanceCount() const { return mInstances.size(); }
+
+    // Bakes the clips of every skeleton into palettes (see Skeleton::BakeAnimations), 0 to play them
+    // live again. Call before SetInstanceGrid(), whose copies then share the baked clips.
+    void BakeAnimations(float framesPerSecond);
+
+    // Queues every skeleton of the scene (or of its instances) for this frame's animation update.
+    // Call after AnimateFrame and before RenderFrame.
+    void GatherAnimated(AnimationScheduler& scheduler);
+
+    // Overrides the material of every primitive (e.g. to preview the editable default material)
+    void SetMaterial(MaterialHandle handle);
 
 	XMMATRIX GetMatrixOfRoot() const;
     std::vector<SceneNode>      mRootNodes;
@@ -251,6 +313,7 @@ private:
 
     bool LoadSceneFromGltfWithSkeleton(IRenderingContext &ctx,
                            const tinygltf::Model &model,
+                           const std::wstring &filePath,
                            const std::wstring &logPrefix);
 
     bool LoadSceneNodeFromGLTF(IRenderingContext &ctx,
@@ -260,10 +323,33 @@ private:
                                const std::wstring &logPrefix);
 
 
-    void RenderNode(IRenderingContext &ctx,
-                    SceneNode &node,
-                    const XMMATRIX &parentWorldMtrx,
-                    const float deltaTime);
+    // Points the node animator at the scene nodes built from the model's nodes
+    void BindNodeAnimations(const tinygltf::Model &model);
+
+    // Maps the glTF material indices of all primitives to handles of materials built from the model
+    void AssignMaterials(IRenderingContext &ctx, const tinygltf::Model &model);
+
+    // Walks the hierarchy and appends the node's primitives to the draw list, placed by their global
+    // transforms and instanceWorldMtrx. Primitives below a node with a loaded skeleton are skinned by
+    // it, or by instanceSkeleton when drawing an instance. Their materials' streamed textures are asked
+    // for the detail their size on screen needs.
+    void CollectNode(IRenderingContext &ctx,
+                     SceneNode &node,
+                     const XMMATRIX &instanceWorldMtrx,
+                     const Skeleton *skeleton,
+                     const Skeleton *instanceSkeleton = nullptr);
+
+    // Sets the morph weights of every node with morph targets from its skeleton's animation and morphs
+    // its primitives. The morphed vertices live in the primitives, which instances share, so with
+    // instances every copy shows the first instance's weights (SetInstanceGrid() warns about it).
+    void UpdateMorphTargets(IRenderingContext &ctx);
+
+    // Writes one palette per distinct skeleton pose of the draw list into the renderer's palette ring
+    // and points the per-draw constants of the skinned nodes at them
+    void WritePalettes(IRenderingContext &ctx, RenderStateTracker &tracker);
+
+    // Requests the levels of the primitive's streamed textures its bounds cover on screen
+    void RequestTextureDetail(IRenderingContext &ctx, const ScenePrimitive &primitive, const XMMATRIX &world);
 
     
 
@@ -273,6 +359,39 @@ private:
     
     SceneId               mSceneId;
 
+    // Copies of the scene drawn by SetInstanceGrid(), with one skeleton per root node
+    struct Instance
+    {
+        XMFLOAT4X4              world;
+        std::vector<Skeleton>   skeletons;
+    };
+    std::vector<Instance>       mInstances;
+
+    // Animation of the nodes that are not joints
+    NodeAnimator                mNodeAnimator;
+    float                       mNodeAnimationTime = 0.0f;
+
+    // Draw list rebuilt every frame and sorted by texture set and material, so textures and materials
+    // are bound once per run
+    struct DrawItem
+    {
+        const ScenePrimitive*   primitive;
+        MaterialHandle          material;
+        uint32_t                textureSet;     // see MaterialLibrary::GetTextureSet()
+        uint32_t                transformIdx;
+    };
+    std::vector<DrawItem>       mDrawList;
+    std::vector<CbPerDraw>      mDrawTransforms;
+    std::vector<const Skeleton*> mDrawSkeletons;    // per transform, null for unskinned nodes
+
+    // Skinned transforms sorted by palette key, see WritePalettes()
+    struct PaletteRef
+    {
+        Skeleton::PaletteKey    key;
+        uint32_t                transformIdx;
+    };
+    std::vector<PaletteRef>     mPaletteRefs;
+
     // Geometry
 
     // Shaders
@@ -282,7 +401,4 @@ private:
     ID3D11Buffer*               mCbScene = nullptr;
     ID3D11Buffer*               mCbFrame = nullptr;
     ID3D11Buffer*               mCbSceneNode = nullptr;
-    ID3D11Buffer*               mCbScenePrimitive = nullptr;
-
-    ID3D11SamplerState*         mSamplerLinear = nullptr;
 };
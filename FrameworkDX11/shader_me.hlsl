@@ -1,17 +1,28 @@
 //--------------------------------------------------------------------------------------
-// Constant Buffer Variables
+// Constant Buffer Variables - split by update frequency (see structures.h)
 //--------------------------------------------------------------------------------------
-cbuffer ConstantBuffer : register(b0)
+cbuffer PerDraw : register(b0)
 {
     matrix World; // World transformation matrix (object to world space)
+}
+
+cbuffer PerView : register(b3)
+{
     matrix View; // Camera view matrix (world to view space)
     matrix Projection; // Camera projection matrix (view to clip space)
-    float4 vOutputColor; // Color to be used as output color (e.g., for solid color rendering)
+    float4 EyePosition; // Camera position (for lighting calculations)
+    float IBLType; // Ambient / IBL mode, a scene setting rather than a material one
+}
+
+cbuffer PerMaterial : register(b4)
+{
     float4 frank;
-    float metal = 0;
-    float rough = 0;
-    float type = 2;
-    float textureSelect = 1;
+    float metal;
+    float rough;
+    float textureSelect;
+    float albedoGrey; // 1 when the albedo map holds grey in R only
+    float4 textureRects[3]; // packed maps: UV scale in xy and offset in zw of albedo, metal and roughness
+    float4 textureSlices; // packed maps: their array slices in xyz, 1 in w when the maps are packed
 }
 
 cbuffer ConstantBuffer : register(b2)
@@ -24,14 +35,15 @@ Texture2D MetallicMap : register(t1); // Normal map for lighting effects
 Texture2D RoughnessMap : register(t2); // Roughness map (PBR)
 TextureCube iblSpecular : register(t3);
 TextureCube iblIrradiance : register(t4);
+// The same maps packed into arrays shared across materials (see TexturePacker)
+Texture2DArray packedAlbedoMap : register(t9);
+Texture2DArray packedMetallicMap : register(t10);
+Texture2DArray packedRoughnessMap : register(t11);
 
 SamplerState samLinear : register(s0); // Texture sampler for linear filtering
 
 static const float PI = 3.14159265f; // Value of PI (used for angle calculations)
 
-// Maximum number of lights supported
-#define MAX_LIGHTS 10
-
 // Light types (for future expansion to support more light types)
 #define DIRECTIONAL_LIGHT 
 #define POINT_LIGHT 1
@@ -39,28 +51,33 @@ static const float PI = 3.14159265f; // Value of PI (used for angle calculations
 
 static const float maxReflectionLod = 10;
 
-// Struct to represent light properties
-struct Light
+// Clustered lights (see ClusteredLighting.h) - only the lights touching a pixel's cluster are shaded
+struct ClusterLight
 {
-    float4 Position; // Light position (used for point and spot lights)
-    float4 Direction; // Light direction (used for directional lights)
+    float4 PositionRadius; // World space position, bounding radius in w
     float4 Color; // Light color (RGBA)
-    float SpotAngle; // Spot light angle
-    float ConstantAttenuation; // Constant attenuation factor (for point lights)
-    float LinearAttenuation; // Linear attenuation factor (for point lights)
-    float QuadraticAttenuation; // Quadratic attenuation factor (for point lights)
-    int LightType; // Light type (e.g., directional, point, spot)
-    bool Enabled; // Flag to enable/disable the light
-    int2 Padding; // Padding to align struct size to 16 bytes
-}; // Total size: 80 bytes
-
-// Constant buffer for light properties
-cbuffer LightProperties : register(b1)
+    float4 Attenuation; // Constant, linear, quadratic
+};
+
+cbuffer ClusterParams : register(b6)
 {
-    float4 EyePosition; // Camera position (for lighting calculations)
-    float4 GlobalAmbient; // Global ambient light color
-    Light Lights[MAX_LIGHTS]; // Array of light sources (with max count defined by MAX_LIGHTS)
-}; 
+    uint4 ClusterGrid; // Clusters in x, y, z and the light count in w
+    float4 ClusterZParams; // Slice scale, slice bias, near, far
+    float4 ClusterTileSize; // Pixels per cluster in x and y
+};
+
+StructuredBuffer<ClusterLight> ClusterLights : register(t5);
+StructuredBuffer<uint2> ClusterRanges : register(t6); // Offset and count into ClusterLightIndices
+StructuredBuffer<uint> ClusterLightIndices : register(t7);
+
+uint ClusterIndex(float2 pixel, float viewDepth)
+{
+    uint x = min((uint) (pixel.x / ClusterTileSize.x), ClusterGrid.x - 1);
+    uint y = min((uint) (pixel.y / ClusterTileSize.y), ClusterGrid.y - 1);
+    int slice = (int) floor(log(max(viewDepth, ClusterZParams.z)) * ClusterZParams.x + ClusterZParams.y);
+    uint z = (uint) clamp(slice, 0, (int) ClusterGrid.z - 1);
+    return (z * ClusterGrid.y + y) * ClusterGrid.x + x;
+}
 
 //--------------------------------------------------------------------------------------
 // Vertex Shader Input and Output Structures
@@ -81,6 +98,7 @@ struct PS_INPUT
     float4 worldPos : POSITION; // World-space position (used for lighting)
     float3 Norm : NORMAL; // Normal vector (in world space)
     float2 Tex : TEXCOORD0; // Texture coordinates
+    float viewDepth : TEXCOORD1; // View space depth (for the cluster lookup)
 };
 
 PS_INPUT VS(VS_INPUT input)
@@ -91,6 +109,7 @@ PS_INPUT VS(VS_INPUT input)
     output.Pos = mul(input.Pos, World);
     output.worldPos = output.Pos;
     output.Pos = mul(output.Pos, View);
+    output.viewDepth = output.Pos.z;
     output.Pos = mul(output.Pos, Projection);
 
     // Transform the normal vector from object space to world space
@@ -144,6 +163,14 @@ float2 IntergrateBRDF(float NdotV, float roughness)
     return float2(-1.04, 1.04) * a004 + r.zw;
 }
 
+// A packed map: frac() repeats the texture inside its atlas region, and the gradients are taken from
+// the unwrapped UVs so the seams pick the same mip as the texels around them
+float4 SamplePacked(Texture2DArray map, float4 rect, float slice, float2 uv)
+{
+    float2 packedUv = rect.zw + frac(uv) * rect.xy;
+    return map.SampleGrad(samLinear, float3(packedUv, slice), ddx(uv) * rect.xy, ddy(uv) * rect.xy);
+}
+
 float4 PS_PBR(PS_INPUT IN) : SV_TARGET
 {
     float3 finalColour = float3(0, 0, 0);
@@ -154,9 +181,25 @@ float4 PS_PBR(PS_INPUT IN) : SV_TARGET
     
     if (textureSelect == 1)
     {
-        albedo = albedoMap.Sample(samLinear, IN.Tex).xyz;
-        metallic = MetallicMap.Sample(samLinear, IN.Tex).r;
-        roughness = RoughnessMap.Sample(samLinear, IN.Tex).r;
+        // The material factors scale the maps, as glTF defines them
+        float3 albedoSample;
+        float metallicSample;
+        float roughnessSample;
+        if (textureSlices.w == 1)
+        {
+            albedoSample = SamplePacked(packedAlbedoMap, textureRects[0], textureSlices.x, IN.Tex).xyz;
+            metallicSample = SamplePacked(packedMetallicMap, textureRects[1], textureSlices.y, IN.Tex).r;
+            roughnessSample = SamplePacked(packedRoughnessMap, textureRects[2], textureSlices.z, IN.Tex).r;
+        }
+        else
+        {
+            albedoSample = albedoMap.Sample(samLinear, IN.Tex).xyz;
+            metallicSample = MetallicMap.Sample(samLinear, IN.Tex).r;
+            roughnessSample = RoughnessMap.Sample(samLinear, IN.Tex).r;
+        }
+        albedo *= albedoGrey == 1 ? albedoSample.xxx : albedoSample;
+        metallic *= metallicSample;
+        roughness *= roughnessSample;
     }
     
     float3 N = normalize(IN.Norm);
@@ -167,12 +210,11 @@ float4 PS_PBR(PS_INPUT IN) : SV_TARGET
     float3 F = FresnelSchlick(cosTheta, F0);
     
     float3 color = float3(0, 0, 0);
-    [unroll]
-    for (int i = 0; i < MAX_LIGHTS; ++i)
+    uint2 clusterRange = ClusterRanges[ClusterIndex(IN.Pos.xy, IN.viewDepth)];
+    for (uint i = 0; i < clusterRange.y; ++i)
     {
-        if (!Lights[i].Enabled)
-            continue;
-        float3 L = normalize(Lights[i].Position - IN.worldPos).xyz;
+        ClusterLight light = ClusterLights[ClusterLightIndices[clusterRange.x + i]];
+        float3 L = normalize(light.PositionRadius.xyz - IN.worldPos.xyz);
         float3 H = normalize(V + L);
     
         float NdotL = max(dot(N, L), 0.0);
@@ -186,17 +228,17 @@ float4 PS_PBR(PS_INPUT IN) : SV_TARGET
     
         float3 Lo = (Diffuse + BRDF) * NdotL;
         
-        float3 L2 = Lights[i].Position.xyz - IN.worldPos.xyz;
+        float3 L2 = light.PositionRadius.xyz - IN.worldPos.xyz;
         float distance = length(L2);
-        float attenuation = 1.0 / (Lights[i].ConstantAttenuation + Lights[i].LinearAttenuation * distance + Lights[i].QuadraticAttenuation * (distance * distance));
-        Lo = Lo * (Lights[i].Color.xyz * attenuation);
+        float attenuation = 1.0 / (light.Attenuation.x + light.Attenuation.y * distance + light.Attenuation.z * (distance * distance));
+        Lo = Lo * (light.Color.xyz * attenuation);
         
         color = color + Lo;
     }
     
     
     float3 finalIBL = float3(0, 0, 0);
-    int typeIBL = type;
+    int typeIBL = IBLType;
 
     if (typeIBL == 0)
     {
@@ -1,16 +1,35 @@
 //--------------------------------------------------------------------------------------
-// Constant Buffer Variables
+// Constant Buffer Variables - same slots as shader_me.hlsl (see structures.h)
 //--------------------------------------------------------------------------------------
-cbuffer ConstantBuffer : register( b0 )
+cbuffer PerDraw : register( b0 )
 {
 	matrix World;
+	uint PaletteOffset;		// first joint of the draw's palette in g_palette
+	uint JointCount;		// 0 for unskinned draws
+}
+
+cbuffer SolidColour : register( b2 )
+{
+	float4 vOutputColor;
+}
+
+cbuffer PerView : register( b3 )
+{
 	matrix View;
 	matrix Projection;
-	float4 vOutputColor;
-    float4x4 g_boneTransforms[100]; // Must match max_bones on CPU
-    unsigned int bone_count;
+	float4 EyePosition;
 }
 
+// Skinning palettes of all draws this frame (see PaletteRing.h). Each joint is the transposed skinning
+// matrix without its constant last row.
+struct JointMatrix
+{
+    float4 row0;
+    float4 row1;
+    float4 row2;
+};
+StructuredBuffer<JointMatrix> g_palette : register(t8);
+
 Texture2D albedoMap : register(t0);
 Texture2D normalMap : register(t1);
 Texture2D metallicMap : register(t2);
@@ -23,33 +42,15 @@ static const float PI = 3.14159265f;
 
 SamplerState samLinear : register(s0);
 
+// Set per permutation by the shader cache (see DX11Renderer::initShaders)
+#ifndef MAX_LIGHTS
 #define MAX_LIGHTS 1
+#endif
 // Light types.
 #define DIRECTIONAL_LIGHT 0
 #define POINT_LIGHT 1
 #define SPOT_LIGHT 2
 
-struct _Material
-{
-	float4  Emissive;       // 16 bytes
-							//----------------------------------- (16 byte boundary)
-	float4  Ambient;        // 16 bytes
-							//------------------------------------(16 byte boundary)
-	float4  Diffuse;        // 16 bytes
-							//----------------------------------- (16 byte boundary)
-	float4  Specular;       // 16 bytes
-							//----------------------------------- (16 byte boundary)
-	float   SpecularPower;  // 4 bytes
-	bool    UseTexture;     // 4 bytes
-	float2  Padding;        // 8 bytes
-							//----------------------------------- (16 byte boundary)
-};  // Total:               // 80 bytes ( 5 * 16 )
-
-cbuffer MaterialProperties : register(b1)
-{
-	_Material Material;
-};
-
 struct Light
 {
 	float4      Position;               // 16 bytes
@@ -69,10 +70,8 @@ struct Light
 										//----------------------------------- (16 byte boundary)
 };  // Total:                           // 80 bytes (5 * 16)
 
-cbuffer LightProperties : register(b2)
+cbuffer LightProperties : register(b1)
 {
-	float4 EyePosition;                 // 16 bytes
-										//----------------------------------- (16 byte boundary)
 	float4 GlobalAmbient;               // 16 bytes
 										//----------------------------------- (16 byte boundary)
 	Light Lights[MAX_LIGHTS];           // 80 * 8 = 640 bytes
@@ -173,12 +172,32 @@ PS_INPUT VS( VS_INPUT input )
 {
     PS_INPUT output = (PS_INPUT) 0;
 	
-	output.Pos = mul(input.Pos, World);
+    // Blend the bind pose position / normal by the joint palette. Vertices without weights (and
+    // draws without a skeleton) are left as they are.
+    float4 pos = input.Pos;
+    float3 norm = input.Norm;
+    float weightSum = dot(input.Weights, float4(1, 1, 1, 1));
+    if (JointCount > 0 && weightSum > 0)
+    {
+        float4 row0 = 0, row1 = 0, row2 = 0;
+        [unroll]
+        for (int i = 0; i < 4; ++i)
+        {
+            JointMatrix joint = g_palette[PaletteOffset + min(input.Joints[i], JointCount - 1)];
+            row0 += joint.row0 * input.Weights[i];
+            row1 += joint.row1 * input.Weights[i];
+            row2 += joint.row2 * input.Weights[i];
+        }
+        pos = float4(dot(row0, input.Pos), dot(row1, input.Pos), dot(row2, input.Pos), input.Pos.w);
+        norm = float3(dot(row0.xyz, input.Norm), dot(row1.xyz, input.Norm), dot(row2.xyz, input.Norm));
+    }
+
+	output.Pos = mul(pos, World);
     output.worldPos = output.Pos;
     output.Pos = mul(output.Pos, View);
     output.Pos = mul(output.Pos, Projection);
 
-    output.Norm = mul(input.Norm, (float3x3) World);
+    output.Norm = mul(norm, (float3x3) World);
     output.Norm = normalize(output.Norm);
 
     output.Tex = input.Tex;
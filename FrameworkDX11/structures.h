@@ -20,17 +20,49 @@ using namespace DirectX;
 //	unsigned int bone_count;
 //};
 
-struct ConstantBufferSwitch
+// Constant buffers are split by update frequency (see ConstantBuffers.h)
+//  b0 - CbPerDraw      : per draw, written into the constant buffer ring
+//  b1 - LightPropertiesConstantBuffer : first MAX_LIGHTS lights, for the skinned shader
+//  b2 - ConstantBufferlight : solid colour shader
+//  b3 - CbPerView      : per camera
+//  b4 - CbPerMaterial  : per material
+//  b6 - CbClusterParams: clustered lighting grid (see ClusteredLighting.h)
+// Skinning palettes are not constants but 3x4 matrices in the palette ring, vertex shader t8
+// (see PaletteRing.h), found through CbPerDraw.
+
+struct CbPerDraw
 {
 	XMMATRIX mWorld;
+	UINT	 paletteOffset;	// first matrix of the node's palette in the palette ring
+	UINT	 jointCount;	// 0 for unskinned nodes
+	XMUINT2	 padding;
+};
+
+struct CbPerView
+{
 	XMMATRIX mView;
 	XMMATRIX mProjection;
-	XMFLOAT4 vOutputColor;
-	XMFLOAT4 frank;
+	XMFLOAT4 EyePosition;
+	float	 IBLType;	// 0 - flat ambient, 1 - hemisphere, 2 - image based
+	XMFLOAT3 padding;
+};
+
+struct CbPerMaterial
+{
+	XMFLOAT4 albedo;
 	float metal;
 	float rough;
-	float type;
 	float textureSelect;
+	float albedoGrey;	// 1 when the albedo map is grey (R only)
+	XMFLOAT4 textureRects[3];	// packed maps: UV scale in xy and offset in zw of albedo, metal and roughness
+	XMFLOAT4 textureSlices;		// packed maps: their array slices in xyz, 1 in w when the maps are packed
+};
+
+struct CbClusterParams
+{
+	XMUINT4  GridSize;	// clusters in x, y, z and the total light count in w
+	XMFLOAT4 ZParams;	// x = slice scale, y = slice bias, z = near, w = far
+	XMFLOAT4 TileSize;	// pixels per cluster in x and y
 };
 
 struct ConstantBufferlight
@@ -83,14 +115,11 @@ struct Light
 struct LightPropertiesConstantBuffer
 {
 	LightPropertiesConstantBuffer()
-		: EyePosition(0, 0, 0, 1)
-		, GlobalAmbient(0.2f, 0.2f, 0.2f, 1.0f)
+		: GlobalAmbient(0.2f, 0.2f, 0.2f, 1.0f)
 	{}
 
-	DirectX::XMFLOAT4   EyePosition;
-	//----------------------------------- (16 byte boundary)
 	DirectX::XMFLOAT4   GlobalAmbient;
 	//----------------------------------- (16 byte boundary)
-	Light               Lights[MAX_LIGHTS]; // 80 * 8 bytes
-};  // Total:                                  672 bytes (42 * 16)
+	Light               Lights[MAX_LIGHTS]; // 80 * 10 bytes
+};  // Total:                                  816 bytes (51 * 16)
 
@@ -5,6 +5,7 @@
 #include <codecvt>
 
 #include <cmath>
+#include <cstring>
 
 
 std::wstring Utils::GetFilePathExt(const std::wstring &path)
@@ -51,3 +52,52 @@ float Utils::ModX(float x, float y)
 
     return result;
 }
+
+
+uint64_t Utils::HashBytes(const void *data, size_t size, uint64_t seed)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+uint64_t Utils::HashBytesMurmur(const void *data, size_t size, uint64_t seed)
+{
+    constexpr uint64_t m = 0xc6a4a7935bd1e995ull;
+    constexpr int r = 47;
+    auto bytes = static_cast<const uint8_t*>(data);
+    uint64_t hash = seed ^ (size * m);
+
+    const size_t words = size / 8;
+    for (size_t i = 0; i < words; i++)
+    {
+        uint64_t k;
+        memcpy(&k, bytes + i * 8, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        hash ^= k;
+        hash *= m;
+    }
+
+    // The last 1 to 7 bytes, little endian
+    if (size & 7)
+    {
+        uint64_t k = 0;
+        for (size_t i = size & 7; i-- > 0;)
+            k = (k << 8) | bytes[words * 8 + i];
+        hash ^= k;
+        hash *= m;
+    }
+
+    hash ^= hash >> r;
+    hash *= m;
+    hash ^= hash >> r;
+    return hash;
+}
@@ -3,6 +3,7 @@
 #include <windows.h>
 #include <stdio.h>
 #include <string>
+#include <cstdint>
 
 namespace Utils
 {
@@ -59,4 +60,12 @@ namespace Utils
     }
 
     float ModX(float x, float y);
+
+    // 64-bit FNV-1a, pass the previous result as seed to hash several blocks
+    constexpr uint64_t kHashSeed = 14695981039346656037ull;
+    uint64_t HashBytes(const void *data, size_t size, uint64_t seed = kHashSeed);
+
+    // 64-bit MurmurHash64A, unrelated to HashBytes, so data matching under both is the same data all
+    // but certainly (used to confirm a HashBytes match without keeping a copy to compare against)
+    uint64_t HashBytesMurmur(const void *data, size_t size, uint64_t seed = 0);
 }